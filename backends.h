@@ -0,0 +1,290 @@
+/*
+ * backends.h
+ * The chat servers a Load Balancer sends clients to, and the admin socket
+ * that changes them while it runs
+ *
+ * A backend file lists one server per line as "host:port [weight]"; blank
+ * lines and everything after a '#' are ignored. The port is the server's
+ * identity everywhere else (routing table, log, gossip, metrics, routing
+ * tokens), so it must be unique across hosts; every list is checked for it.
+ * Balancers that gossip, or share a token key, must list the same servers.
+ * Each address is resolved once, when the file is read or the server is
+ * added, and the control connection reuses it; nothing on the probe or
+ * assignment paths looks a name up.
+ *
+ * The admin socket is a Unix stream socket that takes one command per line
+ * and answers each with text ending in "ok" or "error: ...". It serves one
+ * connection at a time from its own thread.
+ */
+#ifndef BACKENDS_H
+#define BACKENDS_H
+
+#include <bits/stdc++.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace std;
+
+#define BACKEND_HOST_MAX 255  // longest host name sent to clients in an ASSIGN
+#define ADMIN_LINE_MAX 4096   // longest admin command
+#define ADMIN_IDLE_TIMEOUT 30 // s an admin connection may sit idle
+
+struct Backend
+{
+    string host;
+    int port = 0;
+    int weight = 1; // relative capacity, for the weighted strategies
+    struct sockaddr_in address;
+};
+
+// Parses "host:port [weight]". Returns false with error set if it is
+// malformed; the address is left for resolve_backend().
+inline bool parse_backend(const string &line, Backend &backend, string &error)
+{
+    stringstream fields(line);
+    string target, weight, extra;
+    fields >> target >> weight >> extra;
+    size_t colon = target.rfind(':');
+    if (target.empty() || !extra.empty())
+    {
+        error = "expected host:port [weight]";
+        return false;
+    }
+    if (colon == string::npos || colon == 0 || colon > BACKEND_HOST_MAX)
+    {
+        error = "bad host in " + target;
+        return false;
+    }
+    char *end;
+    long port = strtol(target.c_str() + colon + 1, &end, 10);
+    if (*end || port <= 0 || port > 65535)
+    {
+        error = "bad port in " + target;
+        return false;
+    }
+    backend.host = target.substr(0, colon);
+    backend.port = port;
+    backend.weight = 1;
+    if (!weight.empty())
+    {
+        long parsed = strtol(weight.c_str(), &end, 10);
+        if (*end || parsed <= 0 || parsed > 1000000)
+        {
+            error = "bad weight " + weight;
+            return false;
+        }
+        backend.weight = parsed;
+    }
+    return true;
+}
+
+// Looks the host up once. Returns false with error set if it cannot be.
+inline bool resolve_backend(Backend &backend, string &error)
+{
+    struct addrinfo hints, *found;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    int failed = getaddrinfo(backend.host.c_str(), to_string(backend.port).c_str(), &hints, &found);
+    if (failed != 0)
+    {
+        error = backend.host + ": " + gai_strerror(failed);
+        return false;
+    }
+    memcpy(&backend.address, found->ai_addr, sizeof(struct sockaddr_in));
+    freeaddrinfo(found);
+    return true;
+}
+
+// Returns false with error set if two backends share a port, e.g. after an
+// admin command added one, and the index of the second in duplicate if
+// given
+inline bool check_unique_ports(const vector<Backend> &backends, string &error, size_t *duplicate = NULL)
+{
+    set<int> ports;
+    for (size_t idx = 0; idx < backends.size(); idx++)
+        if (!ports.insert(backends[idx].port).second)
+        {
+            error = "port " + to_string(backends[idx].port) + " is listed twice";
+            if (duplicate)
+                *duplicate = idx;
+            return false;
+        }
+    return true;
+}
+
+// Reads and resolves a backend list. Returns false with error naming the
+// line at the first entry that is malformed or unresolvable, or else at
+// the second use of a port.
+inline bool read_backends(istream &in, vector<Backend> &backends, string &error)
+{
+    backends.clear();
+    vector<int> numbers; // line of each backend
+    string line;
+    for (int number = 1; getline(in, line); number++)
+    {
+        line = line.substr(0, line.find('#'));
+        if (line.find_first_not_of(" \t\r") == string::npos)
+            continue;
+        Backend backend;
+        string why;
+        if (!parse_backend(line, backend, why) || !resolve_backend(backend, why))
+        {
+            error = "line " + to_string(number) + ": " + why;
+            return false;
+        }
+        backends.push_back(backend);
+        numbers.push_back(number);
+    }
+    if (backends.empty())
+    {
+        error = "no backends listed";
+        return false;
+    }
+    size_t duplicate;
+    if (!check_unique_ports(backends, error, &duplicate))
+    {
+        error = "line " + to_string(numbers[duplicate]) + ": " + error;
+        return false;
+    }
+    return true;
+}
+
+inline bool load_backends(const string &path, vector<Backend> &backends, string &error)
+{
+    ifstream in(path);
+    if (!in)
+    {
+        error = path + ": " + strerror(errno);
+        return false;
+    }
+    if (!read_backends(in, backends, error))
+    {
+        error = path + ": " + error;
+        return false;
+    }
+    return true;
+}
+
+class AdminServer
+{
+public:
+    // Runs on the admin thread; returns the reply to one command line
+    typedef function<string(const string &command)> Handler;
+
+private:
+    int listen_id = -1;
+    string path;
+    thread worker;
+
+    static bool send_all(int socket_id, const string &text)
+    {
+        size_t sent = 0;
+        while (sent < text.size())
+        {
+            ssize_t n = send(socket_id, text.data() + sent, text.size() - sent, MSG_NOSIGNAL);
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            sent += n;
+        }
+        return true;
+    }
+
+    static void serve(int socket_id, const Handler &handler)
+    {
+        struct timeval timeout = {ADMIN_IDLE_TIMEOUT, 0}; // a forgotten session must not lock others out
+        setsockopt(socket_id, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+        string pending;
+        char buffer[1024];
+        bool open = true;
+        while (open)
+        {
+            size_t newline;
+            while (open && (newline = pending.find('\n')) != string::npos)
+            {
+                string reply = handler(pending.substr(0, newline));
+                pending.erase(0, newline + 1);
+                if (reply.empty() || reply.back() != '\n')
+                    reply += '\n';
+                open = send_all(socket_id, reply);
+            }
+            if (open && pending.size() > ADMIN_LINE_MAX)
+            {
+                send_all(socket_id, "error: command too long\n");
+                break;
+            }
+            ssize_t n = open ? recv(socket_id, buffer, sizeof buffer, 0) : 0;
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            pending.append(buffer, n);
+        }
+        close(socket_id);
+    }
+
+public:
+    AdminServer() = default;
+    ~AdminServer() { stop(); }
+
+    AdminServer(const AdminServer &) = delete;
+    AdminServer &operator=(const AdminServer &) = delete;
+
+    // Listens on the Unix socket at socket_path, replacing a stale one.
+    // Returns false if it cannot listen.
+    bool start(const string &socket_path, Handler handler)
+    {
+        struct sockaddr_un address;
+        memset(&address, 0, sizeof address);
+        address.sun_family = AF_UNIX;
+        if (socket_path.empty() || socket_path.size() >= sizeof address.sun_path)
+        {
+            errno = ENAMETOOLONG;
+            return false;
+        }
+        strcpy(address.sun_path, socket_path.c_str());
+        unlink(socket_path.c_str());
+        listen_id = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listen_id == -1 || bind(listen_id, (struct sockaddr *)&address, sizeof address) == -1 ||
+            listen(listen_id, 4) == -1)
+        {
+            if (listen_id != -1)
+                close(listen_id);
+            listen_id = -1;
+            return false;
+        }
+        path = socket_path;
+        worker = thread([this, handler] {
+            while (true)
+            {
+                int socket_id = accept4(listen_id, NULL, NULL, SOCK_CLOEXEC);
+                if (socket_id == -1)
+                {
+                    if (errno == EINTR || errno == ECONNABORTED)
+                        continue;
+                    return;
+                }
+                serve(socket_id, handler);
+            }
+        });
+        return true;
+    }
+
+    void stop()
+    {
+        if (listen_id == -1)
+            return;
+        shutdown(listen_id, SHUT_RDWR);
+        worker.join();
+        close(listen_id);
+        unlink(path.c_str());
+        listen_id = -1;
+    }
+};
+
+#endif
@@ -0,0 +1,392 @@
+/*
+ * balancer.h
+ * Room placement strategies for the Load Balancer
+ */
+#ifndef BALANCER_H
+#define BALANCER_H
+
+#include <bits/stdc++.h>
+#include "protocol.h"
+
+using namespace std;
+
+#define RING_VNODES 160 // virtual nodes per server on the hash ring
+
+// 64-bit FNV-1a followed by a splitmix64 finalizer, so short keys such as
+// room ids still spread evenly over the ring
+inline uint64_t hash64(const char *data, size_t len)
+{
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)data[i];
+        h *= 1099511628211ULL;
+    }
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+inline uint64_t hash64(const string &key) { return hash64(key.data(), key.size()); }
+
+// Folds a server's LoadReport into the single load the strategies compare,
+// counted in connected users: with the defaults a room adds half a user,
+// five messages a second one more, and so on. Busy rooms then weigh more
+// than idle clients.
+struct LoadWeights
+{
+    double users = 1;
+    double rooms = 0.5;
+    double messages = 0.2; // per message/s
+    double kbps = 0.05;    // per KiB/s sent
+    double queued = 0.5;   // per KiB waiting to be sent
+    double cpu = 1;        // per percent
+
+    int score(const LoadReport &report) const
+    {
+        double load = users * report.users + rooms * report.rooms + messages * report.messages_per_sec +
+                      kbps * report.bytes_per_sec / 1024 + queued * report.queued_bytes / 1024 +
+                      cpu * report.cpu_permille / 10;
+        return (int)min(load + 0.5, (double)INT_MAX - 1); // INT_MAX means unknown
+    }
+
+    // Parses "users=1,cpu=2": the weights named change, the rest keep their
+    // values. Returns false for an unknown name or a bad number.
+    bool parse(const string &spec)
+    {
+        map<string, double *> fields = {{"users", &users},   {"rooms", &rooms},   {"msgs", &messages},
+                                        {"kbps", &kbps},     {"queued", &queued}, {"cpu", &cpu}};
+        stringstream list(spec);
+        string item;
+        while (getline(list, item, ','))
+        {
+            size_t eq = item.find('=');
+            auto field = fields.find(item.substr(0, eq));
+            if (eq == string::npos || field == fields.end())
+                return false;
+            char *end;
+            double value = strtod(item.c_str() + eq + 1, &end);
+            if (end == item.c_str() + eq + 1 || *end || value < 0)
+                return false;
+            *field->second = value;
+        }
+        return true;
+    }
+};
+
+// The view of the server pool a strategy is allowed to see. Loads are read
+// one server at a time so strategies only pay for the servers they look at.
+class ServerPool
+{
+public:
+    virtual ~ServerPool() {}
+    virtual int size() const = 0;
+    virtual int port(int idx) const = 0;
+    virtual bool up(int idx) const = 0;
+    virtual int load(int idx) const = 0; // INT_MAX when unknown
+    virtual int weight(int idx) const = 0;
+};
+
+class BalancingStrategy
+{
+public:
+    virtual ~BalancingStrategy() {}
+    // Returns the index of the server for a new room, or -1 if none is usable
+    virtual int pick(const string &room) = 0;
+    virtual const char *name() const = 0;
+};
+
+// Scans every server and takes the one with the fewest clients
+class LeastConnections : public BalancingStrategy
+{
+    const ServerPool &pool;
+
+public:
+    LeastConnections(const ServerPool &pool) : pool(pool) {}
+
+    int pick(const string &) override
+    {
+        int best = -1, bestLoad = INT_MAX;
+        for (int idx = 0; idx < pool.size(); idx++)
+        {
+            if (!pool.up(idx))
+                continue;
+            int load = pool.load(idx);
+            if (best == -1 || load < bestLoad)
+            {
+                best = idx;
+                bestLoad = load;
+            }
+        }
+        return best;
+    }
+    const char *name() const override { return "least"; }
+};
+
+// Samples two random servers and takes the lighter one: two load reads per
+// decision, and a burst of new rooms spreads instead of hitting one server
+class PowerOfTwoChoices : public BalancingStrategy
+{
+    const ServerPool &pool;
+
+    int sample(mt19937 &rng, int skip)
+    {
+        int n = pool.size();
+        for (int attempt = 0; attempt < 2 * n; attempt++)
+        {
+            int idx = rng() % n;
+            if (idx != skip && pool.up(idx))
+                return idx;
+        }
+        for (int idx = 0; idx < n; idx++) // most servers are down, fall back to a scan
+            if (idx != skip && pool.up(idx))
+                return idx;
+        return -1;
+    }
+
+public:
+    PowerOfTwoChoices(const ServerPool &pool) : pool(pool) {}
+
+    int pick(const string &) override
+    {
+        static thread_local mt19937 rng(random_device{}());
+        int first = sample(rng, -1);
+        if (first == -1)
+            return -1;
+        int second = sample(rng, first);
+        if (second == -1)
+            return first;
+        return pool.load(second) < pool.load(first) ? second : first;
+    }
+    const char *name() const override { return "p2c"; }
+};
+
+// Smooth weighted round robin: servers are chosen in proportion to their
+// weight and evenly interleaved rather than in runs
+class WeightedRoundRobin : public BalancingStrategy
+{
+    const ServerPool &pool;
+    vector<long long> current;
+    mutex round_mutex;
+
+public:
+    WeightedRoundRobin(const ServerPool &pool) : pool(pool), current(pool.size()) {}
+
+    int pick(const string &) override
+    {
+        lock_guard<mutex> guard(round_mutex);
+        int best = -1;
+        long long total = 0;
+        for (int idx = 0; idx < pool.size(); idx++)
+        {
+            if (!pool.up(idx))
+                continue;
+            current[idx] += pool.weight(idx);
+            total += pool.weight(idx);
+            if (best == -1 || current[idx] > current[best])
+                best = idx;
+        }
+        if (best != -1)
+            current[best] -= total;
+        return best;
+    }
+    const char *name() const override { return "wrr"; }
+};
+
+// Consistent-hash ring with virtual nodes. Every server owns RING_VNODES
+// points per unit of weight, so adding or removing one moves only ~1/N of the
+// keys and any process building the ring from the same servers agrees on it.
+class HashRing
+{
+    vector<pair<uint64_t, int>> points; // (point, server index), sorted
+
+public:
+    void add(const string &server, int idx, int weight = 1)
+    {
+        for (int v = 0; v < RING_VNODES * weight; v++)
+        {
+            string point = server + "#" + to_string(v);
+            points.push_back({hash64(point), idx});
+        }
+        sort(points.begin(), points.end());
+    }
+
+    bool empty() const { return points.empty(); }
+
+    // Walks clockwise from the key and returns the first server accept()
+    // agrees to, or -1 if it rejects all of them
+    template <class Accept>
+    int find(uint64_t key, Accept accept) const
+    {
+        if (points.empty())
+            return -1;
+        size_t start = lower_bound(points.begin(), points.end(), make_pair(key, INT_MIN)) - points.begin();
+        // Kept per thread so a lookup does not allocate once it has seen every server
+        static thread_local vector<bool> seen;
+        seen.assign(seen.size(), false);
+        for (size_t i = 0; i < points.size(); i++)
+        {
+            int idx = points[(start + i) % points.size()].second;
+            if ((int)seen.size() <= idx)
+                seen.resize(idx + 1);
+            if (seen[idx])
+                continue;
+            seen[idx] = true;
+            if (accept(idx))
+                return idx;
+        }
+        return -1;
+    }
+};
+
+inline HashRing build_ring(const ServerPool &pool)
+{
+    HashRing ring;
+    for (int idx = 0; idx < pool.size(); idx++)
+        ring.add(to_string(pool.port(idx)), idx, pool.weight(idx));
+    return ring;
+}
+
+// Places a room on the first healthy server clockwise from its hash. The LB
+// still remembers the placement: a room that fell through to the next server
+// while its own was down stays there when that server comes back, rather than
+// new clients hashing it back and splitting it across two servers.
+class ConsistentHash : public BalancingStrategy
+{
+    const ServerPool &pool;
+    HashRing ring;
+
+public:
+    ConsistentHash(const ServerPool &pool) : pool(pool), ring(build_ring(pool)) {}
+
+    int pick(const string &room) override
+    {
+        return ring.find(hash64(room), [&](int idx) { return pool.up(idx); });
+    }
+    const char *name() const override { return "hash"; }
+};
+
+// Consistent hashing with bounded loads: no server may take a new room while
+// it holds more than (1 + epsilon) times the average load, so hot spots on
+// the ring spill over to the next server clockwise.
+class BoundedLoadHash : public BalancingStrategy
+{
+    const ServerPool &pool;
+    HashRing ring;
+    double epsilon;
+
+public:
+    BoundedLoadHash(const ServerPool &pool, double epsilon)
+        : pool(pool), ring(build_ring(pool)), epsilon(epsilon) {}
+
+    int pick(const string &room) override
+    {
+        long long total = 0;
+        int live = 0;
+        for (int idx = 0; idx < pool.size(); idx++)
+        {
+            if (!pool.up(idx))
+                continue;
+            int load = pool.load(idx);
+            total += load == INT_MAX ? 0 : load;
+            live++;
+        }
+        if (live == 0)
+            return -1;
+        long long capacity = (long long)ceil((1 + epsilon) * (total + 1) / live);
+        uint64_t key = hash64(room);
+        int idx = ring.find(key, [&](int idx) {
+            int load = pool.load(idx);
+            return pool.up(idx) && (load == INT_MAX || load < capacity);
+        });
+        if (idx == -1) // loads moved under us, settle for the plain ring
+            idx = ring.find(key, [&](int idx) { return pool.up(idx); });
+        return idx;
+    }
+    const char *name() const override { return "hash-bounded"; }
+};
+
+// A room the rebalancer moves, by server index
+struct Migration
+{
+    string room;
+    int from, to;
+    int members;
+    int load; // the room's estimated share of its server's load
+};
+
+// Plans moves off overloaded servers. A healthy server above (1 + epsilon)
+// times the average load, by at least two clients, hands one room to the
+// least loaded healthy server. The room chosen brings the two closest to
+// even without making the target the hotter one. rooms[idx] lists server
+// idx's rooms and their member counts; a room is taken to carry the
+// server's load in proportion to its members, since weighted loads count
+// more than clients. Servers whose load is unknown take no part.
+inline vector<Migration> plan_rebalance(const ServerPool &pool, const vector<vector<pair<string, int>>> &rooms,
+                                        double epsilon)
+{
+    vector<long long> load(pool.size(), -1);
+    vector<int> live;
+    long long total = 0;
+    for (int idx = 0; idx < pool.size(); idx++)
+    {
+        if (!pool.up(idx) || pool.load(idx) == INT_MAX)
+            continue;
+        load[idx] = pool.load(idx);
+        total += load[idx];
+        live.push_back(idx);
+    }
+    vector<Migration> moves;
+    if (live.size() < 2)
+        return moves;
+    double average = (double)total / live.size();
+    sort(live.begin(), live.end(), [&](int a, int b) { return load[a] > load[b]; });
+    for (int from : live)
+    {
+        if (load[from] <= (1 + epsilon) * average || load[from] - average < 2 || from >= (int)rooms.size())
+            continue;
+        int to = -1;
+        for (int idx : live)
+            if (idx != from && (to == -1 || load[idx] < load[to]))
+                to = idx;
+        long long gap = load[from] - load[to], members = 0;
+        for (auto &room : rooms[from])
+            members += max(room.second, 0);
+        if (!members)
+            continue;
+        auto share = [&](int room_members) { return (long long)llround((double)load[from] * room_members / members); };
+        const pair<string, int> *best = NULL;
+        for (auto &room : rooms[from])
+            if (room.second > 0 && share(room.second) < gap &&
+                (!best || llabs(2 * share(room.second) - gap) < llabs(2 * share(best->second) - gap)))
+                best = &room;
+        if (!best)
+            continue;
+        long long moved = share(best->second);
+        moves.push_back({best->first, from, to, best->second, (int)moved});
+        load[from] -= moved;
+        load[to] += moved;
+    }
+    return moves;
+}
+
+// Builds the strategy named on the command line, or NULL if it is unknown
+inline BalancingStrategy *make_strategy(const string &name, const ServerPool &pool, double epsilon = 0.25)
+{
+    if (name == "least")
+        return new LeastConnections(pool);
+    if (name == "p2c")
+        return new PowerOfTwoChoices(pool);
+    if (name == "wrr")
+        return new WeightedRoundRobin(pool);
+    if (name == "hash")
+        return new ConsistentHash(pool);
+    if (name == "hash-bounded")
+        return new BoundedLoadHash(pool, epsilon);
+    return NULL;
+}
+
+#endif
@@ -1,6 +1,18 @@
 /*
  * client.cpp
  * Client for Chat Room
+ *
+ * A routing token from the load balancer or the server (see token.h) goes
+ * ahead of each HELLO to that server. After a dropped connection the client
+ * first goes straight back with it, and only asks the balancer again if
+ * the server refuses it.
+ *
+ * A balancer in proxy mode answers port 0 and keeps the connection, which
+ * is then already the way into the room; every rejoin goes through it.
+ *
+ * A server that logs its rooms numbers their messages. Going back to a
+ * server directly, the client asks it to resume after the last number it
+ * saw, and is sent what it missed.
  */
 #include <bits/stdc++.h>
 #include <sys/types.h>
@@ -10,86 +22,79 @@
 #include <string.h>
 #include <arpa/inet.h>
 #include <arpa/inet.h>
+#include <netdb.h>
 #include <unistd.h>
 #include <thread>
 #include <signal.h>
 #include <mutex>
+#include "protocol.h"
+#include "token.h"
 #define PORT 6000
-#define MAX_LEN 256
 #define NUM_COLORS 6
+#define REJOIN_ATTEMPTS 10 // asks to the load balancer after losing the server
+#define REJOIN_DELAY 500    // ms between them
 using namespace std;
 
 bool exit_flag = false;
 thread t_send, t_recv;
-int lb_socket, client_socket;
+atomic<int> client_socket(-1); // swapped when the room moves to another server
+string hello;
+string server_host; // of the current server, empty for this machine
+string route_token;  // last MSG_ROUTE_TOKEN frame, empty if none came
+uint32_t route_port; // the server it is for
+bool unconfirmed = false; // rejoined on a kept token, not yet heard from
+bool proxied = false;     // the balancer forwards the connection to the server
+uint32_t room_id;
+uint64_t last_seq = 0; // of the last logged message received, 0 if none
+int seq_port = -1;     // the server that numbered it; numbers are per server
+int joined_port = -1;  // the server last joined directly
 string default_colour = "\033[0m";
 string colors[] = {"\033[31m", "\033[32m", "\033[33m", "\033[34m", "\033[35m", "\033[36m"};
 
 void cancelAndExit(int signal);
 string color(int code);
 int clearText(int cnt);
-void send_message_to_server(int client_socket);
-void recieive_message_from_server(int client_socket);
+int connect_to(const string &host, int port);
+void keep_token(const Frame &frame);
+int ask_load_balancer(string &host, int &kept);
+int join_server(const string &host, int serverPort);
+int rejoin();
+void send_message_to_server();
+void recieive_message_from_server();
 
 int main()
 {
-    if ((lb_socket = socket(AF_INET, SOCK_STREAM, 0)) == -1)
-    {
-        perror("socket: ");
-        exit(-1);
-    }
-
-    struct sockaddr_in lb;
-    lb.sin_family = AF_INET;
-    lb.sin_port = htons(PORT); // Port no. of loadbalancer
-    lb.sin_addr.s_addr = INADDR_ANY;
-    bzero(&lb.sin_zero, 0);
-
-    if ((connect(lb_socket, (struct sockaddr *)&lb, sizeof(struct sockaddr_in))) == -1)
-    {
-        perror("connect: ");
-        exit(-1);
-    }
     signal(SIGINT, cancelAndExit);
-    char name[MAX_LEN], room[MAX_LEN];
+    string name, room;
     cout << "Enter your name : ";
-    cin.getline(name, MAX_LEN);
+    getline(cin, name);
     cout << "Enter the Room Id: ";
-    cin.getline(room, MAX_LEN);
-    send(lb_socket, name, sizeof(name), 0);
-    send(lb_socket, room, sizeof(room), 0);
-    int serverPort;
-    recv(lb_socket, &serverPort, sizeof(serverPort), 0);
-    close(lb_socket);
+    getline(cin, room);
+    room_id = room_id_of(room);
+    encode_named_frame(hello, MSG_HELLO, 0, room_id, name, room.data(), room.size());
 
-    cout << "Server port recieved: " << serverPort << "\n";
-
-    if ((client_socket = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+    int lb_socket;
+    int serverPort = ask_load_balancer(server_host, lb_socket);
+    if (serverPort == -1)
     {
-        perror("socket: ");
+        cerr << "No server assigned by the load balancer\n";
         exit(-1);
     }
-    struct sockaddr_in client;
-    client.sin_family = AF_INET;
-    client.sin_port = htons(serverPort); // Port no. of server
-    client.sin_addr.s_addr = INADDR_ANY;
-    bzero(&client.sin_zero, 0);
-
-    if ((connect(client_socket, (struct sockaddr *)&client, sizeof(struct sockaddr_in))) == -1)
+    if (proxied)
+        cout << "Connected through the load balancer\n";
+    else
+        cout << "Server port recieved: " << serverPort << "\n";
+    if ((client_socket = proxied ? lb_socket : join_server(server_host, serverPort)) == -1)
     {
         perror("connect: ");
         exit(-1);
     }
-    signal(SIGINT, cancelAndExit);
-
-    send(client_socket, name, sizeof(name), 0);
-    send(client_socket, room, sizeof(room), 0);
 
     cout << colors[NUM_COLORS - 1] << "\n\t*********CHAT ROOM***********" << "\n"
          << default_colour;
 
-    thread t1(send_message_to_server, client_socket);
-    thread t2(recieive_message_from_server, client_socket);
+    thread t1(send_message_to_server);
+    thread t2(recieive_message_from_server);
 
     t_send = move(t1);
     t_recv = move(t2);
@@ -104,8 +109,9 @@ int main()
 
 void cancelAndExit(int signal)
 {
-    char str[MAX_LEN] = "#exit";
-    send(client_socket, str, sizeof(str), 0);
+    string exit_frame;
+    encode_frame(exit_frame, MSG_EXIT, 0, 0);
+    send_all(client_socket, exit_frame);
     exit_flag = true;
     t_send.detach();
     t_recv.detach();
@@ -128,17 +134,140 @@ int clearText(int cnt)
     return 1;
 }
 
-void send_message_to_server(int client_socket)
+// Connected socket to a port on host, or on this machine if host is
+// empty; -1 on failure
+int connect_to(const string &host, int port)
+{
+    int socket_id;
+    struct sockaddr_in address;
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = INADDR_ANY;
+    bzero(&address.sin_zero, 0);
+    if (!host.empty())
+    {
+        struct addrinfo hints, *found;
+        memset(&hints, 0, sizeof hints);
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(host.c_str(), NULL, &hints, &found) != 0)
+            return -1;
+        address.sin_addr = ((struct sockaddr_in *)found->ai_addr)->sin_addr;
+        freeaddrinfo(found);
+    }
+    if ((socket_id = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+        return -1;
+    if ((connect(socket_id, (struct sockaddr *)&address, sizeof(struct sockaddr_in))) == -1)
+    {
+        close(socket_id);
+        return -1;
+    }
+    return socket_id;
+}
+
+// Keeps a MSG_ROUTE_TOKEN to send ahead of the next HELLO to its server
+void keep_token(const Frame &frame)
+{
+    uint64_t issued;
+    if (!read_route_token(frame.payload, frame.length, route_port, issued))
+        return;
+    route_token.clear();
+    encode_frame(route_token, MSG_ROUTE_TOKEN, 0, frame.header.room_id, frame.payload, frame.length);
+}
+
+// Port of the server the load balancer assigns the room to, -1 if none.
+// Sets host to the server's host, empty if the balancer names none. Port 0
+// means the balancer proxies: kept is then its connection, already in the
+// room, and proxied is set.
+int ask_load_balancer(string &host, int &kept)
+{
+    int lb_socket = connect_to("", PORT);
+    if (lb_socket == -1)
+        return -1;
+    send_all(lb_socket, hello);
+    FrameDecoder lb_decoder;
+    Frame reply;
+    uint32_t serverPort;
+    bool received;
+    while ((received = recv_frame(lb_socket, lb_decoder, reply)) && reply.header.type == MSG_ROUTE_TOKEN)
+        keep_token(reply);
+    bool assigned = received && reply.header.type == MSG_ASSIGN && split_u32_payload(reply, serverPort, host);
+    proxied = assigned && serverPort == 0;
+    kept = proxied ? lb_socket : -1;
+    if (!proxied)
+        close(lb_socket);
+    return assigned ? (int)serverPort : -1;
+}
+
+// Connects to a chat server and joins the room, with the routing token
+// for it if there is one and asking to resume after the last logged
+// message seen; -1 on failure
+int join_server(const string &host, int serverPort)
+{
+    int socket_id = connect_to(host, serverPort);
+    bool with_token = !route_token.empty() && route_port == (uint32_t)serverPort;
+    string greeting = with_token ? route_token : "";
+    if (last_seq && seq_port == serverPort)
+        encode_u64_frame(greeting, MSG_RESUME, 0, room_id, last_seq + 1);
+    greeting += hello;
+    if (socket_id != -1 && !send_all(socket_id, greeting))
+    {
+        close(socket_id);
+        return -1;
+    }
+    if (socket_id != -1)
+        joined_port = serverPort;
+    return socket_id;
+}
+
+// After losing the server, goes back to it with the kept routing token,
+// which saves the trip to the load balancer; failing that, asks the
+// balancer where the room lives now
+int rejoin()
+{
+    if (!route_token.empty())
+    {
+        int socket_id = join_server(server_host, route_port);
+        if (socket_id != -1)
+        {
+            unconfirmed = true;
+            return socket_id;
+        }
+        route_token.clear();
+    }
+    for (int attempt = 0; attempt < REJOIN_ATTEMPTS && !exit_flag; attempt++)
+    {
+        if (attempt)
+            this_thread::sleep_for(chrono::milliseconds(REJOIN_DELAY));
+        string host;
+        int lb_socket;
+        int serverPort = ask_load_balancer(host, lb_socket);
+        int socket_id = serverPort == -1 ? -1 : proxied ? lb_socket : join_server(host, serverPort);
+        if (socket_id != -1)
+        {
+            server_host = host;
+            return socket_id;
+        }
+    }
+    return -1;
+}
+
+void send_message_to_server()
 {
     while (true)
     {
         cout << colors[1] << "You : " << default_colour;
-        char str[MAX_LEN];
-        cin.getline(str, MAX_LEN);
-        if (send(client_socket, str, strlen(str) + 1, 0) == -1) {
+        string str, frame;
+        if (!getline(cin, str))
+            str = "#exit";
+        if (str == "#exit")
+            encode_frame(frame, MSG_EXIT, 0, 0);
+        else
+            encode_frame(frame, MSG_CHAT, 0, 0, str.data(), min(str.size(), (size_t)MAX_PAYLOAD));
+        if (!send_all(client_socket, frame)) {
             perror("send: ");
         }
-        if (strcmp(str, "#exit") == 0)
+        if (str == "#exit")
         {
             exit_flag = true;
             t_recv.detach();
@@ -148,25 +277,81 @@ void send_message_to_server(int client_socket)
     }
 }
 
-void recieive_message_from_server(int client_socket)
+void recieive_message_from_server()
 {
+    FrameDecoder decoder;
+    Frame frame;
+    string othername, othermsg, host;
+    uint32_t serverPort;
     while (1)
     {
         if (exit_flag)
             return;
-        char othername[MAX_LEN], othermsg[MAX_LEN];
-        int color_code;
-        int bytes_received = recv(client_socket, othername, sizeof(othername), 0);
-        if (bytes_received <= 0)
+        int socket_id = client_socket;
+        if (!recv_frame(socket_id, decoder, frame))
+        {
+            if (exit_flag)
+                return;
+            // The server went away; the load balancer knows where the room
+            // went. A server that closes straight after a rejoin on a kept
+            // token has refused it.
+            close(socket_id);
+            if (unconfirmed)
+                route_token.clear();
+            unconfirmed = false;
+            if ((socket_id = rejoin()) == -1)
+            {
+                cerr << "\nLost the chat server\n";
+                exit(-1);
+            }
+            client_socket = socket_id;
+            decoder = FrameDecoder();
+            continue;
+        }
+        unconfirmed = false;
+        if (frame.header.type == MSG_SEQ)
+        {
+            if (read_u64_payload(frame, last_seq))
+                seq_port = proxied ? -1 : joined_port;
+            continue;
+        }
+        if (frame.header.type == MSG_ROUTE_TOKEN)
+        {
+            // A renewed one after joining, or one for the server named by
+            // the REDIRECT that follows
+            keep_token(frame);
+            continue;
+        }
+        if (frame.header.type == MSG_REDIRECT && split_u32_payload(frame, serverPort, host))
+        {
+            // The room moved; the old server closes this connection. A
+            // server behind a proxying balancer, or one the REDIRECT does
+            // not name the host of, is found by asking the balancer.
+            int moved = proxied || host.empty() ? -1 : join_server(host, serverPort);
+            if (moved != -1)
+                server_host = host;
+            else
+            {
+                route_token.clear(); // for a server that could not be reached
+                moved = rejoin();
+            }
+            if (moved == -1)
+            {
+                cerr << "\nLost the chat server\n";
+                exit(-1);
+            }
+            client_socket = moved;
+            close(socket_id);
+            decoder = FrameDecoder();
             continue;
-        recv(client_socket, &color_code, sizeof(color_code), 0);
-        recv(client_socket, othermsg, sizeof(othermsg), 0);
+        }
+        int color_code = frame.header.sender_id;
         clearText(6);
-        if (strcmp(othername, "#NULL") != 0)
+        if (frame.header.type == MSG_CHAT && split_named_payload(frame, othername, othermsg))
             cout << color(color_code) << othername << " : " << default_colour << othermsg << endl;
-        else
-            cout << color(color_code) << othermsg << endl;
+        else if (frame.header.type == MSG_NOTICE)
+            cout << color(color_code) << string(frame.payload, frame.length) << endl;
         cout << colors[1] << "You : " << default_colour;
         fflush(stdout);
     }
-}
\ No newline at end of file
+}
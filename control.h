@@ -0,0 +1,543 @@
+/*
+ * control.h
+ * Persistent control connections from the Load Balancer to its servers
+ *
+ * The balancer keeps one TCP connection open to every server and sends all
+ * of its traffic with that server over it: load queries, health pings,
+ * room size queries, and notices of the rooms it places there or moves
+ * away. Each request carries an id in the frame's sender_id and the reply
+ * echoes it, so requests go out back to back without waiting for earlier
+ * replies (pipelining). Notices queued by many reactor threads leave
+ * together in one send(). One thread drives every connection with epoll.
+ *
+ * Pings are the heartbeats of a phi-accrual failure detector (detector.h).
+ * A server is down as soon as phi passes the threshold or its connection
+ * breaks. A request or connect that outlives its deadline also drops the
+ * connection. A server that keeps flapping is held back until it has been
+ * stable for a while.
+ *
+ * Servers can be added and removed while the balancer runs. The changes are
+ * queued and the control thread takes them up at its next turn; notices
+ * from other threads look the server up under a shared lock.
+ */
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <bits/stdc++.h>
+#include <shared_mutex>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "detector.h"
+#include "metrics.h"
+#include "protocol.h"
+
+using namespace std;
+
+#define CONTROL_BACKLOG_MAX (1024 * 1024) // unsent bytes per server before notices are dropped
+
+struct ControlConfig
+{
+    int load_interval = 500;   // ms between load queries
+    int ping_interval = 200;   // ms between health pings, the detector's heartbeat
+    int timeout = 2000;        // ms a connect or request may take before the connection is dropped
+    int retry_interval = 1000; // ms between attempts to reopen a connection
+    int room_interval = 1000;  // ms between room size queries, 0 for none
+    DetectorConfig detector;
+};
+
+class ControlPlane
+{
+public:
+    // Both run on the control thread. load is NULL once it is unknown;
+    // health is reported whenever it changes.
+    typedef function<void(int port, const LoadReport *load)> LoadHandler;
+    typedef function<void(int port, bool up)> HealthHandler;
+    // The server's largest rooms and their member counts, largest first
+    typedef function<void(int port, const vector<pair<string, int>> &rooms)> RoomsHandler;
+
+    atomic<uint64_t> requests{0}; // frames sent, notices included
+    atomic<uint64_t> replies{0};
+    atomic<uint64_t> writes{0};   // send() calls
+    atomic<uint64_t> connects{0}; // connections opened
+    atomic<uint64_t> dropped{0};  // notices not sent
+    LatencyHistogram ping_latency; // ping to pong round trips
+
+private:
+    typedef chrono::steady_clock clock;
+
+    struct Channel
+    {
+        int port;
+        struct sockaddr_in address; // resolved once, when the server was added
+        int socket_id = -1;
+        bool connected = false; // connect() has finished
+        bool alive = false;     // answering pings, phi below the threshold
+        int health = -1;        // last reported: -1 none yet, 0 down, 1 up
+        PhiDetector detector;
+        FlapDamper damper;
+        FrameDecoder decoder;
+        string out;          // frames waiting for the socket
+        size_t out_sent = 0; // bytes of out already sent
+        map<uint32_t, clock::time_point> waiting; // request id -> sent at
+        clock::time_point retry_at, connect_deadline;
+        atomic<uint32_t> next_id{1};
+
+        mutex notices_mutex;
+        string notices;          // queued by other threads
+        size_t notice_count = 0; // frames in notices
+        string held;             // migrations, kept until a connection takes them
+    };
+
+    ControlConfig config;
+    LoadHandler on_load;
+    HealthHandler on_health;
+    RoomsHandler on_rooms;
+    vector<unique_ptr<Channel>> channels; // control thread only, once started
+    shared_mutex channels_mutex;          // guards by_port
+    map<int, Channel *> by_port;
+    mutex changes_mutex;
+    vector<pair<int, struct sockaddr_in>> changes; // servers to add, or remove where sin_family is 0
+    int epoll_id = -1, wake_id = -1;
+    thread worker;
+    atomic<bool> stopping{false};
+
+    static double now_ms() { return chrono::duration<double, milli>(clock::now().time_since_epoch()).count(); }
+
+    // Reports the server up while it answers pings in time, unless it is
+    // held back for flapping
+    void update_health(Channel &ch, double now)
+    {
+        if (ch.connected && !ch.detector.started())
+            return; // the first ping is still on its way
+        bool alive = ch.connected && ch.detector.phi(now, config.detector.min_std_dev) < config.detector.phi_threshold;
+        if (ch.alive && !alive)
+            ch.damper.failed(config.detector, now);
+        ch.alive = alive;
+        bool up = alive && ch.damper.usable(config.detector, now);
+        if (ch.health == (int)up)
+            return;
+        ch.health = up;
+        on_health(ch.port, up);
+    }
+
+    void open_channel(Channel &ch)
+    {
+        ch.retry_at = clock::now() + chrono::milliseconds(config.retry_interval);
+        ch.connect_deadline = clock::now() + chrono::milliseconds(config.timeout);
+        ch.socket_id = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (ch.socket_id == -1)
+            return;
+        int one = 1;
+        setsockopt(ch.socket_id, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+        if (connect(ch.socket_id, (struct sockaddr *)&ch.address, sizeof ch.address) == -1 && errno != EINPROGRESS)
+        {
+            close_channel(ch);
+            return;
+        }
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = &ch;
+        epoll_ctl(epoll_id, EPOLL_CTL_ADD, ch.socket_id, &event);
+    }
+
+    // Drops the connection and everything pending on it; the server counts
+    // as down until the connection is open again
+    void close_channel(Channel &ch)
+    {
+        if (ch.socket_id != -1)
+            ::close(ch.socket_id);
+        ch.socket_id = -1;
+        ch.connected = false;
+        ch.decoder = FrameDecoder();
+        ch.out.clear();
+        ch.out_sent = 0;
+        ch.waiting.clear();
+        {
+            lock_guard<mutex> guard(ch.notices_mutex);
+            dropped += ch.notice_count;
+            ch.notices.clear();
+            ch.notice_count = 0;
+        }
+        on_load(ch.port, NULL);
+        update_health(ch, now_ms());
+    }
+
+    void on_connected(Channel &ch)
+    {
+        int error = 0;
+        socklen_t error_len = sizeof error;
+        if (getsockopt(ch.socket_id, SOL_SOCKET, SO_ERROR, &error, &error_len) == -1 || error != 0)
+        {
+            close_channel(ch);
+            return;
+        }
+        ch.connected = true;
+        ch.detector.reset(config.ping_interval);
+        connects++;
+        encode_frame(ch.out, MSG_CONTROL, 0, 0);
+        requests++;
+        // Know the server's state right away rather than at the next tick
+        request(ch, MSG_PING);
+        request(ch, MSG_LOAD_QUERY);
+    }
+
+    void request(Channel &ch, uint8_t type)
+    {
+        uint32_t id = ch.next_id++;
+        encode_frame(ch.out, type, id, 0);
+        ch.waiting[id] = clock::now();
+        requests++;
+    }
+
+    // Moves the notices other threads queued behind the control thread's own
+    // frames. Migrations wait for a connection: a server that comes back
+    // must still learn that its rooms have moved.
+    void take_notices(Channel &ch)
+    {
+        lock_guard<mutex> guard(ch.notices_mutex);
+        if (ch.connected)
+        {
+            ch.out += ch.held;
+            ch.held.clear();
+        }
+        if (ch.notices.empty())
+            return;
+        if (ch.connected && ch.out.size() - ch.out_sent < CONTROL_BACKLOG_MAX)
+            ch.out += ch.notices;
+        else
+            dropped += ch.notice_count;
+        ch.notices.clear();
+        ch.notice_count = 0;
+    }
+
+    // Queues a notice from any thread and wakes the control thread if it is
+    // the first one waiting
+    void queue_notice(Channel &ch, const function<void(string &)> &encode, bool hold)
+    {
+        bool first;
+        {
+            lock_guard<mutex> guard(ch.notices_mutex);
+            string &queue = hold ? ch.held : ch.notices;
+            if (queue.size() >= CONTROL_BACKLOG_MAX)
+            {
+                dropped++;
+                return;
+            }
+            first = queue.empty();
+            encode(queue);
+            if (!hold)
+                ch.notice_count++;
+        }
+        requests++;
+        // Later notices ride along with the wake-up the first one sent
+        uint64_t one = 1;
+        if (first && write(wake_id, &one, sizeof one) == -1)
+            perror("control: eventfd");
+    }
+
+    void flush(Channel &ch)
+    {
+        while (ch.connected && ch.out_sent < ch.out.size())
+        {
+            ssize_t n = send(ch.socket_id, ch.out.data() + ch.out_sent, ch.out.size() - ch.out_sent,
+                             MSG_NOSIGNAL | MSG_DONTWAIT);
+            writes++;
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return; // EPOLLOUT picks it up
+            if (n == -1)
+            {
+                close_channel(ch);
+                return;
+            }
+            ch.out_sent += n;
+        }
+        ch.out.clear();
+        ch.out_sent = 0;
+    }
+
+    void on_readable(Channel &ch)
+    {
+        while (ch.socket_id != -1)
+        {
+            size_t available;
+            char *space = ch.decoder.write_space(4096, available);
+            ssize_t n = recv(ch.socket_id, space, available, MSG_DONTWAIT);
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return;
+            if (n <= 0)
+            {
+                close_channel(ch);
+                return;
+            }
+            ch.decoder.commit(n);
+            Frame frame;
+            int decoded;
+            while ((decoded = ch.decoder.next(frame)) == 1)
+                on_reply(ch, frame);
+            if (decoded == -1)
+                close_channel(ch);
+        }
+    }
+
+    void on_reply(Channel &ch, const Frame &frame)
+    {
+        auto found = ch.waiting.find(frame.header.sender_id);
+        if (found == ch.waiting.end())
+            return;
+        clock::time_point sent_at = found->second;
+        ch.waiting.erase(found);
+        replies++;
+        LoadReport load;
+        vector<pair<string, int>> rooms;
+        if (frame.header.type == MSG_LOAD_REPLY && read_load_report(frame, load))
+            on_load(ch.port, &load);
+        if (frame.header.type == MSG_ROOM_REPLY && on_rooms && read_room_loads(frame, rooms))
+            on_rooms(ch.port, rooms);
+        if (frame.header.type == MSG_PONG)
+        {
+            double now = now_ms();
+            ping_latency.record(clock::now() - sent_at);
+            ch.detector.heartbeat(now);
+            update_health(ch, now);
+        }
+    }
+
+    // Takes up the servers added and removed since the last turn. A removed
+    // server's connection is closed without reporting it down: it is gone,
+    // not failed.
+    void take_changes()
+    {
+        vector<pair<int, struct sockaddr_in>> taken;
+        {
+            lock_guard<mutex> guard(changes_mutex);
+            taken.swap(changes);
+        }
+        for (auto &change : taken)
+        {
+            unique_ptr<Channel> removed;
+            {
+                unique_lock<shared_mutex> guard(channels_mutex);
+                by_port.erase(change.first);
+                for (auto ch = channels.begin(); ch != channels.end(); ++ch)
+                    if ((*ch)->port == change.first)
+                    {
+                        removed = move(*ch);
+                        channels.erase(ch);
+                        break;
+                    }
+                if (change.second.sin_family != 0)
+                {
+                    channels.emplace_back(new Channel());
+                    channels.back()->port = change.first;
+                    channels.back()->address = change.second;
+                    by_port[change.first] = channels.back().get();
+                }
+            }
+            if (removed && removed->socket_id != -1)
+                ::close(removed->socket_id);
+        }
+    }
+
+    void queue_change(int port, const struct sockaddr_in &address)
+    {
+        {
+            lock_guard<mutex> guard(changes_mutex);
+            changes.emplace_back(port, address);
+        }
+        uint64_t one = 1;
+        if (wake_id != -1 && write(wake_id, &one, sizeof one) == -1)
+            perror("control: eventfd");
+    }
+
+    void run()
+    {
+        struct epoll_event events[64];
+        clock::time_point next_load = clock::now(), next_ping = next_load, next_rooms = next_load;
+        bool query_rooms = on_rooms && config.room_interval > 0;
+        while (!stopping.load())
+        {
+            take_changes();
+            clock::time_point now = clock::now(), wake_at = clock::time_point::max();
+            for (auto &ch : channels)
+            {
+                if (ch->socket_id == -1 && now >= ch->retry_at)
+                    open_channel(*ch);
+                if (ch->socket_id == -1)
+                {
+                    wake_at = min(wake_at, ch->retry_at);
+                    continue;
+                }
+                // Ids only grow, so the first request waiting is the oldest.
+                // A server that blackholes the connect is caught here too.
+                bool overdue = ch->connected ? !ch->waiting.empty() && now - ch->waiting.begin()->second >
+                                                                          chrono::milliseconds(config.timeout)
+                                             : now > ch->connect_deadline;
+                if (overdue)
+                {
+                    close_channel(*ch);
+                    continue;
+                }
+                if (!ch->connected)
+                {
+                    wake_at = min(wake_at, ch->connect_deadline);
+                    continue;
+                }
+                update_health(*ch, now_ms());
+                if (now >= next_load)
+                    request(*ch, MSG_LOAD_QUERY);
+                if (now >= next_ping)
+                    request(*ch, MSG_PING);
+                if (query_rooms && now >= next_rooms)
+                    request(*ch, MSG_ROOM_QUERY);
+                take_notices(*ch);
+                flush(*ch);
+                if (ch->socket_id != -1 && !ch->waiting.empty())
+                    wake_at = min(wake_at, ch->waiting.begin()->second + chrono::milliseconds(config.timeout));
+            }
+            if (now >= next_load)
+                next_load = now + chrono::milliseconds(config.load_interval);
+            if (now >= next_ping)
+                next_ping = now + chrono::milliseconds(config.ping_interval);
+            if (query_rooms && now >= next_rooms)
+                next_rooms = now + chrono::milliseconds(config.room_interval);
+            wake_at = min({wake_at, next_load, next_ping, query_rooms ? next_rooms : clock::time_point::max()});
+
+            auto wait = chrono::duration_cast<chrono::milliseconds>(wake_at - clock::now()).count() + 1;
+            int ready = epoll_wait(epoll_id, events, 64, max(0, (int)wait));
+            for (int i = 0; i < ready; i++)
+            {
+                if (!events[i].data.ptr)
+                {
+                    uint64_t value;
+                    if (read(wake_id, &value, sizeof value) == -1 && errno != EAGAIN)
+                        perror("control: eventfd");
+                    continue;
+                }
+                Channel &ch = *(Channel *)events[i].data.ptr;
+                if (ch.socket_id == -1)
+                    continue;
+                if (!ch.connected && (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+                    on_connected(ch);
+                if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP))
+                    on_readable(ch);
+                if (ch.connected && (events[i].events & EPOLLOUT))
+                    flush(ch);
+            }
+        }
+    }
+
+public:
+    ControlPlane() = default;
+    ~ControlPlane() { stop(); }
+
+    ControlPlane(const ControlPlane &) = delete;
+    ControlPlane &operator=(const ControlPlane &) = delete;
+
+    // Opens a control connection to each local server port and starts the
+    // control thread; add_server() brings in servers elsewhere. Returns false
+    // if it could not be started.
+    bool start(const vector<int> &ports, const ControlConfig &control_config, LoadHandler load_handler,
+               HealthHandler health_handler, RoomsHandler rooms_handler = NULL)
+    {
+        config = control_config;
+        on_load = load_handler;
+        on_health = health_handler;
+        on_rooms = rooms_handler;
+        if ((epoll_id = epoll_create1(EPOLL_CLOEXEC)) == -1 ||
+            (wake_id = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+        {
+            perror("control");
+            return false;
+        }
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = NULL;
+        epoll_ctl(epoll_id, EPOLL_CTL_ADD, wake_id, &event);
+        for (int port : ports)
+        {
+            struct sockaddr_in address;
+            memset(&address, 0, sizeof address);
+            address.sin_family = AF_INET;
+            address.sin_port = htons(port);
+            address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            add_server(port, address);
+        }
+        worker = thread(&ControlPlane::run, this);
+        return true;
+    }
+
+    void stop()
+    {
+        if (worker.joinable())
+        {
+            stopping.store(true);
+            uint64_t one = 1;
+            if (write(wake_id, &one, sizeof one) == -1)
+                perror("control: eventfd");
+            worker.join();
+        }
+        for (auto &ch : channels)
+            if (ch->socket_id != -1)
+                ::close(ch->socket_id);
+        channels.clear();
+        by_port.clear();
+        changes.clear();
+        if (epoll_id != -1)
+            ::close(epoll_id);
+        if (wake_id != -1)
+            ::close(wake_id);
+        epoll_id = wake_id = -1;
+    }
+
+    // Starts watching the server known by port at address, or moves an
+    // existing one to that address; safe from any thread
+    void add_server(int port, const struct sockaddr_in &address) { queue_change(port, address); }
+
+    // Stops watching the server and drops whatever was queued for it; safe
+    // from any thread
+    void remove_server(int port)
+    {
+        struct sockaddr_in none;
+        memset(&none, 0, sizeof none);
+        queue_change(port, none);
+    }
+
+    // Tells the server on port that room now lives there; safe from any
+    // thread. Notices for a server that is down are dropped.
+    void notify_placement(int port, const string &room)
+    {
+        shared_lock<shared_mutex> guard(channels_mutex);
+        auto found = by_port.find(port);
+        if (found == by_port.end() || room.size() > MAX_PAYLOAD)
+            return;
+        Channel &ch = *found->second;
+        queue_notice(ch, [&](string &queue) {
+            encode_frame(queue, MSG_PLACE, ch.next_id++, room_id_of(room), room.data(), room.size());
+        }, false);
+    }
+
+    // Tells the server on port to send the room's clients to new_host and
+    // new_port; safe from any thread. Kept until the server can be reached.
+    void migrate(int port, const string &room, int new_port, const string &new_host)
+    {
+        shared_lock<shared_mutex> guard(channels_mutex);
+        auto found = by_port.find(port);
+        if (found == by_port.end() || room.size() + new_host.size() > MAX_PAYLOAD - sizeof(uint32_t) - 1)
+            return;
+        Channel &ch = *found->second;
+        queue_notice(ch, [&](string &queue) {
+            encode_migrate(queue, ch.next_id++, room, new_port, new_host);
+        }, true);
+    }
+};
+
+#endif
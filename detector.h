@@ -0,0 +1,128 @@
+/*
+ * detector.h
+ * Failure detection for the Load Balancer's servers
+ *
+ * PhiDetector is a phi-accrual failure detector. It learns the mean and
+ * spread of the gaps between a server's heartbeats. From those it rates how
+ * unlikely the current silence is: phi = -log10(chance that a live server
+ * stays quiet this long). A fixed timeout is either slow or trigger-happy.
+ * The estimate adapts to what the network actually does, so a threshold on
+ * phi fails over fast on a steady link and tolerates a jittery one.
+ *
+ * FlapDamper holds back a server that keeps failing and coming back, the
+ * way BGP damps flapping routes. Every failure adds a penalty that decays
+ * with a half-life. Past the suppress limit the server stays out until the
+ * penalty has decayed below the reuse limit.
+ *
+ * Both take the time in milliseconds from the caller, so they can be driven
+ * by a real clock or by a test.
+ */
+#ifndef DETECTOR_H
+#define DETECTOR_H
+
+#include <bits/stdc++.h>
+
+using namespace std;
+
+#define PHI_HISTORY 100 // heartbeat gaps remembered
+
+struct DetectorConfig
+{
+    double phi_threshold = 8.0;   // suspect the server above this phi
+    double min_std_dev = 50;      // ms; keeps a very regular link from becoming hair-trigger
+    double flap_penalty = 1000;   // added by every failure
+    double flap_suppress = 2500;  // penalty that keeps a server out
+    double flap_reuse = 750;      // penalty below which it may come back
+    double flap_half_life = 10000; // ms
+};
+
+class PhiDetector
+{
+    deque<double> gaps;
+    double sum = 0, sum_sq = 0;
+    double last = -1; // time of the last heartbeat, -1 before the first
+
+public:
+    // expected_gap seeds the history, so phi means something from the
+    // first heartbeat on
+    void reset(double expected_gap)
+    {
+        gaps.clear();
+        sum = sum_sq = 0;
+        last = -1;
+        add_gap(expected_gap);
+    }
+
+    void add_gap(double gap)
+    {
+        gaps.push_back(gap);
+        sum += gap;
+        sum_sq += gap * gap;
+        if (gaps.size() > PHI_HISTORY)
+        {
+            sum -= gaps.front();
+            sum_sq -= gaps.front() * gaps.front();
+            gaps.pop_front();
+        }
+    }
+
+    void heartbeat(double now)
+    {
+        if (last >= 0)
+            add_gap(now - last);
+        last = now;
+    }
+
+    bool started() const { return last >= 0; }
+
+    // 0 until the first heartbeat
+    double phi(double now, double min_std_dev) const
+    {
+        if (last < 0 || gaps.empty())
+            return 0;
+        double mean = sum / gaps.size();
+        double variance = max(0.0, sum_sq / gaps.size() - mean * mean);
+        double std_dev = max(sqrt(variance), min_std_dev);
+        // Logistic approximation of the normal distribution's tail
+        double y = (now - last - mean) / std_dev;
+        double e = exp(-y * (1.5976 + 0.070566 * y * y));
+        double p_later = now - last > mean ? e / (1 + e) : 1 - 1 / (1 + e);
+        return -log10(max(p_later, 1e-300));
+    }
+};
+
+class FlapDamper
+{
+    double penalty = 0;
+    double updated = 0; // when penalty was last decayed
+    bool suppressed = false;
+
+    void decay(const DetectorConfig &config, double now)
+    {
+        if (now > updated)
+            penalty *= exp2(-(now - updated) / config.flap_half_life);
+        updated = now;
+        if (suppressed && penalty < config.flap_reuse)
+            suppressed = false;
+    }
+
+public:
+    void failed(const DetectorConfig &config, double now)
+    {
+        decay(config, now);
+        penalty += config.flap_penalty;
+        if (penalty > config.flap_suppress)
+            suppressed = true;
+    }
+
+    // False while the server is held back for flapping
+    bool usable(const DetectorConfig &config, double now)
+    {
+        decay(config, now);
+        return !suppressed;
+    }
+
+    double current() const { return penalty; }
+};
+
+#endif
@@ -0,0 +1,592 @@
+/*
+ * gossip.h
+ * Room placements and server health shared between Load Balancer instances
+ *
+ * Several balancers can serve the same servers, behind one SO_REUSEPORT
+ * port or on different hosts. Each keeps its own routing table and they
+ * converge by gossip: every placement a balancer makes carries a version
+ * and goes to every peer, and for each room the newest version wins
+ * (last writer wins, ties going to the higher balancer id). Versions are
+ * hybrid clocks, the later of the wall clock in ms and one past the
+ * newest version seen, so a balancer that restarts still outranks
+ * placements made before it went down.
+ *
+ * Each balancer connects to every peer listed and only writes on that
+ * connection; it reads what its peers send on the connections they open.
+ * A new connection starts with every placement known, so a peer that was
+ * down or fell behind catches up. A heartbeat every interval carries the
+ * sender's view of its servers. A server counts as up only while every
+ * live balancer sees it up, so hashing a new room gives the same server
+ * whichever balancer answers. The live balancer with the lowest id leads:
+ * it alone moves rooms between servers.
+ */
+#ifndef GOSSIP_H
+#define GOSSIP_H
+
+#include <bits/stdc++.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "protocol.h"
+
+using namespace std;
+
+#define GOSSIP_BACKLOG_MAX (64 * 1024 * 1024) // unsent bytes per peer before it must resync
+#define GOSSIP_APPLY_STRIPES 64                 // locks that order the placements of a room
+
+struct GossipConfig
+{
+    uint32_t id = 0;                // unique per balancer
+    int port = 0;                   // where peers connect, 0 for none
+    vector<pair<string, int>> peers; // host and gossip port of every other balancer
+    int interval = 200;             // ms between heartbeats
+    int timeout = 1000;             // ms without a heartbeat before a peer counts as gone
+    int retry_interval = 1000;      // ms between attempts to reach a peer
+};
+
+// Parses "host:port,host:port". Returns false if an entry is malformed.
+inline bool parse_peers(const string &list, vector<pair<string, int>> &peers)
+{
+    stringstream entries(list);
+    string entry;
+    while (getline(entries, entry, ','))
+    {
+        size_t colon = entry.rfind(':');
+        if (colon == string::npos || colon == 0 || atoi(entry.c_str() + colon + 1) <= 0)
+            return false;
+        peers.emplace_back(entry.substr(0, colon), atoi(entry.c_str() + colon + 1));
+    }
+    return true;
+}
+
+class Gossip
+{
+public:
+    // Runs on the gossip thread when a peer's placement of room wins, under
+    // the room's apply lock but not the placement lock. ours is true if it
+    // replaces one this balancer made.
+    typedef function<void(const string &room, int port, bool ours)> PlacementHandler;
+    // This balancer's own view of its servers, polled every heartbeat
+    typedef function<vector<pair<int, bool>>()> HealthSource;
+
+    atomic<uint64_t> sent{0};     // frames queued to peers
+    atomic<uint64_t> received{0}; // frames read from peers
+    atomic<uint64_t> applied{0};  // peer placements that won
+    atomic<uint64_t> resyncs{0};  // connections restarted because a peer fell behind
+
+private:
+    typedef chrono::steady_clock clock;
+
+    struct Placement
+    {
+        int port;
+        uint64_t version;
+        uint32_t origin;
+    };
+
+    // What epoll hands back for a peer connection
+    struct Link
+    {
+        bool incoming;
+    };
+
+    // A connection to a peer; only written to
+    struct Outbound : Link
+    {
+        struct sockaddr_in address;
+        int socket_id = -1;
+        bool connected = false;
+        string out;
+        size_t out_sent = 0;
+        clock::time_point retry_at, connect_deadline;
+    };
+
+    // A connection from a peer; only read from
+    struct Inbound : Link
+    {
+        int socket_id;
+        FrameDecoder decoder;
+    };
+
+    struct PeerView
+    {
+        clock::time_point heard;
+        map<int, bool> up;
+    };
+
+    GossipConfig config;
+    PlacementHandler on_placement;
+    HealthSource health_source;
+    bool enabled = false;
+    vector<unique_ptr<Outbound>> outbound;
+    map<Inbound *, unique_ptr<Inbound>> inbound;
+    map<uint32_t, PeerView> views; // by balancer id, gossip thread only
+    // By server port: some live balancer sees it down. Indexed rather than
+    // looked up so servers can come and go while reactors read it.
+    atomic<bool> vetoed[65536] = {};
+    set<int> vetoed_ports; // the ones set above, gossip thread only
+    atomic<bool> leader{true};
+    atomic<int> live{0};
+    int listen_id = -1, epoll_id = -1, wake_id = -1;
+    thread worker;
+    atomic<bool> stopping{false};
+
+    // A room's placements reach the routing table one at a time, in the
+    // order their versions were decided, under the room's apply lock; the
+    // placement lock only covers deciding them
+    mutex apply_mutexes[GOSSIP_APPLY_STRIPES];
+    mutex placements_mutex;
+    unordered_map<string, Placement> placements;
+    uint64_t last_version = 0;
+    string pending;      // placements made here, not yet queued to peers
+    bool resync = false; // pending overflowed; every peer needs everything again
+
+    // Newest wins; equal versions go to the higher id so every balancer
+    // picks the same one
+    static bool newer(uint64_t version, uint32_t origin, const Placement &than)
+    {
+        return version > than.version || (version == than.version && origin > than.origin);
+    }
+
+    mutex &apply_mutex(const string &room) { return apply_mutexes[room_id_of(room) % GOSSIP_APPLY_STRIPES]; }
+
+    uint64_t next_version()
+    {
+        uint64_t wall = chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now().time_since_epoch())
+                            .count();
+        last_version = max(last_version + 1, wall);
+        return last_version;
+    }
+
+    void wake()
+    {
+        uint64_t one = 1;
+        if (write(wake_id, &one, sizeof one) == -1 && errno != EAGAIN)
+            perror("gossip: eventfd");
+    }
+
+    void watch(int socket_id, void *ptr, uint32_t events)
+    {
+        struct epoll_event event;
+        event.events = events;
+        event.data.ptr = ptr;
+        epoll_ctl(epoll_id, EPOLL_CTL_ADD, socket_id, &event);
+    }
+
+    void open_outbound(Outbound &peer)
+    {
+        peer.retry_at = clock::now() + chrono::milliseconds(config.retry_interval);
+        peer.connect_deadline = clock::now() + chrono::milliseconds(config.timeout);
+        peer.socket_id = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (peer.socket_id == -1)
+            return;
+        int one = 1;
+        setsockopt(peer.socket_id, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+        if (connect(peer.socket_id, (struct sockaddr *)&peer.address, sizeof peer.address) == -1 &&
+            errno != EINPROGRESS)
+        {
+            close_outbound(peer);
+            return;
+        }
+        watch(peer.socket_id, &peer, EPOLLOUT | EPOLLRDHUP | EPOLLET);
+    }
+
+    void close_outbound(Outbound &peer)
+    {
+        if (peer.socket_id != -1)
+            ::close(peer.socket_id);
+        peer.socket_id = -1;
+        peer.connected = false;
+        peer.out.clear();
+        peer.out_sent = 0;
+    }
+
+    // A fresh connection starts with everything this balancer knows
+    void on_connected(Outbound &peer)
+    {
+        int error = 0;
+        socklen_t error_len = sizeof error;
+        if (getsockopt(peer.socket_id, SOL_SOCKET, SO_ERROR, &error, &error_len) == -1 || error != 0)
+        {
+            close_outbound(peer);
+            return;
+        }
+        peer.connected = true;
+        encode_gossip_health(peer.out, config.id, health_source());
+        lock_guard<mutex> guard(placements_mutex);
+        for (auto &placement : placements)
+            encode_gossip_place(peer.out, placement.second.origin, placement.first, placement.second.version,
+                                placement.second.port);
+        sent += placements.size() + 1;
+    }
+
+    void flush(Outbound &peer)
+    {
+        while (peer.connected && peer.out_sent < peer.out.size())
+        {
+            ssize_t n = send(peer.socket_id, peer.out.data() + peer.out_sent, peer.out.size() - peer.out_sent,
+                             MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return; // EPOLLOUT picks it up
+            if (n == -1)
+            {
+                close_outbound(peer);
+                return;
+            }
+            peer.out_sent += n;
+        }
+        peer.out.clear();
+        peer.out_sent = 0;
+    }
+
+    // Moves the placements made since the last call behind every peer's
+    // queue. A peer too far behind is reconnected, which resends everything.
+    void take_pending()
+    {
+        string taken;
+        bool restart;
+        {
+            lock_guard<mutex> guard(placements_mutex);
+            taken.swap(pending);
+            restart = resync;
+            resync = false;
+        }
+        for (auto &peer : outbound)
+        {
+            if (!peer->connected)
+                continue;
+            if (restart || peer->out.size() - peer->out_sent + taken.size() > GOSSIP_BACKLOG_MAX)
+            {
+                resyncs++;
+                close_outbound(*peer);
+                peer->retry_at = clock::now();
+                continue;
+            }
+            peer->out += taken;
+        }
+    }
+
+    void heartbeat()
+    {
+        string beat;
+        encode_gossip_health(beat, config.id, health_source());
+        for (auto &peer : outbound)
+            if (peer->connected)
+            {
+                peer->out += beat;
+                sent++;
+            }
+    }
+
+    // Recounts the live peers, the leader and which servers all of them see up
+    void refresh(clock::time_point now)
+    {
+        uint32_t lowest = config.id;
+        int count = 0;
+        for (auto &view : views)
+        {
+            if (now - view.second.heard > chrono::milliseconds(config.timeout))
+                continue;
+            count++;
+            lowest = min(lowest, view.first);
+        }
+        live = count;
+        leader = lowest == config.id;
+        set<int> down;
+        for (auto &view : views)
+        {
+            if (now - view.second.heard > chrono::milliseconds(config.timeout))
+                continue;
+            for (auto &seen : view.second.up)
+                if (!seen.second && seen.first > 0 && seen.first < 65536)
+                    down.insert(seen.first);
+        }
+        for (int port : vetoed_ports)
+            if (!down.count(port))
+                vetoed[port] = false;
+        for (int port : down)
+            vetoed[port] = true;
+        vetoed_ports.swap(down);
+    }
+
+    void accept_peers()
+    {
+        while (true)
+        {
+            int socket_id = accept4(listen_id, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (socket_id == -1)
+            {
+                if (errno == EINTR || errno == ECONNABORTED)
+                    continue;
+                return;
+            }
+            Inbound *peer = new Inbound();
+            peer->incoming = true;
+            peer->socket_id = socket_id;
+            inbound[peer].reset(peer);
+            watch(socket_id, peer, EPOLLIN | EPOLLRDHUP | EPOLLET);
+        }
+    }
+
+    void close_inbound(Inbound *peer)
+    {
+        ::close(peer->socket_id);
+        inbound.erase(peer);
+    }
+
+    void on_readable(Inbound *peer)
+    {
+        while (true)
+        {
+            size_t available;
+            char *space = peer->decoder.write_space(4096, available);
+            ssize_t n = recv(peer->socket_id, space, available, MSG_DONTWAIT);
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return;
+            if (n <= 0)
+            {
+                close_inbound(peer);
+                return;
+            }
+            peer->decoder.commit(n);
+            Frame frame;
+            int decoded;
+            while ((decoded = peer->decoder.next(frame)) == 1)
+                on_frame(frame);
+            if (decoded == -1)
+            {
+                close_inbound(peer);
+                return;
+            }
+        }
+    }
+
+    void on_frame(const Frame &frame)
+    {
+        received++;
+        if (frame.header.type == MSG_GOSSIP_HEALTH)
+        {
+            vector<pair<int, bool>> servers;
+            if (frame.header.sender_id == config.id || !read_gossip_health(frame, servers))
+                return;
+            PeerView &view = views[frame.header.sender_id];
+            view.heard = clock::now();
+            view.up = map<int, bool>(servers.begin(), servers.end());
+            refresh(view.heard);
+            return;
+        }
+        string room;
+        uint64_t version;
+        uint32_t port;
+        if (frame.header.type != MSG_GOSSIP_PLACE || !read_gossip_place(frame, room, version, port))
+            return;
+        lock_guard<mutex> applying(apply_mutex(room));
+        bool ours;
+        {
+            lock_guard<mutex> guard(placements_mutex);
+            last_version = max(last_version, version);
+            auto found = placements.find(room);
+            if (found != placements.end() && !newer(version, frame.header.sender_id, found->second))
+                return;
+            ours = found != placements.end() && found->second.origin == config.id;
+            placements[room] = {(int)port, version, frame.header.sender_id};
+        }
+        applied++;
+        on_placement(room, port, ours);
+    }
+
+    void run()
+    {
+        struct epoll_event events[64];
+        clock::time_point next_beat = clock::now();
+        while (!stopping.load())
+        {
+            clock::time_point now = clock::now(), wake_at = clock::time_point::max();
+            if (now >= next_beat)
+            {
+                heartbeat();
+                refresh(now);
+                next_beat = now + chrono::milliseconds(config.interval);
+            }
+            take_pending();
+            for (auto &peer : outbound)
+            {
+                if (peer->socket_id == -1 && now >= peer->retry_at)
+                    open_outbound(*peer);
+                if (peer->socket_id == -1)
+                    wake_at = min(wake_at, peer->retry_at);
+                else if (!peer->connected && now > peer->connect_deadline)
+                    close_outbound(*peer);
+                else if (!peer->connected)
+                    wake_at = min(wake_at, peer->connect_deadline);
+                flush(*peer);
+            }
+            wake_at = min(wake_at, next_beat);
+
+            auto wait = chrono::duration_cast<chrono::milliseconds>(wake_at - clock::now()).count() + 1;
+            int ready = epoll_wait(epoll_id, events, 64, max(0, (int)wait));
+            for (int i = 0; i < ready; i++)
+            {
+                void *ptr = events[i].data.ptr;
+                if (!ptr)
+                {
+                    uint64_t value;
+                    if (read(wake_id, &value, sizeof value) == -1 && errno != EAGAIN)
+                        perror("gossip: eventfd");
+                }
+                else if (ptr == this)
+                    accept_peers();
+                else if (((Link *)ptr)->incoming)
+                    on_readable((Inbound *)ptr);
+                else
+                {
+                    Outbound &peer = *(Outbound *)ptr;
+                    if (peer.socket_id == -1)
+                        continue;
+                    if (events[i].events & (EPOLLRDHUP | EPOLLERR | EPOLLHUP))
+                        close_outbound(peer); // peers never write back, so this is a hang-up
+                    else if (!peer.connected)
+                        on_connected(peer);
+                    flush(peer);
+                }
+            }
+        }
+    }
+
+public:
+    Gossip() = default;
+    ~Gossip() { stop(); }
+
+    Gossip(const Gossip &) = delete;
+    Gossip &operator=(const Gossip &) = delete;
+
+    // Listens for peers, resolves their addresses and starts the gossip
+    // thread. known are the placements this balancer had before, such as those replayed
+    // from its log, which rank below any placement made since. Returns false
+    // if it could not be started.
+    bool start(const GossipConfig &gossip_config, const vector<pair<string, int>> &known, PlacementHandler placement_handler, HealthSource health)
+    {
+        config = gossip_config;
+        on_placement = placement_handler;
+        health_source = health;
+        for (auto &placement : known)
+            placements.emplace(placement.first, Placement{placement.second, 0, config.id});
+        for (auto &peer : config.peers)
+        {
+            struct addrinfo hints, *found;
+            memset(&hints, 0, sizeof hints);
+            hints.ai_family = AF_INET;
+            hints.ai_socktype = SOCK_STREAM;
+            int error = getaddrinfo(peer.first.c_str(), to_string(peer.second).c_str(), &hints, &found);
+            if (error != 0)
+            {
+                cerr << "gossip: " << peer.first << ": " << gai_strerror(error) << "\n";
+                return false;
+            }
+            outbound.emplace_back(new Outbound());
+            outbound.back()->incoming = false;
+            memcpy(&outbound.back()->address, found->ai_addr, sizeof(struct sockaddr_in));
+            freeaddrinfo(found);
+        }
+        if ((epoll_id = epoll_create1(EPOLL_CLOEXEC)) == -1 ||
+            (wake_id = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+        {
+            perror("gossip");
+            return false;
+        }
+        watch(wake_id, NULL, EPOLLIN);
+        if (config.port > 0)
+        {
+            struct sockaddr_in address;
+            memset(&address, 0, sizeof address);
+            address.sin_family = AF_INET;
+            address.sin_port = htons(config.port);
+            address.sin_addr.s_addr = INADDR_ANY;
+            int enable = 1;
+            listen_id = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (listen_id == -1 || setsockopt(listen_id, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof enable) == -1 ||
+                ::bind(listen_id, (struct sockaddr *)&address, sizeof address) == -1 || listen(listen_id, 16) == -1)
+            {
+                perror("gossip: listen");
+                return false;
+            }
+            watch(listen_id, this, EPOLLIN | EPOLLET);
+        }
+        enabled = true;
+        stopping.store(false);
+        worker = thread(&Gossip::run, this);
+        return true;
+    }
+
+    void stop()
+    {
+        if (worker.joinable())
+        {
+            stopping.store(true);
+            wake();
+            worker.join();
+        }
+        for (auto &peer : outbound)
+            close_outbound(*peer);
+        for (auto &peer : inbound)
+            ::close(peer.second->socket_id);
+        outbound.clear();
+        inbound.clear();
+        for (int id : {listen_id, epoll_id, wake_id})
+            if (id != -1)
+                ::close(id);
+        listen_id = epoll_id = wake_id = -1;
+        enabled = false;
+        leader = true;
+        live = 0;
+    }
+
+    // Runs change, which updates the routing table, under the room's apply
+    // lock. If it returns true, room now lives on port by this balancer's
+    // decision: that placement outranks every one seen so far and goes to
+    // every peer. Safe from any thread; without gossip it just runs change.
+    template <class Change>
+    bool place(const string &room, int port, Change change)
+    {
+        if (!enabled)
+            return change();
+        lock_guard<mutex> applying(apply_mutex(room));
+        if (!change())
+            return false;
+        bool first;
+        {
+            lock_guard<mutex> guard(placements_mutex);
+            Placement &placement = placements[room];
+            placement = {port, next_version(), config.id};
+            if (pending.size() >= GOSSIP_BACKLOG_MAX)
+            {
+                pending.clear();
+                resync = true;
+            }
+            first = pending.empty();
+            encode_gossip_place(pending, config.id, room, placement.version, port);
+        }
+        sent++;
+        if (first)
+            wake();
+        return true;
+    }
+
+    // Whether every live balancer sees the server up; true for ports no
+    // peer reports on, or without gossip
+    bool agreed_up(int port) const { return port <= 0 || port >= 65536 || !vetoed[port].load(); }
+
+    bool leading() const { return leader.load(); }
+    int live_peers() const { return live.load(); }
+};
+
+#endif
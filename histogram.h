@@ -0,0 +1,96 @@
+/*
+ * histogram.h
+ * Latency histogram with HDR-style log-linear buckets, for lbbench
+ *
+ * Values fall into power-of-two ranges and each range is split into
+ * HISTOGRAM_SUB_BUCKETS / 2 linear buckets, so a recorded value is kept to
+ * within 1/128 of itself from single nanoseconds up to centuries, in a fixed
+ * array of counters. Recording is a shift and an increment. Histograms
+ * filled by different threads merge by adding their counts.
+ */
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <bits/stdc++.h>
+
+using namespace std;
+
+#define HISTOGRAM_SUB_BITS 8
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+
+class Histogram
+{
+    vector<uint64_t> counts;
+    uint64_t total = 0;
+    uint64_t min_value = UINT64_MAX, max_value = 0;
+    long double sum = 0;
+
+    // Values below HISTOGRAM_SUB_BUCKETS have a bucket each; above that a
+    // bucket covers 2^shift values
+    static size_t index_of(uint64_t value)
+    {
+        if (value < HISTOGRAM_SUB_BUCKETS)
+            return value;
+        int shift = 63 - __builtin_clzll(value) - (HISTOGRAM_SUB_BITS - 1);
+        size_t sub = value >> shift; // in [SUB_BUCKETS / 2, SUB_BUCKETS)
+        return HISTOGRAM_SUB_BUCKETS + (shift - 1) * (HISTOGRAM_SUB_BUCKETS / 2) + sub -
+               HISTOGRAM_SUB_BUCKETS / 2;
+    }
+
+    // Largest value that lands in bucket `index`
+    static uint64_t highest_in(size_t index)
+    {
+        if (index < HISTOGRAM_SUB_BUCKETS)
+            return index;
+        size_t past = index - HISTOGRAM_SUB_BUCKETS;
+        int shift = past / (HISTOGRAM_SUB_BUCKETS / 2) + 1;
+        uint64_t sub = past % (HISTOGRAM_SUB_BUCKETS / 2) + HISTOGRAM_SUB_BUCKETS / 2;
+        return ((sub + 1) << shift) - 1;
+    }
+
+public:
+    Histogram() : counts(index_of(UINT64_MAX) + 1, 0) {}
+
+    void record(uint64_t value)
+    {
+        counts[index_of(value)]++;
+        total++;
+        min_value = std::min(min_value, value);
+        max_value = std::max(max_value, value);
+        sum += value;
+    }
+
+    void merge(const Histogram &other)
+    {
+        for (size_t i = 0; i < counts.size(); i++)
+            counts[i] += other.counts[i];
+        total += other.total;
+        min_value = std::min(min_value, other.min_value);
+        max_value = std::max(max_value, other.max_value);
+        sum += other.sum;
+    }
+
+    uint64_t count() const { return total; }
+    uint64_t min() const { return total ? min_value : 0; }
+    uint64_t max() const { return max_value; }
+    double mean() const { return total ? (double)(sum / total) : 0; }
+
+    // Smallest recorded value that `percentile` percent of the values do
+    // not exceed, to within a bucket; 0 when empty
+    uint64_t percentile(double percentile) const
+    {
+        if (!total)
+            return 0;
+        uint64_t rank = std::max((uint64_t)1, (uint64_t)ceil(percentile / 100 * total));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts.size(); i++)
+        {
+            seen += counts[i];
+            if (seen >= rank)
+                return std::min(highest_in(i), max_value);
+        }
+        return max_value;
+    }
+};
+
+#endif
@@ -0,0 +1,232 @@
+/*
+ * history.h
+ * Recent messages of each room, replayed to clients that join it
+ *
+ * A room's history is a ring of encoded CHAT frames in one contiguous arena,
+ * kept exactly as they went out but with FLAG_HISTORY set, so a client can
+ * tell a replay from live traffic. The arena starts small and doubles up to
+ * HISTORY_ARENA_MAX; once full, or once it holds the configured number of
+ * messages, the oldest frames make room for new ones. A joiner is sent the
+ * whole ring as one message, copied out in at most two pieces, which goes
+ * out in the same writev() as the rest of its outbox.
+ *
+ * Histories outlive their rooms' members, so a client that drops and comes
+ * back still sees what it missed. Each reactor keeps the histories of its
+ * own rooms in a HistoryCache under a memory budget; going over it evicts
+ * whole rooms, least recently used first. Every message and every join
+ * counts as use, so the rooms that go are the ones that went quiet. Like
+ * the rooms themselves, a cache is only touched by its reactor's thread.
+ */
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <bits/stdc++.h>
+#include "outbox.h"
+#include "protocol.h"
+
+using namespace std;
+
+#define HISTORY_MESSAGES 32       // frames kept per room unless -H says otherwise
+#define HISTORY_MEMORY_MB 64      // budget for all rooms on a server unless -m says otherwise
+#define HISTORY_ARENA_MIN 4096    // first arena of a room, bytes
+#define HISTORY_ARENA_MAX 131072  // largest arena of a room, bytes; bigger frames are not kept
+
+class RoomHistory
+{
+    struct Entry
+    {
+        uint64_t start; // position of the frame in the stream of kept bytes
+        uint32_t size;
+    };
+    char *arena = NULL;
+    size_t capacity = 0;      // arena bytes, a power of two
+    vector<Entry> entries;    // ring of kept frames, oldest at first
+    size_t first = 0, count = 0;
+    uint64_t end = 0;         // position after the newest frame
+
+    // Copies size bytes between the arena at position and out, across the
+    // arena's end if need be
+    void copy_out(uint64_t position, char *out, size_t size) const
+    {
+        size_t at = position & (capacity - 1), piece = min(size, capacity - at);
+        memcpy(out, arena + at, piece);
+        memcpy(out + piece, arena, size - piece);
+    }
+
+    void copy_in(uint64_t position, const char *in, size_t size)
+    {
+        size_t at = position & (capacity - 1), piece = min(size, capacity - at);
+        memcpy(arena + at, in, piece);
+        memcpy(arena, in + piece, size - piece);
+    }
+
+    void drop_oldest()
+    {
+        first = (first + 1) % entries.size();
+        count--;
+    }
+
+    // Moves the kept frames to an arena of new_capacity bytes
+    void resize(size_t new_capacity)
+    {
+        char *bigger = (char *)pool_alloc(new_capacity);
+        size_t used = bytes_used();
+        if (arena)
+        {
+            // Positions stay the same, so each byte goes to its position
+            // modulo the new capacity, which may wrap elsewhere
+            for (size_t done = 0; done < used;)
+            {
+                uint64_t position = end - used + done;
+                size_t at_old = position & (capacity - 1), at_new = position & (new_capacity - 1);
+                size_t piece = min({used - done, capacity - at_old, new_capacity - at_new});
+                memcpy(bigger + at_new, arena + at_old, piece);
+                done += piece;
+            }
+            pool_free(arena, capacity);
+        }
+        arena = bigger;
+        capacity = new_capacity;
+    }
+
+public:
+    explicit RoomHistory(size_t max_messages) : entries(max(max_messages, (size_t)1)) {}
+    ~RoomHistory()
+    {
+        if (arena)
+            pool_free(arena, capacity);
+    }
+
+    RoomHistory(const RoomHistory &) = delete;
+    RoomHistory &operator=(const RoomHistory &) = delete;
+
+    size_t messages() const { return count; }
+    size_t bytes_used() const { return count ? end - entries[first].start : 0; }
+
+    // Memory held, for the cache's budget
+    size_t footprint() const { return capacity + entries.size() * sizeof(Entry); }
+
+    // Keeps a copy of the encoded frame, marked as history. Returns false for
+    // a frame too big to keep.
+    bool append(const char *frame, size_t size)
+    {
+        if (size < sizeof(FrameHeader) || size > HISTORY_ARENA_MAX)
+            return false;
+        if (count == entries.size())
+            drop_oldest();
+        if (bytes_used() + size > capacity && capacity < HISTORY_ARENA_MAX)
+        {
+            size_t wanted = max(capacity, (size_t)HISTORY_ARENA_MIN);
+            while (wanted < bytes_used() + size && wanted < HISTORY_ARENA_MAX)
+                wanted *= 2;
+            resize(wanted);
+        }
+        while (bytes_used() + size > capacity)
+            drop_oldest();
+        copy_in(end, frame, size);
+        uint16_t flags = htons(FLAG_HISTORY);
+        copy_in(end + offsetof(FrameHeader, flags), (const char *)&flags, sizeof flags);
+        entries[(first + count) % entries.size()] = {end, (uint32_t)size};
+        count++;
+        end += size;
+        return true;
+    }
+
+    // Every kept frame, oldest first, in one message. Returns false if there
+    // are none.
+    bool replay(Message &out) const
+    {
+        size_t used = bytes_used();
+        if (!used)
+            return false;
+        out = Message(used);
+        copy_out(end - used, out.data(), used);
+        return true;
+    }
+};
+
+class HistoryCache
+{
+    struct Kept
+    {
+        RoomHistory history;
+        list<string>::iterator use; // place in lru
+        size_t footprint = 0;       // counted in total
+
+        explicit Kept(size_t max_messages) : history(max_messages) {}
+    };
+    unordered_map<string, Kept> rooms;
+    list<string> lru; // room names, most recently used first
+    size_t total = 0; // footprint of all kept rooms
+
+    void touch(Kept &kept)
+    {
+        lru.splice(lru.begin(), lru, kept.use);
+    }
+
+    // Returns the number of rooms evicted
+    size_t evict_over_budget(const string &keep)
+    {
+        size_t evicted = 0;
+        while (total > budget && !lru.empty() && lru.back() != keep)
+        {
+            string idle = lru.back();
+            forget(idle);
+            evicted++;
+        }
+        return evicted;
+    }
+
+public:
+    size_t max_messages = HISTORY_MESSAGES; // per room, 0 to keep none
+    size_t budget = (size_t)HISTORY_MEMORY_MB << 20;
+
+    size_t memory() const { return total; }
+    size_t size() const { return rooms.size(); }
+
+    // Keeps an encoded CHAT frame sent to room. Returns the number of other
+    // rooms evicted to stay within budget.
+    size_t record(const string &room, const char *frame, size_t size)
+    {
+        if (max_messages == 0)
+            return 0;
+        auto found = rooms.find(room);
+        if (found == rooms.end())
+        {
+            found = rooms.try_emplace(room, max_messages).first;
+            lru.push_front(room);
+            found->second.use = lru.begin();
+        }
+        else
+            touch(found->second);
+        Kept &kept = found->second;
+        kept.history.append(frame, size);
+        total += kept.history.footprint() - kept.footprint;
+        kept.footprint = kept.history.footprint();
+        return evict_over_budget(room);
+    }
+
+    // The room's kept frames for a joiner, in one message. Returns false if
+    // it has none.
+    bool replay(const string &room, Message &out)
+    {
+        auto found = rooms.find(room);
+        if (found == rooms.end())
+            return false;
+        touch(found->second);
+        return found->second.history.replay(out);
+    }
+
+    // Drops a room's history, e.g. once the room moved to another server
+    void forget(const string &room)
+    {
+        auto found = rooms.find(room);
+        if (found == rooms.end())
+            return;
+        total -= found->second.footprint;
+        lru.erase(found->second.use);
+        rooms.erase(found);
+    }
+};
+
+#endif
@@ -0,0 +1,744 @@
+/*
+ * lbbench.cpp
+ * Load generator and end-to-end latency benchmark for the Load Balancer
+ *
+ * Opens many simulated clients through the balancer the way client.cpp
+ * does: HELLO to the balancer, ASSIGN back, HELLO to the assigned server.
+ * Clients are spread over rooms by a Zipf distribution (-z 0 is uniform)
+ * and, once all have joined, send chat messages at -m per second each,
+ * with Poisson or fixed gaps. Every message carries the time it was sent;
+ * each member that receives it records how long the server took to fan it
+ * out. Assignment and fan-out latencies go into HDR-style histograms
+ * (histogram.h), reported with throughput at the end. Messages a server
+ * replays from a room's history to a joiner are counted, not timed.
+ *
+ * Both timestamps come from this process's monotonic clock, so the servers
+ * may run anywhere the benchmark can reach. Clients go to the host the
+ * ASSIGN names, looked up once per worker, or to the balancer's if it
+ * names none. Behind a proxying balancer (ASSIGN for port 0) they stay on
+ * the balancer's connection.
+ *
+ * With -R every client then drops its server connection at once and
+ * rejoins, the way client.cpp does: straight back to the server with its
+ * routing token when the balancer issued one (-K, see token.h), else
+ * through the balancer; -n always takes the balancer. The time from the
+ * drop to being back in the room is reported as the rejoin latency. A
+ * client going back to a server that logs its rooms (-D) resumes from the
+ * last message it saw, and what it missed is counted as replayed.
+ *
+ * Worker threads each drive a share of the clients with epoll.
+ */
+#include <bits/stdc++.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "protocol.h"
+#include "histogram.h"
+#include "token.h"
+using namespace std;
+#define LB_PORT 6000
+#define MAX_EVENTS 256
+#define CONNECTS_IN_FLIGHT 64 // handshakes each worker runs at once
+#define JOIN_TIMEOUT 60       // s to wait for every client to join
+#define SETTLE_MS 200         // between the last join and the first message
+#define DRAIN_MS 1000         // after the last message, for deliveries still on the way
+#define REJOIN_TIMEOUT 30     // s to wait for every client to rejoin with -R
+#define BENCH_MAGIC 0x6c62626eu
+
+enum bench_state
+{
+    BENCH_IDLE,
+    BENCH_ASKING,  // connecting to the balancer or waiting for ASSIGN
+    BENCH_JOINING, // connecting to the assigned server, or waiting for it to renew the token
+    BENCH_JOINED,
+    BENCH_FAILED,
+};
+
+enum bench_phase
+{
+    PHASE_JOIN,
+    PHASE_RUN,
+    PHASE_DRAIN,
+    PHASE_REJOIN, // with -R
+    PHASE_DONE,
+};
+
+struct BenchConfig
+{
+    int clients = 1000;
+    int rooms = 100;
+    double zipf = 0;   // 0 spreads clients evenly over the rooms
+    double rate = 1;   // messages per second per client
+    bool poisson = true;
+    int size = 64;     // chat payload bytes, timestamp included
+    int seconds = 10;
+    int threads = 4;
+    string host = "127.0.0.1";
+    int port = LB_PORT;
+    unsigned seed = 1;
+    bool rejoin = false;     // -R
+    bool use_tokens = true;  // -n turns off
+};
+
+// Chat payload: [u32 magic][u32 sender][u64 sent at, ns] then padding
+struct Stamp
+{
+    uint32_t magic;
+    uint32_t sender;
+    uint64_t sent_ns;
+} __attribute__((packed));
+
+struct BenchClient
+{
+    int id, room;
+    int socket_id = -1;
+    bool connecting = false; // the next writable event finishes the connect
+    bench_state state = BENCH_IDLE;
+    uint64_t asked_at = 0; // or dropped at, when rejoining
+    struct in_addr server; // host of the assigned server
+    uint32_t port = 0;     // and its port, 0 if the balancer proxies
+    string token;          // last MSG_ROUTE_TOKEN frame, empty if none came
+    uint32_t token_port = 0;
+    bool direct = false;   // rejoining on the token, without the balancer
+    uint64_t last_seq = 0; // of the last logged message received, 0 if none
+    uint32_t seq_port = 0; // the server that numbered it
+    FrameDecoder decoder;
+    string out; // unsent bytes, only while the socket is full
+    size_t out_sent = 0;
+};
+
+BenchConfig config;
+atomic<int> phase{PHASE_JOIN};
+atomic<int> joined{0}, failed{0};
+atomic<int> dropped{0}; // workers whose clients have all left their servers, with -R
+vector<atomic<int>> room_members; // joined clients per room
+struct sockaddr_in lb_address;
+
+uint64_t now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+class Worker
+{
+    vector<BenchClient *> clients;
+    size_t next_start = 0;
+    int in_flight = 0;
+    int epoll_id;
+    mt19937_64 random;
+    // Clients by the time of their next message, earliest first
+    priority_queue<pair<uint64_t, int>, vector<pair<uint64_t, int>>, greater<pair<uint64_t, int>>> schedule;
+    string message;
+    map<string, struct in_addr> hosts; // server hosts looked up so far
+    string host; // reused for every ASSIGN and REDIRECT
+
+    // Address of a server host named in an ASSIGN; false if it cannot be
+    // looked up
+    bool resolve(const string &name, struct in_addr &address)
+    {
+        if (name.empty())
+        {
+            address = lb_address.sin_addr;
+            return true;
+        }
+        auto found = hosts.find(name);
+        if (found != hosts.end())
+        {
+            address = found->second;
+            return true;
+        }
+        struct addrinfo hints, *results;
+        memset(&hints, 0, sizeof hints);
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(name.c_str(), NULL, &hints, &results) != 0)
+            return false;
+        address = hosts[name] = ((struct sockaddr_in *)results->ai_addr)->sin_addr;
+        freeaddrinfo(results);
+        return true;
+    }
+
+    // Non-blocking connect; the socket reports writable once it is open
+    bool open_socket(BenchClient *client, struct sockaddr_in address)
+    {
+        client->socket_id = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (client->socket_id == -1)
+            return false;
+        client->connecting = true;
+        int enable = 1;
+        setsockopt(client->socket_id, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof enable);
+        if (connect(client->socket_id, (struct sockaddr *)&address, sizeof address) == -1 && errno != EINPROGRESS)
+            return false;
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLOUT;
+        event.data.ptr = client;
+        return epoll_ctl(epoll_id, EPOLL_CTL_ADD, client->socket_id, &event) == 0;
+    }
+
+    void close_socket(BenchClient *client)
+    {
+        if (client->socket_id != -1)
+            close(client->socket_id);
+        client->socket_id = -1;
+        client->decoder = FrameDecoder();
+        client->out.clear();
+        client->out_sent = 0;
+    }
+
+    void fail(BenchClient *client)
+    {
+        if (client->state == BENCH_JOINED)
+            room_members[client->room]--;
+        else
+            in_flight--;
+        close_socket(client);
+        client->state = BENCH_FAILED;
+        failed++;
+    }
+
+    void start_client(BenchClient *client)
+    {
+        in_flight++;
+        ask(client);
+    }
+
+    void ask(BenchClient *client)
+    {
+        close_socket(client);
+        client->direct = false;
+        client->state = BENCH_ASKING;
+        client->asked_at = now_ns();
+        if (!open_socket(client, lb_address))
+            fail(client);
+    }
+
+    // HELLO for the client's room, after a MSG_RESUME when going back to the
+    // server that numbered the messages it last saw
+    string hello(BenchClient *client)
+    {
+        string room = "bench-" + to_string(client->room), frame;
+        if (client->state == BENCH_JOINING && client->last_seq && client->seq_port == client->port)
+            encode_u64_frame(frame, MSG_RESUME, 0, room_id_of(room), client->last_seq + 1);
+        encode_named_frame(frame, MSG_HELLO, 0, room_id_of(room), "c" + to_string(client->id), room.data(),
+                           room.size());
+        return frame;
+    }
+
+    // Sends what fits now and keeps the rest until the socket is writable
+    bool send_now(BenchClient *client, const string &data)
+    {
+        if (!client->out.empty())
+        {
+            client->out += data;
+            return true;
+        }
+        ssize_t sent = send(client->socket_id, data.data(), data.size(), MSG_NOSIGNAL);
+        if (sent == -1 && errno != EAGAIN)
+            return false;
+        if (sent < (ssize_t)data.size())
+        {
+            client->out.assign(data, max(sent, (ssize_t)0), string::npos);
+            client->out_sent = 0;
+        }
+        return true;
+    }
+
+    bool flush(BenchClient *client)
+    {
+        while (client->out_sent < client->out.size())
+        {
+            ssize_t sent = send(client->socket_id, client->out.data() + client->out_sent,
+                                client->out.size() - client->out_sent, MSG_NOSIGNAL);
+            if (sent == -1)
+                return errno == EAGAIN;
+            client->out_sent += sent;
+        }
+        client->out.clear();
+        client->out_sent = 0;
+        return true;
+    }
+
+    void on_writable(BenchClient *client)
+    {
+        if (client->connecting)
+        {
+            client->connecting = false;
+            int error = 0;
+            socklen_t length = sizeof error;
+            getsockopt(client->socket_id, SOL_SOCKET, SO_ERROR, &error, &length);
+            bool with_token = client->state == BENCH_JOINING && !client->token.empty() &&
+                              client->token_port == client->port;
+            if (error || !send_now(client, with_token ? client->token + hello(client) : hello(client)))
+            {
+                if (client->direct)
+                    refused(client);
+                else
+                    fail(client);
+                return;
+            }
+            struct epoll_event event;
+            event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+            event.data.ptr = client;
+            epoll_ctl(epoll_id, EPOLL_CTL_MOD, client->socket_id, &event);
+            // An unkeyed server answers nothing to HELLO, so the client is
+            // in; a keyed one renews the token once it has let it in
+            if (client->state == BENCH_JOINING && !with_token)
+                admit(client);
+            return;
+        }
+        if (!flush(client))
+            fail(client);
+    }
+
+    void join(BenchClient *client, int port)
+    {
+        close_socket(client);
+        struct sockaddr_in server = lb_address;
+        server.sin_addr = client->server;
+        server.sin_port = htons(port);
+        client->port = port;
+        client->state = BENCH_JOINING;
+        if (!open_socket(client, server))
+            fail(client);
+    }
+
+    void admit(BenchClient *client)
+    {
+        client->state = BENCH_JOINED;
+        in_flight--;
+        joined++;
+        room_members[client->room]++;
+        if (phase == PHASE_REJOIN)
+        {
+            rejoins.record(now_ns() - client->asked_at);
+            if (client->direct)
+                direct_rejoins++;
+        }
+        client->direct = false;
+    }
+
+    // The server closed on a rejoin with a kept token; ask the balancer
+    void refused(BenchClient *client)
+    {
+        client->token.clear();
+        refusals++;
+        ask(client);
+    }
+
+    // Drops the server connection and goes back, on the token if there is one
+    void rejoin(BenchClient *client)
+    {
+        if (client->state != BENCH_JOINED)
+            return;
+        room_members[client->room]--;
+        joined--;
+        in_flight++;
+        client->asked_at = now_ns();
+        if (config.use_tokens && !client->token.empty())
+        {
+            client->direct = true;
+            join(client, client->token_port);
+        }
+        else
+            ask(client);
+    }
+
+    void keep_token(BenchClient *client, const Frame &frame)
+    {
+        uint64_t issued;
+        if (!read_route_token(frame.payload, frame.length, client->token_port, issued))
+            return;
+        client->token.clear();
+        encode_frame(client->token, MSG_ROUTE_TOKEN, 0, frame.header.room_id, frame.payload, frame.length);
+    }
+
+    void on_frame(BenchClient *client, const Frame &frame, uint64_t now)
+    {
+        if (frame.header.type == MSG_ROUTE_TOKEN)
+        {
+            keep_token(client, frame);
+            if (client->state == BENCH_JOINING)
+                admit(client);
+            return;
+        }
+        if (client->state == BENCH_ASKING)
+        {
+            uint32_t port;
+            if (frame.header.type != MSG_ASSIGN || !split_u32_payload(frame, port, host) ||
+                !resolve(host, client->server))
+            {
+                fail(client);
+                return;
+            }
+            if (phase == PHASE_JOIN)
+                assignments.record(now - client->asked_at);
+            client->port = port;
+            if (port == 0)
+                admit(client); // the balancer has passed the HELLO on
+            else
+                join(client, port);
+            return;
+        }
+        uint32_t port;
+        if (frame.header.type == MSG_REDIRECT && split_u32_payload(frame, port, host))
+        {
+            // The balancer moved the room; follow it like client.cpp does,
+            // to the host it names or back through the balancer
+            room_members[client->room]--;
+            joined--;
+            in_flight++;
+            redirects++;
+            if (client->port == 0 || host.empty() || !resolve(host, client->server))
+                ask(client);
+            else
+                join(client, port);
+            return;
+        }
+        if (frame.header.type == MSG_SEQ)
+        {
+            if (client->port && read_u64_payload(frame, client->last_seq))
+                client->seq_port = client->port;
+            return;
+        }
+        // [u8 name length][name][text], read in place: this runs for every
+        // delivery and must not be what limits the benchmark
+        if (frame.header.type != MSG_CHAT || frame.length < 1)
+            return;
+        if (frame.header.flags & FLAG_HISTORY)
+        {
+            replayed++;
+            return;
+        }
+        size_t text_at = 1 + (unsigned char)frame.payload[0];
+        if (frame.length < text_at + sizeof(Stamp))
+            return;
+        Stamp stamp;
+        memcpy(&stamp, frame.payload + text_at, sizeof stamp);
+        if (stamp.magic != BENCH_MAGIC)
+            return;
+        fanouts.record(now - stamp.sent_ns);
+        delivered++;
+    }
+
+    void on_readable(BenchClient *client)
+    {
+        while (client->socket_id != -1)
+        {
+            size_t available;
+            char *space = client->decoder.write_space(READ_SIZE, available);
+            ssize_t n = recv(client->socket_id, space, available, 0);
+            if (n == -1 && errno == EAGAIN)
+                return;
+            if (n <= 0)
+            {
+                if (client->direct)
+                    refused(client);
+                else
+                    fail(client);
+                return;
+            }
+            client->decoder.commit(n);
+            uint64_t now = now_ns();
+            Frame frame;
+            int decoded = 0;
+            while (client->socket_id != -1 && (decoded = client->decoder.next(frame)) == 1)
+                on_frame(client, frame, now);
+            if (decoded == -1)
+            {
+                fail(client);
+                return;
+            }
+        }
+    }
+
+    uint64_t gap_ns()
+    {
+        double mean = 1e9 / config.rate;
+        if (!config.poisson)
+            return mean;
+        exponential_distribution<double> gap(1 / mean);
+        return gap(random);
+    }
+
+    void send_message(BenchClient *client, uint64_t now)
+    {
+        Stamp stamp = {BENCH_MAGIC, (uint32_t)client->id, now};
+        memcpy(&message[0], &stamp, sizeof stamp);
+        string frame;
+        encode_frame(frame, MSG_CHAT, 0, 0, message.data(), message.size());
+        if (!client->out.empty())
+        {
+            backlogged++; // the server is not keeping up; do not pile on
+            return;
+        }
+        if (!send_now(client, frame))
+        {
+            fail(client);
+            return;
+        }
+        sent++;
+        expected += max(room_members[client->room].load() - 1, 0);
+    }
+
+    void send_due(uint64_t now)
+    {
+        while (!schedule.empty() && schedule.top().first <= now)
+        {
+            auto [due, idx] = schedule.top();
+            schedule.pop();
+            BenchClient *client = clients[idx];
+            if (client->state != BENCH_JOINED)
+                continue;
+            send_message(client, now);
+            schedule.emplace(due + gap_ns(), idx);
+        }
+    }
+
+public:
+    static const size_t READ_SIZE = 16384;
+    Histogram assignments, fanouts, rejoins; // ns
+    uint64_t sent = 0, delivered = 0, expected = 0, backlogged = 0, redirects = 0;
+    uint64_t direct_rejoins = 0, refusals = 0, replayed = 0;
+
+    Worker(unsigned seed) : epoll_id(epoll_create1(0)), random(seed), message(config.size, '.') {}
+
+    void add(BenchClient *client) { clients.push_back(client); }
+
+    void run()
+    {
+        struct epoll_event events[MAX_EVENTS];
+        bool scheduled = false, rejoining = false;
+        while (phase != PHASE_DONE)
+        {
+            if (phase == PHASE_REJOIN && !rejoining)
+            {
+                for (BenchClient *client : clients)
+                    rejoin(client);
+                rejoining = true;
+                dropped++;
+            }
+            while (phase == PHASE_JOIN && in_flight < CONNECTS_IN_FLIGHT && next_start < clients.size())
+                start_client(clients[next_start++]);
+            if (phase == PHASE_RUN && !scheduled)
+            {
+                // Spread the first messages over one gap so they do not all
+                // leave together
+                uint64_t now = now_ns();
+                uniform_real_distribution<double> offset(0, 1e9 / config.rate);
+                for (size_t idx = 0; idx < clients.size(); idx++)
+                    schedule.emplace(now + offset(random), idx);
+                scheduled = true;
+            }
+            int timeout = 10;
+            if (phase == PHASE_RUN && !schedule.empty())
+            {
+                uint64_t now = now_ns(), due = schedule.top().first;
+                timeout = due <= now ? 0 : min((uint64_t)10, (due - now) / 1000000);
+            }
+            int n = epoll_wait(epoll_id, events, MAX_EVENTS, timeout);
+            for (int i = 0; i < n; i++)
+            {
+                BenchClient *client = (BenchClient *)events[i].data.ptr;
+                if (client->state == BENCH_FAILED)
+                    continue;
+                int socket_id = client->socket_id;
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                    on_readable(client);
+                // After an ASSIGN the event was for the balancer's socket
+                if (client->socket_id == socket_id && (events[i].events & EPOLLOUT))
+                    on_writable(client);
+            }
+            if (phase == PHASE_RUN)
+                send_due(now_ns());
+        }
+        for (BenchClient *client : clients)
+            close_socket(client);
+        close(epoll_id);
+    }
+};
+
+// Rooms ranked by popularity: room k gets a share proportional to
+// 1 / (k + 1)^zipf
+vector<int> place_clients(mt19937_64 &random)
+{
+    vector<double> weights(config.rooms);
+    for (int k = 0; k < config.rooms; k++)
+        weights[k] = 1 / pow(k + 1, config.zipf);
+    discrete_distribution<int> pick(weights.begin(), weights.end());
+    vector<int> rooms(config.clients);
+    for (int &room : rooms)
+        room = pick(random);
+    return rooms;
+}
+
+void print_latency(const char *what, const Histogram &histogram)
+{
+    printf("%-12s %10llu samples  p50 %9.1f  p99 %9.1f  p999 %9.1f  max %9.1f  mean %9.1f us\n", what,
+           (unsigned long long)histogram.count(), histogram.percentile(50) / 1e3, histogram.percentile(99) / 1e3,
+           histogram.percentile(99.9) / 1e3, histogram.max() / 1e3, histogram.mean() / 1e3);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "c:r:z:m:fs:d:t:H:p:S:Rn")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+            config.clients = max(1, atoi(optarg));
+            break;
+        case 'r':
+            config.rooms = max(1, atoi(optarg));
+            break;
+        case 'z':
+            config.zipf = max(0.0, atof(optarg));
+            break;
+        case 'm':
+            config.rate = max(0.001, atof(optarg));
+            break;
+        case 'f':
+            config.poisson = false;
+            break;
+        case 's':
+            config.size = max((int)sizeof(Stamp), min(atoi(optarg), MAX_PAYLOAD));
+            break;
+        case 'd':
+            config.seconds = max(1, atoi(optarg));
+            break;
+        case 't':
+            config.threads = max(1, atoi(optarg));
+            break;
+        case 'H':
+            config.host = optarg;
+            break;
+        case 'p':
+            config.port = atoi(optarg);
+            break;
+        case 'S':
+            config.seed = atoi(optarg);
+            break;
+        case 'R':
+            config.rejoin = true;
+            break;
+        case 'n':
+            config.use_tokens = false;
+            break;
+        default:
+            cerr << "Usage: " << argv[0] << " [-c clients] [-r rooms] [-z zipf] [-m msgs_per_sec] [-f]"
+                 << " [-s bytes] [-d seconds] [-t threads] [-H lb_host] [-p lb_port] [-S seed] [-R] [-n]\n";
+            exit(1);
+        }
+    }
+    memset(&lb_address, 0, sizeof lb_address);
+    lb_address.sin_family = AF_INET;
+    lb_address.sin_port = htons(config.port);
+    if (inet_pton(AF_INET, config.host.c_str(), &lb_address.sin_addr) != 1)
+    {
+        cerr << "Bad balancer address: " << config.host << "\n";
+        exit(1);
+    }
+    // Every client holds a socket, two while it moves to its server
+    struct rlimit files;
+    getrlimit(RLIMIT_NOFILE, &files);
+    files.rlim_cur = files.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &files);
+    if (files.rlim_cur < (rlim_t)config.clients + 64)
+        cerr << "Only " << files.rlim_cur << " file descriptors for " << config.clients << " clients\n";
+    signal(SIGPIPE, SIG_IGN);
+
+    mt19937_64 random(config.seed);
+    vector<int> rooms = place_clients(random);
+    room_members = vector<atomic<int>>(config.rooms);
+    vector<unique_ptr<BenchClient>> clients;
+    vector<unique_ptr<Worker>> workers;
+    for (int t = 0; t < config.threads; t++)
+        workers.emplace_back(new Worker(config.seed + t + 1));
+    for (int id = 0; id < config.clients; id++)
+    {
+        clients.emplace_back(new BenchClient());
+        clients.back()->id = id;
+        clients.back()->room = rooms[id];
+        workers[id % config.threads]->add(clients.back().get());
+    }
+
+    printf("%d clients in %d rooms (zipf %.2f), %.2f msgs/s each (%s), %d byte messages, %d threads\n",
+           config.clients, config.rooms, config.zipf, config.rate, config.poisson ? "poisson" : "fixed", config.size,
+           config.threads);
+    vector<thread> threads;
+    for (auto &worker : workers)
+        threads.emplace_back(&Worker::run, worker.get());
+
+    auto started = chrono::steady_clock::now();
+    while (joined + failed < config.clients && chrono::steady_clock::now() - started < chrono::seconds(JOIN_TIMEOUT))
+        this_thread::sleep_for(chrono::milliseconds(10));
+    double join_seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    printf("joined %d, failed %d in %.2f s\n", joined.load(), failed.load(), join_seconds);
+    int largest = 0;
+    for (auto &members : room_members)
+        largest = max(largest, members.load());
+    printf("largest room %d members\n", largest);
+
+    this_thread::sleep_for(chrono::milliseconds(SETTLE_MS));
+    phase = PHASE_RUN;
+    this_thread::sleep_for(chrono::seconds(config.seconds));
+    phase = PHASE_DRAIN;
+    this_thread::sleep_for(chrono::milliseconds(DRAIN_MS));
+    if (config.rejoin)
+    {
+        int before = joined;
+        started = chrono::steady_clock::now();
+        phase = PHASE_REJOIN;
+        // Every worker drops its clients before they are counted back
+        while (dropped < config.threads)
+            this_thread::sleep_for(chrono::milliseconds(1));
+        while (joined + failed < config.clients &&
+               chrono::steady_clock::now() - started < chrono::seconds(REJOIN_TIMEOUT))
+            this_thread::sleep_for(chrono::milliseconds(10));
+        printf("rejoined %d of %d in %.2f s\n", joined.load(), before,
+               chrono::duration<double>(chrono::steady_clock::now() - started).count());
+    }
+    phase = PHASE_DONE;
+    for (thread &worker : threads)
+        worker.join();
+
+    Histogram assignments, fanouts, rejoins;
+    uint64_t sent = 0, delivered = 0, expected = 0, backlogged = 0, redirects = 0, direct_rejoins = 0, refusals = 0;
+    uint64_t replayed = 0;
+    for (auto &worker : workers)
+    {
+        assignments.merge(worker->assignments);
+        fanouts.merge(worker->fanouts);
+        rejoins.merge(worker->rejoins);
+        direct_rejoins += worker->direct_rejoins;
+        refusals += worker->refusals;
+        sent += worker->sent;
+        delivered += worker->delivered;
+        expected += worker->expected;
+        backlogged += worker->backlogged;
+        redirects += worker->redirects;
+        replayed += worker->replayed;
+    }
+    print_latency("assignment", assignments);
+    print_latency("fan-out", fanouts);
+    printf("sent %llu msgs (%.0f/s), delivered %llu of %llu (%.0f/s), %llu skipped on full sockets\n",
+           (unsigned long long)sent, sent / (double)config.seconds, (unsigned long long)delivered,
+           (unsigned long long)expected, delivered / (double)config.seconds, (unsigned long long)backlogged);
+    printf("%llu clients redirected, %d failed, %llu history frames replayed\n", (unsigned long long)redirects,
+           failed.load(), (unsigned long long)replayed);
+    if (config.rejoin)
+    {
+        print_latency("rejoin", rejoins);
+        printf("%llu rejoined on a kept token, %llu tokens refused\n", (unsigned long long)direct_rejoins,
+               (unsigned long long)refusals);
+    }
+    return failed > 0;
+}
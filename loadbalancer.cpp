@@ -1,6 +1,33 @@
 /*
  * loadbalancer.cpp
  * Load Balancer for forwarding requests to servers
+ *
+ * With -u the reactors run the handshake on io_uring (see uring.h): a
+ * multishot accept puts new sockets straight into registered file slots,
+ * HELLO lands in a provided buffer, and the ASSIGN reply is hard-linked to
+ * the close of the slot.
+ *
+ * With -P several balancers share the servers (see gossip.h). New rooms are
+ * then placed by consistent hash, so every balancer picks the same server
+ * without asking the others; placements and moves are gossiped, and only
+ * the leader rebalances.
+ *
+ * With -M the balancer serves its counters on http://127.0.0.1:<port>/metrics
+ * (see metrics.h). The console only shows per-client lines at -L debug.
+ *
+ * With -c the servers come from a backend file (see backends.h) instead of
+ * the prompt, and SIGHUP rereads it. With -A servers can be listed, added
+ * and removed through an admin socket. A removed server gets no new rooms;
+ * the rebalancer moves its rooms off, then its control connection closes.
+ *
+ * With -K every ASSIGN comes after a routing token signed with a key the
+ * servers share (see token.h). Clients keep it and rejoin their server
+ * straight away after a dropped connection, without coming back here.
+ *
+ * With -x the balancer is also the clients' only way in (see proxy.h): it
+ * answers HELLO with an ASSIGN for port 0, opens the server's side from a
+ * pool of ready connections, and splices the two together. Only port 6000
+ * then needs to be reachable. The proxy runs on the epoll reactors.
  */
 #include <netinet/in.h>
 #include <pthread.h>
@@ -11,85 +38,523 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/epoll.h>
 #include <unistd.h>
 #include <netdb.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <chrono>
 #include <thread>
 #include <fstream>
+#include "backends.h"
+#include "balancer.h"
+#include "control.h"
+#include "gossip.h"
+#include "log.h"
+#include "metrics.h"
+#include "protocol.h"
+#include "proxy.h"
+#include "routing_table.h"
+#include "token.h"
+#include "uring.h"
+#include "wal.h"
 
 using namespace std;
 
-#define MAX_LEN 256
-#define BACKLOG 10
-#define SERVER_NAME_LEN_MAX 255
+#define BACKLOG SOMAXCONN
+#define MAX_EVENTS 256
+#define REACTOR_THREADS 4
+#define REBALANCE_INTERVAL 1000 // ms between rebalancing rounds
+#define REBALANCE_COOLDOWN 3000 // ms without load moves after one, while clients reconnect
 #define PORT 6000
-#define HEARTBEAT_INTERVAL 30 // seconds
-vector<int> SERVERPORTS;
-map<string, int> roomServerDict;
-map<int, bool> serverStatus; // Tracks server health (true = up, false = down)
-int clientNumber = 0;
+#define URING_ENTRIES 256
+#define URING_BUFFERS 256      // provided receive buffers per reactor
+#define URING_BUFFER_SIZE 512  // a HELLO is a header, a name and a room
+#define URING_FILES 4096       // registered file slots per reactor
+RoutingTable roomServerDict;        // Room -> server port, safe to share across reactor threads
+atomic<int> clientNumber{0};
+bool use_uring = false;
+Wal wal; // room placements, replayed into roomServerDict on startup
+ControlPlane control; // one persistent connection per server for loads, pings and placements
+mutex roomLoadsMutex;
+map<int, vector<pair<string, int>>> roomLoads; // each server's largest rooms, as last reported
+double epsilon = 0.25; // how far above the average load a server may run
+LoadWeights loadWeights; // how the servers' load reports add up to one number
+int rebalanceInterval = REBALANCE_INTERVAL;
+Gossip gossip; // placements and health shared with the other balancers
+string strategyName = "least";
+string backendFile; // -c, reread on SIGHUP
+RouteKey routeKey;  // -K, signs a routing token for each assignment
+bool proxyMode = false; // -x
+BackendPool backendPool; // ready connections to the servers, for proxied clients
+atomic<int> proxiedClients{0};
 
-struct socket_client_thread
+Counter &acceptsTotal = metrics.counter("lb_accepts_total", "Client connections accepted.");
+Counter &handshakeErrors = metrics.counter("lb_handshake_errors_total", "Handshakes that closed or were malformed before the reply.");
+Counter &assignmentsTotal = metrics.counter("lb_assignments_total", "Clients matched to a server.");
+Counter &roomHits = metrics.counter("lb_room_cache_hits_total", "Assignments to a room that was already placed.");
+Counter &roomPlacements = metrics.counter("lb_room_placements_total", "Rooms placed on a server by the strategy.");
+Counter &roomsMoved = metrics.counter("lb_rooms_moved_total", "Rooms moved to another server by the rebalancer.");
+Counter &proxiedBytes = metrics.counter("lb_proxied_bytes_total", "Bytes spliced between proxied clients and servers.");
+LatencyHistogram &assignLatency =
+    metrics.histogram("lb_assignment_latency_seconds", "Time from accepting a client to its ASSIGN reply being ready.");
+
+// One chat server. The same state is kept for as long as the server stays
+// listed, so its health and load survive a reload.
+struct ServerState
+{
+    Backend backend;           // host, port and resolved address never change
+    atomic<int> weight{1};     // relative capacity used by weighted strategies
+    atomic<bool> up{true};     // by this balancer's probes; healthy until they say otherwise
+    atomic<int> load{INT_MAX}; // weighted last load report, INT_MAX if unknown
+};
+
+// The servers clients are sent to and the strategy that picks among them.
+// A change builds a new set, swaps it in and retires the old one. Readers
+// hold the current one inside an RCU read section (routing_table.h), and
+// the reclaimer frees the old one once none of them can still see it.
+// Nothing waits for readers, so code holding a set may write the table.
+class ServerSet : public ServerPool
+{
+public:
+    vector<shared_ptr<ServerState>> servers;
+    unordered_map<int, shared_ptr<ServerState>> by_port;
+    unique_ptr<BalancingStrategy> strategy;
+
+    int size() const override { return servers.size(); }
+    int port(int idx) const override { return servers[idx]->backend.port; }
+    bool up(int idx) const override { return servers[idx]->up && gossip.agreed_up(port(idx)); }
+    int load(int idx) const override { return servers[idx]->load.load(); }
+    int weight(int idx) const override { return servers[idx]->weight.load(); }
+
+    ServerState *find(int port) const
+    {
+        auto found = by_port.find(port);
+        return found == by_port.end() ? NULL : found->second.get();
+    }
+};
+atomic<ServerSet *> serverSet{new ServerSet()};
+mutex backendsMutex; // one change to the servers at a time
+set<int> watched;   // servers with a control connection: the set's, and removed ones still holding rooms
+
+// Runs use(server) if port is one of the servers
+template <class Use>
+bool with_server(int port, Use use)
+{
+    RcuReadGuard guard;
+    ServerState *server = serverSet.load()->find(port);
+    if (server)
+        use(*server);
+    return server != NULL;
+}
+
+// Host clients reach the server on port at, as ASSIGNs name it; empty if
+// the server is no longer listed
+string host_of(int port)
+{
+    string host;
+    with_server(port, [&](ServerState &server) { host = server.backend.host; });
+    return host;
+}
+
+// Listed, up by this balancer's probes, and by every other live balancer's
+bool server_up(int port)
+{
+    bool up = false;
+    with_server(port, [&](ServerState &server) { up = server.up && gossip.agreed_up(port); });
+    return up;
+}
+
+// Counts members on a server ahead of its next load report
+void add_load(int port, int members)
+{
+    with_server(port, [&](ServerState &server) {
+        if (server.load != INT_MAX)
+            server.load += members;
+    });
+}
+
+// Port of the server the strategy picks for a new room, and its load. If
+// none is usable: the first server's with fallback, since the room has to
+// live somewhere, else -1.
+int pick_server(const string &room, bool fallback, int *load = NULL)
+{
+    RcuReadGuard guard;
+    const ServerSet &servers = *serverSet.load();
+    int best = servers.strategy->pick(room);
+    if (best == -1 && !fallback)
+        return -1;
+    best = max(best, 0);
+    if (load)
+        *load = servers.load(best);
+    return servers.port(best);
+}
+
+// Handshake progress of a client connection on a reactor thread
+enum lb_state
 {
-    int server_socket;
-    struct sockaddr_in client_address;
+    LB_READ_HELLO,
+    LB_WRITE_ASSIGN,
+    LB_PROXY_CONNECT, // -x: passing the HELLO on to the server
+    LB_PROXYING,
+    LB_CLOSED
 };
 
-void logMessage(const string &message);
-void *balance_load(void *arg);
+struct lb_connection : Pooled
+{
+    int socket_id; // registered file slot on io_uring reactors
+    lb_state state;
+    FrameDecoder decoder;
+    char reply[ROUTE_TOKEN_FRAME_SIZE + U32_FRAME_SIZE + BACKEND_HOST_MAX]; // [MSG_ROUTE_TOKEN] MSG_ASSIGN
+    size_t reply_length;
+    size_t sent; // bytes of reply written so far
+    chrono::steady_clock::time_point accepted_at;
+
+    // Proxy mode only
+    int backend_id = -1;
+    bool backend_watched = false; // in the reactor's epoll set
+    const char *forward = NULL;   // the HELLO and what followed it, still in the decoder
+    size_t forward_length = 0;
+    SplicePipe up, down; // client to server, server to client
+};
+
+// io_uring requests carry the connection they are for, tagged in the low bits
+enum uring_tag
+{
+    TAG_ACCEPT,
+    TAG_RECV,
+    TAG_CLOSE,  // the last request of a connection; frees it
+    TAG_IGNORE, // the reply, which the close is linked to
+};
+
+inline uint64_t tagged(lb_connection *conn, uring_tag tag) { return (uint64_t)conn | tag; }
+
+int assign_room(const string &name, const string &room);
+bool move_room(const string &room, int fromPort, int toPort);
+bool change_backends(const function<bool(vector<Backend> &, string &)> &edit, string &error);
+bool reload_backends(string &error);
+string admin_command(const string &line);
+void *reload_loop(void *);
+void *rebalance_loop(void *);
+void *pool_loop(void *);
+void *reactor_loop(void *);
+void *uring_reactor_loop(void *);
+void drop_drained_servers();
 void signal_handler(int signal_number);
-void *health_check(void *arg);
-bool pingServer(int serverPort);
+void register_metrics();
+
+// Parses the -f flag. Returns false for an unknown fsync policy.
+bool parse_sync(const string &name, wal_sync &sync)
+{
+    if (name == "none")
+        sync = WAL_SYNC_NONE;
+    else if (name == "interval")
+        sync = WAL_SYNC_INTERVAL;
+    else if (name == "batch")
+        sync = WAL_SYNC_BATCH;
+    else
+        return false;
+    return true;
+}
 
-int main()
+// Left out when a test builds this file in (test_alloc_*.cpp)
+#ifndef NO_MAIN
+int main(int argc, char *argv[])
 {
-    int socket_id, server_socket, totalServers, serverport;
-    cout << "\n\t************Load Balancer************\n";
-    cout << "Enter the Starting Server port: ";
-    cin >> serverport;
-    cout << "Enter total number of Servers: ";
-    cin >> totalServers;
-    cout << "\n";
-    while (totalServers--)
+    int totalServers, serverport, reactorThreads = REACTOR_THREADS, opt;
+    vector<int> weights;
+    WalConfig walConfig;
+    ControlConfig controlConfig;
+    GossipConfig gossipConfig;
+    int metricsPort = 0;
+    bool idGiven = false;
+    string adminPath;
+    while ((opt = getopt(argc, argv, "t:s:w:e:ul:f:i:a:r:m:M:L:g:P:n:c:A:K:x")) != -1)
     {
-        SERVERPORTS.push_back(serverport++);
-        serverStatus[serverport - 1] = true; // Initially set all servers as healthy
+        switch (opt)
+        {
+        case 't':
+            reactorThreads = max(1, atoi(optarg));
+            break;
+        case 's':
+            strategyName = optarg;
+            break;
+        case 'w':
+        {
+            stringstream list(optarg);
+            string weight;
+            while (getline(list, weight, ','))
+                weights.push_back(max(1, atoi(weight.c_str())));
+            break;
+        }
+        case 'e':
+            epsilon = max(0.0, atof(optarg));
+            break;
+        case 'u':
+            use_uring = true;
+            break;
+        case 'l':
+            walConfig.dir = optarg;
+            break;
+        case 'i':
+            controlConfig.ping_interval = max(10, atoi(optarg));
+            break;
+        case 'a':
+            controlConfig.detector.phi_threshold = max(1.0, atof(optarg));
+            break;
+        case 'r':
+            rebalanceInterval = max(0, atoi(optarg));
+            break;
+        case 'm':
+            if (!loadWeights.parse(optarg))
+            {
+                cerr << "Bad load weights: " << optarg << " (names: users, rooms, msgs, kbps, queued, cpu)\n";
+                exit(1);
+            }
+            break;
+        case 'M':
+            metricsPort = atoi(optarg);
+            break;
+        case 'g':
+            gossipConfig.port = atoi(optarg);
+            break;
+        case 'P':
+            if (!parse_peers(optarg, gossipConfig.peers))
+            {
+                cerr << "Bad peer list: " << optarg << " (host:port,...)\n";
+                exit(1);
+            }
+            break;
+        case 'n':
+            gossipConfig.id = strtoul(optarg, NULL, 10);
+            idGiven = true;
+            break;
+        case 'c':
+            backendFile = optarg;
+            break;
+        case 'A':
+            adminPath = optarg;
+            break;
+        case 'x':
+            proxyMode = true;
+            break;
+        case 'K':
+        {
+            string error;
+            if (!load_route_key(optarg, routeKey, error))
+            {
+                cerr << "Routing key: " << error << "\n";
+                exit(1);
+            }
+            break;
+        }
+        case 'L':
+        {
+            int level;
+            if (!parse_log_level(optarg, level))
+            {
+                cerr << "Bad log level: " << optarg << " (error, warn, info or debug)\n";
+                exit(1);
+            }
+            log_threshold = level;
+            break;
+        }
+        case 'f':
+            if (parse_sync(optarg, walConfig.sync))
+                break;
+            // fall through
+        default:
+            cerr << "Usage: " << argv[0] << " [-t reactor_threads] [-u] [-s least|p2c|wrr|hash|hash-bounded]"
+                 << " [-w w1,w2,...] [-e epsilon] [-l wal_dir] [-f none|interval|batch] [-i ping_ms] [-a phi] [-r rebalance_ms]"
+                 << " [-m name=weight,...] [-M metrics_port] [-L error|warn|info|debug]"
+                 << " [-g gossip_port] [-P host:port,...] [-n id] [-c backend_file] [-A admin_socket]"
+                 << " [-K route_key_file] [-x]\n";
+            exit(1);
+        }
+    }
+    if (proxyMode && routeKey.set)
+    {
+        cerr << "-x and -K do not mix: behind the proxy clients cannot reach the servers themselves\n";
+        exit(1);
     }
+    if (proxyMode && use_uring)
+    {
+        cout << "Proxy mode runs on the epoll reactors\n";
+        use_uring = false;
+    }
+    if (use_uring && !IoUring::available())
+    {
+        cout << "io_uring is not usable on this kernel, falling back to epoll\n";
+        use_uring = false;
+    }
+
+    // Only reload_loop takes SIGHUP; it is blocked before any thread starts
+    // so every thread inherits the mask
+    sigset_t reloadSignals;
+    sigemptyset(&reloadSignals);
+    sigaddset(&reloadSignals, SIGHUP);
+    if (!backendFile.empty())
+        pthread_sigmask(SIG_BLOCK, &reloadSignals, NULL);
 
-    // Start the health check thread
-    pthread_t healthCheckThread;
-    if (pthread_create(&healthCheckThread, NULL, health_check, NULL) != 0)
+    vector<Backend> backends;
+    string error;
+    if (!backendFile.empty() && !load_backends(backendFile, backends, error))
     {
-        perror("Error creating health check thread");
+        cerr << error << "\n";
         exit(1);
     }
+    if (backendFile.empty())
+    {
+        cout << "\n\t************Load Balancer************\n";
+        cout << "Enter the Starting Server port: ";
+        cin >> serverport;
+        cout << "Enter total number of Servers: ";
+        cin >> totalServers;
+        cout << "\n";
+        for (int i = 0; i < totalServers; i++)
+        {
+            Backend backend;
+            backend.host = "localhost";
+            backend.port = serverport + i;
+            backend.weight = i < (int)weights.size() ? weights[i] : 1;
+            if (!resolve_backend(backend, error))
+            {
+                cerr << error << "\n";
+                exit(1);
+            }
+            backends.push_back(backend);
+        }
+    }
 
-    struct sockaddr_in address;
-    pthread_attr_t pthread_attr;
-    socket_client_thread *pthread_arg;
-    pthread_t pthread;
-    socklen_t client_address_len;
+    // Balancers that share servers must hash a new room to the same one
+    bool clustered = !gossipConfig.peers.empty();
+    if (clustered && gossipConfig.port <= 0)
+    {
+        cerr << "-P needs -g: peers must be able to reach this balancer\n";
+        exit(1);
+    }
+    if (clustered && strategyName != "hash")
+    {
+        cout << "With peers, new rooms are placed by consistent hash (-s hash) and rebalanced by the leader\n";
+        strategyName = "hash";
+    }
+    if (!idGiven)
+        gossipConfig.id = gossipConfig.port;
+    // The control connections open once control.start() below runs
+    if (!change_backends([&](vector<Backend> &listed, string &) {
+            listed = backends;
+            return true;
+        }, error))
+    {
+        cerr << error << "\n";
+        exit(1);
+    }
+    cout << "Balancing strategy: " << serverSet.load()->strategy->name() << "\n";
 
-    memset(&address, 0, sizeof address);
-    address.sin_family = AF_INET;
-    address.sin_port = htons(PORT);
-    address.sin_addr.s_addr = INADDR_ANY;
+    // Rooms keep the server they had before a restart, as long as that
+    // server is still part of the pool
+    size_t replayed = 0;
+    wal_replay(walConfig.dir, [&](const WalRecord &record) {
+        if (!serverSet.load()->find(record.port))
+            return;
+        if (record.type == WAL_ASSIGN)
+            roomServerDict.assign(record.room, record.port);
+        else if (record.type == WAL_ERASE)
+            roomServerDict.erase(record.room, record.port);
+        replayed++;
+    });
+    if (replayed)
+        cout << "Restored " << roomServerDict.size() << " room placements from " << walConfig.dir << "\n";
+    bool walOpen = wal.open(walConfig, [] {
+        vector<pair<string, int>> placements;
+        roomServerDict.for_each([&](const string &room, int port) { placements.emplace_back(room, port); });
+        return placements;
+    });
+    if (!walOpen)
+        exit(1);
 
-    if ((socket_id = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+    // Keep the load and health tables fresh so assignments never wait on a
+    // backend
+    bool controlStarted = control.start(
+        {}, controlConfig,
+        [](int serverPort, const LoadReport *load) {
+            int score = load ? loadWeights.score(*load) : INT_MAX;
+            with_server(serverPort, [&](ServerState &server) { server.load = score; });
+        },
+        [](int serverPort, bool isHealthy) {
+            with_server(serverPort, [&](ServerState &server) { server.up = isHealthy; });
+            if (isHealthy)
+                LOG(LOG_INFO, "Server " << serverPort << " is up.");
+            else
+                LOG(LOG_WARN, "Server " << serverPort << " is down.");
+        },
+        [](int serverPort, const vector<pair<string, int>> &rooms) {
+            lock_guard<mutex> guard(roomLoadsMutex);
+            roomLoads[serverPort] = rooms;
+        });
+    if (!controlStarted)
+        exit(1);
+
+    if (clustered)
     {
-        perror("socket");
+        vector<pair<string, int>> known;
+        roomServerDict.for_each([&](const string &room, int port) { known.emplace_back(room, port); });
+        bool gossipStarted = gossip.start(
+            gossipConfig, known,
+            [](const string &room, int serverPort, bool ours) {
+                int previousPort = 0;
+                bool placed = roomServerDict.lookup(room, previousPort);
+                if (placed && previousPort == serverPort)
+                    return;
+                roomServerDict.assign(room, serverPort);
+                wal.append(WAL_ASSIGN, room, serverPort);
+                // Clients this balancer sent to the other server follow
+                if (placed && ours)
+                    control.migrate(previousPort, room, serverPort, host_of(serverPort));
+            },
+            [] {
+                vector<pair<int, bool>> health;
+                RcuReadGuard guard;
+                for (auto &server : serverSet.load()->servers)
+                    health.emplace_back(server->backend.port, server->up.load());
+                return health;
+            });
+        if (!gossipStarted)
+            exit(1);
+        cout << "Balancer " << gossipConfig.id << " gossiping with " << gossipConfig.peers.size() << " peer(s)\n";
+    }
+
+    register_metrics();
+    static MetricsServer metricsServer;
+    if (metricsPort > 0 && !metricsServer.start(metricsPort))
+    {
+        perror("metrics port");
+        exit(1);
+    }
+    static AdminServer adminServer;
+    if (!adminPath.empty() && !adminServer.start(adminPath, admin_command))
+    {
+        perror("admin socket");
+        exit(1);
+    }
+    pthread_t reloadThread;
+    if (!backendFile.empty() && pthread_create(&reloadThread, NULL, reload_loop, NULL) != 0)
+    {
+        perror("Error creating reload thread");
         exit(1);
     }
 
-    if (bind(socket_id, (struct sockaddr *)&address, sizeof address) == -1)
+    pthread_t rebalanceThread;
+    if (rebalanceInterval > 0 && pthread_create(&rebalanceThread, NULL, rebalance_loop, NULL) != 0)
     {
-        perror("bind");
+        perror("Error creating rebalance thread");
         exit(1);
     }
 
-    if (listen(socket_id, BACKLOG) == -1)
+    pthread_t poolThread;
+    if (proxyMode && pthread_create(&poolThread, NULL, pool_loop, NULL) != 0)
     {
-        perror("listen");
+        perror("Error creating backend pool thread");
         exit(1);
     }
 
@@ -109,196 +574,788 @@ int main()
         exit(1);
     }
 
-    if (pthread_attr_init(&pthread_attr) != 0)
+    // Every reactor owns a listening socket on PORT; SO_REUSEPORT lets the
+    // kernel spread incoming connections across them.
+    void *(*loop)(void *) = use_uring ? uring_reactor_loop : reactor_loop;
+    vector<pthread_t> reactors(reactorThreads);
+    for (int i = 1; i < reactorThreads; i++)
+    {
+        if (pthread_create(&reactors[i], NULL, loop, NULL) != 0)
+        {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    loop(NULL);
+    return 0;
+}
+#endif
+
+int create_listen_socket()
+{
+    struct sockaddr_in address;
+    int socket_id, enable = 1;
+
+    memset(&address, 0, sizeof address);
+    address.sin_family = AF_INET;
+    address.sin_port = htons(PORT);
+    address.sin_addr.s_addr = INADDR_ANY;
+
+    if ((socket_id = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1)
+    {
+        perror("socket");
+        exit(1);
+    }
+    if (setsockopt(socket_id, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof enable) == -1 ||
+        setsockopt(socket_id, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof enable) == -1)
     {
-        perror("pthread_attr_init");
+        perror("setsockopt");
         exit(1);
     }
-    if (pthread_attr_setdetachstate(&pthread_attr, PTHREAD_CREATE_DETACHED) != 0)
+    if (bind(socket_id, (struct sockaddr *)&address, sizeof address) == -1)
     {
-        perror("pthread_attr_setdetachstate");
+        perror("bind");
         exit(1);
     }
+    if (listen(socket_id, BACKLOG) == -1)
+    {
+        perror("listen");
+        exit(1);
+    }
+    return socket_id;
+}
+
+// Proxy mode: tells the client to stay on this connection and opens the
+// server's side. The HELLO, and anything the client sent after it, are
+// still in the decoder and go to the server first.
+int start_proxy(lb_connection *conn, const Frame &frame, int port)
+{
+    struct sockaddr_in address;
+    bool connecting;
+    if (!with_server(port, [&](ServerState &server) { address = server.backend.address; }) || !conn->up.open() ||
+        !conn->down.open() || (conn->backend_id = backendPool.take(port, address, connecting)) == -1)
+        return -1;
+    conn->forward = frame.payload - sizeof(FrameHeader);
+    conn->forward_length = frame.payload + frame.length + conn->decoder.buffered() - conn->forward;
+    conn->reply_length = U32_FRAME_SIZE;
+    put_u32_frame(conn->reply, MSG_ASSIGN, 0, frame.header.room_id, 0);
+    conn->state = LB_WRITE_ASSIGN;
+    assignLatency.record(chrono::steady_clock::now() - conn->accepted_at);
+    return 1;
+}
+
+// Answers a HELLO once the decoder holds one. Returns 1 when the reply is
+// ready, 0 if more bytes are needed and -1 for a malformed handshake.
+int read_hello(lb_connection *conn)
+{
+    Frame frame;
+    int decoded = conn->decoder.next(frame);
+    if (decoded != 1)
+        return decoded;
+    // Reused by every handshake on this thread, so they stop allocating once
+    // they have grown to the longest name and room seen
+    static thread_local string name, room;
+    if (frame.header.type != MSG_HELLO || !split_named_payload(frame, name, room))
+        return -1;
+    int port = assign_room(name, room);
+    if (proxyMode)
+        return start_proxy(conn, frame, port);
+    size_t token = routeKey.set ? ROUTE_TOKEN_FRAME_SIZE : 0;
+    if (token)
+        put_route_token_frame(conn->reply, routeKey, room.data(), room.size(), port, wall_ms());
+    bool listed = with_server(port, [&](ServerState &server) {
+        const string &host = server.backend.host;
+        put_u32_text_frame(conn->reply + token, MSG_ASSIGN, 0, frame.header.room_id, port, host.data(), host.size());
+        conn->reply_length = token + U32_FRAME_SIZE + host.size();
+    });
+    if (!listed)
+    {
+        // Removed since it was picked: no host to name, the client tries
+        // the port on the balancer's host
+        put_u32_frame(conn->reply + token, MSG_ASSIGN, 0, frame.header.room_id, port);
+        conn->reply_length = token + U32_FRAME_SIZE;
+    }
+    conn->state = LB_WRITE_ASSIGN;
+    assignLatency.record(chrono::steady_clock::now() - conn->accepted_at);
+    return 1;
+}
 
+// Advances the handshake as far as the socket allows. Returns false once the
+// connection is finished and can be released.
+bool handle_connection_io(lb_connection *conn)
+{
     while (true)
     {
-        pthread_arg = (socket_client_thread *)malloc(sizeof *pthread_arg);
-        if (!pthread_arg)
+        if (conn->state == LB_READ_HELLO)
         {
-            perror("malloc");
-            continue;
-        }
+            int hello = read_hello(conn);
+            if (hello == 1)
+                continue;
+            if (hello == -1)
+                return false;
 
-        client_address_len = sizeof(pthread_arg->client_address);
-        server_socket = accept(socket_id, (struct sockaddr *)&pthread_arg->client_address, &client_address_len);
-        if (server_socket == -1)
+            size_t available;
+            char *space = conn->decoder.write_space(sizeof(FrameHeader), available);
+            ssize_t n = recv(conn->socket_id, space, available, 0);
+            if (n > 0)
+            {
+                conn->decoder.commit(n);
+                continue;
+            }
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return true;
+            return false; // peer closed or socket error
+        }
+        if (conn->state == LB_WRITE_ASSIGN)
         {
-            perror("accept");
-            free(pthread_arg);
-            continue;
+            ssize_t n = send(conn->socket_id, conn->reply + conn->sent, conn->reply_length - conn->sent, MSG_NOSIGNAL);
+            if (n > 0)
+            {
+                conn->sent += n;
+                if (conn->sent == conn->reply_length)
+                    conn->state = proxyMode ? LB_PROXY_CONNECT : LB_CLOSED;
+                continue;
+            }
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return true;
+            return false;
         }
-
-        pthread_arg->server_socket = server_socket;
-        if (pthread_create(&pthread, &pthread_attr, balance_load, (void *)pthread_arg) != 0)
+        if (conn->state == LB_PROXY_CONNECT)
         {
-            perror("pthread_create");
-            free(pthread_arg);
-            continue;
+            // A socket still connecting says EAGAIN and turns writable later
+            ssize_t n = send(conn->backend_id, conn->forward, conn->forward_length, MSG_NOSIGNAL);
+            if (n > 0)
+            {
+                conn->forward += n;
+                conn->forward_length -= n;
+                if (conn->forward_length == 0)
+                {
+                    conn->state = LB_PROXYING;
+                    proxiedClients++;
+                }
+                continue;
+            }
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return true;
+            return false;
         }
+        if (conn->state == LB_PROXYING)
+        {
+            size_t moved = 0;
+            bool open = conn->up.pump(conn->socket_id, conn->backend_id, moved) &&
+                        conn->down.pump(conn->backend_id, conn->socket_id, moved);
+            if (moved)
+                proxiedBytes.add(moved);
+            return open;
+        }
+        return false;
     }
-    return 0;
 }
 
-void logMessage(const string &message)
+void *reactor_loop(void *)
 {
-    ofstream logFile("chat_log.txt", ios::app);
-    if (logFile.is_open())
+    int listen_socket = create_listen_socket();
+    int epoll_id = epoll_create1(0);
+    if (epoll_id == -1)
     {
-        logFile << message << endl;
-        logFile.close();
+        perror("epoll_create1");
+        exit(1);
     }
-    else
+
+    struct epoll_event event, events[MAX_EVENTS];
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = NULL; // NULL marks the listening socket, a set low bit a proxied server socket
+    vector<lb_connection *> finished; // freed after the batch, which may hold both of a proxy's sockets
+    finished.reserve(MAX_EVENTS);
+    if (epoll_ctl(epoll_id, EPOLL_CTL_ADD, listen_socket, &event) == -1)
     {
-        cerr << "Unable to open log file!" << endl;
+        perror("epoll_ctl");
+        exit(1);
     }
-}
 
-int getLoadServer(int idx)
-{
-    char server_name[SERVER_NAME_LEN_MAX + 1] = "127.0.0.1\0";
-    int server_port = SERVERPORTS[idx], socket_id;
-    struct hostent *server_host;
-    struct sockaddr_in server_address;
-    server_host = gethostbyname("localhost");
-    memset(&server_address, 0, sizeof server_address);
-    server_address.sin_family = AF_INET;
-    server_address.sin_port = htons(server_port);
-    memcpy(&server_address.sin_addr.s_addr, server_host->h_addr, server_host->h_length);
-
-    socket_id = socket(AF_INET, SOCK_STREAM, 0);
-    connect(socket_id, (struct sockaddr *)&server_address, sizeof server_address);
-
-    char name[MAX_LEN] = "__LoadBalancer__";
-    send(socket_id, name, sizeof(name), 0);
-    char room[MAX_LEN] = "__getLoad?__";
-    send(socket_id, room, sizeof(room), 0);
-
-    int reply = -1;
-    recv(socket_id, &reply, sizeof(reply), 0);
-    char str[MAX_LEN] = "#exit";
-    send(socket_id, str, sizeof(str), 0);
-    close(socket_id);
-    return reply;
+    while (true)
+    {
+        int ready = epoll_wait(epoll_id, events, MAX_EVENTS, -1);
+        if (ready == -1)
+        {
+            if (errno != EINTR)
+                perror("epoll_wait");
+            continue;
+        }
+        for (int i = 0; i < ready; i++)
+        {
+            lb_connection *conn = (lb_connection *)((uintptr_t)events[i].data.ptr & ~(uintptr_t)1);
+            if (conn == NULL)
+            {
+                // Edge triggered: drain the accept queue completely
+                while (true)
+                {
+                    int client_socket = accept4(listen_socket, NULL, NULL, SOCK_NONBLOCK);
+                    if (client_socket == -1)
+                    {
+                        if (errno == EINTR || errno == ECONNABORTED)
+                            continue;
+                        if (errno != EAGAIN && errno != EWOULDBLOCK)
+                            perror("accept");
+                        break;
+                    }
+                    conn = new lb_connection();
+                    conn->socket_id = client_socket;
+                    conn->state = LB_READ_HELLO;
+                    conn->sent = 0;
+                    conn->accepted_at = chrono::steady_clock::now();
+                    acceptsTotal.add();
+                    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+                    event.data.ptr = conn;
+                    if (epoll_ctl(epoll_id, EPOLL_CTL_ADD, client_socket, &event) == -1)
+                    {
+                        perror("epoll_ctl");
+                        close(client_socket);
+                        delete conn;
+                    }
+                }
+                continue;
+            }
+            if (conn->state == LB_CLOSED)
+                continue; // in finished
+            bool open = handle_connection_io(conn);
+            if (open && conn->backend_id != -1 && !conn->backend_watched)
+            {
+                event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+                event.data.ptr = (void *)((uintptr_t)conn | 1);
+                open = epoll_ctl(epoll_id, EPOLL_CTL_ADD, conn->backend_id, &event) == 0;
+                conn->backend_watched = true;
+            }
+            if (!open)
+            {
+                if (conn->state == LB_PROXYING)
+                    proxiedClients--;
+                else if (conn->state != LB_CLOSED)
+                    handshakeErrors.add();
+                close(conn->socket_id); // also removes it from the epoll set
+                if (conn->backend_id != -1)
+                    close(conn->backend_id);
+                conn->state = LB_CLOSED;
+                finished.push_back(conn);
+            }
+        }
+        for (lb_connection *conn : finished)
+            delete conn;
+        finished.clear();
+    }
+    return NULL;
 }
 
-void *balance_load(void *arg)
+// Proxy mode: keeps idle connections open to every server that is up
+void *pool_loop(void *)
 {
-    clientNumber++;
-    int clientIdx = clientNumber;
-    socket_client_thread *pthread_arg = (socket_client_thread *)arg;
-    int server_socket = pthread_arg->server_socket;
-    struct sockaddr_in client_address = pthread_arg->client_address;
-
-    free(arg);
-    char name[MAX_LEN], room[MAX_LEN];
-    recv(server_socket, name, sizeof(name), 0);
-    recv(server_socket, room, sizeof(room), 0);
-    cout << "Client (" << name << ") connected.\n";
+    while (true)
+    {
+        vector<pair<int, struct sockaddr_in>> servers;
+        {
+            RcuReadGuard guard;
+            const ServerSet &current = *serverSet.load();
+            for (int i = 0; i < current.size(); i++)
+                if (current.up(i))
+                    servers.emplace_back(current.port(i), current.servers[i]->backend.address);
+        }
+        backendPool.refill(servers);
+        this_thread::sleep_for(chrono::milliseconds(PROXY_POOL_INTERVAL));
+    }
+    return NULL;
+}
 
-    // Log client request to WAL file
-    string logMessageStr = "Client (" + string(name) + ") requested room: " + string(room);
-    logMessage(logMessageStr); // Logging the client request
+// Ends the handshake: the reply, if any, then the close, which frees conn
+void finish_handshake(IoUring &ring, lb_connection *conn)
+{
+    if (conn->state == LB_WRITE_ASSIGN)
+        ring.send(conn->socket_id, true, conn->reply, conn->reply_length, true, tagged(NULL, TAG_IGNORE));
+    else
+        handshakeErrors.add();
+    ring.close_file(conn->socket_id, tagged(conn, TAG_CLOSE));
+}
 
-    if (roomServerDict.find(string(room)) != roomServerDict.end())
+void *uring_reactor_loop(void *)
+{
+    int listen_socket = create_listen_socket();
+    IoUring ring;
+    if (!ring.init(URING_ENTRIES, URING_BUFFERS, URING_BUFFER_SIZE, URING_FILES))
     {
-        cout << "Directing client to server for room no. " << string(room) << "\n";
-        int optimalServerPort = roomServerDict[string(room)];
-        send(server_socket, &optimalServerPort, sizeof(optimalServerPort), 0);
+        perror("io_uring");
+        exit(1);
     }
-    else
+    ring.multishot_recv = false; // a handshake is one frame, received one request at a time
+    ring.accept_multishot(listen_socket, tagged(NULL, TAG_ACCEPT), true);
+
+    while (true)
     {
-        cout << "\nNew Room Id found, Finding optimal server for load balancing:\n\n";
-        cout << "Loads on Servers:\n";
-        vector<int> loads(SERVERPORTS.size());
-        for (int idx = 0; idx < loads.size(); idx++)
-        {
-            if (serverStatus[SERVERPORTS[idx]]) // Check if the server is healthy
+        ring.submit(1, -1);
+        ring.for_each_cqe([&](const struct io_uring_cqe &cqe) {
+            lb_connection *conn = (lb_connection *)(cqe.user_data & ~(uint64_t)7);
+            switch (cqe.user_data & 7)
             {
-                loads[idx] = getLoadServer(idx);
-                if (loads[idx] < 0)
+            case TAG_ACCEPT:
+                if (cqe.res >= 0)
                 {
-                    loads[idx] = INT_MAX;
-                    cout << "Server " << idx + 1 << " : " << "Not Responding" << "\n";
+                    conn = new lb_connection();
+                    conn->socket_id = cqe.res;
+                    conn->state = LB_READ_HELLO;
+                    conn->sent = 0;
+                    conn->accepted_at = chrono::steady_clock::now();
+                    acceptsTotal.add();
+                    ring.recv(conn->socket_id, true, tagged(conn, TAG_RECV));
                 }
                 else
+                    fprintf(stderr, "accept: %s\n", strerror(-cqe.res));
+                if (!(cqe.flags & IORING_CQE_F_MORE))
+                    ring.accept_multishot(listen_socket, tagged(NULL, TAG_ACCEPT), true);
+                break;
+            case TAG_RECV:
+            {
+                int hello = 0;
+                if (cqe.flags & IORING_CQE_F_BUFFER)
                 {
-                    cout << "Server " << idx + 1 << " : " << loads[idx] << "\n";
+                    unsigned bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+                    if (cqe.res > 0)
+                        conn->decoder.feed(ring.buffer(bid), cqe.res);
+                    ring.recycle(bid);
                 }
+                if (cqe.res > 0 || cqe.res == -ENOBUFS)
+                    hello = read_hello(conn);
+                else
+                    hello = -1; // peer closed or socket error
+                if (hello == 0)
+                    ring.recv(conn->socket_id, true, tagged(conn, TAG_RECV));
+                else
+                    finish_handshake(ring, conn);
+                break;
             }
-            else
-            {
-                loads[idx] = INT_MAX;
-                cout << "Server " << idx + 1 << " : " << "Down" << "\n";
+            case TAG_CLOSE:
+                delete conn;
+                break;
             }
+        });
+    }
+    return NULL;
+}
+
+int assign_room(const string &name, const string &room)
+{
+    clientNumber++;
+    assignmentsTotal.add();
+    int optimalServerPort;
+    LOG(LOG_DEBUG, "Client (" << name << ") connected.");
+
+    const string &roomId = room;
+    wal.append(WAL_REQUEST, roomId, 0, name);
+    int placedPort = 0, strandedPort = 0;
+    bool placed = roomServerDict.lookup(roomId, placedPort);
+    if (placed && !server_up(placedPort))
+    {
+        // The room's server died, place the room again
+        LOG(LOG_INFO, "Server " << placedPort << " for room no. " << roomId << " is down, placing the room again.");
+        if (roomServerDict.erase(roomId, placedPort))
+        {
+            wal.append(WAL_ERASE, roomId, placedPort);
+            strandedPort = placedPort;
         }
-        cout << "\n";
-        int optimalServerPort = SERVERPORTS[min_element(loads.begin(), loads.end()) - loads.begin()];
-        send(server_socket, &optimalServerPort, sizeof(optimalServerPort), 0);
-        roomServerDict[string(room)] = optimalServerPort;
+        placed = false;
     }
 
-    cout << "Client (" << name << ") matched to Server: "<< roomServerDict[string(room)] << "\n";
-    close(server_socket);
+    if (placed)
+    {
+        LOG(LOG_DEBUG, "Directing client to server for room no. " << roomId);
+        roomHits.add();
+        optimalServerPort = placedPort;
+    }
+    else
+    {
+        int load, pickedPort = pick_server(roomId, true, &load);
+        if (load == INT_MAX)
+            LOG(LOG_DEBUG, "New room " << roomId << ": server " << pickedPort << " picked, load unknown");
+        else
+            LOG(LOG_DEBUG, "New room " << roomId << ": server " << pickedPort << " picked, load " << load);
+        // Another reactor, or another balancer, may have placed the same
+        // room meanwhile; its placement wins so both clients meet on one
+        // server
+        bool ours = gossip.place(roomId, pickedPort, [&] {
+            optimalServerPort = roomServerDict.insert(roomId, pickedPort);
+            return optimalServerPort == pickedPort;
+        });
+        if (ours)
+        {
+            wal.append(WAL_ASSIGN, roomId, optimalServerPort);
+            control.notify_placement(optimalServerPort, roomId);
+            roomPlacements.add();
+        }
+        // Clients still on the old server follow once it answers again
+        if (strandedPort && strandedPort != optimalServerPort)
+            control.migrate(strandedPort, roomId, optimalServerPort, host_of(optimalServerPort));
+        // Count the new client right away so a burst of new rooms does not
+        // pile onto the same server before its next load report
+        if (load != INT_MAX && optimalServerPort == pickedPort)
+            add_load(optimalServerPort, 1);
+    }
 
-    return NULL;
+    LOG(LOG_DEBUG, "Client (" << name << ") matched to Server: " << optimalServerPort);
+    return optimalServerPort;
 }
 
-void *health_check(void *arg)
+// Moves a placed room to another server: the table first, so new clients go
+// straight there, then the log, then the old server sends its clients over
+bool move_room(const string &room, int fromPort, int toPort)
 {
+    if (!gossip.place(room, toPort, [&] { return roomServerDict.move(room, fromPort, toPort); }))
+        return false; // placed again meanwhile
+    wal.append(WAL_ASSIGN, room, toPort);
+    control.notify_placement(toPort, room);
+    control.migrate(fromPort, room, toPort, host_of(toPort));
+    roomsMoved.add();
+    LOG(LOG_INFO, "Room " << room << " moved from server " << fromPort << " to " << toPort);
+    return true;
+}
+
+// Last reported member count of a room on a server, 1 if unknown
+int room_members(int serverPort, const string &room)
+{
+    lock_guard<mutex> guard(roomLoadsMutex);
+    for (auto &reported : roomLoads[serverPort])
+        if (reported.first == room)
+            return reported.second;
+    return 1;
+}
+
+// Moves every room off servers that are down, then one room off each
+// overloaded server, so placements follow what the servers can take now
+// rather than what they could when the rooms were placed
+void *rebalance_loop(void *)
+{
+    auto lastLoadMove = chrono::steady_clock::now() - chrono::milliseconds(REBALANCE_COOLDOWN);
+    bool leading = true;
     while (true)
     {
-        for (int i = 0; i < SERVERPORTS.size(); ++i)
+        this_thread::sleep_for(chrono::milliseconds(rebalanceInterval));
+        drop_drained_servers(); // followers too: the leader's moves reach them by gossip
+        // With peers, only the leader moves rooms, so two balancers never
+        // move the same room at once
+        if (gossip.leading() != leading)
         {
-            int serverPort = SERVERPORTS[i];
-            bool isHealthy = pingServer(serverPort);
-            serverStatus[serverPort] = isHealthy;
-            if (isHealthy)
+            leading = !leading;
+            LOG(LOG_INFO, (leading ? "This balancer now leads rebalancing" : "Another balancer leads rebalancing"));
+            lastLoadMove = chrono::steady_clock::now(); // let the new leader see settled loads
+        }
+        if (!leading)
+            continue;
+
+        vector<pair<string, int>> stranded;
+        roomServerDict.for_each([&](const string &room, int serverPort) {
+            if (!server_up(serverPort))
+                stranded.emplace_back(room, serverPort);
+        });
+        for (auto &room : stranded)
+        {
+            int toPort = pick_server(room.first, false);
+            if (toPort == -1)
+                break; // nowhere to go
+            int members = room_members(room.second, room.first);
+            if (toPort != room.second && move_room(room.first, room.second, toPort))
+                add_load(toPort, members);
+        }
+
+        // Loads take a while to settle after a move; wait for them
+        if (chrono::steady_clock::now() - lastLoadMove < chrono::milliseconds(REBALANCE_COOLDOWN))
+            continue;
+        vector<Migration> migrations;
+        {
+            RcuReadGuard guard;
+            const ServerSet &servers = *serverSet.load();
+            vector<vector<pair<string, int>>> rooms(servers.size());
             {
-                cout << "Server " << serverPort << " is up.\n";
+                lock_guard<mutex> guard(roomLoadsMutex);
+                for (int idx = 0; idx < servers.size(); idx++)
+                    rooms[idx] = roomLoads[servers.port(idx)];
             }
-            else
+            migrations = plan_rebalance(servers, rooms, epsilon);
+            // Indexes into this set, which may be gone by the time they move
+            for (Migration &migration : migrations)
             {
-                cout << "Server " << serverPort << " is down.\n";
+                migration.from = servers.port(migration.from);
+                migration.to = servers.port(migration.to);
             }
         }
-        this_thread::sleep_for(chrono::seconds(HEARTBEAT_INTERVAL)); // Wait before next health check
+        for (Migration &migration : migrations)
+        {
+            if (!move_room(migration.room, migration.from, migration.to))
+                continue;
+            LOG(LOG_INFO, "Server " << migration.from << " is overloaded, moving " << migration.members << " clients");
+            add_load(migration.from, -migration.load);
+            add_load(migration.to, migration.load);
+            lastLoadMove = chrono::steady_clock::now();
+        }
+    }
+    return NULL;
+}
+
+// Closes the control connection of removed servers once no room is placed
+// on them any more
+void drop_drained_servers()
+{
+    {
+        lock_guard<mutex> guard(backendsMutex);
+        if (watched.size() == serverSet.load()->servers.size())
+            return; // nothing removed
+    }
+    set<int> holding;
+    roomServerDict.for_each([&](const string &, int serverPort) { holding.insert(serverPort); });
+    lock_guard<mutex> guard(backendsMutex);
+    for (auto serverPort = watched.begin(); serverPort != watched.end();)
+    {
+        if (holding.count(*serverPort) || serverSet.load()->find(*serverPort))
+        {
+            ++serverPort;
+            continue;
+        }
+        LOG(LOG_INFO, "Server " << *serverPort << " has no rooms left and is let go.");
+        control.remove_server(*serverPort);
+        serverPort = watched.erase(serverPort);
+    }
+}
+
+bool same_backend(const Backend &a, const Backend &b)
+{
+    return a.host == b.host && a.port == b.port && a.address.sin_addr.s_addr == b.address.sin_addr.s_addr;
+}
+
+// Lets edit change the list of servers, then makes the result the servers
+// clients are sent to. Servers still listed at the same address keep their
+// health and load; new ones get a control connection. Rooms on servers no
+// longer listed are moved off by the rebalancer, or stay until their
+// clients ask again if there is none. Returns false with error set,
+// changing nothing, if edit fails or the result cannot be used.
+bool change_backends(const function<bool(vector<Backend> &, string &)> &edit, string &error)
+{
+    lock_guard<mutex> guard(backendsMutex);
+    ServerSet *current = serverSet.load();
+    vector<Backend> backends;
+    for (auto &server : current->servers)
+    {
+        backends.push_back(server->backend);
+        backends.back().weight = server->weight;
+    }
+    if (!edit(backends, error))
+        return false;
+    if (backends.empty())
+    {
+        error = "at least one server is needed";
+        return false;
+    }
+    if (!check_unique_ports(backends, error))
+        return false;
+
+    unique_ptr<ServerSet> next(new ServerSet());
+    vector<const Backend *> connect;
+    for (const Backend &backend : backends)
+    {
+        auto kept = current->by_port.find(backend.port);
+        shared_ptr<ServerState> server;
+        if (kept != current->by_port.end() && same_backend(kept->second->backend, backend))
+            server = kept->second;
+        else
+        {
+            server = make_shared<ServerState>();
+            server->backend = backend;
+            connect.push_back(&backend);
+        }
+        next->servers.push_back(server);
+        next->by_port[backend.port] = server;
+    }
+    next->strategy.reset(make_strategy(strategyName, *next, epsilon));
+    if (!next->strategy)
+    {
+        error = "unknown balancing strategy " + strategyName;
+        return false;
+    }
+    for (size_t idx = 0; idx < backends.size(); idx++)
+        next->servers[idx]->weight = backends[idx].weight;
+
+    ServerSet *old = serverSet.exchange(next.release());
+    // A new state gets a new connection, so its health is reported again
+    // rather than assumed
+    for (const Backend *backend : connect)
+    {
+        control.add_server(backend->port, backend->address);
+        watched.insert(backend->port);
+        LOG(LOG_INFO, "Server " << backend->port << " at " << backend->host << " added.");
+    }
+    bool draining = rebalanceInterval > 0;
+    for (auto &server : old->servers)
+    {
+        int serverPort = server->backend.port;
+        if (serverSet.load()->find(serverPort))
+            continue;
+        LOG(LOG_INFO, "Server " << serverPort << " removed" << (draining ? ", moving its rooms off." : "."));
+        if (!draining)
+        {
+            control.remove_server(serverPort);
+            watched.erase(serverPort);
+        }
+    }
+    Rcu::instance().retire(old);
+    return true;
+}
+
+// Replaces the servers with those in the backend file
+bool reload_backends(string &error)
+{
+    vector<Backend> backends;
+    if (!load_backends(backendFile, backends, error))
+        return false;
+    return change_backends([&](vector<Backend> &listed, string &) {
+        listed = backends;
+        return true;
+    }, error);
+}
+
+// Rereads the backend file on every SIGHUP; a file that does not read or
+// resolve leaves the servers as they were
+void *reload_loop(void *)
+{
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+    while (true)
+    {
+        int received;
+        if (sigwait(&signals, &received) != 0)
+            continue;
+        string error;
+        if (reload_backends(error))
+            LOG(LOG_INFO, "Reloaded servers from " << backendFile);
+        else
+            LOG(LOG_ERROR, "Keeping the servers, reload failed: " << error);
     }
     return NULL;
 }
 
-bool pingServer(int serverPort)
-{
-    char server_name[SERVER_NAME_LEN_MAX + 1] = "127.0.0.1\0";
-    int socket_id;
-    struct hostent *server_host;
-    struct sockaddr_in server_address;
-    server_host = gethostbyname("localhost");
-    memset(&server_address, 0, sizeof server_address);
-    server_address.sin_family = AF_INET;
-    server_address.sin_port = htons(serverPort);
-    memcpy(&server_address.sin_addr.s_addr, server_host->h_addr, server_host->h_length);
-
-    socket_id = socket(AF_INET, SOCK_STREAM, 0);
-    int result = connect(socket_id, (struct sockaddr *)&server_address, sizeof server_address);
-    if (result == 0) {
-        // Send special health check message to distinguish from client
-        char name[MAX_LEN] = "__HealthCheck__";
-        char room[MAX_LEN] = "__ping__";
-        send(socket_id, name, sizeof(name), 0);
-        send(socket_id, room, sizeof(room), 0);
-    }
-    close(socket_id);
-    return result == 0; // If connect is successful, the server is up
+// Answers one admin socket command:
+//   list                    each server with its weight, health, load and rooms
+//   add host:port [weight]  adds a server, or changes the host or weight of one
+//   remove port|host:port   sends no more clients there and moves its rooms off
+//   reload                  rereads the -c file, undoing changes made here
+string admin_command(const string &line)
+{
+    stringstream words(line);
+    string command, argument, error;
+    words >> command;
+    getline(words >> ws, argument);
+    if (command == "list")
+    {
+        map<int, int> rooms;
+        roomServerDict.for_each([&](const string &, int serverPort) { rooms[serverPort]++; });
+        ostringstream out;
+        RcuReadGuard guard;
+        for (auto &server : serverSet.load()->servers)
+        {
+            int serverPort = server->backend.port, load = server->load;
+            out << server->backend.host << ":" << serverPort << " weight " << server->weight
+                << (server->up && gossip.agreed_up(serverPort) ? " up" : " down") << " load "
+                << (load == INT_MAX ? string("unknown") : to_string(load)) << " rooms " << rooms[serverPort] << "\n";
+        }
+        return out.str() + "ok";
+    }
+    if (command == "add")
+    {
+        Backend backend;
+        if (!parse_backend(argument, backend, error) || !resolve_backend(backend, error))
+            return "error: " + error;
+        bool added = change_backends([&](vector<Backend> &backends, string &) {
+            for (Backend &listed : backends)
+                if (listed.port == backend.port)
+                {
+                    listed = backend;
+                    return true;
+                }
+            backends.push_back(backend);
+            return true;
+        }, error);
+        return added ? "ok" : "error: " + error;
+    }
+    if (command == "remove")
+    {
+        size_t colon = argument.rfind(':');
+        string host = colon == string::npos ? "" : argument.substr(0, colon);
+        int serverPort = atoi(argument.c_str() + (colon == string::npos ? 0 : colon + 1));
+        bool removed = change_backends([&](vector<Backend> &backends, string &error) {
+            for (auto listed = backends.begin(); listed != backends.end(); ++listed)
+                if (listed->port == serverPort && (host.empty() || listed->host == host))
+                {
+                    backends.erase(listed);
+                    return true;
+                }
+            error = "no server " + argument;
+            return false;
+        }, error);
+        return removed ? "ok" : "error: " + error;
+    }
+    if (command == "reload")
+    {
+        if (backendFile.empty())
+            return "error: no backend file (-c) to reload";
+        return reload_backends(error) ? "ok" : "error: " + error;
+    }
+    return "error: unknown command " + command + " (list, add, remove or reload)";
+}
+
+// Gauges read the shared tables at scrape time; the counters above are
+// registered where they are defined
+void register_metrics()
+{
+    metrics.gauge("lb_rooms", "Rooms placed on a server.", [] { return (double)roomServerDict.size(); });
+    metrics.gauges("lb_server_up", "1 while the server answers health pings.", [] {
+        vector<pair<string, double>> up;
+        RcuReadGuard guard;
+        for (auto &server : serverSet.load()->servers)
+            up.emplace_back("port=\"" + to_string(server->backend.port) + "\"", server->up ? 1 : 0);
+        return up;
+    });
+    metrics.gauges("lb_server_load", "Weighted load of the server from its last report, -1 if unknown.", [] {
+        vector<pair<string, double>> loads;
+        RcuReadGuard guard;
+        for (auto &server : serverSet.load()->servers)
+        {
+            int load = server->load;
+            loads.emplace_back("port=\"" + to_string(server->backend.port) + "\"", load == INT_MAX ? -1 : load);
+        }
+        return loads;
+    });
+    metrics.histogram_of("lb_probe_latency_seconds", "Round trip of health pings to the servers.", control.ping_latency);
+    metrics.counter("lb_control_requests_total", "Frames sent to the servers, notices included.",
+                    [] { return control.requests.load(); });
+    metrics.counter("lb_control_replies_total", "Replies read from the servers.", [] { return control.replies.load(); });
+    metrics.counter("lb_control_connects_total", "Control connections opened.", [] { return control.connects.load(); });
+    metrics.counter("lb_control_dropped_total", "Notices dropped because a server fell behind.",
+                    [] { return control.dropped.load(); });
+    metrics.gauge("lb_proxied_clients", "Clients whose connections are spliced to a server (-x).",
+                  [] { return (double)proxiedClients.load(); });
+    metrics.counter("lb_backend_pool_hits_total", "Proxied clients given a pooled server connection.",
+                    [] { return backendPool.hits.load(); });
+    metrics.counter("lb_backend_pool_misses_total", "Proxied clients that had to wait for a new server connection.",
+                    [] { return backendPool.misses.load(); });
+    metrics.gauge("lb_gossip_peers", "Other balancers heard from recently.", [] { return gossip.live_peers(); });
+    metrics.gauge("lb_gossip_leader", "1 while this balancer leads rebalancing.", [] { return gossip.leading(); });
+    metrics.counter("lb_gossip_sent_total", "Frames queued to other balancers.", [] { return gossip.sent.load(); });
+    metrics.counter("lb_gossip_received_total", "Frames read from other balancers.",
+                    [] { return gossip.received.load(); });
+    metrics.counter("lb_gossip_applied_total", "Placements taken from other balancers.",
+                    [] { return gossip.applied.load(); });
+    metrics.counter("lb_gossip_resyncs_total", "Peer connections restarted because a peer fell behind.",
+                    [] { return gossip.resyncs.load(); });
 }
 
 void signal_handler(int signal_number)
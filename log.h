@@ -0,0 +1,54 @@
+/*
+ * log.h
+ * Leveled console logging for the Load Balancer and the chat servers
+ *
+ * LOG(level, a << b) formats nothing unless the level is enabled, and
+ * writes each line whole under one lock, so lines from different threads
+ * never interleave. Per-client chatter is LOG_DEBUG; the default level,
+ * LOG_INFO, keeps the console to events worth reading.
+ */
+#ifndef LOG_H
+#define LOG_H
+
+#include <bits/stdc++.h>
+
+using namespace std;
+
+enum log_level
+{
+    LOG_ERROR,
+    LOG_WARN,
+    LOG_INFO,
+    LOG_DEBUG,
+};
+
+inline atomic<int> log_threshold{LOG_INFO};
+inline mutex log_mutex;
+
+#define LOG(level, message)                                                  \
+    do                                                                       \
+    {                                                                        \
+        if ((level) <= log_threshold.load(memory_order_relaxed))             \
+        {                                                                    \
+            ostringstream log_line_;                                         \
+            log_line_ << message << "\n";                                    \
+            lock_guard<mutex> log_guard_(log_mutex);                         \
+            fputs(log_line_.str().c_str(), stdout);                          \
+            fflush(stdout);                                                  \
+        }                                                                    \
+    } while (0)
+
+// Parses error, warn, info or debug. Returns false for anything else.
+inline bool parse_log_level(const string &name, int &level)
+{
+    static const char *names[] = {"error", "warn", "info", "debug"};
+    for (int i = LOG_ERROR; i <= LOG_DEBUG; i++)
+        if (name == names[i])
+        {
+            level = i;
+            return true;
+        }
+    return false;
+}
+
+#endif
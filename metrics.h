@@ -0,0 +1,307 @@
+/*
+ * metrics.h
+ * Counters, gauges and latency histograms for the Load Balancer and the
+ * chat servers, served in the Prometheus text format on GET /metrics
+ *
+ * Counters and histograms are split into per-thread shards on their own
+ * cache lines. A hot path adds to its own thread's shard with one relaxed
+ * atomic, so reactors never take a lock or bounce a line between cores to
+ * count something; a scrape adds the shards up. Gauges are callbacks run at
+ * scrape time. MetricsServer answers scrapes on a loopback port from its
+ * own thread.
+ */
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <bits/stdc++.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace std;
+
+#define METRIC_SHARDS 16 // threads beyond this share shards, still correctly
+#define METRIC_REQUEST_MAX 4096
+
+// This thread's shard, the same for every metric
+inline int metric_shard()
+{
+    static atomic<int> next_shard{0};
+    thread_local int shard = next_shard++ % METRIC_SHARDS;
+    return shard;
+}
+
+class Counter
+{
+    struct alignas(64) Cell
+    {
+        atomic<uint64_t> value{0};
+    };
+    Cell cells[METRIC_SHARDS];
+
+public:
+    void add(uint64_t n = 1) { cells[metric_shard()].value.fetch_add(n, memory_order_relaxed); }
+
+    uint64_t value() const
+    {
+        uint64_t total = 0;
+        for (const Cell &cell : cells)
+            total += cell.value.load(memory_order_relaxed);
+        return total;
+    }
+};
+
+// Latency in fixed buckets from 50 us to 5 s, the way Prometheus wants
+// histograms: cumulative counts per upper bound, plus a sum and a count
+class LatencyHistogram
+{
+public:
+    static constexpr double BOUNDS[] = {0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01,
+                                        0.025,   0.05,   0.1,     0.25,   0.5,   1,      2.5,   5};
+    static const int BUCKETS = sizeof BOUNDS / sizeof BOUNDS[0] + 1; // the last one is +Inf
+
+private:
+    struct alignas(64) Shard
+    {
+        atomic<uint64_t> counts[BUCKETS] = {};
+        atomic<uint64_t> sum_ns{0};
+    };
+    Shard shards[METRIC_SHARDS];
+
+public:
+    void record(chrono::nanoseconds elapsed)
+    {
+        double seconds = chrono::duration<double>(elapsed).count();
+        int bucket = lower_bound(begin(BOUNDS), end(BOUNDS), seconds) - begin(BOUNDS); // first bound >= it
+        Shard &shard = shards[metric_shard()];
+        shard.counts[bucket].fetch_add(1, memory_order_relaxed);
+        shard.sum_ns.fetch_add(max(elapsed.count(), (int64_t)0), memory_order_relaxed);
+    }
+
+    // Per-bucket counts (not cumulative) and the sum in seconds
+    void collect(vector<uint64_t> &counts, double &sum) const
+    {
+        counts.assign(BUCKETS, 0);
+        uint64_t sum_ns = 0;
+        for (const Shard &shard : shards)
+        {
+            for (int i = 0; i < BUCKETS; i++)
+                counts[i] += shard.counts[i].load(memory_order_relaxed);
+            sum_ns += shard.sum_ns.load(memory_order_relaxed);
+        }
+        sum = sum_ns / 1e9;
+    }
+};
+
+class MetricsRegistry
+{
+    struct Entry
+    {
+        string name, help, type;
+        function<void(string &out, const string &name)> render;
+    };
+    mutex entries_mutex;
+    vector<Entry> entries;
+    deque<Counter> counters; // owned metrics; deque keeps their addresses
+    deque<LatencyHistogram> histograms;
+
+    static string number(double value)
+    {
+        if (isinf(value))
+            return "+Inf";
+        ostringstream out;
+        out << setprecision(12) << value;
+        return out.str();
+    }
+
+    void add(const string &name, const string &help, const string &type,
+             function<void(string &, const string &)> render)
+    {
+        lock_guard<mutex> guard(entries_mutex);
+        entries.push_back({name, help, type, render});
+    }
+
+public:
+    Counter &counter(const string &name, const string &help)
+    {
+        Counter *counter;
+        {
+            lock_guard<mutex> guard(entries_mutex);
+            counters.emplace_back();
+            counter = &counters.back();
+        }
+        add(name, help, "counter",
+            [counter](string &out, const string &name) { out += name + " " + number(counter->value()) + "\n"; });
+        return *counter;
+    }
+
+    // A counter kept elsewhere, read at scrape time
+    void counter(const string &name, const string &help, function<uint64_t()> read)
+    {
+        add(name, help, "counter", [read](string &out, const string &name) {
+            out += name + " " + number(read()) + "\n";
+        });
+    }
+
+    void gauge(const string &name, const string &help, function<double()> read)
+    {
+        add(name, help, "gauge", [read](string &out, const string &name) {
+            out += name + " " + number(read()) + "\n";
+        });
+    }
+
+    // One gauge per label set, e.g. {"port=\"8000\"", 1}
+    void gauges(const string &name, const string &help, function<vector<pair<string, double>>()> read)
+    {
+        add(name, help, "gauge", [read](string &out, const string &name) {
+            for (auto &labelled : read())
+                out += name + "{" + labelled.first + "} " + number(labelled.second) + "\n";
+        });
+    }
+
+    LatencyHistogram &histogram(const string &name, const string &help)
+    {
+        LatencyHistogram *histogram;
+        {
+            lock_guard<mutex> guard(entries_mutex);
+            histograms.emplace_back();
+            histogram = &histograms.back();
+        }
+        histogram_of(name, help, *histogram);
+        return *histogram;
+    }
+
+    // A histogram kept elsewhere, e.g. inside a ControlPlane
+    void histogram_of(const string &name, const string &help, const LatencyHistogram &histogram)
+    {
+        add(name, help, "histogram", [&histogram](string &out, const string &name) {
+            vector<uint64_t> counts;
+            double sum;
+            histogram.collect(counts, sum);
+            uint64_t cumulative = 0;
+            for (int i = 0; i < LatencyHistogram::BUCKETS; i++)
+            {
+                cumulative += counts[i];
+                double bound = i + 1 < LatencyHistogram::BUCKETS ? LatencyHistogram::BOUNDS[i] : INFINITY;
+                out += name + "_bucket{le=\"" + number(bound) + "\"} " + number(cumulative) + "\n";
+            }
+            out += name + "_sum " + number(sum) + "\n";
+            out += name + "_count " + number(cumulative) + "\n";
+        });
+    }
+
+    // Every metric in the Prometheus text exposition format
+    string render()
+    {
+        lock_guard<mutex> guard(entries_mutex);
+        string out;
+        for (Entry &entry : entries)
+        {
+            out += "# HELP " + entry.name + " " + entry.help + "\n";
+            out += "# TYPE " + entry.name + " " + entry.type + "\n";
+            entry.render(out, entry.name);
+        }
+        return out;
+    }
+};
+
+inline MetricsRegistry metrics;
+
+// Serves GET /metrics over HTTP/1.0 on 127.0.0.1, one scrape at a time
+class MetricsServer
+{
+    int listen_id = -1;
+    thread worker;
+
+    static void answer(int socket_id, MetricsRegistry &registry)
+    {
+        struct timeval timeout = {1, 0}; // a stuck scraper must not hold up the next
+        setsockopt(socket_id, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+        string request;
+        char buffer[1024];
+        while (request.find("\r\n\r\n") == string::npos && request.find("\n\n") == string::npos &&
+               request.size() < METRIC_REQUEST_MAX)
+        {
+            ssize_t n = recv(socket_id, buffer, sizeof buffer, 0);
+            if (n <= 0)
+                break;
+            request.append(buffer, n);
+        }
+        string status = "200 OK", body;
+        if (request.compare(0, 13, "GET /metrics ") == 0 || request.compare(0, 13, "GET /metrics?") == 0)
+            body = registry.render();
+        else
+        {
+            status = "404 Not Found";
+            body = "Try GET /metrics\n";
+        }
+        string response = "HTTP/1.0 " + status + "\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                          to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+        size_t sent = 0;
+        while (sent < response.size())
+        {
+            ssize_t n = send(socket_id, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0)
+                break;
+            sent += n;
+        }
+        close(socket_id);
+    }
+
+public:
+    ~MetricsServer()
+    {
+        if (listen_id == -1)
+            return;
+        shutdown(listen_id, SHUT_RDWR);
+        worker.join();
+        close(listen_id);
+    }
+
+    // port 0 picks a free one; see port(). Returns false if it cannot listen.
+    bool start(int port, MetricsRegistry &registry = metrics)
+    {
+        listen_id = socket(AF_INET, SOCK_STREAM, 0);
+        int enable = 1;
+        setsockopt(listen_id, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof enable);
+        struct sockaddr_in address;
+        memset(&address, 0, sizeof address);
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (listen_id == -1 || bind(listen_id, (struct sockaddr *)&address, sizeof address) == -1 ||
+            listen(listen_id, 16) == -1)
+        {
+            if (listen_id != -1)
+                close(listen_id);
+            listen_id = -1;
+            return false;
+        }
+        worker = thread([this, &registry] {
+            while (true)
+            {
+                int socket_id = accept(listen_id, NULL, NULL);
+                if (socket_id == -1)
+                {
+                    if (errno == EINTR || errno == ECONNABORTED)
+                        continue;
+                    return;
+                }
+                answer(socket_id, registry);
+            }
+        });
+        return true;
+    }
+
+    int port() const
+    {
+        struct sockaddr_in address;
+        socklen_t length = sizeof address;
+        if (listen_id == -1 || getsockname(listen_id, (struct sockaddr *)&address, &length) == -1)
+            return 0;
+        return ntohs(address.sin_port);
+    }
+};
+
+#endif
@@ -0,0 +1,272 @@
+/*
+ * outbox.h
+ * Per-client output queue for the chat server
+ *
+ * A broadcast serializes its frame once into a reference counted Message and
+ * queues a reference to it on every recipient's Outbox. Messages, like the
+ * outbox rings, live in pooled memory (pool.h), so fanning a frame out does
+ * not touch the heap. Flushing hands all
+ * queued frames to one writev(), so messages that pile up behind a busy
+ * socket are coalesced into one write.
+ *
+ * An outbox belongs to the reactor that owns its connection and is only ever
+ * touched from that thread. Sends never block: what the socket does not take
+ * stays queued until the reactor sees EPOLLOUT and flushes again. Each outbox
+ * holds about outbox_config.max_bytes; what happens to a client that falls
+ * further behind is chosen by outbox_config.policy.
+ */
+#ifndef OUTBOX_H
+#define OUTBOX_H
+
+#include <bits/stdc++.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <unistd.h>
+#include "pool.h"
+
+using namespace std;
+
+#define FLUSH_BATCH 64 // frames handed to one writev()
+
+// An encoded frame shared by every outbox it is queued on. The frame is
+// written once through data() before the message is first copied.
+class Message
+{
+    struct Block
+    {
+        atomic<uint32_t> refs;
+        uint32_t size;
+    };
+    Block *block = NULL;
+
+    void release()
+    {
+        if (block && block->refs.fetch_sub(1, memory_order_acq_rel) == 1)
+            pool_free(block, sizeof(Block) + block->size);
+        block = NULL;
+    }
+
+public:
+    Message() = default;
+    explicit Message(size_t size) : block((Block *)pool_alloc(sizeof(Block) + size))
+    {
+        block->refs.store(1, memory_order_relaxed);
+        block->size = size;
+    }
+    Message(const Message &other) : block(other.block)
+    {
+        if (block)
+            block->refs.fetch_add(1, memory_order_relaxed);
+    }
+    Message(Message &&other) : block(other.block) { other.block = NULL; }
+    ~Message() { release(); }
+
+    Message &operator=(Message other)
+    {
+        swap(block, other.block);
+        return *this;
+    }
+
+    void reset() { release(); }
+    size_t size() const { return block->size; }
+    const char *data() const { return (const char *)(block + 1); }
+    char *data() { return (char *)(block + 1); }
+};
+
+inline Message make_message(const string &frame)
+{
+    Message message(frame.size());
+    memcpy(message.data(), frame.data(), frame.size());
+    return message;
+}
+
+enum overflow_policy
+{
+    DROP_OLDEST,     // discard the oldest queued frames of the slow client
+    DISCONNECT_SLOW, // disconnect the slow client
+    BACKPRESSURE,    // stop reading the room's senders, up to a timeout, then disconnect
+};
+
+struct OutboxConfig
+{
+    size_t max_bytes = 256 * 1024;
+    overflow_policy policy = DISCONNECT_SLOW;
+    int backpressure_timeout = 2000; // milliseconds
+};
+inline OutboxConfig outbox_config;
+
+// Shared by all reactors
+struct OutboxCounters
+{
+    atomic<uint64_t> dropped_frames{0};
+    atomic<uint64_t> slow_disconnects{0};
+    atomic<uint64_t> backpressure_waits{0};
+};
+inline OutboxCounters outbox_counters;
+
+class Outbox
+{
+    int socket_id;
+    // Ring of queued frames; head is the frame currently being written
+    vector<Message, PoolAllocator<Message>> ring;
+    size_t head = 0, count = 0;
+    size_t offset = 0;       // bytes of ring[head] already written
+    size_t queued_bytes = 0; // unwritten bytes across the ring
+    size_t in_flight = 0;    // frames handed to an asynchronous send
+    size_t offered = 0;      // their unwritten bytes
+    bool blocked = false;    // the socket took less than offered; wait for EPOLLOUT
+
+    Message &at(size_t i) { return ring[(head + i) & (ring.size() - 1)]; }
+
+    void grow()
+    {
+        vector<Message, PoolAllocator<Message>> bigger(ring.size() * 2);
+        for (size_t i = 0; i < count; i++)
+            bigger[i] = move(at(i));
+        ring.swap(bigger);
+        head = 0;
+    }
+
+    // Drops `written` bytes from the front of the queue
+    void consume(size_t written)
+    {
+        queued_bytes -= written;
+        while (written > 0)
+        {
+            size_t left = at(0).size() - offset;
+            if (written < left)
+            {
+                offset += written;
+                return;
+            }
+            written -= left;
+            at(0).reset();
+            head = (head + 1) & (ring.size() - 1);
+            count--;
+            offset = 0;
+        }
+    }
+
+    // Removes the oldest frame that is neither partly written nor being
+    // sent. Returns false if there is none.
+    bool drop_oldest()
+    {
+        size_t first = max(in_flight, offset > 0 ? (size_t)1 : (size_t)0);
+        if (first >= count)
+            return false;
+        queued_bytes -= at(first).size();
+        for (size_t i = first; i + 1 < count; i++)
+            at(i) = move(at(i + 1));
+        at(count - 1).reset();
+        count--;
+        return true;
+    }
+
+public:
+    Outbox(int socket_id) : socket_id(socket_id), ring(16) {}
+    ~Outbox() { close(socket_id); }
+
+    Outbox(const Outbox &) = delete;
+    Outbox &operator=(const Outbox &) = delete;
+
+    int socket() const { return socket_id; }
+    bool empty() const { return count == 0; }
+    bool sending() const { return in_flight > 0; }
+    bool waiting() const { return blocked; } // for the socket to become writable
+    bool over_limit() const { return queued_bytes > outbox_config.max_bytes; }
+    size_t queued() const { return queued_bytes; }
+
+    // Keeps the queued frames back, as if the socket were full, until the
+    // next flush(true); for bytes the caller writes to the socket first
+    void hold() { blocked = true; }
+
+    // Queues a frame, applying the overflow policy if the client is too far
+    // behind. Returns false if the client has to be disconnected instead.
+    // Under BACKPRESSURE the frame is always queued; the caller watches
+    // over_limit() and stops reading the senders.
+    bool enqueue(const Message &message)
+    {
+        // Flushes are batched; give the socket a chance before calling
+        // the client slow. An asynchronous send still under way has not had
+        // its chance yet, and it ends without waiting for the socket.
+        if (count > 0 && queued_bytes + message.size() > outbox_config.max_bytes && !blocked && !flush())
+            return false;
+        if (count > 0 && queued_bytes + message.size() > outbox_config.max_bytes && !sending())
+        {
+            if (outbox_config.policy == DISCONNECT_SLOW)
+            {
+                outbox_counters.slow_disconnects++;
+                return false;
+            }
+            if (outbox_config.policy == DROP_OLDEST)
+            {
+                while (queued_bytes + message.size() > outbox_config.max_bytes && drop_oldest())
+                    outbox_counters.dropped_frames++;
+            }
+        }
+        if (count == ring.size())
+            grow();
+        at(count++) = message;
+        queued_bytes += message.size();
+        return true;
+    }
+
+    // Points iov at up to max_frames queued frames for an asynchronous send.
+    // They stay queued, out of reach of drop-oldest, until end_send()
+    // reports how much of them was written. Returns the number of iovecs.
+    size_t begin_send(struct iovec *iov, size_t max_frames)
+    {
+        in_flight = min(count, max_frames);
+        offered = 0;
+        for (size_t i = 0; i < in_flight; i++)
+        {
+            const Message &frame = at(i);
+            size_t skip = i == 0 ? offset : 0;
+            iov[i].iov_base = (void *)(frame.data() + skip);
+            iov[i].iov_len = frame.size() - skip;
+            offered += iov[i].iov_len;
+        }
+        return in_flight;
+    }
+
+    // A short write means the socket is full, as with EAGAIN from flush()
+    void end_send(size_t written)
+    {
+        in_flight = 0;
+        if (written < offered)
+            blocked = true;
+        consume(written);
+    }
+
+    // Writes until the queue is empty or the socket is full. A full socket is
+    // not retried until the reactor reports EPOLLOUT and passes writable.
+    // Returns false if the connection failed.
+    bool flush(bool writable = false)
+    {
+        struct iovec iov[FLUSH_BATCH];
+        if (writable)
+            blocked = false;
+        while (count > 0 && !blocked && !sending())
+        {
+            struct msghdr msg = {};
+            msg.msg_iov = iov;
+            msg.msg_iovlen = begin_send(iov, FLUSH_BATCH);
+            ssize_t written = sendmsg(socket_id, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+            in_flight = 0;
+            if (written == -1 && errno == EINTR)
+                continue;
+            if (written == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                blocked = true;
+                return true;
+            }
+            if (written <= 0)
+                return false;
+            consume(written);
+        }
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,179 @@
+/*
+ * pool.h
+ * Per-thread pooled memory for the request paths of the server and the LB
+ *
+ * Blocks come in power-of-two size classes up to POOL_MAX_BLOCK bytes. Each
+ * thread keeps a free list per class and only touches shared state when a
+ * list runs dry or grows too long: then a batch of blocks moves to or from a
+ * depot shared by all threads, and only an empty depot carves a new slab.
+ * Memory freed on another thread than the one that allocated it (a
+ * connection moving to its room's reactor) goes to the freeing thread's list
+ * and finds its way back through the depot. Slabs are never returned, so
+ * after warm-up a steady load allocates nothing from the heap. Larger blocks
+ * go straight to the heap.
+ */
+#ifndef POOL_H
+#define POOL_H
+
+#include <bits/stdc++.h>
+
+using namespace std;
+
+#define POOL_MIN_SHIFT 4        // 16 byte blocks
+#define POOL_MAX_SHIFT 17       // 128 KB blocks, enough for a MAX_PAYLOAD frame
+#define POOL_BATCH_BYTES 65536  // bytes moved between a thread and the depot at once
+#define POOL_CLASSES (POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1)
+#define POOL_MAX_BLOCK ((size_t)1 << POOL_MAX_SHIFT)
+
+struct PoolBlock
+{
+    PoolBlock *next;
+};
+
+// A thread's free blocks of one size class
+struct PoolList
+{
+    PoolBlock *head = NULL;
+    size_t count = 0;
+};
+
+// Batches of free blocks handed between threads
+struct PoolDepot
+{
+    mutex lock;
+    vector<pair<PoolBlock *, size_t>> batches[POOL_CLASSES];
+};
+
+// Never destroyed: blocks may be freed while the process exits
+inline PoolDepot &pool_depot()
+{
+    static PoolDepot *depot = new PoolDepot();
+    return *depot;
+}
+
+// A thread's lists; what is left on them when the thread exits goes to the
+// depot rather than being lost with the thread
+struct PoolLists
+{
+    PoolList lists[POOL_CLASSES];
+
+    PoolList &operator[](int c) { return lists[c]; }
+
+    ~PoolLists()
+    {
+        PoolDepot &depot = pool_depot();
+        lock_guard<mutex> guard(depot.lock);
+        for (int c = 0; c < POOL_CLASSES; c++)
+            if (lists[c].head)
+                depot.batches[c].emplace_back(lists[c].head, lists[c].count);
+    }
+};
+
+inline thread_local PoolLists pool_lists;
+
+inline int pool_class(size_t bytes)
+{
+    int c = 0;
+    while (((size_t)1 << (c + POOL_MIN_SHIFT)) < bytes)
+        c++;
+    return c;
+}
+
+inline size_t pool_batch(int c) { return max((size_t)4, (size_t)POOL_BATCH_BYTES >> (c + POOL_MIN_SHIFT)); }
+
+// Refills an empty list from the depot, or from a new slab
+inline void pool_refill(int c)
+{
+    PoolList &list = pool_lists[c];
+    PoolDepot &depot = pool_depot();
+    {
+        lock_guard<mutex> guard(depot.lock);
+        if (!depot.batches[c].empty())
+        {
+            list.head = depot.batches[c].back().first;
+            list.count = depot.batches[c].back().second;
+            depot.batches[c].pop_back();
+            return;
+        }
+    }
+    size_t block = (size_t)1 << (c + POOL_MIN_SHIFT), blocks = pool_batch(c);
+    char *slab = (char *)::operator new(block * blocks);
+    for (size_t i = 0; i < blocks; i++)
+    {
+        PoolBlock *free = (PoolBlock *)(slab + i * block);
+        free->next = list.head;
+        list.head = free;
+    }
+    list.count = blocks;
+}
+
+inline void *pool_alloc(size_t bytes)
+{
+    if (bytes > POOL_MAX_BLOCK)
+        return ::operator new(bytes);
+    int c = pool_class(bytes);
+    PoolList &list = pool_lists[c];
+    if (!list.head)
+        pool_refill(c);
+    PoolBlock *block = list.head;
+    list.head = block->next;
+    list.count--;
+    return block;
+}
+
+// bytes must be the size the block was allocated with
+inline void pool_free(void *memory, size_t bytes)
+{
+    if (!memory)
+        return;
+    if (bytes > POOL_MAX_BLOCK)
+    {
+        ::operator delete(memory);
+        return;
+    }
+    int c = pool_class(bytes);
+    PoolList &list = pool_lists[c];
+    PoolBlock *block = (PoolBlock *)memory;
+    block->next = list.head;
+    list.head = block;
+    if (++list.count < 2 * pool_batch(c))
+        return;
+    // Too many for this thread: hand a batch to the depot
+    PoolBlock *batch = list.head, *last = batch;
+    for (size_t i = 1; i < pool_batch(c); i++)
+        last = last->next;
+    list.head = last->next;
+    last->next = NULL;
+    list.count -= pool_batch(c);
+    PoolDepot &depot = pool_depot();
+    lock_guard<mutex> guard(depot.lock);
+    depot.batches[c].emplace_back(batch, pool_batch(c));
+}
+
+// Base class for objects created and destroyed on the request path
+struct Pooled
+{
+    static void *operator new(size_t bytes) { return pool_alloc(bytes); }
+    static void operator delete(void *memory, size_t bytes) { pool_free(memory, bytes); }
+};
+
+// Allocator that puts standard containers in pooled memory
+template <class T>
+struct PoolAllocator
+{
+    typedef T value_type;
+
+    PoolAllocator() = default;
+    template <class U>
+    PoolAllocator(const PoolAllocator<U> &) {}
+
+    T *allocate(size_t n) { return (T *)pool_alloc(n * sizeof(T)); }
+    void deallocate(T *memory, size_t n) { pool_free(memory, n * sizeof(T)); }
+
+    template <class U>
+    bool operator==(const PoolAllocator<U> &) const { return true; }
+    template <class U>
+    bool operator!=(const PoolAllocator<U> &) const { return false; }
+};
+
+#endif
@@ -0,0 +1,527 @@
+/*
+ * protocol.h
+ * Length-prefixed binary framing shared by the client, server and load balancer
+ *
+ * Every frame is a 16 byte FrameHeader (all fields in network byte order)
+ * followed by `length` bytes of payload:
+ *
+ *   MSG_HELLO       client -> LB/server   [u8 name length][name][room]
+ *   MSG_ASSIGN      LB -> client          [u32 server port][server host], see backends.h
+ *   MSG_CHAT        client -> server      [text]
+ *                   server -> client      [u8 name length][name][text]
+ *   MSG_NOTICE      server -> client      [text], e.g. "x has joined Room: y"
+ *   MSG_EXIT        client -> server      empty
+ *   MSG_LOAD_QUERY  LB -> server          empty
+ *   MSG_LOAD_REPLY  server -> LB          [u32 users][u32 rooms][u32 msgs/s][u32 bytes/s]
+ *                                         [u32 queued bytes][u32 cpu permille], see LoadReport
+ *   MSG_PING        LB -> server          empty
+ *   MSG_CONTROL     LB -> server          empty, opens a control connection
+ *   MSG_PONG        server -> LB          empty
+ *   MSG_PLACE       LB -> server          [room], a room was placed there
+ *   MSG_MIGRATE     LB -> server          [u32 new port][u8 host length][host][room], move
+ *                                         the room's clients to that server
+ *   MSG_REDIRECT    server -> client      [u32 port][host], rejoin the room there (no host:
+ *                                         ask the LB again)
+ *   MSG_ROOM_QUERY  LB -> server          empty
+ *   MSG_ROOM_REPLY  server -> LB          ([u32 members][u8 room length][room])*, largest first
+ *   MSG_GOSSIP_PLACE   LB -> LB           [u32 version high][u32 version low][u32 port][room]
+ *   MSG_GOSSIP_HEALTH  LB -> LB           ([u32 port][u8 up])*, the sender's view of its servers
+ *   MSG_ROUTE_TOKEN LB/server -> client,  [u32 port][u64 issued][u64 mac], ahead of the ASSIGN,
+ *                   client -> server      REDIRECT or HELLO it goes with, see token.h
+ *   MSG_SEQ         server -> client      [u64 seq], ahead of each CHAT a logging server
+ *                                         sends, see roomlog.h
+ *   MSG_RESUME      client -> server      [u64 seq], ahead of the HELLO: replay the room's
+ *                                         logged messages from seq on
+ *
+ * A server sets FLAG_HISTORY on the CHAT frames it replays to a joiner from
+ * the room's history (see history.h), so they can be told from live ones.
+ *
+ * On a control connection (see control.h) sender_id carries a request id
+ * instead, and the reply to a LOAD_QUERY, PING or ROOM_QUERY echoes it.
+ * Between balancers (see gossip.h) it carries the id of the balancer that
+ * made the placement, or that sends its health view.
+ */
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <bits/stdc++.h>
+#include <arpa/inet.h>
+#include <endian.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <unistd.h>
+#include "pool.h"
+
+using namespace std;
+
+#define PROTOCOL_VERSION 1
+#define MAX_PAYLOAD 65536
+#define MAX_NAME_LEN 255
+#define FLAG_HISTORY 0x0001 // a CHAT frame replayed from the room's history
+
+enum frame_type
+{
+    MSG_HELLO = 1,
+    MSG_ASSIGN,
+    MSG_CHAT,
+    MSG_NOTICE,
+    MSG_EXIT,
+    MSG_LOAD_QUERY,
+    MSG_LOAD_REPLY,
+    MSG_PING,
+    MSG_CONTROL,
+    MSG_PONG,
+    MSG_PLACE,
+    MSG_MIGRATE,
+    MSG_REDIRECT,
+    MSG_ROOM_QUERY,
+    MSG_ROOM_REPLY,
+    MSG_GOSSIP_PLACE,
+    MSG_GOSSIP_HEALTH,
+    MSG_ROUTE_TOKEN,
+    MSG_SEQ,
+    MSG_RESUME,
+};
+
+struct FrameHeader
+{
+    uint8_t version;
+    uint8_t type;
+    uint16_t flags;
+    uint32_t sender_id;
+    uint32_t room_id;
+    uint32_t length; // payload bytes following the header
+} __attribute__((packed));
+
+static_assert(sizeof(FrameHeader) == 16, "FrameHeader must stay 16 bytes on the wire");
+
+// A decoded frame. Header fields are in host byte order; payload points into
+// the decoder's buffer and stays valid until the decoder is fed again.
+struct Frame
+{
+    FrameHeader header{};
+    const char *payload = NULL;
+    uint32_t length = 0;
+};
+
+// 32-bit FNV-1a of a room name, carried in every frame of that room
+inline uint32_t room_id_of(const char *room, size_t len)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)room[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+inline uint32_t room_id_of(const string &room) { return room_id_of(room.data(), room.size()); }
+
+inline void put_header(char *out, uint8_t type, uint32_t sender_id, uint32_t room_id, uint32_t length)
+{
+    FrameHeader header{};
+    header.version = PROTOCOL_VERSION;
+    header.type = type;
+    header.flags = 0;
+    header.sender_id = htonl(sender_id);
+    header.room_id = htonl(room_id);
+    header.length = htonl(length);
+    memcpy(out, &header, sizeof header);
+}
+
+// Appends a complete frame to out
+inline void encode_frame(string &out, uint8_t type, uint32_t sender_id, uint32_t room_id,
+                         const char *payload = NULL, size_t length = 0)
+{
+    size_t at = out.size();
+    out.resize(at + sizeof(FrameHeader));
+    put_header(&out[at], type, sender_id, room_id, length);
+    out.append(payload, length);
+}
+
+inline size_t named_frame_size(const string &name, size_t text_len)
+{
+    return sizeof(FrameHeader) + 1 + min(name.size(), (size_t)MAX_NAME_LEN) + text_len;
+}
+
+// Writes a frame whose payload is [u8 name length][name][text], the layout
+// shared by MSG_HELLO and server-to-client MSG_CHAT, into the
+// named_frame_size() bytes at out
+inline void put_named_frame(char *out, uint8_t type, uint32_t sender_id, uint32_t room_id, const string &name,
+                            const char *text, size_t text_len)
+{
+    size_t name_len = min(name.size(), (size_t)MAX_NAME_LEN);
+    put_header(out, type, sender_id, room_id, 1 + name_len + text_len);
+    out += sizeof(FrameHeader);
+    *out = (char)name_len;
+    memcpy(out + 1, name.data(), name_len);
+    memcpy(out + 1 + name_len, text, text_len);
+}
+
+inline void encode_named_frame(string &out, uint8_t type, uint32_t sender_id, uint32_t room_id,
+                               const string &name, const char *text, size_t text_len)
+{
+    size_t at = out.size();
+    out.resize(at + named_frame_size(name, text_len));
+    put_named_frame(&out[at], type, sender_id, room_id, name, text, text_len);
+}
+
+#define U32_FRAME_SIZE (sizeof(FrameHeader) + sizeof(uint32_t))
+
+// Writes a frame carrying one u32 into the U32_FRAME_SIZE bytes at out
+inline void put_u32_frame(char *out, uint8_t type, uint32_t sender_id, uint32_t room_id, uint32_t value)
+{
+    put_header(out, type, sender_id, room_id, sizeof value);
+    value = htonl(value);
+    memcpy(out + sizeof(FrameHeader), &value, sizeof value);
+}
+
+inline void encode_u32_frame(string &out, uint8_t type, uint32_t sender_id, uint32_t room_id, uint32_t value)
+{
+    size_t at = out.size();
+    out.resize(at + U32_FRAME_SIZE);
+    put_u32_frame(&out[at], type, sender_id, room_id, value);
+}
+
+#define U64_FRAME_SIZE (sizeof(FrameHeader) + sizeof(uint64_t))
+
+// Writes a frame carrying one u64 into the U64_FRAME_SIZE bytes at out
+inline void put_u64_frame(char *out, uint8_t type, uint32_t sender_id, uint32_t room_id, uint64_t value)
+{
+    put_header(out, type, sender_id, room_id, sizeof value);
+    value = htobe64(value);
+    memcpy(out + sizeof(FrameHeader), &value, sizeof value);
+}
+
+inline void encode_u64_frame(string &out, uint8_t type, uint32_t sender_id, uint32_t room_id, uint64_t value)
+{
+    size_t at = out.size();
+    out.resize(at + U64_FRAME_SIZE);
+    put_u64_frame(&out[at], type, sender_id, room_id, value);
+}
+
+// Writes a frame whose payload is [u32 value][text] into the
+// U32_FRAME_SIZE + text_len bytes at out
+inline void put_u32_text_frame(char *out, uint8_t type, uint32_t sender_id, uint32_t room_id, uint32_t value,
+                               const char *text, size_t text_len)
+{
+    put_header(out, type, sender_id, room_id, sizeof value + text_len);
+    value = htonl(value);
+    memcpy(out + sizeof(FrameHeader), &value, sizeof value);
+    memcpy(out + U32_FRAME_SIZE, text, text_len);
+}
+
+// Appends a frame whose payload is [u32 value][text], e.g. MSG_ASSIGN
+inline void encode_u32_text_frame(string &out, uint8_t type, uint32_t sender_id, uint32_t room_id, uint32_t value,
+                                  const string &text)
+{
+    size_t at = out.size();
+    out.resize(at + U32_FRAME_SIZE + text.size());
+    put_u32_text_frame(&out[at], type, sender_id, room_id, value, text.data(), text.size());
+}
+
+// Splits a [u32 value][text] payload. Returns false if malformed.
+inline bool split_u32_payload(const Frame &frame, uint32_t &value, string &text)
+{
+    if (frame.length < sizeof value)
+        return false;
+    memcpy(&value, frame.payload, sizeof value);
+    value = ntohl(value);
+    text.assign(frame.payload + sizeof value, frame.length - sizeof value);
+    return true;
+}
+
+// Appends a MSG_MIGRATE: move room's clients to the server at host:port
+inline void encode_migrate(string &out, uint32_t sender_id, const string &room, uint32_t port, const string &host)
+{
+    size_t host_len = min(host.size(), (size_t)MAX_NAME_LEN);
+    size_t at = out.size();
+    out.resize(at + U32_FRAME_SIZE + 1);
+    put_header(&out[at], MSG_MIGRATE, sender_id, room_id_of(room), sizeof port + 1 + host_len + room.size());
+    port = htonl(port);
+    memcpy(&out[at + sizeof(FrameHeader)], &port, sizeof port);
+    out[at + U32_FRAME_SIZE] = (char)host_len;
+    out.append(host, 0, host_len);
+    out += room;
+}
+
+// Reads a MSG_MIGRATE payload. Returns false if malformed.
+inline bool read_migrate(const Frame &frame, string &room, uint32_t &port, string &host)
+{
+    if (frame.length < sizeof port + 1)
+        return false;
+    size_t host_len = (unsigned char)frame.payload[sizeof port];
+    if (sizeof port + 1 + host_len > frame.length)
+        return false;
+    memcpy(&port, frame.payload, sizeof port);
+    port = ntohl(port);
+    host.assign(frame.payload + sizeof port + 1, host_len);
+    room.assign(frame.payload + sizeof port + 1 + host_len, frame.length - sizeof port - 1 - host_len);
+    return true;
+}
+
+// Appends a MSG_ROOM_REPLY listing rooms and their member counts
+inline void encode_room_loads(string &out, uint32_t sender_id, const vector<pair<string, int>> &rooms)
+{
+    string payload;
+    for (auto &room : rooms)
+    {
+        if (room.first.size() > MAX_NAME_LEN || payload.size() + 5 + room.first.size() > MAX_PAYLOAD)
+            continue;
+        uint32_t members = htonl(room.second);
+        payload.append((const char *)&members, sizeof members);
+        payload.push_back((char)room.first.size());
+        payload += room.first;
+    }
+    encode_frame(out, MSG_ROOM_REPLY, sender_id, 0, payload.data(), payload.size());
+}
+
+// Reads a MSG_ROOM_REPLY payload. Returns false if malformed.
+inline bool read_room_loads(const Frame &frame, vector<pair<string, int>> &rooms)
+{
+    rooms.clear();
+    size_t at = 0;
+    while (at < frame.length)
+    {
+        uint32_t members;
+        if (frame.length - at < sizeof members + 1)
+            return false;
+        memcpy(&members, frame.payload + at, sizeof members);
+        size_t len = (unsigned char)frame.payload[at + sizeof members];
+        at += sizeof members + 1;
+        if (frame.length - at < len)
+            return false;
+        rooms.emplace_back(string(frame.payload + at, len), (int)ntohl(members));
+        at += len;
+    }
+    return true;
+}
+
+// Appends a MSG_GOSSIP_PLACE: origin placed room on port, at version
+inline void encode_gossip_place(string &out, uint32_t origin, const string &room, uint64_t version, uint32_t port)
+{
+    uint32_t fields[3] = {htonl((uint32_t)(version >> 32)), htonl((uint32_t)version), htonl(port)};
+    size_t at = out.size();
+    out.resize(at + sizeof(FrameHeader) + sizeof fields);
+    put_header(&out[at], MSG_GOSSIP_PLACE, origin, room_id_of(room), sizeof fields + room.size());
+    memcpy(&out[at + sizeof(FrameHeader)], fields, sizeof fields);
+    out += room;
+}
+
+// Reads a MSG_GOSSIP_PLACE payload. Returns false if malformed.
+inline bool read_gossip_place(const Frame &frame, string &room, uint64_t &version, uint32_t &port)
+{
+    uint32_t fields[3];
+    if (frame.length < sizeof fields)
+        return false;
+    memcpy(fields, frame.payload, sizeof fields);
+    version = (uint64_t)ntohl(fields[0]) << 32 | ntohl(fields[1]);
+    port = ntohl(fields[2]);
+    room.assign(frame.payload + sizeof fields, frame.length - sizeof fields);
+    return true;
+}
+
+// Appends a MSG_GOSSIP_HEALTH with whether each server port is up
+inline void encode_gossip_health(string &out, uint32_t origin, const vector<pair<int, bool>> &servers)
+{
+    string payload;
+    for (auto &server : servers)
+    {
+        uint32_t port = htonl(server.first);
+        payload.append((const char *)&port, sizeof port);
+        payload.push_back(server.second ? 1 : 0);
+    }
+    encode_frame(out, MSG_GOSSIP_HEALTH, origin, 0, payload.data(), payload.size());
+}
+
+// Reads a MSG_GOSSIP_HEALTH payload. Returns false if malformed.
+inline bool read_gossip_health(const Frame &frame, vector<pair<int, bool>> &servers)
+{
+    servers.clear();
+    if (frame.length % 5)
+        return false;
+    for (size_t at = 0; at < frame.length; at += 5)
+    {
+        uint32_t port;
+        memcpy(&port, frame.payload + at, sizeof port);
+        servers.emplace_back((int)ntohl(port), frame.payload[at + sizeof port] != 0);
+    }
+    return true;
+}
+
+// What a server reports about itself in MSG_LOAD_REPLY. Rates are averaged
+// since the previous report, cpu is in thousandths of the CPUs the server
+// may run on.
+struct LoadReport
+{
+    uint32_t users = 0; // clients that have joined a room
+    uint32_t rooms = 0;
+    uint32_t messages_per_sec = 0; // chat messages relayed
+    uint32_t bytes_per_sec = 0;    // bytes queued to clients, fan-out included
+    uint32_t queued_bytes = 0;     // written to outboxes but not yet to sockets
+    uint32_t cpu_permille = 0;
+};
+
+#define LOAD_REPORT_FIELDS 6
+#define LOAD_FRAME_SIZE (sizeof(FrameHeader) + LOAD_REPORT_FIELDS * sizeof(uint32_t))
+
+// Writes a MSG_LOAD_REPLY into the LOAD_FRAME_SIZE bytes at out
+inline void put_load_frame(char *out, uint32_t sender_id, const LoadReport &report)
+{
+    uint32_t fields[LOAD_REPORT_FIELDS] = {report.users,        report.rooms,        report.messages_per_sec,
+                                           report.bytes_per_sec, report.queued_bytes, report.cpu_permille};
+    put_header(out, MSG_LOAD_REPLY, sender_id, 0, sizeof fields);
+    for (uint32_t &field : fields)
+        field = htonl(field);
+    memcpy(out + sizeof(FrameHeader), fields, sizeof fields);
+}
+
+// Reads a MSG_LOAD_REPLY payload. A bare [u32] from an older server is its
+// user count; fields added after these are skipped. Returns false if
+// malformed.
+inline bool read_load_report(const Frame &frame, LoadReport &report)
+{
+    uint32_t fields[LOAD_REPORT_FIELDS] = {0};
+    if (frame.length != sizeof(uint32_t) && frame.length < sizeof fields)
+        return false;
+    memcpy(fields, frame.payload, min((size_t)frame.length, sizeof fields));
+    report.users = ntohl(fields[0]);
+    report.rooms = ntohl(fields[1]);
+    report.messages_per_sec = ntohl(fields[2]);
+    report.bytes_per_sec = ntohl(fields[3]);
+    report.queued_bytes = ntohl(fields[4]);
+    report.cpu_permille = ntohl(fields[5]);
+    return true;
+}
+
+// Splits a [u8 name length][name][text] payload. Returns false if malformed.
+inline bool split_named_payload(const Frame &frame, string &name, string &text)
+{
+    if (frame.length < 1 || (uint32_t)(unsigned char)frame.payload[0] + 1 > frame.length)
+        return false;
+    size_t name_len = (unsigned char)frame.payload[0];
+    name.assign(frame.payload + 1, name_len);
+    text.assign(frame.payload + 1 + name_len, frame.length - 1 - name_len);
+    return true;
+}
+
+inline bool read_u32_payload(const Frame &frame, uint32_t &value)
+{
+    if (frame.length != sizeof value)
+        return false;
+    memcpy(&value, frame.payload, sizeof value);
+    value = ntohl(value);
+    return true;
+}
+
+inline bool read_u64_payload(const Frame &frame, uint64_t &value)
+{
+    if (frame.length != sizeof value)
+        return false;
+    memcpy(&value, frame.payload, sizeof value);
+    value = be64toh(value);
+    return true;
+}
+
+// Streaming decoder: bytes arrive in whatever pieces recv() hands out, frames
+// come out whole. Handles frames split across reads and many frames per read.
+class FrameDecoder
+{
+    vector<char, PoolAllocator<char>> buffer;
+    size_t start = 0, end = 0; // undecoded bytes are buffer[start, end)
+
+public:
+    FrameDecoder() : buffer(4096) {}
+
+    // Returns room for at least `want` more bytes; recv() straight into it
+    // and report the bytes received with commit()
+    char *write_space(size_t want, size_t &available)
+    {
+        if (start == end)
+            start = end = 0;
+        if (buffer.size() - end < want && start > 0)
+        {
+            memmove(buffer.data(), buffer.data() + start, end - start);
+            end -= start;
+            start = 0;
+        }
+        if (buffer.size() - end < want)
+            buffer.resize(max(end + want, buffer.size() * 2));
+        available = buffer.size() - end;
+        return buffer.data() + end;
+    }
+
+    void commit(size_t bytes) { end += bytes; }
+
+    void feed(const char *data, size_t bytes)
+    {
+        size_t available;
+        memcpy(write_space(bytes, available), data, bytes);
+        commit(bytes);
+    }
+
+    // Returns 1 and fills frame if a whole frame is buffered, 0 if more bytes
+    // are needed and -1 if the stream is not speaking this protocol
+    int next(Frame &frame)
+    {
+        if (end - start < sizeof(FrameHeader))
+            return 0;
+        memcpy(&frame.header, buffer.data() + start, sizeof(FrameHeader));
+        frame.header.flags = ntohs(frame.header.flags);
+        frame.header.sender_id = ntohl(frame.header.sender_id);
+        frame.header.room_id = ntohl(frame.header.room_id);
+        frame.header.length = ntohl(frame.header.length);
+        if (frame.header.version != PROTOCOL_VERSION || frame.header.length > MAX_PAYLOAD)
+            return -1;
+        if (end - start < sizeof(FrameHeader) + frame.header.length)
+            return 0;
+        frame.payload = buffer.data() + start + sizeof(FrameHeader);
+        frame.length = frame.header.length;
+        start += sizeof(FrameHeader) + frame.header.length;
+        return 1;
+    }
+
+    size_t buffered() const { return end - start; }
+};
+
+// Sends all of data on a blocking socket. Returns false on error.
+inline bool send_all(int socket_id, const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t n = send(socket_id, data, length, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        length -= n;
+    }
+    return true;
+}
+
+inline bool send_all(int socket_id, const string &data) { return send_all(socket_id, data.data(), data.size()); }
+
+// Blocks until a whole frame arrives on the socket. Returns false if the
+// connection closed, failed or sent garbage.
+inline bool recv_frame(int socket_id, FrameDecoder &decoder, Frame &frame)
+{
+    while (true)
+    {
+        int decoded = decoder.next(frame);
+        if (decoded != 0)
+            return decoded == 1;
+        size_t available;
+        char *space = decoder.write_space(sizeof(FrameHeader), available);
+        ssize_t n = recv(socket_id, space, available, 0);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        decoder.commit(n);
+    }
+}
+
+#endif
@@ -0,0 +1,252 @@
+/*
+ * proxy.h
+ * Zero-copy forwarding for the Load Balancer's proxy mode (-x)
+ *
+ * A proxied client keeps its connection to the balancer, which opens one to
+ * the room's server and moves bytes between the two with splice() through
+ * a pipe per direction. Chat payloads go from one socket buffer to the other
+ * through the pipe's pages and are never copied into user space.
+ *
+ * Connections to the servers are opened ahead of time and pooled per
+ * server, so a client's first message does not wait for a second TCP
+ * handshake. Each is used by one client and closed with it: the server
+ * knows a client by its connection, so they cannot be shared or reused.
+ */
+#ifndef PROXY_H
+#define PROXY_H
+
+#include <bits/stdc++.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace std;
+
+#define PROXY_PIPE_SIZE 65536   // most bytes held in a pipe, one default pipe's worth
+#define PROXY_POOL_SIZE 8       // idle connections kept open to each server
+#define PROXY_POOL_INTERVAL 100 // ms between pool top-ups
+#define PROXY_CONNECT_TIMEOUT 1 // s the pool waits for a server to accept
+
+// One direction of a proxied connection. Both sockets must be non-blocking.
+class SplicePipe
+{
+    int pipe_ids[2] = {-1, -1};
+    size_t held = 0;          // read from the source, not yet written on
+    bool source_done = false; // the source has closed its side
+
+public:
+    SplicePipe() = default;
+    ~SplicePipe() { close_pipe(); }
+
+    SplicePipe(const SplicePipe &) = delete;
+    SplicePipe &operator=(const SplicePipe &) = delete;
+
+    bool open() { return pipe2(pipe_ids, O_NONBLOCK | O_CLOEXEC) == 0; }
+
+    void close_pipe()
+    {
+        for (int &id : pipe_ids)
+            if (id != -1)
+            {
+                close(id);
+                id = -1;
+            }
+        held = 0;
+        source_done = false;
+    }
+
+    size_t pending() const { return held; }
+
+    // Moves what it can from the socket `from` to `to`, adding the bytes
+    // written to moved. Stops when from has nothing more to read and to
+    // takes no more, so under edge-triggered epoll it must run again on
+    // any event from either socket. Returns false once the direction is
+    // over: from closed and everything it sent was passed on, or a socket
+    // failed.
+    bool pump(int from, int to, size_t &moved)
+    {
+        while (true)
+        {
+            bool progress = false;
+            if (!source_done && held < PROXY_PIPE_SIZE)
+            {
+                ssize_t n = splice(from, NULL, pipe_ids[1], NULL, PROXY_PIPE_SIZE - held,
+                                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                if (n > 0)
+                {
+                    held += n;
+                    progress = true;
+                }
+                else if (n == 0)
+                    source_done = true;
+                else if (errno != EAGAIN && errno != EINTR)
+                    return false;
+            }
+            if (held > 0)
+            {
+                ssize_t n = splice(pipe_ids[0], NULL, to, NULL, held, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                if (n > 0)
+                {
+                    held -= n;
+                    moved += n;
+                    progress = true;
+                }
+                else if (n == -1 && errno != EAGAIN && errno != EINTR)
+                    return false;
+            }
+            if (source_done && held == 0)
+                return false;
+            if (!progress)
+                return true;
+        }
+    }
+};
+
+// Idle connections to each server, opened by refill() on a thread of its
+// own and taken by the reactors
+class BackendPool
+{
+    mutex pool_mutex;
+    unordered_map<int, vector<int>> idle; // server port -> connected sockets nobody has used
+
+    // A pooled connection is dead if the server closed it, and no use if it
+    // sent anything, since a client would see bytes not meant for it
+    static bool alive(int socket_id)
+    {
+        char byte;
+        ssize_t n = recv(socket_id, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+        return n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    }
+
+    static void tune(int socket_id)
+    {
+        int enable = 1;
+        setsockopt(socket_id, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof enable);
+    }
+
+public:
+    int size = PROXY_POOL_SIZE;
+    atomic<uint64_t> hits{0}, misses{0}; // takes served from the pool, and ones that had to connect
+
+    BackendPool() = default;
+    ~BackendPool() { close_all(); }
+
+    BackendPool(const BackendPool &) = delete;
+    BackendPool &operator=(const BackendPool &) = delete;
+
+    // A non-blocking socket to the server at address, from the pool if it
+    // holds a live one. Otherwise a connect is started and connecting is set:
+    // the socket turns writable once it is done. -1 if that fails at once.
+    int take(int port, const struct sockaddr_in &address, bool &connecting)
+    {
+        connecting = false;
+        while (true)
+        {
+            int socket_id;
+            {
+                lock_guard<mutex> guard(pool_mutex);
+                auto found = idle.find(port);
+                if (found == idle.end() || found->second.empty())
+                    break;
+                socket_id = found->second.back();
+                found->second.pop_back();
+            }
+            if (alive(socket_id))
+            {
+                hits++;
+                return socket_id;
+            }
+            close(socket_id);
+        }
+        misses++;
+        int socket_id = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (socket_id == -1)
+            return -1;
+        tune(socket_id);
+        if (connect(socket_id, (const struct sockaddr *)&address, sizeof address) == 0)
+            return socket_id;
+        if (errno != EINPROGRESS)
+        {
+            close(socket_id);
+            return -1;
+        }
+        connecting = true;
+        return socket_id;
+    }
+
+    // Tops every listed server up to size idle connections, dropping dead
+    // ones, and closes those of servers no longer listed. Connects block, up
+    // to PROXY_CONNECT_TIMEOUT each.
+    void refill(const vector<pair<int, struct sockaddr_in>> &servers)
+    {
+        set<int> listed;
+        for (auto &server : servers)
+            listed.insert(server.first);
+        vector<int> doomed;
+        vector<pair<int, int>> wanted; // port, connections short
+        {
+            lock_guard<mutex> guard(pool_mutex);
+            for (auto entry = idle.begin(); entry != idle.end();)
+            {
+                if (listed.count(entry->first))
+                {
+                    ++entry;
+                    continue;
+                }
+                doomed.insert(doomed.end(), entry->second.begin(), entry->second.end());
+                entry = idle.erase(entry);
+            }
+            for (auto &server : servers)
+            {
+                vector<int> &sockets = idle[server.first];
+                auto dead = partition(sockets.begin(), sockets.end(), alive);
+                doomed.insert(doomed.end(), dead, sockets.end());
+                sockets.erase(dead, sockets.end());
+                if ((int)sockets.size() < size)
+                    wanted.emplace_back(server.first, size - sockets.size());
+            }
+        }
+        for (int socket_id : doomed)
+            close(socket_id);
+        map<int, struct sockaddr_in> addresses(servers.begin(), servers.end());
+        for (auto &want : wanted)
+            for (int i = 0; i < want.second; i++)
+            {
+                int socket_id = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+                if (socket_id == -1)
+                    return;
+                struct timeval timeout = {PROXY_CONNECT_TIMEOUT, 0};
+                setsockopt(socket_id, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+                const struct sockaddr_in &address = addresses[want.first];
+                if (connect(socket_id, (const struct sockaddr *)&address, sizeof address) == -1)
+                {
+                    close(socket_id);
+                    break; // the server is not taking connections; try again next round
+                }
+                tune(socket_id);
+                fcntl(socket_id, F_SETFL, fcntl(socket_id, F_GETFL) | O_NONBLOCK);
+                lock_guard<mutex> guard(pool_mutex);
+                idle[want.first].push_back(socket_id);
+            }
+    }
+
+    size_t idle_count(int port)
+    {
+        lock_guard<mutex> guard(pool_mutex);
+        auto found = idle.find(port);
+        return found == idle.end() ? 0 : found->second.size();
+    }
+
+    void close_all()
+    {
+        lock_guard<mutex> guard(pool_mutex);
+        for (auto &entry : idle)
+            for (int socket_id : entry.second)
+                close(socket_id);
+        idle.clear();
+    }
+};
+
+#endif
@@ -0,0 +1,616 @@
+/*
+ * roomlog.h
+ * Durable per-room message log of the chat server, with resume by sequence
+ * number
+ *
+ * With -D every CHAT a room receives gets the room's next sequence number
+ * and is appended to the room's log, in the same bytes clients are sent: a
+ * MSG_SEQ frame carrying the number, then the CHAT frame (FLAG_HISTORY set
+ * in the log). A client that comes back with MSG_RESUME ahead of its HELLO
+ * is sent every record from that number on with sendfile(), straight from
+ * the log's page cache to its socket; the live messages of the room queue
+ * up behind.
+ *
+ * A log is a directory per room, named by the room id, of segment files
+ * named by the first sequence number they hold. The segment being appended
+ * to is mapped into memory with its full ROOMLOG_SEGMENT_BYTES, so an append
+ * is a memcpy. The file for the next one is created and mapped ahead as
+ * spare.tmp, so a full segment is swapped for it in memory; cutting the
+ * full one to its records, naming the new one and deleting segments beyond
+ * the newest ROOMLOG_SEGMENTS are left to RoomLogWorker, a thread that does
+ * the disk work of every log in the order it is posted. The server opens
+ * logs on it too. Every ROOMLOG_INDEX_EVERY bytes a
+ * segment notes (seq, offset) in a sparse index, and a resume walks records
+ * only from the entry before its number.
+ *
+ * Segments record their room's name, so a room whose id collides with one
+ * already logged is refused rather than mixed in. Reopening a log scans its
+ * newest segment up to the first record that is torn or out of sequence,
+ * which is where a crash left it; a record's number is written after the
+ * rest of it; a spare.tmp that had become the newest segment but was not
+ * yet named is named then. Writes are left to the kernel's write-back: they survive a
+ * restart of the server, not of the machine. The segment header uses the
+ * host's byte order, like the WAL's.
+ */
+#ifndef ROOMLOG_H
+#define ROOMLOG_H
+
+#include <bits/stdc++.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "protocol.h"
+
+using namespace std;
+
+#define ROOMLOG_SEGMENT_BYTES (4 << 20) // mapped size of a segment, and the most it holds
+#define ROOMLOG_SEGMENTS 8              // kept per room, oldest deleted first
+#define ROOMLOG_INDEX_EVERY 4096        // bytes of records between sparse index entries
+#define ROOMLOG_INDEX_MAX (ROOMLOG_SEGMENT_BYTES / ROOMLOG_INDEX_EVERY + 1) // entries of a full segment
+#define ROOMLOG_MAGIC 0x474f4c52        // "RLOG"
+#define ROOMLOG_RECORD_MAX (U64_FRAME_SIZE + sizeof(FrameHeader) + 1 + MAX_NAME_LEN + MAX_PAYLOAD)
+
+struct __attribute__((packed)) RoomLogHeader
+{
+    uint32_t magic;
+    uint16_t room_length; // bytes of room name following the header
+    uint16_t reserved;
+    uint64_t base; // sequence number of the segment's first record
+};
+
+// Part of a segment file still to be sent to a client; fd is owned
+struct LogRange
+{
+    int fd;
+    off_t offset, end;
+};
+
+inline void close_log_ranges(vector<LogRange> &ranges)
+{
+    for (LogRange &range : ranges)
+        close(range.fd);
+    ranges.clear();
+}
+
+// Sends the ranges in order with sendfile() until they are done or the
+// socket is full, adding the bytes written to sent. Ranges sent in full
+// are closed and removed. Returns false if the socket failed.
+inline bool send_log_ranges(int socket_id, vector<LogRange> &ranges, size_t &sent)
+{
+    while (!ranges.empty())
+    {
+        LogRange &range = ranges.front();
+        while (range.offset < range.end)
+        {
+            ssize_t n = sendfile(socket_id, range.fd, &range.offset, range.end - range.offset);
+            if (n > 0)
+                sent += n;
+            else if (n == -1 && errno == EINTR)
+                continue;
+            else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return true;
+            else
+                return false; // 0: the file ended early
+        }
+        close(range.fd);
+        ranges.erase(ranges.begin());
+    }
+    return true;
+}
+
+// The thread that opens room logs and finishes their segment changes, so a
+// reactor never waits on the disk for them. Jobs run one at a time, in the
+// order they were posted.
+class RoomLogWorker
+{
+    mutex jobs_mutex;
+    condition_variable wake, idle;
+    deque<function<void()>> jobs;
+    bool busy = false;
+    thread worker;
+
+    void run()
+    {
+        unique_lock<mutex> lock(jobs_mutex);
+        while (true)
+        {
+            wake.wait(lock, [&] { return !jobs.empty(); });
+            function<void()> job = move(jobs.front());
+            jobs.pop_front();
+            busy = true;
+            lock.unlock();
+            job();
+            lock.lock();
+            busy = false;
+            if (jobs.empty())
+                idle.notify_all();
+        }
+    }
+
+    RoomLogWorker() : worker(&RoomLogWorker::run, this) {}
+
+public:
+    // Never destroyed, so logs closed at exit can still wait for it
+    static RoomLogWorker &instance()
+    {
+        static RoomLogWorker *worker = new RoomLogWorker();
+        return *worker;
+    }
+
+    void post(function<void()> job)
+    {
+        {
+            lock_guard<mutex> guard(jobs_mutex);
+            jobs.push_back(move(job));
+        }
+        wake.notify_one();
+    }
+
+    // Waits until every job posted so far has run. Must not be called from
+    // a job.
+    void drain()
+    {
+        unique_lock<mutex> lock(jobs_mutex);
+        idle.wait(lock, [&] { return jobs.empty() && !busy; });
+    }
+};
+
+// Size of the record at offset at of the size bytes at data, and its
+// sequence number. 0 where there is none: the end of the records, or a
+// torn one.
+inline size_t roomlog_record(const char *data, size_t size, size_t at, uint64_t &seq)
+{
+    FrameHeader seq_header, chat_header;
+    if (at > size || size - at < U64_FRAME_SIZE + sizeof(FrameHeader))
+        return 0;
+    memcpy(&seq_header, data + at, sizeof seq_header);
+    memcpy(&chat_header, data + at + U64_FRAME_SIZE, sizeof chat_header);
+    size_t record = U64_FRAME_SIZE + sizeof(FrameHeader) + ntohl(chat_header.length);
+    if (seq_header.version != PROTOCOL_VERSION || seq_header.type != MSG_SEQ ||
+        ntohl(seq_header.length) != sizeof seq || chat_header.version != PROTOCOL_VERSION ||
+        chat_header.type != MSG_CHAT || record > ROOMLOG_RECORD_MAX || size - at < record)
+        return 0;
+    memcpy(&seq, data + at + sizeof(FrameHeader), sizeof seq);
+    seq = be64toh(seq);
+    return record;
+}
+
+class RoomLog
+{
+    struct Segment
+    {
+        uint64_t base;
+        size_t end = 0; // end of its records, 0 until a sealed one is scanned
+        vector<pair<uint64_t, size_t>> index; // (seq, offset) of a record every ROOMLOG_INDEX_EVERY bytes
+    };
+    string room_dir, room;
+    size_t header_size = 0;
+    vector<Segment> segments; // oldest first; records are appended to the last
+    int active_id = -1;       // the last segment, mapped at map
+    char *map = NULL;
+    uint64_t next = 1; // sequence number of the next record
+    // The file of the next segment, mapped by the worker; the appending
+    // thread takes them once spare_ready is set
+    int spare_id = -1;
+    char *spare_map = NULL;
+    atomic<bool> spare_ready{false};
+    atomic<int> pending{0}; // jobs posted for this log and not yet run
+
+    string spare_path() const { return room_dir + "/spare.tmp"; }
+
+    string path_of(uint64_t base) const
+    {
+        char name[32];
+        snprintf(name, sizeof name, "%016llx.seg", (unsigned long long)base);
+        return room_dir + "/" + name;
+    }
+
+    // Walks the records of seg from its header on, building its index and
+    // finding its end. Returns the sequence number after the last record.
+    uint64_t scan(Segment &seg, const char *data, size_t size)
+    {
+        seg.index.clear();
+        uint64_t expected = seg.base, seq;
+        size_t at = header_size, indexed = 0;
+        while (size_t record = roomlog_record(data, size, at, seq))
+        {
+            if (seq != expected)
+                break;
+            if (seg.index.empty() || at - indexed >= ROOMLOG_INDEX_EVERY)
+            {
+                seg.index.emplace_back(seq, at);
+                indexed = at;
+            }
+            at += record;
+            expected++;
+        }
+        seg.end = at;
+        return expected;
+    }
+
+    // Calls visit(data, size) with the bytes of a sealed segment. Returns
+    // false if it cannot be read.
+    template <class Visit>
+    bool view(const Segment &seg, Visit visit)
+    {
+        int file_id = ::open(path_of(seg.base).c_str(), O_RDONLY | O_CLOEXEC);
+        if (file_id == -1)
+            return false;
+        struct stat info;
+        void *data = fstat(file_id, &info) == 0 && info.st_size > 0
+                         ? mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, file_id, 0)
+                         : MAP_FAILED;
+        ::close(file_id);
+        if (data == MAP_FAILED)
+            return false;
+        visit((const char *)data, (size_t)info.st_size);
+        munmap(data, info.st_size);
+        return true;
+    }
+
+    // Offset in seg of the first record numbered from or later
+    size_t find(const Segment &seg, const char *data, size_t size, uint64_t from) const
+    {
+        auto after = upper_bound(seg.index.begin(), seg.index.end(), make_pair(from, SIZE_MAX));
+        size_t at = after == seg.index.begin() ? header_size : prev(after)->second;
+        uint64_t seq;
+        while (at < seg.end)
+        {
+            size_t record = roomlog_record(data, size, at, seq);
+            if (!record || seq >= from)
+                break;
+            at += record;
+        }
+        return at;
+    }
+
+    // Maps the segment file at path for appending, with its full size
+    static bool map_segment(const string &path, bool create, int &file_id, char *&data, string &error)
+    {
+        file_id = ::open(path.c_str(), O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_TRUNC : 0), 0644);
+        void *mapped = MAP_FAILED;
+        if (file_id != -1 && ftruncate(file_id, ROOMLOG_SEGMENT_BYTES) == 0)
+            mapped = mmap(NULL, ROOMLOG_SEGMENT_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, file_id, 0);
+        if (mapped == MAP_FAILED)
+        {
+            error = path + ": " + strerror(errno);
+            if (file_id != -1)
+                ::close(file_id);
+            file_id = -1;
+            return false;
+        }
+        data = (char *)mapped;
+        return true;
+    }
+
+    // Cuts a segment file mapped at data down to its first end bytes, and
+    // lets go of it
+    static void seal_file(int file_id, char *data, size_t end)
+    {
+        msync(data, end, MS_ASYNC);
+        munmap(data, ROOMLOG_SEGMENT_BYTES);
+        if (ftruncate(file_id, end) == -1)
+            perror("roomlog: ");
+        ::close(file_id);
+    }
+
+    // Writes the header of a segment starting at base into the mapped map
+    // and adds the segment, dropping the oldest beyond ROOMLOG_SEGMENTS.
+    // Returns the paths of the dropped ones, still to be deleted.
+    vector<string> add_segment(uint64_t base)
+    {
+        RoomLogHeader header = {ROOMLOG_MAGIC, (uint16_t)room.size(), 0, base};
+        memcpy(map, &header, sizeof header);
+        memcpy(map + sizeof header, room.data(), room.size());
+        Segment seg;
+        seg.base = base;
+        seg.end = header_size;
+        seg.index.reserve(ROOMLOG_INDEX_MAX); // appends never grow it
+        segments.push_back(move(seg));
+        vector<string> dropped;
+        while (segments.size() > ROOMLOG_SEGMENTS)
+        {
+            dropped.push_back(path_of(segments.front().base));
+            segments.erase(segments.begin());
+        }
+        return dropped;
+    }
+
+    bool start_segment(uint64_t base, string &error)
+    {
+        if (!map_segment(path_of(base), true, active_id, map, error))
+            return false;
+        for (const string &path : add_segment(base))
+            unlink(path.c_str()); // senders holding it open keep reading
+        return true;
+    }
+
+    // Cuts the segment being appended to down to its records
+    void seal()
+    {
+        if (!map)
+            return;
+        segments.back().index.shrink_to_fit();
+        seal_file(active_id, map, segments.back().end);
+        map = NULL;
+        active_id = -1;
+    }
+
+    // Creates and maps spare.tmp for the next segment. A log without a
+    // spare starts its next segment itself.
+    void prepare_spare()
+    {
+        string error;
+        if (map_segment(spare_path(), true, spare_id, spare_map, error))
+            spare_ready.store(true, memory_order_release);
+        else
+            cerr << "roomlog: " << error << "\n";
+    }
+
+    // Moves appends on to a new segment from next. With the spare ready this
+    // only swaps mappings, and the worker seals the full segment, names the
+    // new one, deletes the dropped ones and prepares the next spare. A room
+    // that fills a segment before the worker is done with the last waits for
+    // it; without a spare the work is done here.
+    bool rotate(string &error)
+    {
+        if (pending > 0 && !spare_ready.load(memory_order_acquire))
+            RoomLogWorker::instance().drain();
+        if (!spare_ready.load(memory_order_acquire))
+        {
+            seal();
+            return start_segment(next, error);
+        }
+        segments.back().index.shrink_to_fit();
+        int full_id = active_id;
+        char *full_map = map;
+        size_t full_end = segments.back().end;
+        active_id = spare_id;
+        map = spare_map;
+        spare_id = -1;
+        spare_map = NULL;
+        spare_ready.store(false, memory_order_relaxed);
+        string named = path_of(next);
+        vector<string> dropped = add_segment(next);
+        pending++;
+        RoomLogWorker::instance().post([this, full_id, full_map, full_end, named, dropped] {
+            // Named first: a crash in between leaves a spare.tmp that open()
+            // names
+            if (rename(spare_path().c_str(), named.c_str()) == -1)
+                perror("roomlog: ");
+            seal_file(full_id, full_map, full_end);
+            for (const string &path : dropped)
+                unlink(path.c_str());
+            prepare_spare();
+            pending--;
+        });
+        return true;
+    }
+
+    // Names a spare.tmp that had become the newest segment, and deletes one
+    // that had not
+    void recover_spare()
+    {
+        string spare = spare_path();
+        int file_id = ::open(spare.c_str(), O_RDONLY | O_CLOEXEC);
+        if (file_id == -1)
+            return;
+        RoomLogHeader header;
+        bool started = pread(file_id, &header, sizeof header, 0) == sizeof header && header.magic == ROOMLOG_MAGIC;
+        ::close(file_id);
+        if (!started || rename(spare.c_str(), path_of(header.base).c_str()) == -1)
+            unlink(spare.c_str());
+    }
+
+    // Whether the segment file at path was written for this room
+    bool ours(const string &path)
+    {
+        int file_id = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (file_id == -1)
+            return false;
+        RoomLogHeader header;
+        string name(room.size(), 0);
+        bool same = pread(file_id, &header, sizeof header, 0) == sizeof header && header.magic == ROOMLOG_MAGIC &&
+                    header.room_length == room.size() &&
+                    pread(file_id, &name[0], name.size(), sizeof header) == (ssize_t)name.size() && name == room;
+        ::close(file_id);
+        return same;
+    }
+
+    bool open_segments(const string &dir, const string &room_name, string &error)
+    {
+        char name[16];
+        snprintf(name, sizeof name, "%08x", room_id_of(room_name));
+        room_dir = dir + "/" + name;
+        room = room_name;
+        header_size = sizeof(RoomLogHeader) + room.size();
+        if (room.size() > UINT16_MAX)
+        {
+            error = "room name too long to log";
+            return false;
+        }
+        if (mkdir(room_dir.c_str(), 0755) == -1 && errno != EEXIST)
+        {
+            error = room_dir + ": " + strerror(errno);
+            return false;
+        }
+        recover_spare();
+        vector<uint64_t> bases;
+        if (DIR *listing = opendir(room_dir.c_str()))
+        {
+            while (struct dirent *entry = readdir(listing))
+            {
+                unsigned long long base;
+                char suffix[8];
+                if (sscanf(entry->d_name, "%16llx.%4s", &base, suffix) == 2 && strcmp(suffix, "seg") == 0)
+                    bases.push_back(base);
+            }
+            closedir(listing);
+        }
+        sort(bases.begin(), bases.end());
+        if (bases.empty())
+            return start_segment(1, error);
+        if (!ours(path_of(bases.back())))
+        {
+            error = room_dir + " holds the log of another room";
+            return false;
+        }
+        for (uint64_t base : bases)
+        {
+            Segment seg;
+            seg.base = base;
+            segments.push_back(seg);
+        }
+        // The newest segment is still being written unless it was cut
+        struct stat info;
+        string path = path_of(bases.back());
+        if (stat(path.c_str(), &info) == 0 && info.st_size == ROOMLOG_SEGMENT_BYTES)
+        {
+            if (!map_segment(path, false, active_id, map, error))
+                return false;
+            next = scan(segments.back(), map, ROOMLOG_SEGMENT_BYTES);
+            segments.back().index.reserve(ROOMLOG_INDEX_MAX);
+            // Clears what a torn record left, so no stale bytes follow the
+            // next one
+            size_t end = segments.back().end;
+            memset(map + end, 0, min(ROOMLOG_RECORD_MAX, ROOMLOG_SEGMENT_BYTES - end));
+            return true;
+        }
+        Segment &last = segments.back();
+        if (!view(last, [&](const char *data, size_t size) { next = scan(last, data, size); }))
+        {
+            error = path + ": " + strerror(errno);
+            return false;
+        }
+        return start_segment(next, error);
+    }
+
+public:
+    RoomLog() = default;
+    ~RoomLog() { close(); }
+
+    RoomLog(const RoomLog &) = delete;
+    RoomLog &operator=(const RoomLog &) = delete;
+
+    uint64_t next_seq() const { return next; }
+    size_t segment_count() const { return segments.size(); }
+
+    // Opens the log of room under dir, picking up where an earlier run left
+    // it, and prepares the spare. Returns false with error set if it cannot
+    // be written, or if the directory belongs to another room. Does all its
+    // work on the disk right away, so the server calls it on the worker.
+    bool open(const string &dir, const string &room_name, string &error)
+    {
+        if (!open_segments(dir, room_name, error))
+            return false;
+        prepare_spare();
+        return true;
+    }
+
+    // Appends a record: the MSG_SEQ frame for next_seq(), then the CHAT
+    // frame, of at least U64_FRAME_SIZE bytes. Returns false with error set if a new segment could not be
+    // started; the log is closed then.
+    bool append(const char *record, size_t size, string &error)
+    {
+        if (!map || size < U64_FRAME_SIZE || size > ROOMLOG_RECORD_MAX)
+        {
+            error = "record not logged";
+            return false;
+        }
+        if (segments.back().end + size > ROOMLOG_SEGMENT_BYTES && !rotate(error))
+        {
+            close();
+            return false;
+        }
+        // The number goes in last, so a record is only there once it is
+        // complete
+        Segment &seg = segments.back();
+        memcpy(map + seg.end + U64_FRAME_SIZE, record + U64_FRAME_SIZE, size - U64_FRAME_SIZE);
+        uint16_t flags = htons(FLAG_HISTORY);
+        memcpy(map + seg.end + U64_FRAME_SIZE + offsetof(FrameHeader, flags), &flags, sizeof flags);
+        memcpy(map + seg.end, record, U64_FRAME_SIZE);
+        if (seg.index.empty() || seg.end - seg.index.back().second >= ROOMLOG_INDEX_EVERY)
+            seg.index.emplace_back(next, seg.end);
+        seg.end += size;
+        next++;
+        return true;
+    }
+
+    // Adds the ranges of segment files holding every record from number
+    // from on, as far as the log goes now, each with its own descriptor.
+    // Numbers older than the oldest segment start from there. Returns false
+    // if a segment could not be opened.
+    bool ranges_from(uint64_t from, vector<LogRange> &out)
+    {
+        if (segments.empty() || from >= next)
+            return true;
+        from = max(from, segments.front().base);
+        auto seg = upper_bound(segments.begin(), segments.end(), from,
+                               [](uint64_t seq, const Segment &s) { return seq < s.base; });
+        --seg;
+        size_t added = 0;
+        for (auto at = seg; at != segments.end(); ++at)
+        {
+            Segment &s = *at;
+            bool active = map && &s == &segments.back();
+            size_t offset = header_size;
+            bool read = true;
+            if (active && at == seg)
+                offset = find(s, map, ROOMLOG_SEGMENT_BYTES, from);
+            else if (!active && (at == seg || s.end == 0))
+                read = view(s, [&](const char *data, size_t size) {
+                    if (s.end == 0)
+                        scan(s, data, size);
+                    if (at == seg)
+                        offset = find(s, data, size, from);
+                });
+            if (read && offset >= s.end)
+                continue;
+            // The active segment may not have its name yet
+            int file_id = !read    ? -1
+                          : active ? fcntl(active_id, F_DUPFD_CLOEXEC, 0)
+                                   : ::open(path_of(s.base).c_str(), O_RDONLY | O_CLOEXEC);
+            if (file_id == -1)
+            {
+                for (; added > 0; added--)
+                {
+                    ::close(out.back().fd);
+                    out.pop_back();
+                }
+                return false;
+            }
+            out.push_back({file_id, (off_t)offset, (off_t)s.end});
+            added++;
+        }
+        return true;
+    }
+
+    // Waits for the worker's jobs for this log, unmaps the segment being
+    // appended to, leaving it to be picked up by the next open(), and
+    // deletes the spare
+    void close()
+    {
+        if (pending > 0)
+            RoomLogWorker::instance().drain();
+        if (map)
+            munmap(map, ROOMLOG_SEGMENT_BYTES);
+        if (active_id != -1)
+            ::close(active_id);
+        map = NULL;
+        active_id = -1;
+        if (spare_map)
+        {
+            munmap(spare_map, ROOMLOG_SEGMENT_BYTES);
+            ::close(spare_id);
+            unlink(spare_path().c_str());
+        }
+        spare_map = NULL;
+        spare_id = -1;
+        spare_ready = false;
+    }
+};
+
+#endif
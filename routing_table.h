@@ -0,0 +1,390 @@
+/*
+ * routing_table.h
+ * Concurrent room -> server table for the Load Balancer
+ *
+ * The table is split into shards, each a hash table whose chains readers
+ * walk without taking any lock. A placement lives in a node that is never
+ * changed once published: writers, one at a time per shard, link in a new
+ * node with one atomic store and retire the one it replaced or removed (a
+ * small userspace RCU). A shard that fills up is rebuilt at twice the size
+ * and swapped in the same way. Retired nodes and bucket arrays are freed by a
+ * background thread once every reader that might still see them has
+ * finished, so a writer never waits for readers.
+ */
+#ifndef ROUTING_TABLE_H
+#define ROUTING_TABLE_H
+
+#include <bits/stdc++.h>
+
+using namespace std;
+
+#define RCU_MAX_THREADS 256
+#define ROUTING_SHARDS 64
+#define ROUTING_BUCKETS 16 // per shard to start with; doubles when it holds more rooms
+
+// Every reader thread owns one slot. The counter is odd while the thread is
+// inside a read-side critical section.
+struct alignas(64) RcuSlot
+{
+    atomic<uint64_t> counter{0};
+    atomic<bool> used{false};
+};
+
+class Rcu
+{
+    RcuSlot slots[RCU_MAX_THREADS];
+    atomic<int> highWater{0};
+
+    // Objects waiting for a grace period before they are freed
+    struct Retired
+    {
+        void (*free)(const void *);
+        const void *object;
+    };
+    mutex retireMutex;
+    condition_variable retireWake, freedWake;
+    vector<Retired> retired;
+    uint64_t retiredCount = 0, freedCount = 0;
+    thread reclaimer;
+
+    struct ThreadSlot
+    {
+        RcuSlot *slot = NULL;
+        int depth = 0;
+        ~ThreadSlot()
+        {
+            if (slot)
+                slot->used.store(false, memory_order_release);
+        }
+    };
+
+    RcuSlot *claim()
+    {
+        for (int i = 0; i < RCU_MAX_THREADS; i++)
+        {
+            bool expected = false;
+            if (!slots[i].used.load(memory_order_relaxed) &&
+                slots[i].used.compare_exchange_strong(expected, true))
+            {
+                int seen = highWater.load();
+                while (seen < i + 1 && !highWater.compare_exchange_weak(seen, i + 1))
+                    ;
+                return &slots[i];
+            }
+        }
+        cerr << "rcu: more than " << RCU_MAX_THREADS << " reader threads\n";
+        abort();
+    }
+
+    ThreadSlot &mine()
+    {
+        static thread_local ThreadSlot self;
+        if (!self.slot)
+            self.slot = claim();
+        return self;
+    }
+
+    // Frees what was retired, a batch per grace period; whatever is retired
+    // while one batch waits goes in the next
+    void reclaim_loop()
+    {
+        vector<Retired> batch; // swapped with retired, so neither reallocates once warm
+        unique_lock<mutex> lock(retireMutex);
+        while (true)
+        {
+            retireWake.wait(lock, [&] { return !retired.empty(); });
+            batch.swap(retired);
+            lock.unlock();
+            synchronize();
+            for (Retired &object : batch)
+                object.free(object.object);
+            lock.lock();
+            freedCount += batch.size();
+            batch.clear();
+            freedWake.notify_all();
+        }
+    }
+
+    Rcu() : reclaimer(&Rcu::reclaim_loop, this) {}
+
+public:
+    // Never destroyed, so threads still running at exit can go on using it
+    static Rcu &instance()
+    {
+        static Rcu *rcu = new Rcu();
+        return *rcu;
+    }
+
+    void read_lock()
+    {
+        ThreadSlot &self = mine();
+        if (self.depth++ == 0)
+        {
+            self.slot->counter.store(self.slot->counter.load(memory_order_relaxed) + 1);
+            // Pairs with the fence in synchronize(): either it sees the
+            // section, or the section sees everything written before it
+            atomic_thread_fence(memory_order_seq_cst);
+        }
+    }
+
+    void read_unlock()
+    {
+        ThreadSlot &self = mine();
+        if (--self.depth == 0)
+            self.slot->counter.store(self.slot->counter.load(memory_order_relaxed) + 1,
+                                     memory_order_release);
+    }
+
+    // Waits until every read-side critical section that was running when
+    // this was called has finished. Must not be called from inside one.
+    void synchronize()
+    {
+        atomic_thread_fence(memory_order_seq_cst);
+        int slotsInUse = highWater.load();
+        for (int i = 0; i < slotsInUse; i++)
+        {
+            uint64_t seen = slots[i].counter.load();
+            if (!(seen & 1))
+                continue;
+            while (slots[i].counter.load(memory_order_acquire) == seen)
+                this_thread::yield();
+        }
+    }
+
+    // Deletes object once every read-side critical section that was running
+    // when this was called has finished, without waiting for them. May be
+    // called from inside one.
+    template <class T>
+    void retire(const T *object)
+    {
+        {
+            lock_guard<mutex> guard(retireMutex);
+            retired.push_back({[](const void *p) { delete (const T *)p; }, object});
+            retiredCount++;
+        }
+        retireWake.notify_one();
+    }
+
+    // Waits until everything retired before this call has been freed
+    void barrier()
+    {
+        unique_lock<mutex> lock(retireMutex);
+        uint64_t target = retiredCount;
+        freedWake.wait(lock, [&] { return freedCount >= target; });
+    }
+};
+
+struct RcuReadGuard
+{
+    RcuReadGuard() { Rcu::instance().read_lock(); }
+    ~RcuReadGuard() { Rcu::instance().read_unlock(); }
+};
+
+class RoutingTable
+{
+    // A placement. A move publishes a new node in the old one's place.
+    struct Node
+    {
+        const string room;
+        const int server;
+        atomic<Node *> next;
+
+        Node(const string &room, int server, Node *next) : room(room), server(server), next(next) {}
+    };
+
+    // A shard's chains. Owns the nodes linked from it.
+    struct Buckets
+    {
+        const size_t mask; // bucket count - 1, a power of two
+        unique_ptr<atomic<Node *>[]> heads;
+
+        explicit Buckets(size_t count) : mask(count - 1), heads(new atomic<Node *>[count])
+        {
+            for (size_t i = 0; i < count; i++)
+                heads[i].store(NULL, memory_order_relaxed);
+        }
+        ~Buckets()
+        {
+            for (size_t i = 0; i <= mask; i++)
+                for (Node *node = heads[i].load(memory_order_relaxed), *next; node; node = next)
+                {
+                    next = node->next.load(memory_order_relaxed);
+                    delete node;
+                }
+        }
+
+        // The shard index takes the hash's low bits, the bucket the next ones
+        atomic<Node *> &head(size_t hash) { return heads[(hash / ROUTING_SHARDS) & mask]; }
+    };
+
+    struct alignas(64) Shard
+    {
+        atomic<Buckets *> buckets{new Buckets(ROUTING_BUCKETS)};
+        atomic<size_t> count{0};
+        mutex write_mutex;
+    };
+    Shard shards[ROUTING_SHARDS];
+
+    static size_t hash_of(const string &room) { return hash<string>()(room); }
+
+    // Inside a read-side critical section
+    static const Node *find(const Shard &shard, const string &room, size_t hash)
+    {
+        for (const Node *node = shard.buckets.load(memory_order_acquire)->head(hash).load(memory_order_acquire); node;
+             node = node->next.load(memory_order_acquire))
+            if (node->room == room)
+                return node;
+        return NULL;
+    }
+
+    // Under the shard's write_mutex: the link that points at the room's node,
+    // or the null link at the end of its chain
+    static atomic<Node *> &link_of(Shard &shard, const string &room, size_t hash)
+    {
+        atomic<Node *> *link = &shard.buckets.load(memory_order_relaxed)->head(hash);
+        for (Node *node; (node = link->load(memory_order_relaxed)) && node->room != room;)
+            link = &node->next;
+        return *link;
+    }
+
+    // Puts a node with the room's new server where the old one was
+    static void replace(atomic<Node *> &link, int server)
+    {
+        Node *old = link.load(memory_order_relaxed);
+        link.store(new Node(old->room, server, old->next.load(memory_order_relaxed)), memory_order_release);
+        Rcu::instance().retire(old);
+    }
+
+    // Once a shard holds more rooms than buckets, copies it into twice as
+    // many; readers still in the old copy finish there
+    static void grow_if_full(Shard &shard)
+    {
+        Buckets *old = shard.buckets.load(memory_order_relaxed);
+        if (shard.count.load(memory_order_relaxed) <= old->mask + 1)
+            return;
+        Buckets *bigger = new Buckets((old->mask + 1) * 2);
+        for (size_t i = 0; i <= old->mask; i++)
+            for (Node *node = old->heads[i].load(memory_order_relaxed); node;
+                 node = node->next.load(memory_order_relaxed))
+            {
+                atomic<Node *> &head = bigger->head(hash_of(node->room));
+                head.store(new Node(node->room, node->server, head.load(memory_order_relaxed)),
+                           memory_order_relaxed);
+            }
+        shard.buckets.store(bigger, memory_order_release);
+        Rcu::instance().retire(old);
+    }
+
+public:
+    ~RoutingTable()
+    {
+        for (Shard &shard : shards)
+            delete shard.buckets.load();
+    }
+
+    // Wait-free: never blocks, even while the room's shard is being written
+    bool lookup(const string &room, int &server) const
+    {
+        RcuReadGuard guard;
+        size_t hash = hash_of(room);
+        const Node *node = find(shards[hash % ROUTING_SHARDS], room, hash);
+        if (!node)
+            return false;
+        server = node->server;
+        return true;
+    }
+
+    // Places the room on server unless another thread placed it first.
+    // Returns the server the room ended up on.
+    int insert(const string &room, int server)
+    {
+        size_t hash = hash_of(room);
+        Shard &shard = shards[hash % ROUTING_SHARDS];
+        lock_guard<mutex> guard(shard.write_mutex);
+        atomic<Node *> &link = link_of(shard, room, hash);
+        if (Node *placed = link.load(memory_order_relaxed))
+            return placed->server;
+        link.store(new Node(room, server, NULL), memory_order_release);
+        shard.count.fetch_add(1, memory_order_relaxed);
+        grow_if_full(shard);
+        return server;
+    }
+
+    // Places the room on server, replacing any earlier placement
+    void assign(const string &room, int server)
+    {
+        size_t hash = hash_of(room);
+        Shard &shard = shards[hash % ROUTING_SHARDS];
+        lock_guard<mutex> guard(shard.write_mutex);
+        atomic<Node *> &link = link_of(shard, room, hash);
+        Node *placed = link.load(memory_order_relaxed);
+        if (placed && placed->server == server)
+            return;
+        if (placed)
+        {
+            replace(link, server);
+            return;
+        }
+        link.store(new Node(room, server, NULL), memory_order_release);
+        shard.count.fetch_add(1, memory_order_relaxed);
+        grow_if_full(shard);
+    }
+
+    // Forgets the room, but only if it is still placed on server
+    bool erase(const string &room, int server)
+    {
+        size_t hash = hash_of(room);
+        Shard &shard = shards[hash % ROUTING_SHARDS];
+        lock_guard<mutex> guard(shard.write_mutex);
+        atomic<Node *> &link = link_of(shard, room, hash);
+        Node *placed = link.load(memory_order_relaxed);
+        if (!placed || placed->server != server)
+            return false;
+        link.store(placed->next.load(memory_order_relaxed), memory_order_release);
+        shard.count.fetch_sub(1, memory_order_relaxed);
+        Rcu::instance().retire(placed);
+        return true;
+    }
+
+    // Moves the room from one server to another in a single step, but only
+    // if it is still placed on from
+    bool move(const string &room, int from, int to)
+    {
+        size_t hash = hash_of(room);
+        Shard &shard = shards[hash % ROUTING_SHARDS];
+        lock_guard<mutex> guard(shard.write_mutex);
+        atomic<Node *> &link = link_of(shard, room, hash);
+        Node *placed = link.load(memory_order_relaxed);
+        if (!placed || placed->server != from)
+            return false;
+        replace(link, to);
+        return true;
+    }
+
+    size_t size() const
+    {
+        size_t total = 0;
+        for (const Shard &shard : shards)
+            total += shard.count.load(memory_order_relaxed);
+        return total;
+    }
+
+    // Calls visit(room, server) for every room, shard by shard. visit may
+    // write to the table; whether it then sees its own writes depends on
+    // whether it has reached their chain yet.
+    template <class Visit>
+    void for_each(Visit visit) const
+    {
+        RcuReadGuard guard;
+        for (const Shard &shard : shards)
+        {
+            const Buckets *buckets = shard.buckets.load(memory_order_acquire);
+            for (size_t i = 0; i <= buckets->mask; i++)
+                for (const Node *node = buckets->heads[i].load(memory_order_acquire); node;
+                     node = node->next.load(memory_order_acquire))
+                    visit(node->room, node->server);
+        }
+    }
+};
+
+#endif
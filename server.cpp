@@ -1,218 +1,1533 @@
 /*
  * server.cpp
  * Server for Chat Room
+ *
+ * A fixed pool of reactor threads, each pinned to its own core, serves every
+ * connection with edge-triggered epoll. The accept thread deals new
+ * connections out round robin; once a client names its room it moves to the
+ * reactor that owns the room, so the room's member list and its fan-out all
+ * stay on one core and need no locks.
+ *
+ * With -u the reactors run on io_uring instead (see uring.h): every reactor
+ * keeps a multishot accept on the listening socket, receives land in a
+ * provided buffer ring, sockets are registered files and each flush is one
+ * chain of linked sendmsg requests. The handlers are the same for both.
+ *
+ * With -M the server serves its counters on http://127.0.0.1:<port>/metrics
+ * (see metrics.h). Joins, leaves and load queries are logged at -L debug.
+ *
+ * With -K the server shares a key with the balancer and admits only clients
+ * that show a routing token for their room (see token.h). A fresh token
+ * admits any room; an older one only a room the server already knows, so a
+ * reconnecting client can skip the balancer without reviving a room that
+ * was never placed here.
+ *
+ * Each reactor keeps the last -H chat messages of its rooms (see history.h)
+ * and sends them to every client that joins, ahead of live traffic. The
+ * histories of all rooms share a budget of -m MB, split between the
+ * reactors; rooms that went quiet are dropped first to stay within it.
+ *
+ * With -D the server also numbers each room's chat messages and logs them
+ * to disk (see roomlog.h), sending the number ahead of each message. A
+ * client that reconnects with MSG_RESUME ahead of its HELLO is sent what it
+ * missed from the log with sendfile() instead of the in-memory history, even
+ * after a restart of the server. Logs are opened on the room log worker and
+ * handed back to the reactor; until a room's log arrives its messages go
+ * unnumbered and joiners are sent its history.
  */
 #include <bits/stdc++.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <netinet/in.h>
 #include <errno.h>
 #include <string.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/resource.h>
 #include <thread>
 #include <mutex>
+#include "log.h"
+#include "metrics.h"
+#include "protocol.h"
+#include "outbox.h"
+#include "uring.h"
+#include "token.h"
+#include "history.h"
+#include "roomlog.h"
 using namespace std;
-#define MAX_LEN 256
 #define NUM_COLORS 6
+#define BACKLOG SOMAXCONN
+#define MAX_EVENTS 256
+#define READ_CHUNK 16384     // bytes asked of each recv()
+#define CONGESTION_CHECK 100 // ms between backpressure timeout checks
+#define URING_ENTRIES 1024
+#define URING_BUFFERS 512       // provided receive buffers per reactor
+#define URING_BUFFER_SIZE 8192
+#define URING_FILES 16384       // registered file slots per reactor
+#define LINKED_SENDS 4          // sendmsg requests chained per flush
+#define ROOM_REPORT_MAX 32      // largest rooms listed in a MSG_ROOM_REPLY
+#define LOAD_WINDOW_MIN 100     // ms; load queries closer together reuse the last rates
 string default_colour = "\033[0m";
 string colors[] = {"\033[31m", "\033[32m", "\033[33m", "\033[34m", "\033[35m", "\033[36m"};
-int client_index_count = 0;
-mutex cout_mutex, clients_mutex;
+atomic<int> client_index_count{0};
+bool use_uring = false;
+atomic<int> active_clients{0}; // clients that have joined a room
+mutex room_sizes_mutex;
+unordered_map<string, int> room_sizes; // members per room, across reactors, for the balancer
+int cpu_count = 1;                     // CPUs this process may run on
+int server_port = 0;
+RouteKey route_key; // set with -K; then HELLOs need a routing token
+size_t history_messages = HISTORY_MESSAGES;              // kept per room, -H
+size_t history_budget = (size_t)HISTORY_MEMORY_MB << 20; // -m, per reactor once main has split it
+string log_dir;                                          // -D; rooms are logged there if set
 
-using namespace std;
+Counter &accepts_total = metrics.counter("chat_accepts_total", "Connections accepted.");
+Counter &messages_in = metrics.counter("chat_messages_in_total", "Chat messages received from clients.");
+Counter &messages_out = metrics.counter("chat_messages_out_total", "Chat messages queued to room members.");
+Counter &bytes_in = metrics.counter("chat_bytes_in_total", "Bytes of chat frames received from clients.");
+Counter &bytes_out = metrics.counter("chat_bytes_out_total", "Bytes of chat frames queued to room members.");
+Counter &token_rejects =
+    metrics.counter("chat_token_rejects_total", "Clients refused for a missing, bad or stale routing token.");
+Counter &resumes = metrics.counter("chat_resumes_total", "Clients sent what they missed from a room's log.");
+Counter &resume_bytes = metrics.counter("chat_resume_bytes_total", "Bytes sent to resuming clients from room logs.");
+Counter &history_evictions =
+    metrics.counter("chat_history_evictions_total", "Room histories dropped to stay within the -m budget.");
+LatencyHistogram &batch_latency =
+    metrics.histogram("chat_batch_seconds", "Time a reactor spends on one batch of events, flushes included.");
+
+enum conn_state
+{
+    CONN_HANDSHAKE, // waiting for HELLO (maybe after a ROUTE_TOKEN or RESUME), PING, LOAD_QUERY or CONTROL
+    CONN_CHAT,      // named and in (or on its way to) its room
+    CONN_CONTROL,   // the load balancer's control connection
+};
 
-struct Client
+struct Connection : Pooled
 {
     int client_id;
-    string client_name;
-    string client_room;
-    int client_socket;
-    thread client_thread;
+    string client_name = "Anonymous";
+    string room_name;
+    uint32_t room_id = 0;
+    conn_state state = CONN_HANDSHAKE;
+    int client_room = -1;  // index into the reactor's rooms, -1 until joined
+    int room_position = 0; // index of this client in its room's member list
+    bool closing = false;  // released once the current event batch is done
+    bool dirty = false;    // has queued frames to flush
+    bool paused = false;   // not read while its room is congested
+    bool congested = false;
+    bool migrating = false; // sent to another server; leaves without a notice
+    bool has_token = false; // a MSG_ROUTE_TOKEN came ahead of the HELLO
+    route_check route = ROUTE_BAD;
+    char route_token[ROUTE_TOKEN_SIZE];
+    bool has_resume = false; // a MSG_RESUME came ahead of the HELLO
+    uint64_t resume_from = 0;
+    vector<LogRange> catch_up; // of the room's log, sent ahead of the outbox
+    size_t counted_queue = 0; // outbox bytes included in the reactor's queued total
+    chrono::steady_clock::time_point congested_since;
+    FrameDecoder decoder;
+    Outbox outbox; // owns the socket
+
+    // io_uring backend only
+    int file_slot = -1;      // registered file, -1 if the plain fd is used
+    bool recv_armed = false; // a receive request is queued
+    bool poll_armed = false; // waiting for a full socket to become writable
+    int pending = 0;         // queued requests that point at this connection
+    bool moving = false;     // hand off to the room's reactor once pending is 0
+    bool released = false;   // delete once pending is 0
+    unique_ptr<struct SendChain> chain;
+
+    Connection(int socket_id, int id) : client_id(id), outbox(socket_id) {}
+    ~Connection() { close_log_ranges(catch_up); }
+};
+
+// The linked sendmsg requests of one io_uring flush
+struct SendChain : Pooled
+{
+    struct iovec iov[LINKED_SENDS * FLUSH_BATCH];
+    struct msghdr msg[LINKED_SENDS];
+    int parts = 0; // requests still running
+    size_t written = 0;
+    bool failed = false;
+};
+
+// io_uring requests carry the connection they are for, tagged in the low bits
+enum uring_tag
+{
+    TAG_WAKE,   // read of the handoff eventfd
+    TAG_ACCEPT, // multishot accept on the listening socket
+    TAG_RECV,
+    TAG_SEND,
+    TAG_WRITABLE,
+    TAG_IGNORE, // cancels, nothing to do when they complete
 };
-vector<Client> clients;
-string color(int code);
 
-void handle_client_connection(int client_socket, int id);
+inline uint64_t tagged(Connection *conn, uring_tag tag) { return (uint64_t)conn | tag; }
+
+struct Room
+{
+    string room_name;
+    vector<Connection *> members;
+    int congested = 0;           // members over their queue limit (backpressure)
+    vector<Connection *> paused; // senders waiting for them to catch up
+    unique_ptr<RoomLog> log;     // with -D, open while the room has members
+};
+
+// The server the balancer sent a room to
+struct Destination
+{
+    int port = 0; // 0 when it is this server
+    string host;  // as the balancer's ASSIGNs name it
+};
+
+class Reactor
+{
+    int epoll_id = -1, wake_id, listen_id = -1;
+    unique_ptr<IoUring> ring; // set when running on io_uring
+    uint64_t wake_value;
+    vector<int> free_files; // unused registered file slots
+    mutex handoff_mutex;
+    vector<Connection *> handoffs; // connections moving in from other threads
+    vector<pair<string, Destination>> room_tasks; // rooms placed here (port 0) or moved to another server
+    vector<pair<string, RoomLog *>> opened_logs;  // from the room log worker, NULL if one could not be opened
+
+    // Rooms live in reusable slots and keep the members of their room, all
+    // owned by this reactor's thread
+    vector<Room> rooms;
+    vector<int> free_rooms;
+    unordered_map<string, int> room_index; // interned room name -> index into rooms
+    unordered_map<string, Destination> moved_rooms; // room name -> server its clients are sent to
+    unordered_set<string> routed_rooms;     // with -K: rooms placed or joined here, for older tokens
+    unordered_set<string> logs_opening;     // rooms whose log the worker is opening
+    HistoryCache histories;                 // recent messages of this reactor's rooms
+
+    vector<Connection *> dirty;     // outboxes to flush after this event batch
+    vector<Connection *> flushing;  // dirty swapped out, so both keep their capacity
+    vector<Connection *> doomed;    // connections to release after this event batch
+    vector<Connection *> congested; // over their queue limit, oldest first
+
+    void run();
+    void run_uring();
+    void adopt_handoffs();
+    void adopt(Connection *conn);
+    void move_to_owner(Connection *conn);
+    void on_readable(Connection *conn);
+    void on_writable(Connection *conn);
+    void on_completion(const struct io_uring_cqe &cqe);
+    void on_recv(Connection *conn, const struct io_uring_cqe &cqe);
+    void on_sent(Connection *conn, const struct io_uring_cqe &cqe);
+    void after_send(Connection *conn);
+    void arm_recv(Connection *conn);
+    void arm_writable(Connection *conn);
+    void stop_recv(Connection *conn);
+    void submit_send(Connection *conn);
+    void forget_file(Connection *conn);
+    bool finish_pending(Connection *conn);
+    void mark_dirty(Connection *conn);
+    bool process_frames(Connection *conn);
+    bool handshake(Connection *conn, const Frame &frame);
+    void answer_control(Connection *conn, const Frame &frame);
+    void run_room_task(const string &room, const Destination &to);
+    void redirect(Connection *conn, const Destination &to);
+    bool join_room(Connection *conn);
+    void leave_room(Connection *conn);
+    void broadcast(int room, const Message &message, Connection *sender);
+    void broadcast_notice(const string &text, Connection *sender);
+    void keep_history(const string &room, const char *frame, size_t size);
+    void open_log(const string &room);
+    void adopt_log(const string &room, RoomLog *log);
+    bool replay_to(Connection *conn);
+    bool send_catch_up(Connection *conn);
+    void set_congested(Connection *conn, bool over);
+    void resume_room(int room);
+    void close_connection(Connection *conn);
+    void release(Connection *conn);
+    void expire_congested();
+    void count_queue(Connection *conn);
+    void settle();
+
+public:
+    // Written only by the reactor's thread, summed for load reports
+    atomic<int64_t> queued_bytes{0}; // in this reactor's outboxes
+    atomic<int64_t> history_bytes{0}; // held by its room histories
 
+    Reactor();
+    void start(int cpu, int listen_socket);
+    void hand_off(Connection *conn);
+    void post_room_task(const string &room, const Destination &to);
+    void post_log(const string &room, RoomLog *log);
+};
+
+// Closes and deletes a room's log on the worker, which may have to write it
+void drop_log(RoomLog *log)
+{
+    if (log)
+        RoomLogWorker::instance().post([log] { delete log; });
+}
+
+vector<unique_ptr<Reactor>> reactors;
+
+string color(int code) { return colors[code % NUM_COLORS]; }
+
+// Every room is served by exactly one reactor
+Reactor *reactor_of(uint32_t room_id) { return reactors[room_id % reactors.size()].get(); }
+
+// The load vector sent to the balancer. Rates cover the time since the
+// previous query, whichever connection asked.
+LoadReport current_load()
+{
+    static mutex sample_mutex;
+    static chrono::steady_clock::time_point sampled_at = chrono::steady_clock::now();
+    static uint64_t messages = 0, bytes = 0;
+    static double cpu_seconds = 0;
+    static LoadReport rates;
+
+    LoadReport report;
+    report.users = active_clients;
+    {
+        lock_guard<mutex> guard(room_sizes_mutex);
+        report.rooms = room_sizes.size();
+    }
+    uint64_t total_messages = messages_in.value(), total_bytes = bytes_out.value();
+    int64_t queued = 0;
+    for (auto &reactor : reactors)
+        queued += reactor->queued_bytes.load(memory_order_relaxed);
+    report.queued_bytes = (uint32_t)min(max(queued, (int64_t)0), (int64_t)UINT32_MAX);
+
+    lock_guard<mutex> guard(sample_mutex);
+    auto now = chrono::steady_clock::now();
+    double elapsed = chrono::duration<double>(now - sampled_at).count();
+    if (elapsed * 1000 >= LOAD_WINDOW_MIN)
+    {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        double cpu_now = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+                         (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+        rates.messages_per_sec = (total_messages - messages) / elapsed;
+        rates.bytes_per_sec = min((total_bytes - bytes) / elapsed, (double)UINT32_MAX);
+        rates.cpu_permille = min(1000.0, (cpu_now - cpu_seconds) / elapsed / cpu_count * 1000);
+        sampled_at = now;
+        messages = total_messages;
+        bytes = total_bytes;
+        cpu_seconds = cpu_now;
+    }
+    report.messages_per_sec = rates.messages_per_sec;
+    report.bytes_per_sec = rates.bytes_per_sec;
+    report.cpu_permille = rates.cpu_permille;
+    return report;
+}
+
+// Parses the -p flag. Returns false for an unknown policy name.
+bool parse_policy(const string &name, overflow_policy &policy)
+{
+    if (name == "drop-oldest")
+        policy = DROP_OLDEST;
+    else if (name == "disconnect")
+        policy = DISCONNECT_SLOW;
+    else if (name == "backpressure")
+        policy = BACKPRESSURE;
+    else
+        return false;
+    return true;
+}
+
+// Gauges and the outbox counters, read at scrape time
+void register_metrics()
+{
+    metrics.gauge("chat_clients", "Clients in a room.", [] { return (double)active_clients.load(); });
+    metrics.gauge("chat_rooms", "Rooms with at least one member.", [] {
+        lock_guard<mutex> guard(room_sizes_mutex);
+        return (double)room_sizes.size();
+    });
+    metrics.gauge("chat_queued_bytes", "Bytes waiting in client outboxes.", [] {
+        int64_t queued = 0;
+        for (auto &reactor : reactors)
+            queued += reactor->queued_bytes.load(memory_order_relaxed);
+        return (double)max(queued, (int64_t)0);
+    });
+    metrics.gauge("chat_history_bytes", "Memory held by room histories.", [] {
+        int64_t held = 0;
+        for (auto &reactor : reactors)
+            held += reactor->history_bytes.load(memory_order_relaxed);
+        return (double)held;
+    });
+    metrics.counter("chat_dropped_frames_total", "Frames dropped from full outboxes (-p drop-oldest).",
+                    [] { return outbox_counters.dropped_frames.load(); });
+    metrics.counter("chat_slow_disconnects_total", "Clients disconnected for not reading their messages.",
+                    [] { return outbox_counters.slow_disconnects.load(); });
+    metrics.counter("chat_backpressure_waits_total", "Times a sender was paused for a slow room member.",
+                    [] { return outbox_counters.backpressure_waits.load(); });
+}
+
+// Left out when a test builds this file in (test_alloc_*.cpp)
+#ifndef NO_MAIN
 int main(int argc, char *argv[])
 {
-    int PORT = argc > 1 ? atoi(argv[1]) : 0;
+    // Reactors are pinned to the CPUs this process may run on
+    cpu_set_t allowed;
+    vector<int> cpus;
+    CPU_ZERO(&allowed);
+    sched_getaffinity(0, sizeof allowed, &allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        if (CPU_ISSET(cpu, &allowed))
+            cpus.push_back(cpu);
+    cpu_count = max((int)cpus.size(), 1);
+    int reactorThreads = max((int)cpus.size(), 1), metrics_port = 0, opt;
+    while ((opt = getopt(argc, argv, "t:q:p:uM:L:K:H:m:D:")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            reactorThreads = max(1, atoi(optarg));
+            break;
+        case 'u':
+            use_uring = true;
+            break;
+        case 'q':
+            outbox_config.max_bytes = max(atoi(optarg), 1) * (size_t)1024;
+            break;
+        case 'M':
+            metrics_port = atoi(optarg);
+            break;
+        case 'H':
+            history_messages = max(atoi(optarg), 0);
+            break;
+        case 'm':
+            history_budget = (size_t)max(atoi(optarg), 1) << 20;
+            break;
+        case 'D':
+            log_dir = optarg;
+            if (mkdir(optarg, 0755) == -1 && errno != EEXIST)
+            {
+                perror(optarg);
+                exit(-1);
+            }
+            break;
+        case 'K':
+        {
+            string error;
+            if (!load_route_key(optarg, route_key, error))
+            {
+                cerr << "Routing key: " << error << "\n";
+                exit(-1);
+            }
+            break;
+        }
+        case 'L':
+        {
+            int level;
+            if (!parse_log_level(optarg, level))
+            {
+                cerr << "Bad log level: " << optarg << " (error, warn, info or debug)\n";
+                exit(-1);
+            }
+            log_threshold = level;
+            break;
+        }
+        case 'p':
+            if (parse_policy(optarg, outbox_config.policy))
+                break;
+            // fall through
+        default:
+            cerr << "Usage: " << argv[0]
+                 << " [-t reactor_threads] [-u] [-q queue KB] [-p drop-oldest|disconnect|backpressure]"
+                 << " [-M metrics_port] [-L error|warn|info|debug] [-K route_key_file] [-H history_messages]"
+                 << " [-m history_MB] [-D log_dir] <port>\n";
+            exit(-1);
+        }
+    }
+    if (use_uring && !IoUring::available())
+    {
+        cout << "io_uring is not usable on this kernel, falling back to epoll\n";
+        use_uring = false;
+    }
+    int PORT = optind < argc ? atoi(argv[optind]) : 0;
     if (!PORT)
     {
         cout << "Enter Port: \n";
         cin >> PORT;
     }
-    int server_socket;
+    server_port = PORT;
+    int server_socket, enable = 1;
     if ((server_socket = socket(AF_INET, SOCK_STREAM, 0)) == -1)
     {
         perror("Socket: ");
         exit(-1);
     }
+    setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof enable);
     struct sockaddr_in server;
+    memset(&server, 0, sizeof server);
     server.sin_family = AF_INET;
     server.sin_port = htons(PORT);
     server.sin_addr.s_addr = INADDR_ANY;
-    bzero(&server.sin_zero, 0);
 
     if ((bind(server_socket, (struct sockaddr *)&server, sizeof(struct sockaddr_in))) == -1)
     {
         perror("Bind error: ");
         exit(-1);
     }
-    if ((listen(server_socket, 8)) == -1)
+    if ((listen(server_socket, BACKLOG)) == -1)
     {
         perror("Listen error: ");
         exit(-1);
     }
+    signal(SIGPIPE, SIG_IGN); // io_uring sends cannot pass MSG_NOSIGNAL on every kernel
+
+    register_metrics();
+    static MetricsServer metrics_server;
+    if (metrics_port > 0 && !metrics_server.start(metrics_port))
+    {
+        perror("Metrics port: ");
+        exit(-1);
+    }
+
+    history_budget /= reactorThreads;
+    for (int i = 0; i < reactorThreads; i++)
+        reactors.emplace_back(new Reactor());
+    for (int i = 0; i < reactorThreads; i++)
+        reactors[i]->start(cpus.empty() ? -1 : cpus[i % cpus.size()], use_uring ? server_socket : -1);
+
     struct sockaddr_in client;
     int client_socket;
     unsigned int len = sizeof(sockaddr_in);
     cout << colors[NUM_COLORS - 1] << "\n\t************CHAT ROOM SERVER: " << PORT << "************" << "\n"
          << default_colour;
+    if (use_uring)
+    {
+        cout << "I/O backend: io_uring\n";
+        while (true)
+            pause(); // the reactors accept for themselves
+    }
+    // Until HELLO names the room, connections are dealt out round robin
     while (true)
     {
-        if ((client_socket = accept(server_socket, (struct sockaddr *)&client, &len)) == -1)
+        if ((client_socket = accept4(server_socket, (struct sockaddr *)&client, &len, SOCK_NONBLOCK)) == -1)
         {
             perror("Accept error: ");
             continue;
         }
-        client_index_count++;
-        thread connection_thread(handle_client_connection, client_socket, client_index_count);
-        lock_guard<mutex> guard(clients_mutex);
-        clients.push_back({client_index_count, string("Anonymous"), "0", client_socket, (move(connection_thread))});
-    }
-    for (int i = 0; i < clients.size(); i++)
-    {
-        if (clients[i].client_thread.joinable())
-            clients[i].client_thread.join();
+        accepts_total.add();
+        int id = ++client_index_count;
+        reactors[id % reactors.size()]->hand_off(new Connection(client_socket, id));
     }
     close(server_socket);
     return 0;
 }
+#endif
 
-string color(int code) { return colors[code % NUM_COLORS]; }
+Reactor::Reactor()
+{
+    if ((wake_id = eventfd(0, EFD_NONBLOCK)) == -1)
+    {
+        perror("reactor: ");
+        exit(-1);
+    }
+    histories.max_messages = history_messages;
+    histories.budget = history_budget;
+    if (use_uring)
+        return;
+    if ((epoll_id = epoll_create1(0)) == -1)
+    {
+        perror("reactor: ");
+        exit(-1);
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL; // the wakeup eventfd
+    epoll_ctl(epoll_id, EPOLL_CTL_ADD, wake_id, &event);
+}
 
-void set_Client(int id, char name[], char room[])
+// listen_socket is only used by io_uring reactors, which accept themselves
+void Reactor::start(int cpu, int listen_socket)
 {
-    for (int i = 0; i < clients.size(); i++)
+    listen_id = listen_socket;
+    thread worker(&Reactor::run, this);
+    if (cpu >= 0)
     {
-        if (clients[i].client_id == id)
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (pthread_setaffinity_np(worker.native_handle(), sizeof set, &set) != 0)
+            LOG(LOG_WARN, "Could not pin a reactor to CPU " << cpu);
+    }
+    worker.detach();
+}
+
+// Passes a connection to this reactor. Safe to call from any thread.
+void Reactor::hand_off(Connection *conn)
+{
+    {
+        lock_guard<mutex> guard(handoff_mutex);
+        handoffs.push_back(conn);
+    }
+    uint64_t one = 1;
+    if (write(wake_id, &one, sizeof one) == -1 && errno != EAGAIN)
+        perror("eventfd: ");
+}
+
+// Passes a placement or migration of one of this reactor's rooms. Safe to
+// call from any thread.
+void Reactor::post_room_task(const string &room, const Destination &to)
+{
+    {
+        lock_guard<mutex> guard(handoff_mutex);
+        room_tasks.emplace_back(room, to);
+    }
+    uint64_t one = 1;
+    if (write(wake_id, &one, sizeof one) == -1 && errno != EAGAIN)
+        perror("eventfd: ");
+}
+
+// Passes the log the worker opened for one of this reactor's rooms. Safe to
+// call from any thread.
+void Reactor::post_log(const string &room, RoomLog *log)
+{
+    {
+        lock_guard<mutex> guard(handoff_mutex);
+        opened_logs.emplace_back(room, log);
+    }
+    uint64_t one = 1;
+    if (write(wake_id, &one, sizeof one) == -1 && errno != EAGAIN)
+        perror("eventfd: ");
+}
+
+void Reactor::run()
+{
+    if (use_uring)
+    {
+        run_uring();
+        return;
+    }
+    struct epoll_event events[MAX_EVENTS];
+    while (true)
+    {
+        int ready = epoll_wait(epoll_id, events, MAX_EVENTS, congested.empty() ? -1 : CONGESTION_CHECK);
+        if (ready == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait: ");
+            exit(-1);
+        }
+        auto batch_start = chrono::steady_clock::now();
+        for (int i = 0; i < ready; i++)
         {
-            clients[i].client_name = string(name);
-            clients[i].client_room = string(room);
+            Connection *conn = (Connection *)events[i].data.ptr;
+            if (!conn)
+            {
+                uint64_t wakeups;
+                if (read(wake_id, &wakeups, sizeof wakeups) == -1 && errno != EAGAIN)
+                    perror("eventfd: ");
+                adopt_handoffs();
+                continue;
+            }
+            if (conn->closing)
+                continue;
+            if (events[i].events & EPOLLOUT)
+                on_writable(conn);
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                on_readable(conn);
+        }
+        expire_congested();
+        settle();
+        batch_latency.record(chrono::steady_clock::now() - batch_start);
+    }
+}
+
+void Reactor::run_uring()
+{
+    ring.reset(new IoUring());
+    if (!ring->init(URING_ENTRIES, URING_BUFFERS, URING_BUFFER_SIZE, URING_FILES))
+    {
+        perror("io_uring: ");
+        exit(-1);
+    }
+    for (int slot = URING_FILES - 1; slot >= 0; slot--)
+        free_files.push_back(slot);
+    ring->read(wake_id, &wake_value, sizeof wake_value, tagged(NULL, TAG_WAKE));
+    ring->accept_multishot(listen_id, tagged(NULL, TAG_ACCEPT), false);
+    while (true)
+    {
+        // Submitting the batch's sends and waiting for more work is one syscall
+        ring->submit(1, congested.empty() ? -1 : CONGESTION_CHECK);
+        auto batch_start = chrono::steady_clock::now();
+        ring->for_each_cqe([&](const struct io_uring_cqe &cqe) { on_completion(cqe); });
+        expire_congested();
+        settle();
+        batch_latency.record(chrono::steady_clock::now() - batch_start);
+    }
+}
+
+void Reactor::on_completion(const struct io_uring_cqe &cqe)
+{
+    Connection *conn = (Connection *)(cqe.user_data & ~(uint64_t)7);
+    switch (cqe.user_data & 7)
+    {
+    case TAG_WAKE:
+        adopt_handoffs();
+        ring->read(wake_id, &wake_value, sizeof wake_value, tagged(NULL, TAG_WAKE));
+        break;
+    case TAG_ACCEPT:
+        if (cqe.res >= 0)
+        {
+            accepts_total.add();
+            adopt(new Connection(cqe.res, ++client_index_count));
         }
+        else
+            LOG(LOG_ERROR, "Accept error: " << strerror(-cqe.res));
+        if (!(cqe.flags & IORING_CQE_F_MORE))
+            ring->accept_multishot(listen_id, tagged(NULL, TAG_ACCEPT), false);
+        break;
+    case TAG_RECV:
+        on_recv(conn, cqe);
+        break;
+    case TAG_SEND:
+        on_sent(conn, cqe);
+        break;
+    case TAG_WRITABLE:
+        conn->poll_armed = false;
+        conn->pending--;
+        if (!finish_pending(conn) && !conn->closing)
+            on_writable(conn);
+        break;
+    }
+}
+
+void Reactor::on_recv(Connection *conn, const struct io_uring_cqe &cqe)
+{
+    if (!(cqe.flags & IORING_CQE_F_MORE))
+    {
+        conn->recv_armed = false;
+        conn->pending--;
+    }
+    if (cqe.flags & IORING_CQE_F_BUFFER)
+    {
+        unsigned bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+        // Bytes that arrive while the connection moves belong to its stream
+        if (cqe.res > 0 && !conn->closing)
+            conn->decoder.feed(ring->buffer(bid), cqe.res);
+        ring->recycle(bid);
+    }
+    if (finish_pending(conn) || conn->closing)
+        return;
+    if (cqe.res == -EINVAL && ring->multishot_recv)
+        ring->multishot_recv = false; // re-armed as a single receive below
+    else if (cqe.res == 0 || (cqe.res < 0 && cqe.res != -ENOBUFS && cqe.res != -ECANCELED))
+    {
+        close_connection(conn); // a dropped connection leaves the room like #exit
+        return;
+    }
+    on_readable(conn);
+}
+
+void Reactor::on_sent(Connection *conn, const struct io_uring_cqe &cqe)
+{
+    SendChain &chain = *conn->chain;
+    conn->pending--;
+    if (cqe.res >= 0)
+        chain.written += cqe.res;
+    else if (cqe.res != -EAGAIN && cqe.res != -ECANCELED)
+        chain.failed = true; // the rest of the chain is cancelled
+    if (--chain.parts > 0)
+        return;
+    conn->outbox.end_send(chain.written);
+    if (finish_pending(conn) || conn->closing)
+        return;
+    if (chain.failed)
+    {
+        close_connection(conn);
+        return;
     }
+    after_send(conn);
+    if (!conn->outbox.empty())
+        mark_dirty(conn);
 }
 
-void server_print(string str, bool endLine = true)
+// Rooms must not stay blocked on a client that stopped reading
+void Reactor::expire_congested()
 {
-    lock_guard<mutex> guard(cout_mutex);
-    cout << str;
-    if (endLine)
-        cout << endl;
+    auto now = chrono::steady_clock::now();
+    while (!congested.empty() &&
+           now - congested.front()->congested_since > chrono::milliseconds(outbox_config.backpressure_timeout))
+    {
+        outbox_counters.slow_disconnects++;
+        close_connection(congested.front());
+    }
 }
 
-int broadcast_to_clients(string message, int sender_id, string sender_room)
+// Flushes the outboxes written during the event batch and releases the
+// connections that ended, until neither produces more work
+void Reactor::settle()
 {
-    char temp[MAX_LEN];
-    strcpy(temp, message.c_str());
-    for (int i = 0; i < clients.size(); i++)
+    while (!dirty.empty() || !doomed.empty())
     {
-        if (clients[i].client_id != sender_id && clients[i].client_room == sender_room)
+        flushing.swap(dirty);
+        for (Connection *conn : flushing)
+        {
+            conn->dirty = false;
+            if (conn->closing)
+                continue;
+            if (!conn->catch_up.empty() && !send_catch_up(conn))
+            {
+                close_connection(conn);
+                continue;
+            }
+            if (ring && conn->outbox.waiting())
+                arm_writable(conn);
+            else if (ring)
+                submit_send(conn);
+            else if (!conn->outbox.flush())
+                close_connection(conn);
+            count_queue(conn);
+        }
+        flushing.clear();
+        while (!doomed.empty())
         {
-            send(clients[i].client_socket, temp, sizeof(temp), 0);
+            Connection *conn = doomed.back();
+            doomed.pop_back();
+            if (conn->client_room != -1)
+            {
+                if (!conn->migrating)
+                {
+                    string leave_message = conn->client_name + string(" has left Room: ");
+                    broadcast_notice(leave_message + conn->room_name, conn);
+                    LOG(LOG_DEBUG, color(conn->client_id) << leave_message << conn->room_name << default_colour);
+                }
+                leave_room(conn);
+            }
+            if (conn->dirty)
+                dirty.erase(find(dirty.begin(), dirty.end(), conn));
+            release(conn);
         }
     }
-    return 1;
 }
 
-int broadcast_to_clients(int num, int sender_id, string sender_room)
+// Brings the reactor's queued total up to date with one outbox
+void Reactor::count_queue(Connection *conn)
+{
+    size_t queued = conn->closing ? 0 : conn->outbox.queued();
+    queued_bytes.fetch_add((int64_t)queued - (int64_t)conn->counted_queue, memory_order_relaxed);
+    conn->counted_queue = queued;
+}
+
+void Reactor::release(Connection *conn)
+{
+    count_queue(conn); // closing, so its queue no longer counts
+    if (!ring)
+    {
+        delete conn; // closing the socket also removes it from epoll
+        return;
+    }
+    // Queued requests still point at the connection; the shutdown makes
+    // them complete soon and the last one deletes it
+    shutdown(conn->outbox.socket(), SHUT_RDWR);
+    stop_recv(conn);
+    forget_file(conn);
+    conn->released = true;
+    finish_pending(conn);
+}
+
+// If the connection is being released or moved, completes that once no
+// request points at it any more. Returns true if it is no longer ours.
+bool Reactor::finish_pending(Connection *conn)
+{
+    if (!conn->released && !conn->moving)
+        return false;
+    if (conn->pending > 0)
+        return true;
+    if (conn->released)
+        delete conn;
+    else
+    {
+        conn->moving = false;
+        reactor_of(conn->room_id)->hand_off(conn);
+    }
+    return true;
+}
+
+void Reactor::adopt_handoffs()
 {
-    for (int i = 0; i < clients.size(); i++)
+    vector<Connection *> arrived;
+    vector<pair<string, Destination>> tasks;
+    vector<pair<string, RoomLog *>> logs;
     {
-        if (clients[i].client_id != sender_id && clients[i].client_room == sender_room)
-            send(clients[i].client_socket, &num, sizeof(num), 0);
+        lock_guard<mutex> guard(handoff_mutex);
+        arrived.swap(handoffs);
+        tasks.swap(room_tasks);
+        logs.swap(opened_logs);
     }
-    return 1;
+    for (auto &task : tasks)
+        run_room_task(task.first, task.second);
+    for (auto &log : logs)
+        adopt_log(log.first, log.second);
+    for (Connection *conn : arrived)
+        adopt(conn);
 }
 
-void end_connection(int id, string room)
+void Reactor::adopt(Connection *conn)
 {
-    lock_guard<mutex> guard(clients_mutex);
-    for (int i = 0; i < clients.size(); i++)
+    if (ring)
     {
-        if (clients[i].client_id == id && clients[i].client_room == room)
+        if (!free_files.empty() && ring->update_file(free_files.back(), conn->outbox.socket()))
         {
-            if (clients[i].client_thread.joinable())
-                clients[i].client_thread.detach();
-            close(clients[i].client_socket);
-            clients.erase(clients.begin() + i);
-            break;
+            conn->file_slot = free_files.back();
+            free_files.pop_back();
+        }
+    }
+    else
+    {
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = conn;
+        if (epoll_ctl(epoll_id, EPOLL_CTL_ADD, conn->outbox.socket(), &event) == -1)
+        {
+            perror("epoll_ctl: ");
+            delete conn;
+            return;
+        }
+    }
+    if (conn->state == CONN_CHAT && !join_room(conn))
+        return;
+    // Frames that arrived along with HELLO are already in the decoder
+    on_readable(conn);
+}
+
+// Hands the connection to the reactor that owns its room
+void Reactor::move_to_owner(Connection *conn)
+{
+    if (!ring)
+    {
+        epoll_ctl(epoll_id, EPOLL_CTL_DEL, conn->outbox.socket(), NULL);
+        reactor_of(conn->room_id)->hand_off(conn);
+        return;
+    }
+    conn->moving = true;
+    stop_recv(conn);
+    forget_file(conn);
+    finish_pending(conn);
+}
+
+void Reactor::on_writable(Connection *conn)
+{
+    if (!conn->catch_up.empty())
+    {
+        if (!send_catch_up(conn))
+        {
+            close_connection(conn);
+            return;
+        }
+        if (!conn->catch_up.empty())
+        {
+            if (ring)
+                mark_dirty(conn); // wait for the socket again
+            return;
         }
     }
+    if (!conn->outbox.flush(true))
+    {
+        close_connection(conn);
+        return;
+    }
+    after_send(conn);
+    if (ring && !conn->outbox.empty())
+        mark_dirty(conn); // still full: wait for it again
+}
+
+void Reactor::after_send(Connection *conn)
+{
+    count_queue(conn);
+    if (conn->congested && !conn->outbox.over_limit())
+        set_congested(conn, false);
 }
 
-void handle_client_connection(int client_socket, int id)
+void Reactor::arm_recv(Connection *conn)
 {
-    char name[MAX_LEN], room[MAX_LEN], str[MAX_LEN];
-    if (recv(client_socket, name, sizeof(name), 0) <= 0) {
-        close(client_socket);
+    bool fixed = conn->file_slot != -1;
+    conn->recv_armed = true;
+    conn->pending++;
+    ring->recv(fixed ? conn->file_slot : conn->outbox.socket(), fixed, tagged(conn, TAG_RECV));
+}
+
+void Reactor::arm_writable(Connection *conn)
+{
+    if (conn->poll_armed)
         return;
+    bool fixed = conn->file_slot != -1;
+    conn->poll_armed = true;
+    conn->pending++;
+    ring->poll_writable(fixed ? conn->file_slot : conn->outbox.socket(), fixed, tagged(conn, TAG_WRITABLE));
+}
+
+void Reactor::stop_recv(Connection *conn)
+{
+    if (conn->recv_armed)
+        ring->cancel(tagged(conn, TAG_RECV), tagged(NULL, TAG_IGNORE));
+}
+
+// Sends everything queued, up to LINKED_SENDS * FLUSH_BATCH frames, as one
+// chain of linked sendmsg requests; the chain's completions pick up the rest
+void Reactor::submit_send(Connection *conn)
+{
+    if (conn->outbox.sending() || conn->outbox.empty())
+        return;
+    if (!conn->chain)
+        conn->chain.reset(new SendChain());
+    SendChain &chain = *conn->chain;
+    size_t frames = conn->outbox.begin_send(chain.iov, LINKED_SENDS * FLUSH_BATCH);
+    bool fixed = conn->file_slot != -1;
+    chain.parts = 0;
+    chain.written = 0;
+    chain.failed = false;
+    for (size_t at = 0; at < frames; at += FLUSH_BATCH)
+    {
+        struct msghdr &msg = chain.msg[chain.parts++];
+        memset(&msg, 0, sizeof msg);
+        msg.msg_iov = chain.iov + at;
+        msg.msg_iovlen = min((size_t)FLUSH_BATCH, frames - at);
+        ring->sendmsg(fixed ? conn->file_slot : conn->outbox.socket(), fixed, &msg, at + FLUSH_BATCH < frames,
+                      tagged(conn, TAG_SEND));
     }
-    if (recv(client_socket, room, sizeof(room), 0) <= 0) {
-        close(client_socket);
+    conn->pending += chain.parts;
+}
+
+void Reactor::forget_file(Connection *conn)
+{
+    if (conn->file_slot == -1)
         return;
+    ring->update_file(conn->file_slot, -1);
+    free_files.push_back(conn->file_slot);
+    conn->file_slot = -1;
+}
+
+void Reactor::mark_dirty(Connection *conn)
+{
+    if (!conn->dirty)
+    {
+        conn->dirty = true;
+        dirty.push_back(conn);
     }
+}
+
+// Reads and handles frames until the socket is drained, unless the
+// connection ends, moves to another reactor or is paused
+void Reactor::on_readable(Connection *conn)
+{
+    while (!conn->closing && !conn->paused)
+    {
+        if (!process_frames(conn))
+            return;
+        if (ring)
+        {
+            if (!conn->recv_armed)
+                arm_recv(conn);
+            return;
+        }
+        size_t available;
+        char *space = conn->decoder.write_space(READ_CHUNK, available);
+        ssize_t n = recv(conn->outbox.socket(), space, available, 0);
+        if (n > 0)
+            conn->decoder.commit(n);
+        else if (n == -1 && errno == EINTR)
+            continue;
+        else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        else
+            close_connection(conn); // a dropped connection leaves the room like #exit
+    }
+}
 
+// Handles every buffered frame. Returns false if the caller must stop
+// reading the connection.
+bool Reactor::process_frames(Connection *conn)
+{
+    Frame frame;
+    int decoded;
+    while ((decoded = conn->decoder.next(frame)) == 1)
+    {
+        if (conn->state == CONN_HANDSHAKE)
+        {
+            if (!handshake(conn, frame))
+                return false;
+            continue;
+        }
+        if (conn->state == CONN_CONTROL)
+        {
+            answer_control(conn, frame);
+            continue;
+        }
+        if (frame.header.type == MSG_EXIT)
+        {
+            close_connection(conn);
+            return false;
+        }
+        if (frame.header.type != MSG_CHAT)
+            continue;
+        // Encoded straight into the message every member's outbox shares,
+        // behind its number if the room is logged
+        Room &room = rooms[conn->client_room];
+        size_t seq_size = room.log ? U64_FRAME_SIZE : 0;
+        Message message(seq_size + named_frame_size(conn->client_name, frame.length));
+        if (seq_size)
+            put_u64_frame(message.data(), MSG_SEQ, 0, conn->room_id, room.log->next_seq());
+        put_named_frame(message.data() + seq_size, MSG_CHAT, conn->client_id, conn->room_id, conn->client_name,
+                        frame.payload, frame.length);
+        broadcast(conn->client_room, message, conn);
+        string error;
+        if (room.log && !room.log->append(message.data(), message.size(), error))
+        {
+            LOG(LOG_ERROR, "Room " << room.room_name << " is no longer logged: " << error);
+            drop_log(room.log.release());
+        }
+        keep_history(conn->room_name, message.data() + seq_size, message.size() - seq_size);
+        messages_in.add();
+        bytes_in.add(sizeof(FrameHeader) + frame.length);
+        // Backpressure: stop reading senders until the room has caught up
+        if (room.congested > 0)
+        {
+            outbox_counters.backpressure_waits++;
+            conn->paused = true;
+            room.paused.push_back(conn);
+            if (ring)
+                stop_recv(conn);
+            return false;
+        }
+    }
+    if (decoded == -1)
+    {
+        close_connection(conn);
+        return false;
+    }
+    return true;
+}
+
+// Handles the first frame of a connection. Returns false if the connection
+// ended or moved to the reactor that owns its room.
+bool Reactor::handshake(Connection *conn, const Frame &frame)
+{
     // Handle healthcheck ping client separately
-    if (strcmp(name, "__HealthCheck__") == 0 && strcmp(room, "__ping__") == 0)
+    if (frame.header.type == MSG_PING)
+    {
+        close_connection(conn);
+        return false;
+    }
+    if (frame.header.type == MSG_LOAD_QUERY)
+    {
+        LoadReport load = current_load();
+        Message reply(LOAD_FRAME_SIZE);
+        put_load_frame(reply.data(), 0, load);
+        conn->outbox.enqueue(reply);
+        conn->outbox.flush();
+        LOG(LOG_DEBUG, "Load on this server: " << load.users);
+        close_connection(conn);
+        return false;
+    }
+    if (frame.header.type == MSG_CONTROL)
+    {
+        // Stays on this reactor; it never joins a room
+        conn->state = CONN_CONTROL;
+        LOG(LOG_INFO, "Load balancer connected for control");
+        return true;
+    }
+    if (frame.header.type == MSG_ROUTE_TOKEN && frame.length == ROUTE_TOKEN_SIZE)
+    {
+        // Checked with the HELLO that follows
+        memcpy(conn->route_token, frame.payload, ROUTE_TOKEN_SIZE);
+        conn->has_token = true;
+        return true;
+    }
+    if (frame.header.type == MSG_RESUME && read_u64_payload(frame, conn->resume_from))
+    {
+        // Served once the HELLO has put the client in its room
+        conn->has_resume = true;
+        return true;
+    }
+    string name, room;
+    if (frame.header.type != MSG_HELLO || !split_named_payload(frame, name, room))
+    {
+        close_connection(conn);
+        return false;
+    }
+    if (route_key.set)
+    {
+        if (conn->has_token)
+            conn->route =
+                check_route_token(route_key, conn->route_token, ROUTE_TOKEN_SIZE, room, server_port, wall_ms());
+        if (conn->route == ROUTE_BAD)
+        {
+            token_rejects.add();
+            LOG(LOG_DEBUG, "Refused " << name << " for Room: " << room << ", no valid routing token");
+            close_connection(conn);
+            return false;
+        }
+    }
+    conn->client_name = name;
+    conn->room_name = room;
+    conn->room_id = room_id_of(room);
+    conn->state = CONN_CHAT;
+    if (reactor_of(conn->room_id) != this)
+    {
+        move_to_owner(conn);
+        return false;
+    }
+    return join_room(conn);
+}
+
+// Answers a request from the load balancer, echoing its id. Replies go out
+// with the rest of the event batch, so pipelined requests share one send.
+void Reactor::answer_control(Connection *conn, const Frame &frame)
+{
+    uint32_t id = frame.header.sender_id;
+    string room;
+    uint32_t port;
+    if (frame.header.type == MSG_PLACE)
     {
-        close(client_socket);
+        room.assign(frame.payload, frame.length);
+        LOG(LOG_DEBUG, "Room " << room << " placed on this server");
+        reactor_of(room_id_of(room))->post_room_task(room, Destination());
         return;
     }
-    if (strcmp(name, "__LoadBalancer__") == 0 && strcmp(room, "__getLoad?__") == 0)
+    if (frame.header.type == MSG_MIGRATE)
     {
-        int noOfClients = clients.size() - 1;
-        send(client_socket, &noOfClients, sizeof(noOfClients), 0);
-        cout << "Load on this server: " << noOfClients << "\n";
-        close(client_socket);
-        end_connection(id, room);
+        Destination to;
+        if (read_migrate(frame, room, port, to.host))
+        {
+            to.port = port;
+            reactor_of(room_id_of(room))->post_room_task(room, to);
+        }
         return;
     }
+    Message reply;
+    if (frame.header.type == MSG_PING)
+    {
+        reply = Message(sizeof(FrameHeader));
+        put_header(reply.data(), MSG_PONG, id, 0, 0);
+    }
+    else if (frame.header.type == MSG_LOAD_QUERY)
+    {
+        LoadReport load = current_load();
+        reply = Message(LOAD_FRAME_SIZE);
+        put_load_frame(reply.data(), id, load);
+        LOG(LOG_DEBUG, "Load on this server: " << load.users);
+    }
+    else if (frame.header.type == MSG_ROOM_QUERY)
+    {
+        vector<pair<string, int>> largest;
+        {
+            lock_guard<mutex> guard(room_sizes_mutex);
+            largest.assign(room_sizes.begin(), room_sizes.end());
+        }
+        auto bigger = [](const pair<string, int> &a, const pair<string, int> &b) { return a.second > b.second; };
+        size_t listed = min(largest.size(), (size_t)ROOM_REPORT_MAX);
+        partial_sort(largest.begin(), largest.begin() + listed, largest.end(), bigger);
+        largest.resize(listed);
+        string frame_out;
+        encode_room_loads(frame_out, id, largest);
+        reply = make_message(frame_out);
+    }
+    else
+        return;
+    if (!conn->outbox.enqueue(reply))
+        close_connection(conn);
     else
+        mark_dirty(conn);
+}
+
+// A room placed here again takes new clients; a room that moved sends its
+// members, and anyone still arriving, to its new server
+void Reactor::run_room_task(const string &room, const Destination &to)
+{
+    if (to.port == 0)
     {
-        set_Client(id, name, room);
-        string initial_message = string(name) + string(" has joined Room: ");
-        broadcast_to_clients("#NULL", id, room);
-        broadcast_to_clients(id, id, room);
-        broadcast_to_clients(initial_message + room, id, room);
-        server_print(color(id) + initial_message + room + default_colour);
+        moved_rooms.erase(room);
+        if (route_key.set)
+            routed_rooms.insert(room);
+        return;
     }
-    while (true)
+    moved_rooms[room] = to;
+    routed_rooms.erase(room);
+    histories.forget(room);
+    history_bytes.store(histories.memory(), memory_order_relaxed);
+    auto found = room_index.find(room);
+    if (found == room_index.end())
+        return;
+    vector<Connection *> members = rooms[found->second].members;
+    for (Connection *member : members)
+        redirect(member, to);
+    LOG(LOG_INFO, "Room " << room << " moved to server " << to.host << ":" << to.port);
+}
+
+// Tells the client to rejoin its room on the destination server and ends the
+// connection. The frame is written right away since the connection closes
+// with this batch; a client that misses it finds the room again through the
+// balancer. With -K a token for the new server goes ahead of it.
+void Reactor::redirect(Connection *conn, const Destination &to)
+{
+    size_t token_size = route_key.set ? ROUTE_TOKEN_FRAME_SIZE : 0;
+    Message message(token_size + U32_FRAME_SIZE + to.host.size());
+    if (token_size)
+        put_route_token_frame(message.data(), route_key, conn->room_name.data(), conn->room_name.size(), to.port,
+                              wall_ms());
+    put_u32_text_frame(message.data() + token_size, MSG_REDIRECT, 0, conn->room_id, to.port, to.host.data(),
+                       to.host.size());
+    conn->migrating = true;
+    if (!conn->outbox.sending() && conn->outbox.enqueue(message))
+        conn->outbox.flush();
+    close_connection(conn);
+}
+
+// Adds the client to the member list of its room, interning the room name.
+// Returns false if the room has moved and the client was sent after it, or
+// if its routing token is too old for a room this server does not know.
+bool Reactor::join_room(Connection *conn)
+{
+    auto moved = moved_rooms.find(conn->room_name);
+    if (moved != moved_rooms.end())
     {
-        int bytes_received = recv(client_socket, str, sizeof(str), 0);
-        if (bytes_received <= 0)
-            return;
-        if (strcmp(str, "#exit") == 0)
+        redirect(conn, moved->second);
+        return false;
+    }
+    auto found = room_index.find(conn->room_name);
+    if (route_key.set)
+    {
+        if (conn->route != ROUTE_FRESH && found == room_index.end() && !routed_rooms.count(conn->room_name))
         {
-            if (strcmp(name, "__LoadBalancer__") != 0 || strcmp(room, "__getLoad?__") != 0)
-            {
-                string message = string(name) + string(" has left Room: ");
-                broadcast_to_clients("#NULL", id, room);
-                broadcast_to_clients(id, id, room);
-                broadcast_to_clients(message + room, id, room);
-                server_print(color(id) + message + room + default_colour);
-            }
-            else
+            token_rejects.add();
+            LOG(LOG_DEBUG, "Refused " << conn->client_name << ", Room: " << conn->room_name << " is not known here");
+            close_connection(conn);
+            return false;
+        }
+        routed_rooms.insert(conn->room_name);
+        // A renewed token, which also tells the client it was let in
+        Message token(ROUTE_TOKEN_FRAME_SIZE);
+        put_route_token_frame(token.data(), route_key, conn->room_name.data(), conn->room_name.size(), server_port,
+                              wall_ms());
+        if (!conn->outbox.enqueue(token))
+        {
+            close_connection(conn);
+            return false;
+        }
+        mark_dirty(conn);
+    }
+    int idx;
+    if (found != room_index.end())
+        idx = found->second;
+    else
+    {
+        if (!free_rooms.empty())
+        {
+            idx = free_rooms.back();
+            free_rooms.pop_back();
+        }
+        else
+        {
+            idx = rooms.size();
+            rooms.emplace_back();
+        }
+        rooms[idx].room_name = conn->room_name;
+        room_index[conn->room_name] = idx;
+        if (!log_dir.empty())
+            open_log(conn->room_name);
+    }
+    conn->client_room = idx;
+    conn->room_position = rooms[idx].members.size();
+    rooms[idx].members.push_back(conn);
+    active_clients++;
+    {
+        lock_guard<mutex> guard(room_sizes_mutex);
+        room_sizes[conn->room_name]++;
+    }
+
+    string initial_message = conn->client_name + string(" has joined Room: ");
+    broadcast_notice(initial_message + conn->room_name, conn);
+    LOG(LOG_DEBUG, color(conn->client_id) << initial_message << conn->room_name << default_colour);
+    if (!replay_to(conn))
+    {
+        close_connection(conn);
+        return false;
+    }
+    return true;
+}
+
+// Has the worker open the room's log, unless it already is; a room that
+// cannot be logged goes on without one
+void Reactor::open_log(const string &room)
+{
+    if (!logs_opening.insert(room).second)
+        return;
+    RoomLogWorker::instance().post([this, room] {
+        string error;
+        RoomLog *log = new RoomLog();
+        if (!log->open(log_dir, room, error))
+        {
+            LOG(LOG_WARN, "Room " << room << " is not logged: " << error);
+            delete log;
+            log = NULL;
+        }
+        post_log(room, log);
+    });
+}
+
+// Gives a room the log the worker opened, if the room still has members
+// and no log; a room emptied and rejoined meanwhile takes it too
+void Reactor::adopt_log(const string &room, RoomLog *log)
+{
+    logs_opening.erase(room);
+    auto found = room_index.find(room);
+    if (log && found != room_index.end() && !rooms[found->second].log)
+        rooms[found->second].log.reset(log);
+    else
+        drop_log(log);
+}
+
+// Sends a joiner what its room said before, ahead of anything said from now
+// on: from the room's log if it asked to resume and the room is logged,
+// else from the in-memory history. Returns false if it has to be closed.
+bool Reactor::replay_to(Connection *conn)
+{
+    RoomLog *log = rooms[conn->client_room].log.get();
+    // The log is written to the socket directly, so what is queued has to
+    // go first; the few bytes queued on a new connection always do
+    if (conn->has_resume && log && !conn->outbox.sending() && conn->outbox.flush() && conn->outbox.empty())
+    {
+        if (log->ranges_from(conn->resume_from, conn->catch_up))
+        {
+            resumes.add();
+            if (!conn->catch_up.empty())
             {
-                cout << "Sent Load count to Loadbalancer\n";
+                conn->outbox.hold();
+                mark_dirty(conn);
             }
-            end_connection(id, room);
-            return;
+            return true;
+        }
+        LOG(LOG_WARN, "Room " << conn->room_name << ": cannot read its log: " << strerror(errno));
+    }
+    Message past;
+    if (!histories.replay(conn->room_name, past))
+        return true;
+    if (!conn->outbox.enqueue(past))
+        return false;
+    mark_dirty(conn);
+    return true;
+}
+
+// Sends what is left of a resuming client's catch-up. The room's messages
+// since wait in its outbox, which is let go once the catch-up is done.
+// Returns false if the connection failed.
+bool Reactor::send_catch_up(Connection *conn)
+{
+    size_t sent = 0;
+    bool ok = send_log_ranges(conn->outbox.socket(), conn->catch_up, sent);
+    resume_bytes.add(sent);
+    if (ok && conn->catch_up.empty())
+        return conn->outbox.flush(true);
+    return ok;
+}
+
+// O(1) removal: the last member takes the leaving client's place
+void Reactor::leave_room(Connection *conn)
+{
+    int idx = conn->client_room;
+    Room &room = rooms[idx];
+    if (conn->paused)
+    {
+        room.paused.erase(find(room.paused.begin(), room.paused.end(), conn));
+        conn->paused = false;
+    }
+    Connection *moved = room.members.back();
+    room.members[conn->room_position] = moved;
+    moved->room_position = conn->room_position;
+    room.members.pop_back();
+    if (room.members.empty())
+    {
+        room_index.erase(room.room_name);
+        free_rooms.push_back(idx);
+        drop_log(room.log.release());
+    }
+    conn->client_room = -1;
+    active_clients--;
+    lock_guard<mutex> guard(room_sizes_mutex);
+    if (--room_sizes[conn->room_name] == 0)
+        room_sizes.erase(conn->room_name);
+}
+
+// Queues the frame for everyone in the room except the sender. The frame
+// itself is shared, never copied per recipient; the outboxes are flushed
+// once the event batch is done, so frames for the same client coalesce.
+void Reactor::broadcast(int room, const Message &message, Connection *sender)
+{
+    uint64_t delivered = 0;
+    for (Connection *member : rooms[room].members)
+    {
+        if (member == sender || member->closing)
+            continue;
+        if (!member->outbox.enqueue(message))
+        {
+            close_connection(member);
+            continue;
         }
-        broadcast_to_clients(string(name), id, room);
-        broadcast_to_clients(id, id, room);
-        broadcast_to_clients(string(str), id, room);
+        delivered++;
+        mark_dirty(member);
+        if (outbox_config.policy == BACKPRESSURE && !member->congested && member->outbox.over_limit())
+            set_congested(member, true);
+    }
+    messages_out.add(delivered);
+    bytes_out.add(delivered * message.size());
+}
+
+void Reactor::broadcast_notice(const string &text, Connection *sender)
+{
+    string frame;
+    encode_frame(frame, MSG_NOTICE, sender->client_id, sender->room_id, text.data(), text.size());
+    broadcast(sender->client_room, make_message(frame), sender);
+}
+
+// Keeps a chat frame for the room's future joiners
+void Reactor::keep_history(const string &room, const char *frame, size_t size)
+{
+    history_evictions.add(histories.record(room, frame, size));
+    history_bytes.store(histories.memory(), memory_order_relaxed);
+}
+
+void Reactor::set_congested(Connection *conn, bool over)
+{
+    Room &room = rooms[conn->client_room];
+    conn->congested = over;
+    if (over)
+    {
+        conn->congested_since = chrono::steady_clock::now();
+        congested.push_back(conn);
+        room.congested++;
+        return;
+    }
+    congested.erase(find(congested.begin(), congested.end(), conn));
+    if (--room.congested == 0)
+        resume_room(conn->client_room);
+}
+
+// Lets the room's paused senders go on with the frames they have buffered
+void Reactor::resume_room(int room)
+{
+    vector<Connection *> waiting;
+    waiting.swap(rooms[room].paused);
+    for (Connection *conn : waiting)
+    {
+        conn->paused = false;
+        on_readable(conn);
     }
-}
\ No newline at end of file
+}
+
+// Releases the connection once the current event batch is done, so events
+// already fetched for it never see a freed connection
+void Reactor::close_connection(Connection *conn)
+{
+    if (conn->closing)
+        return;
+    conn->closing = true;
+    if (conn->congested)
+        set_congested(conn, false);
+    doomed.push_back(conn);
+}
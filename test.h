@@ -0,0 +1,38 @@
+/*
+ * test.h
+ * What every test_*.cpp shares: CHECK, which reports a failed condition
+ * with its file and line and counts it, and test_result(), which main
+ * returns once all checks have run
+ */
+#ifndef TEST_H
+#define TEST_H
+
+#include <bits/stdc++.h>
+
+using namespace std;
+
+inline int failures = 0;
+
+#define CHECK(cond)                                                        \
+    do                                                                     \
+    {                                                                      \
+        if (!(cond))                                                       \
+        {                                                                  \
+            cerr << __FILE__ << ":" << __LINE__ << ": failed: " #cond "\n"; \
+            failures++;                                                    \
+        }                                                                  \
+    } while (0)
+
+// Reports how the checks went: 0 if all passed, else 1
+inline int test_result(const char *name)
+{
+    if (failures)
+    {
+        cerr << failures << " check(s) failed\n";
+        return 1;
+    }
+    cout << name << ": all checks passed\n";
+    return 0;
+}
+
+#endif
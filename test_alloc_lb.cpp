@@ -0,0 +1,139 @@
+/*
+ * test_alloc_lb.cpp
+ * Checks that the Load Balancer answers a handshake without allocating from
+ * the heap once pool.h has warmed up
+ *
+ * Builds loadbalancer.cpp in, without its main, and runs real handshakes
+ * over socket pairs: handle_connection_io reads the HELLO, read_hello and
+ * assign_room log it to the WAL and look the room up (or place it), and the
+ * ASSIGN goes back. Replaces the global operator new so every heap
+ * allocation in the process is counted, the WAL writer's included; the
+ * pools carve their slabs through it too.
+ */
+#define NO_MAIN
+#include "loadbalancer.cpp"
+#include "test.h"
+
+atomic<size_t> heap_allocations(0);
+
+// Not inlined into the balancer's code, which GCC would then check for
+// mismatched malloc and delete
+__attribute__((noinline)) void *operator new(size_t bytes)
+{
+    heap_allocations++;
+    if (void *memory = malloc(bytes ? bytes : 1))
+        return memory;
+    throw bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void *memory) noexcept { free(memory); }
+__attribute__((noinline)) void operator delete(void *memory, size_t) noexcept { free(memory); }
+
+const int ROUNDS = 1000;
+const int ROOMS = 64;
+const int SERVERS = 4;
+
+// One client's HELLO through the real handshake; the port of its ASSIGN,
+// or -1
+int handshake(const string &hello)
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+        return -1;
+    fcntl(fds[0], F_SETFL, O_NONBLOCK); // the way the reactors accept them
+    int port = -1;
+    if (send(fds[1], hello.data(), hello.size(), 0) == (ssize_t)hello.size())
+    {
+        lb_connection *conn = new lb_connection();
+        conn->socket_id = fds[0];
+        conn->state = LB_READ_HELLO;
+        conn->sent = 0;
+        conn->accepted_at = chrono::steady_clock::now();
+        bool open = handle_connection_io(conn);
+        char reply[U32_FRAME_SIZE + BACKEND_HOST_MAX];
+        FrameHeader header;
+        uint32_t assigned;
+        if (!open && conn->state == LB_CLOSED && recv(fds[1], reply, sizeof reply, 0) >= (ssize_t)U32_FRAME_SIZE)
+        {
+            memcpy(&header, reply, sizeof header);
+            memcpy(&assigned, reply + sizeof header, sizeof assigned);
+            if (header.type == MSG_ASSIGN)
+                port = ntohl(assigned);
+        }
+        delete conn;
+    }
+    close(fds[0]);
+    close(fds[1]);
+    return port;
+}
+
+void test_handshake_allocates_nothing()
+{
+    log_threshold = LOG_WARN;
+    string error;
+    CHECK(change_backends(
+        [](vector<Backend> &listed, string &error) {
+            for (int i = 0; i < SERVERS; i++)
+            {
+                Backend backend;
+                backend.host = "localhost";
+                backend.port = 8000 + i;
+                if (!resolve_backend(backend, error))
+                    return false;
+                listed.push_back(backend);
+            }
+            return true;
+        },
+        error));
+    char dir[] = "/tmp/test_alloc.XXXXXX";
+    WalConfig config;
+    config.dir = mkdtemp(dir);
+    CHECK(wal.open(config, [] { return vector<pair<string, int>>(); }));
+
+    vector<string> hellos;
+    for (int r = 0; r < ROOMS; r++)
+    {
+        string hello, room = "room" + to_string(r);
+        encode_named_frame(hello, MSG_HELLO, 0, room_id_of(room), "client" + to_string(r), room.data(), room.size());
+        hellos.push_back(hello);
+    }
+    vector<int> placed(ROOMS, -1);
+    size_t before = 0;
+    bool same_server = true;
+    for (int round = 0; round < 2 * ROUNDS; round++)
+    {
+        if (round == ROUNDS)
+            before = heap_allocations;
+        int r = round % ROOMS, port = handshake(hellos[r]);
+        if (placed[r] == -1)
+            placed[r] = port;
+        same_server &= port >= 8000 && port == placed[r];
+    }
+    CHECK(same_server);
+    CHECK(heap_allocations == before);
+
+    // A new room costs its node in the routing table and its share of the
+    // shard's growth
+    vector<string> fresh;
+    for (int r = 0; r < ROUNDS; r++)
+    {
+        string hello, room = "fresh" + to_string(r);
+        encode_named_frame(hello, MSG_HELLO, 0, room_id_of(room), "client", room.data(), room.size());
+        fresh.push_back(hello);
+    }
+    before = heap_allocations;
+    for (const string &hello : fresh)
+        CHECK(handshake(hello) >= 8000);
+    CHECK(heap_allocations - before <= (size_t)ROUNDS * 2);
+    CHECK(roomServerDict.size() == (size_t)(ROOMS + ROUNDS));
+
+    wal.close();
+    CHECK(system(("rm -rf " + config.dir).c_str()) == 0);
+}
+
+int main()
+{
+    signal(SIGPIPE, SIG_IGN);
+    test_handshake_allocates_nothing();
+    return test_result("test_alloc_lb");
+}
@@ -0,0 +1,141 @@
+/*
+ * test_alloc_server.cpp
+ * Checks that the chat server relays messages without allocating from the
+ * heap once pool.h has warmed up
+ *
+ * Builds server.cpp in, without its main, and drives a real reactor over
+ * socket pairs: HELLO, then chat through process_frames, broadcast, the
+ * room's history and log, and the outbox flush. Replaces the global
+ * operator new so every heap allocation in the process is counted, the
+ * reactor thread's included; the pools carve their slabs through it too.
+ */
+#define NO_MAIN
+#include "server.cpp"
+#include "test.h"
+
+atomic<size_t> heap_allocations(0);
+
+// Not inlined into the server's code, which GCC would then check for
+// mismatched malloc and delete
+__attribute__((noinline)) void *operator new(size_t bytes)
+{
+    heap_allocations++;
+    if (void *memory = malloc(bytes ? bytes : 1))
+        return memory;
+    throw bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void *memory) noexcept { free(memory); }
+__attribute__((noinline)) void operator delete(void *memory, size_t) noexcept { free(memory); }
+
+const int ROUNDS = 1000;
+const int PEERS = 8;
+
+bool receive_all(int socket_id, char *buffer, size_t size)
+{
+    for (size_t got = 0; got < size;)
+    {
+        ssize_t n = recv(socket_id, buffer + got, size - got, 0);
+        if (n <= 0)
+            return false;
+        got += n;
+    }
+    return true;
+}
+
+// Reads whatever arrives until the socket has been quiet for a while
+void drain_until_quiet(int socket_id)
+{
+    char buffer[4096];
+    struct pollfd ready = {socket_id, POLLIN, 0};
+    while (poll(&ready, 1, 200) == 1 && recv(socket_id, buffer, sizeof buffer, 0) > 0)
+        ;
+}
+
+// PEERS clients in one logged room take turns to talk; every other member
+// gets each message behind its number
+void test_chat_relay_allocates_nothing()
+{
+    char dir[] = "/tmp/test_alloc.XXXXXX";
+    log_dir = mkdtemp(dir);
+    reactors.emplace_back(new Reactor());
+    reactors[0]->start(-1, -1);
+
+    int fds[PEERS][2];
+    string room = "lobby", text(200, 'x');
+    for (int i = 0; i < PEERS; i++)
+    {
+        socketpair(AF_UNIX, SOCK_STREAM, 0, fds[i]);
+        fcntl(fds[i][0], F_SETFL, O_NONBLOCK); // the way main accepts them
+        reactors[0]->hand_off(new Connection(fds[i][0], i + 1));
+        string hello;
+        encode_named_frame(hello, MSG_HELLO, 0, room_id_of(room), "peer" + to_string(i), room.data(), room.size());
+        CHECK(send(fds[i][1], hello.data(), hello.size(), 0) == (ssize_t)hello.size());
+    }
+    // The log is opened on the worker, and numbers messages once the
+    // reactor has it
+    RoomLogWorker::instance().drain();
+    for (int i = 0; i < PEERS; i++)
+        drain_until_quiet(fds[i][1]); // join notices
+    string chat;
+    encode_frame(chat, MSG_CHAT, 0, room_id_of(room), text.data(), text.size());
+    const size_t delivery = U64_FRAME_SIZE + named_frame_size("peer0", text.size());
+    char received[1024];
+
+    size_t before = 0;
+    bool delivered = true;
+    for (int round = 0; round < 2 * ROUNDS; round++)
+    {
+        if (round == ROUNDS)
+            before = heap_allocations;
+        int speaker = round % PEERS;
+        CHECK(send(fds[speaker][1], chat.data(), chat.size(), 0) == (ssize_t)chat.size());
+        for (int i = 0; i < PEERS; i++)
+        {
+            if (i == speaker)
+                continue;
+            FrameHeader header;
+            delivered &= receive_all(fds[i][1], received, delivery);
+            memcpy(&header, received + U64_FRAME_SIZE, sizeof header);
+            delivered &= header.type == MSG_CHAT && received[1] == MSG_SEQ;
+        }
+    }
+    CHECK(delivered);
+    CHECK(heap_allocations == before);
+    for (int i = 0; i < PEERS; i++)
+        close(fds[i][1]);
+    CHECK(system(("rm -rf " + log_dir).c_str()) == 0);
+}
+
+// Connections move to their room's reactor, so blocks are often freed on a
+// different thread than the one that allocated them; the depot brings them
+// back instead of the allocating thread carving new slabs forever
+void test_cross_thread_frees_are_recycled()
+{
+    const int BATCH = 4096;
+    vector<Connection *> conns(BATCH);
+    auto round_trip = [&] {
+        for (Connection *&conn : conns)
+            conn = new Connection(-1, 0);
+        thread freer([&] {
+            for (Connection *conn : conns)
+                delete conn;
+        });
+        freer.join();
+    };
+    for (int round = 0; round < 4; round++)
+        round_trip();
+    size_t before = heap_allocations;
+    for (int round = 0; round < 16; round++)
+        round_trip();
+    // Only the thread objects themselves may touch the heap
+    CHECK(heap_allocations - before <= 16 * 2);
+}
+
+int main()
+{
+    signal(SIGPIPE, SIG_IGN);
+    test_chat_relay_allocates_nothing();
+    test_cross_thread_frees_are_recycled();
+    return test_result("test_alloc_server");
+}
@@ -0,0 +1,110 @@
+/*
+ * test_backends.cpp
+ * Checks backend lines and files in backends.h, and commands over the
+ * admin socket
+ */
+#include "backends.h"
+#include "test.h"
+
+void test_parse_backend()
+{
+    Backend backend;
+    string error;
+    CHECK(parse_backend("chat1.internal:8001 3", backend, error));
+    CHECK(backend.host == "chat1.internal" && backend.port == 8001 && backend.weight == 3);
+    CHECK(parse_backend("  10.0.0.7:8002\t", backend, error));
+    CHECK(backend.host == "10.0.0.7" && backend.port == 8002 && backend.weight == 1);
+    CHECK(!parse_backend("chat1", backend, error) && error == "bad host in chat1");
+    CHECK(!parse_backend(":8001", backend, error));
+    CHECK(!parse_backend("chat1:", backend, error) && error == "bad port in chat1:");
+    CHECK(!parse_backend("chat1:70000", backend, error));
+    CHECK(!parse_backend("chat1:80x1", backend, error));
+    CHECK(!parse_backend("chat1:8001 0", backend, error) && error == "bad weight 0");
+    CHECK(!parse_backend("chat1:8001 2 extra", backend, error));
+    CHECK(!parse_backend(string(BACKEND_HOST_MAX + 1, 'h') + ":8001", backend, error));
+}
+
+void test_read_backends()
+{
+    vector<Backend> backends;
+    string error;
+    stringstream file("# chat servers\n"
+                      "localhost:8001 2\n"
+                      "\n"
+                      "127.0.0.1:8002   # the small one\n");
+    CHECK(read_backends(file, backends, error));
+    CHECK(backends.size() == 2);
+    CHECK(backends[0].port == 8001 && backends[0].weight == 2 && backends[1].weight == 1);
+    // Resolved once, up front
+    CHECK(backends[0].address.sin_family == AF_INET && ntohs(backends[0].address.sin_port) == 8001);
+    CHECK(backends[1].address.sin_addr.s_addr == htonl(INADDR_LOOPBACK));
+
+    stringstream twice("localhost:8001\n127.0.0.1:8001\n");
+    CHECK(!read_backends(twice, backends, error) && error == "line 2: port 8001 is listed twice");
+    stringstream bad("localhost:8001\n\nlocalhost:x\n");
+    CHECK(!read_backends(bad, backends, error) && error == "line 3: bad port in localhost:x");
+    stringstream unknown("no-such-host.invalid:8001\n");
+    CHECK(!read_backends(unknown, backends, error) && error.compare(0, 28, "line 1: no-such-host.invalid") == 0);
+    stringstream empty("# nothing yet\n");
+    CHECK(!read_backends(empty, backends, error) && error == "no backends listed");
+    CHECK(!load_backends("/nonexistent/backends", backends, error));
+
+    // Lists edited by admin commands are held to the same rule
+    Backend first, second;
+    first.host = "10.0.0.1";
+    first.port = second.port = 8001;
+    second.host = "10.0.0.2";
+    CHECK(check_unique_ports({first}, error));
+    CHECK(!check_unique_ports({first, second}, error) && error == "port 8001 is listed twice");
+}
+
+// Sends commands on one connection and reads until every reply is in
+string admin_session(const string &path, const string &commands, int replies)
+{
+    int socket_id = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof address);
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path.c_str());
+    if (connect(socket_id, (struct sockaddr *)&address, sizeof address) == -1)
+    {
+        close(socket_id);
+        return "";
+    }
+    send(socket_id, commands.data(), commands.size(), 0);
+    string response;
+    char buffer[1024];
+    ssize_t n;
+    while (count(response.begin(), response.end(), '\n') < replies &&
+           (n = recv(socket_id, buffer, sizeof buffer, 0)) > 0)
+        response.append(buffer, n);
+    close(socket_id);
+    return response;
+}
+
+void test_admin_socket()
+{
+    string path = "/tmp/test_backends." + to_string(getpid()) + ".sock";
+    vector<string> seen;
+    AdminServer admin;
+    CHECK(admin.start(path, [&](const string &command) {
+        seen.push_back(command);
+        return command == "list" ? string("localhost:8001 up\nok") : string("error: unknown command");
+    }));
+    // Commands may arrive split or several to a packet
+    CHECK(admin_session(path, "list\nfrob\n", 3) == "localhost:8001 up\nok\nerror: unknown command\n");
+    CHECK(admin_session(path, "list\n", 2) == "localhost:8001 up\nok\n");
+    CHECK(seen == (vector<string>{"list", "frob", "list"}));
+    CHECK(admin_session(path, string(ADMIN_LINE_MAX + 10, 'x'), 1) == "error: command too long\n");
+    admin.stop();
+    CHECK(access(path.c_str(), F_OK) == -1);
+    CHECK(!admin.start(string(200, 'p'), NULL));
+}
+
+int main()
+{
+    test_parse_backend();
+    test_read_backends();
+    test_admin_socket();
+    return test_result("test_backends");
+}
@@ -4,6 +4,38 @@ import subprocess
 import threading
 import time
 import os
+import struct
+
+
+# Wire format shared with protocol.h: a 16 byte header (version, type, flags,
+# sender id, room id, payload length; network byte order) plus the payload
+MSG_HELLO, MSG_ASSIGN, MSG_CHAT, MSG_NOTICE, MSG_EXIT = 1, 2, 3, 4, 5
+
+
+def frame(msg_type, payload=b""):
+    return struct.pack("!BBHIII", 1, msg_type, 0, 0, 0, len(payload)) + payload
+
+
+def hello_frame(name, room):
+    name = name.encode() if isinstance(name, str) else name
+    room = room.encode() if isinstance(room, str) else room
+    return frame(MSG_HELLO, bytes([len(name)]) + name + room)
+
+
+def chat_frame(text):
+    return frame(MSG_EXIT) if text in ("#exit", b"#exit") else \
+        frame(MSG_CHAT, text.encode() if isinstance(text, str) else text)
+
+
+def read_assigned_port(sock):
+    """Reads the MSG_ASSIGN reply of the load balancer"""
+    data = b""
+    while len(data) < 20:
+        chunk = sock.recv(20 - len(data))
+        if not chunk:
+            break
+        data += chunk
+    return struct.unpack("!I", data[16:20])[0] if len(data) == 20 else -1
 
 class TestLoadBalancer(unittest.TestCase):
     @classmethod
@@ -28,9 +60,9 @@ class TestLoadBalancer(unittest.TestCase):
     def test_lb_server_assignment(self):
         client = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
         client.connect(('localhost', 6000))
-        client.send(b"TestClient\nRoom1")
-        port = client.recv(4)
-        self.assertTrue(8000 <= int.from_bytes(port, 'big') <= 8002)
+        client.send(hello_frame("TestClient", "Room1"))
+        port = read_assigned_port(client)
+        self.assertTrue(8000 <= port <= 8002)
         client.close()
 
     def test_lb_multiple_clients(self):
@@ -39,8 +71,8 @@ class TestLoadBalancer(unittest.TestCase):
         for i in range(5):
             client = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
             client.connect(('localhost', 6000))
-            client.send(f"TestClient{i}\nRoom1".encode())
-            port = int.from_bytes(client.recv(4), 'big')
+            client.send(hello_frame(f"TestClient{i}", "Room1"))
+            port = read_assigned_port(client)
             ports.add(port)
             clients.append(client)
         
@@ -51,16 +83,16 @@ class TestLoadBalancer(unittest.TestCase):
     def test_lb_server_failure_recovery(self):
         client = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
         client.connect(('localhost', 6000))
-        client.send(b"TestClient\nRoom1")
-        port = client.recv(4)
+        client.send(hello_frame("TestClient", "Room1"))
+        port = read_assigned_port(client)
         client.close()
         
         # Try reconnecting immediately
         client = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
         client.connect(('localhost', 6000))
-        client.send(b"TestClient\nRoom1")
-        new_port = client.recv(4)
-        self.assertTrue(8000 <= int.from_bytes(new_port, 'big') <= 8002)
+        client.send(hello_frame("TestClient", "Room1"))
+        new_port = read_assigned_port(client)
+        self.assertTrue(8000 <= new_port <= 8002)
         client.close()
 
     @classmethod
@@ -80,7 +112,7 @@ class TestServer(unittest.TestCase):
     def test_server_client_connection(self):
         client = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
         client.connect(('localhost', 9000))
-        client.send(b"TestClient\nTestRoom")
+        client.send(hello_frame("TestClient", "TestRoom"))
         time.sleep(0.1)
         self.assertTrue(client.fileno() > 0)
         client.close()
@@ -94,11 +126,11 @@ class TestServer(unittest.TestCase):
         client2.connect(('localhost', 9000))
         
         # Join same room
-        client1.send(b"Client1\nRoom1")
-        client2.send(b"Client2\nRoom1")
+        client1.send(hello_frame("Client1", "Room1"))
+        client2.send(hello_frame("Client2", "Room1"))
         
         # Send message from client1
-        client1.send(b"Hello from Client1")
+        client1.send(chat_frame(b"Hello from Client1"))
         
         # Check if client2 receives the message
         received = client2.recv(256)
@@ -112,11 +144,11 @@ class TestServer(unittest.TestCase):
         for i in range(3):
             client = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
             client.connect(('localhost', 9000))
-            client.send(f"Client{i}\nRoom{i%2}".encode())
+            client.send(hello_frame(f"Client{i}", f"Room{i%2}"))
             clients.append(client)
         
         # Send message in Room0
-        clients[0].send(b"Message to Room0")
+        clients[0].send(chat_frame(b"Message to Room0"))
         time.sleep(0.1)
         
         # Client2 should receive it (same room)
@@ -133,14 +165,14 @@ class TestServer(unittest.TestCase):
         client1.connect(('localhost', 9000))
         client2.connect(('localhost', 9000))
         
-        client1.send(b"Client1\nRoom1")
-        client2.send(b"Client2\nRoom1")
+        client1.send(hello_frame("Client1", "Room1"))
+        client2.send(hello_frame("Client2", "Room1"))
         
         client1.close()
         time.sleep(0.1)
         
         # Client2 should still be able to send/receive
-        client2.send(b"Test message")
+        client2.send(chat_frame(b"Test message"))
         client2.close()
 
     @classmethod
@@ -184,13 +216,13 @@ class TestClient(unittest.TestCase):
         def run_client(name, room, messages):
             client = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
             client.connect(('localhost', 9500))
-            client.send(f"{name}\n{room}".encode())
+            client.send(hello_frame(name, room))
             
             for msg in messages:
-                client.send(msg.encode())
+                client.send(chat_frame(msg.encode()))
                 time.sleep(0.1)
             
-            client.send(b"#exit")
+            client.send(chat_frame(b"#exit"))
             client.close()
 
         # Test two clients communicating
@@ -232,10 +264,10 @@ class TestClient(unittest.TestCase):
     def test_client_long_messages(self):
         client = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
         client.connect(('localhost', 9500))
-        client.send(b"TestClient\nTestRoom")
+        client.send(hello_frame("TestClient", "TestRoom"))
         
         long_message = "A" * 1024
-        client.send(long_message.encode())
+        client.send(chat_frame(long_message.encode()))
         time.sleep(0.1)
         client.close()
 
@@ -301,8 +333,8 @@ class TestIntegration(unittest.TestCase):
         for i in range(10):
             client = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
             client.connect(('localhost', 6000))
-            client.send(f"TestClient{i}\nRoom{i%3}".encode())
-            port = int.from_bytes(client.recv(4), 'big')
+            client.send(hello_frame(f"TestClient{i}", f"Room{i%3}"))
+            port = read_assigned_port(client)
             clients.append((client, port))
         
         # Check distribution across servers
@@ -316,12 +348,12 @@ class TestIntegration(unittest.TestCase):
         def run_room_client(name, room, send_msg, expect_msg):
             client = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
             client.connect(('localhost', 6000))
-            client.send(f"{name}\n{room}".encode())
-            port = client.recv(4)
-            client.connect(('localhost', int.from_bytes(port, 'big')))
+            client.send(hello_frame(name, room))
+            port = read_assigned_port(client)
+            client.connect(('localhost', port))
             
             if send_msg:
-                client.send(send_msg.encode())
+                client.send(chat_frame(send_msg.encode()))
             
             if expect_msg:
                 received = client.recv(256)
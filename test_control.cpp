@@ -0,0 +1,384 @@
+/*
+ * test_control.cpp
+ * Checks the balancer's control connections in control.h against a stand-in
+ * server: pipelined requests, placement notices from many threads, room
+ * reports and migrations, servers added and removed while it runs, and
+ * servers that go away, stop answering, flap or never accept
+ */
+#include <poll.h>
+#include "control.h"
+#include "test.h"
+
+const int THREADS = 4;
+const int NOTICES = 2000;
+
+ControlConfig fast_config()
+{
+    ControlConfig config;
+    config.load_interval = 20;
+    config.ping_interval = 20;
+    config.timeout = 200;
+    config.retry_interval = 50;
+    return config;
+}
+
+// Answers control connections on a loopback port the way server.cpp does,
+// one connection at a time
+class FakeServer
+{
+    int listen_id;
+    thread worker;
+    atomic<bool> stopping{false};
+
+    void answer(int socket_id, const Frame &frame)
+    {
+        string reply;
+        if (frame.header.type == MSG_CONTROL)
+            controls++;
+        else if (frame.header.type == MSG_PLACE)
+        {
+            lock_guard<mutex> guard(rooms_mutex);
+            rooms.emplace_back(frame.payload, frame.length);
+        }
+        else if (frame.header.type == MSG_MIGRATE)
+        {
+            uint32_t port;
+            string room, host;
+            if (read_migrate(frame, room, port, host))
+            {
+                lock_guard<mutex> guard(rooms_mutex);
+                migrations.emplace_back(room, port);
+                migration_hosts.push_back(host);
+            }
+        }
+        else if (mute.load())
+            return;
+        else if (frame.header.type == MSG_PING)
+            encode_frame(reply, MSG_PONG, frame.header.sender_id, 0);
+        else if (frame.header.type == MSG_LOAD_QUERY)
+        {
+            LoadReport report;
+            report.users = load.load();
+            reply.resize(LOAD_FRAME_SIZE);
+            put_load_frame(&reply[0], frame.header.sender_id, report);
+        }
+        else if (frame.header.type == MSG_ROOM_QUERY)
+            encode_room_loads(reply, frame.header.sender_id, {{"big", 9}, {"small", 2}});
+        if (!reply.empty())
+            send_all(socket_id, reply);
+    }
+
+    // Serves one connection until it ends or the test hangs up
+    void serve(int socket_id)
+    {
+        FrameDecoder decoder;
+        Frame frame;
+        while (!stopping.load() && !hang_up.load())
+        {
+            struct pollfd pfd = {socket_id, POLLIN, 0};
+            if (poll(&pfd, 1, 20) == 0)
+                continue;
+            size_t available;
+            char *space = decoder.write_space(4096, available);
+            ssize_t n = recv(socket_id, space, available, 0);
+            if (n <= 0)
+                break;
+            decoder.commit(n);
+            while (decoder.next(frame) == 1)
+                answer(socket_id, frame);
+        }
+        close(socket_id);
+    }
+
+public:
+    int port = 0;
+    atomic<int> load{42};
+    atomic<bool> mute{false};    // stop answering, but keep the connection
+    atomic<bool> hang_up{false}; // close the current connection
+    atomic<int> controls{0};
+    mutex rooms_mutex;
+    vector<string> rooms; // placement notices, in arrival order
+    vector<pair<string, int>> migrations;
+    vector<string> migration_hosts;
+
+    FakeServer()
+    {
+        listen_id = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in address;
+        memset(&address, 0, sizeof address);
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        bind(listen_id, (struct sockaddr *)&address, sizeof address);
+        socklen_t length = sizeof address;
+        getsockname(listen_id, (struct sockaddr *)&address, &length);
+        port = ntohs(address.sin_port);
+        listen(listen_id, 4);
+        worker = thread([this] {
+            while (!stopping.load())
+            {
+                int socket_id = accept(listen_id, NULL, NULL);
+                if (socket_id == -1)
+                    break;
+                hang_up.store(false);
+                serve(socket_id);
+            }
+        });
+    }
+
+    ~FakeServer()
+    {
+        stopping.store(true);
+        shutdown(listen_id, SHUT_RDWR);
+        worker.join();
+        close(listen_id);
+    }
+};
+
+// Polls until done() holds or the time is up
+bool wait_for(function<bool()> done, int timeout_ms = 2000)
+{
+    for (int waited = 0; waited < timeout_ms; waited += 5)
+    {
+        if (done())
+            return true;
+        this_thread::sleep_for(chrono::milliseconds(5));
+    }
+    return done();
+}
+
+struct Observed
+{
+    atomic<int> load{-2};
+    atomic<int> up{-1};
+    atomic<int> downs{0};
+    mutex rooms_mutex;
+    vector<pair<string, int>> rooms;
+};
+
+bool start(ControlPlane &control, int port, Observed &seen, ControlConfig config = fast_config())
+{
+    return control.start(
+        {port}, config, [&seen](int, const LoadReport *load) { seen.load = load ? (int)load->users : -1; },
+        [&seen](int, bool up) {
+            seen.up = up;
+            if (!up)
+                seen.downs++;
+        },
+        [&seen](int, const vector<pair<string, int>> &rooms) {
+            lock_guard<mutex> guard(seen.rooms_mutex);
+            seen.rooms = rooms;
+        });
+}
+
+void test_loads_and_notices_are_pipelined()
+{
+    FakeServer server;
+    Observed seen;
+    ControlPlane control;
+    CHECK(start(control, server.port, seen));
+    CHECK(wait_for([&] { return seen.up == 1 && seen.load == 42; }));
+    server.load = 7;
+    CHECK(wait_for([&] { return seen.load == 7; }));
+
+    vector<thread> placers;
+    for (int t = 0; t < THREADS; t++)
+        placers.emplace_back([&, t] {
+            for (int i = 0; i < NOTICES; i++)
+                control.notify_placement(server.port, to_string(t) + ":" + to_string(i));
+        });
+    for (thread &placer : placers)
+        placer.join();
+    control.notify_placement(server.port + 1, "elsewhere"); // not one of ours
+    CHECK(wait_for([&] {
+        lock_guard<mutex> guard(server.rooms_mutex);
+        return server.rooms.size() == (size_t)THREADS * NOTICES;
+    }));
+    {
+        lock_guard<mutex> guard(server.rooms_mutex);
+        vector<int> next(THREADS, 0);
+        for (const string &room : server.rooms)
+        {
+            int t = stoi(room.substr(0, room.find(':')));
+            CHECK(room == to_string(t) + ":" + to_string(next[t]));
+            next[t]++;
+        }
+    }
+    // One connection for everything, and notices share their writes
+    CHECK(control.connects == 1 && server.controls == 1);
+    CHECK(control.writes < control.requests / 4);
+    CHECK(control.dropped == 0);
+    // The pings that brought it up were timed
+    vector<uint64_t> counts;
+    double sum;
+    control.ping_latency.collect(counts, sum);
+    CHECK(accumulate(counts.begin(), counts.end(), 0ULL) > 0 && counts.back() == 0);
+}
+
+// A closed connection marks the server down at once; it is reopened
+void test_reconnects_after_hang_up()
+{
+    FakeServer server;
+    Observed seen;
+    ControlPlane control;
+    CHECK(start(control, server.port, seen));
+    CHECK(wait_for([&] { return seen.up == 1; }));
+    server.hang_up = true;
+    CHECK(wait_for([&] { return seen.downs == 1; }));
+    CHECK(wait_for([&] { return seen.up == 1 && seen.load == 42; }));
+    CHECK(control.connects == 2 && server.controls == 2);
+}
+
+// A server that stops answering is down once a request times out
+void test_silent_server_times_out()
+{
+    FakeServer server;
+    Observed seen;
+    ControlPlane control;
+    CHECK(start(control, server.port, seen));
+    CHECK(wait_for([&] { return seen.up == 1; }));
+    server.mute = true;
+    CHECK(wait_for([&] { return seen.up == 0 && seen.load == -1; }));
+    server.mute = false;
+    CHECK(wait_for([&] { return seen.up == 1; }));
+}
+
+// A server that keeps dropping its connection is held back even while it
+// answers, until it has been quiet for a while
+void test_flapping_server_is_suppressed()
+{
+    FakeServer server;
+    Observed seen;
+    ControlPlane control;
+    ControlConfig config = fast_config();
+    config.detector.flap_half_life = 1000;
+    CHECK(start(control, server.port, seen, config));
+    CHECK(wait_for([&] { return seen.up == 1; }));
+    for (int flap = 1; flap <= 3; flap++)
+    {
+        server.hang_up = true;
+        CHECK(wait_for([&] { return seen.downs == flap; }));
+        CHECK(wait_for([&] { return control.connects == (uint64_t)flap + 1 && seen.load == 42; }));
+    }
+    // Connected and answering, but not used yet
+    this_thread::sleep_for(chrono::milliseconds(300));
+    CHECK(seen.up == 0);
+    CHECK(wait_for([&] { return seen.up == 1; }, 4000));
+}
+
+// A SYN the server never answers must not hold up the connection: the
+// accept queue of a listener with backlog 0 is full after one connection,
+// and later connects hang the way they do against a blackholed host
+void test_blackholed_connect_times_out()
+{
+    int listen_id = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof address);
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(listen_id, (struct sockaddr *)&address, sizeof address);
+    socklen_t length = sizeof address;
+    getsockname(listen_id, (struct sockaddr *)&address, &length);
+    listen(listen_id, 0);
+    int filler = socket(AF_INET, SOCK_STREAM, 0);
+    CHECK(connect(filler, (struct sockaddr *)&address, sizeof address) == 0);
+
+    Observed seen;
+    ControlPlane control;
+    auto started = chrono::steady_clock::now();
+    CHECK(start(control, ntohs(address.sin_port), seen));
+    CHECK(wait_for([&] { return seen.up == 0; }));
+    auto waited = chrono::steady_clock::now() - started;
+    CHECK(waited >= chrono::milliseconds(fast_config().timeout));
+    CHECK(control.connects == 0);
+    control.stop();
+    close(filler);
+    close(listen_id);
+}
+
+// Room sizes are polled; a migration sent while the server is away is
+// delivered once it is back, since its clients are still waiting there
+void test_room_reports_and_held_migrations()
+{
+    FakeServer server;
+    Observed seen;
+    ControlPlane control;
+    ControlConfig config = fast_config();
+    config.room_interval = 20;
+    CHECK(start(control, server.port, seen, config));
+    CHECK(wait_for([&] {
+        lock_guard<mutex> guard(seen.rooms_mutex);
+        return seen.rooms == vector<pair<string, int>>{{"big", 9}, {"small", 2}};
+    }));
+    server.hang_up = true;
+    CHECK(wait_for([&] { return seen.downs == 1; }));
+    control.migrate(server.port, "small", 9001, "chat2.example");
+    CHECK(wait_for([&] {
+        lock_guard<mutex> guard(server.rooms_mutex);
+        return !server.migrations.empty();
+    }));
+    lock_guard<mutex> guard(server.rooms_mutex);
+    CHECK(server.migrations == (vector<pair<string, int>>{{"small", 9001}}));
+    CHECK(server.migration_hosts == vector<string>{"chat2.example"});
+}
+
+// Nothing listening: down right away, and placements are not kept for later
+void test_unreachable_server()
+{
+    int port;
+    {
+        FakeServer gone;
+        port = gone.port;
+    }
+    Observed seen;
+    ControlPlane control;
+    CHECK(start(control, port, seen));
+    CHECK(wait_for([&] { return seen.up == 0; }));
+    control.notify_placement(port, "lost");
+    CHECK(wait_for([&] { return control.dropped == 1; }));
+    CHECK(control.connects == 0 && control.replies == 0);
+}
+
+// Servers added later are watched like the first ones; a removed server
+// is let go without being reported down
+void test_servers_added_and_removed()
+{
+    FakeServer first, second;
+    Observed seen;
+    ControlPlane control;
+    CHECK(start(control, first.port, seen));
+    CHECK(wait_for([&] { return seen.up == 1; }));
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof address);
+    address.sin_family = AF_INET;
+    address.sin_port = htons(second.port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    control.add_server(second.port, address);
+    CHECK(wait_for([&] { return second.controls == 1; }));
+    control.notify_placement(second.port, "added");
+    CHECK(wait_for([&] {
+        lock_guard<mutex> guard(second.rooms_mutex);
+        return second.rooms == vector<string>{"added"};
+    }));
+
+    control.remove_server(first.port);
+    this_thread::sleep_for(chrono::milliseconds(100));
+    control.notify_placement(first.port, "removed");
+    this_thread::sleep_for(chrono::milliseconds(100));
+    CHECK(seen.downs == 0);
+    CHECK(control.connects == 2);
+    lock_guard<mutex> guard(first.rooms_mutex);
+    CHECK(first.rooms.empty());
+}
+
+int main()
+{
+    test_loads_and_notices_are_pipelined();
+    test_reconnects_after_hang_up();
+    test_silent_server_times_out();
+    test_flapping_server_is_suppressed();
+    test_blackholed_connect_times_out();
+    test_room_reports_and_held_migrations();
+    test_unreachable_server();
+    test_servers_added_and_removed();
+    return test_result("test_control");
+}
@@ -0,0 +1,98 @@
+/*
+ * test_detector.cpp
+ * Checks the phi-accrual failure detector and flap damping in detector.h on
+ * a simulated clock
+ */
+#include "detector.h"
+#include "test.h"
+
+const double MIN_STD_DEV = 20;
+
+// Heartbeats every `gap` ms, or alternating between two gaps; returns the
+// time of the last one
+double beat(PhiDetector &detector, int beats, double gap, double other_gap = -1)
+{
+    double now = 0;
+    detector.reset(gap);
+    for (int i = 0; i < beats; i++)
+    {
+        now += i % 2 && other_gap >= 0 ? other_gap : gap;
+        detector.heartbeat(now);
+    }
+    return now;
+}
+
+void test_phi_grows_with_silence()
+{
+    PhiDetector detector;
+    CHECK(detector.phi(1000, MIN_STD_DEV) == 0); // no heartbeat yet
+    double last = beat(detector, 50, 100);
+    CHECK(detector.phi(last + 50, MIN_STD_DEV) < 1);
+    CHECK(detector.phi(last + 100, MIN_STD_DEV) < 1);
+    double previous = 0;
+    for (double silence = 100; silence <= 400; silence += 20)
+    {
+        double phi = detector.phi(last + silence, MIN_STD_DEV);
+        CHECK(phi >= previous);
+        previous = phi;
+    }
+    // A few intervals of silence on a steady link is far past any threshold
+    CHECK(detector.phi(last + 300, MIN_STD_DEV) > 8);
+    // A heartbeat clears the suspicion
+    detector.heartbeat(last + 300);
+    CHECK(detector.phi(last + 350, MIN_STD_DEV) < 1);
+}
+
+// The same silence is less suspicious on a link whose heartbeats have
+// always been irregular
+void test_phi_adapts_to_jitter()
+{
+    PhiDetector steady, jittery;
+    double steady_last = beat(steady, 50, 100);
+    double jittery_last = beat(jittery, 50, 20, 180);
+    double silence = 250;
+    CHECK(jittery.phi(jittery_last + silence, MIN_STD_DEV) < 8);
+    CHECK(steady.phi(steady_last + silence, MIN_STD_DEV) > 8);
+    CHECK(jittery.phi(jittery_last + silence, MIN_STD_DEV) < steady.phi(steady_last + silence, MIN_STD_DEV));
+}
+
+// The floor on the spread keeps a perfectly regular link from failing over
+// on the first late heartbeat
+void test_min_std_dev_damps_regular_links()
+{
+    PhiDetector detector;
+    double last = beat(detector, 50, 100);
+    CHECK(detector.phi(last + 130, MIN_STD_DEV) < 8);
+    CHECK(detector.phi(last + 130, 1) > 8);
+}
+
+void test_flap_damping()
+{
+    DetectorConfig config;
+    FlapDamper damper;
+    CHECK(damper.usable(config, 0));
+    damper.failed(config, 0);
+    CHECK(damper.usable(config, 0)); // one failure is not a flap
+    damper.failed(config, 1000);
+    damper.failed(config, 2000);
+    CHECK(!damper.usable(config, 2000));
+    CHECK(!damper.usable(config, 15000));
+    // Penalty 2804 at t=2000 halves every 10 s: below 750 after about 19 s
+    CHECK(damper.usable(config, 22000));
+    CHECK(damper.current() < config.flap_reuse);
+
+    // Failures far apart never add up
+    FlapDamper rare;
+    for (int i = 0; i < 10; i++)
+        rare.failed(config, i * 60000.0);
+    CHECK(rare.usable(config, 10 * 60000.0));
+}
+
+int main()
+{
+    test_phi_grows_with_silence();
+    test_phi_adapts_to_jitter();
+    test_min_std_dev_damps_regular_links();
+    test_flap_damping();
+    return test_result("test_detector");
+}
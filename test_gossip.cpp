@@ -0,0 +1,234 @@
+/*
+ * test_gossip.cpp
+ * Runs balancers' gossip (gossip.h) against each other on loopback: shared
+ * placements, conflicting ones, catching up after a late start, a slow
+ * placement handler, the agreed server health and the leader
+ */
+#include "gossip.h"
+#include "test.h"
+
+bool wait_for(const function<bool()> &cond, int ms = 3000)
+{
+    for (int waited = 0; waited < ms; waited += 5)
+    {
+        if (cond())
+            return true;
+        this_thread::sleep_for(chrono::milliseconds(5));
+    }
+    return cond();
+}
+
+// A port nothing listens on right now
+int free_port()
+{
+    int socket_id = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof address);
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof address;
+    bind(socket_id, (struct sockaddr *)&address, sizeof address);
+    getsockname(socket_id, (struct sockaddr *)&address, &length);
+    close(socket_id);
+    return ntohs(address.sin_port);
+}
+
+// One balancer: its routing table, what it sees of the servers and its gossip
+struct Balancer
+{
+    mutex table_mutex;
+    map<string, int> table;
+    map<int, bool> servers = {{8000, true}, {8001, true}};
+    int overridden = 0; // own placements a peer's replaced
+    atomic<bool> stall{false}, stalled{false}; // hold up applying a peer's placement of "slow"
+    Gossip gossip;
+    GossipConfig config;
+
+    Balancer(uint32_t id, int port)
+    {
+        config.id = id;
+        config.port = port;
+        config.interval = 20;
+        config.timeout = 200;
+        config.retry_interval = 50;
+    }
+
+    bool start(const vector<pair<string, int>> &known = {})
+    {
+        for (auto &placement : known)
+            table[placement.first] = placement.second;
+        return gossip.start(config, known,
+                            [this](const string &room, int port, bool ours) {
+                                while (stall && room == "slow")
+                                {
+                                    stalled = true;
+                                    this_thread::sleep_for(chrono::milliseconds(1));
+                                }
+                                lock_guard<mutex> guard(table_mutex);
+                                table[room] = port;
+                                overridden += ours;
+                            },
+                            [this] {
+                                lock_guard<mutex> guard(table_mutex);
+                                return vector<pair<int, bool>>(servers.begin(), servers.end());
+                            });
+    }
+
+    void place(const string &room, int port)
+    {
+        gossip.place(room, port, [&] {
+            lock_guard<mutex> guard(table_mutex);
+            table[room] = port;
+            return true;
+        });
+    }
+
+    int lookup(const string &room)
+    {
+        lock_guard<mutex> guard(table_mutex);
+        auto found = table.find(room);
+        return found == table.end() ? 0 : found->second;
+    }
+};
+
+void connect_pair(Balancer &a, Balancer &b)
+{
+    a.config.peers = {{"127.0.0.1", b.config.port}};
+    b.config.peers = {{"localhost", a.config.port}};
+}
+
+void test_placements_reach_peers()
+{
+    Balancer a(1, free_port()), b(2, free_port());
+    connect_pair(a, b);
+    CHECK(a.start() && b.start());
+    a.place("lobby", 8000);
+    b.place("games", 8001);
+    CHECK(wait_for([&] { return b.lookup("lobby") == 8000 && a.lookup("games") == 8001; }));
+    // A later move wins over the first placement, on both
+    a.place("lobby", 8001);
+    CHECK(wait_for([&] { return b.lookup("lobby") == 8001; }));
+    CHECK(a.lookup("lobby") == 8001);
+    CHECK(b.overridden == 0);
+}
+
+// Both place the same rooms at once: each side ends up with the same winner
+void test_conflicts_converge()
+{
+    Balancer a(1, free_port()), b(2, free_port());
+    connect_pair(a, b);
+    CHECK(a.start() && b.start());
+    for (int i = 0; i < 200; i++)
+    {
+        a.place("room" + to_string(i), 8000);
+        b.place("room" + to_string(i), 8001);
+    }
+    CHECK(wait_for([&] {
+        for (int i = 0; i < 200; i++)
+            if (a.lookup("room" + to_string(i)) != b.lookup("room" + to_string(i)))
+                return false;
+        return true;
+    }));
+    // b places second and has the higher id, so it wins every tie
+    int b_won = 0;
+    for (int i = 0; i < 200; i++)
+        b_won += a.lookup("room" + to_string(i)) == 8001;
+    CHECK(b_won == 200);
+    CHECK(a.overridden == 200);
+}
+
+// A balancer that starts late is sent everything, restored placements too
+void test_late_start_catches_up()
+{
+    Balancer a(1, free_port()), b(2, free_port());
+    connect_pair(a, b);
+    CHECK(a.start({{"restored", 8001}}));
+    for (int i = 0; i < 1000; i++)
+        a.place("room" + to_string(i), 8000 + i % 2);
+    this_thread::sleep_for(chrono::milliseconds(100)); // a keeps retrying b
+    CHECK(b.start());
+    CHECK(wait_for([&] { return b.lookup("room999") == 8001 && b.lookup("restored") == 8001; }));
+    for (int i = 0; i < 1000; i++)
+        CHECK(b.lookup("room" + to_string(i)) == 8000 + i % 2);
+    // A log replayed on b ranks below what a placed since
+    Balancer c(3, free_port());
+    c.config.peers = {{"127.0.0.1", a.config.port}};
+    a.gossip.stop();
+    a.config.peers.push_back({"127.0.0.1", c.config.port});
+    CHECK(a.start());
+    CHECK(c.start({{"room0", 8001}}));
+    CHECK(wait_for([&] { return c.lookup("room0") == 8000; }));
+}
+
+// A peer's placement is applied outside the placement lock, so while one
+// room's update is slow other rooms are still placed
+void test_slow_apply_holds_up_only_its_room()
+{
+    Balancer a(1, free_port()), b(2, free_port());
+    connect_pair(a, b);
+    b.stall = true;
+    CHECK(a.start() && b.start());
+    a.place("slow", 8000);
+    CHECK(wait_for([&] { return b.stalled.load(); }));
+    atomic<bool> placed{false};
+    thread placer([&] {
+        b.place("fast", 8001); // another apply lock than "slow"
+        placed = true;
+    });
+    CHECK(wait_for([&] { return placed.load(); }, 1000));
+    CHECK(b.lookup("fast") == 8001 && b.lookup("slow") == 0);
+    b.stall = false;
+    placer.join();
+    CHECK(wait_for([&] { return b.lookup("slow") == 8000 && a.lookup("fast") == 8001; }));
+}
+
+void test_health_and_leader()
+{
+    Balancer a(1, free_port()), b(2, free_port());
+    connect_pair(a, b);
+    {
+        lock_guard<mutex> guard(a.table_mutex);
+        a.servers[8001] = false; // a cannot reach 8001
+    }
+    CHECK(a.start() && b.start());
+    CHECK(wait_for([&] { return a.gossip.live_peers() == 1 && b.gossip.live_peers() == 1; }));
+    CHECK(wait_for([&] { return !b.gossip.agreed_up(8001); }));
+    CHECK(b.gossip.agreed_up(8000) && b.gossip.agreed_up(9999));
+    // A server added to a after the start is agreed on too
+    {
+        lock_guard<mutex> guard(a.table_mutex);
+        a.servers[9100] = false;
+    }
+    CHECK(wait_for([&] { return !b.gossip.agreed_up(9100); }));
+    {
+        lock_guard<mutex> guard(a.table_mutex);
+        a.servers.erase(9100);
+    }
+    CHECK(wait_for([&] { return b.gossip.agreed_up(9100); }));
+    CHECK(a.gossip.leading() && !b.gossip.leading());
+    // Once a is gone, b leads and goes by its own view again
+    a.gossip.stop();
+    CHECK(wait_for([&] { return b.gossip.leading() && b.gossip.agreed_up(8001); }));
+    CHECK(b.gossip.live_peers() == 0);
+}
+
+void test_parse_peers()
+{
+    vector<pair<string, int>> peers;
+    CHECK(parse_peers("10.0.0.2:7000,lb3:7001", peers));
+    CHECK(peers == (vector<pair<string, int>>{{"10.0.0.2", 7000}, {"lb3", 7001}}));
+    CHECK(!parse_peers("10.0.0.2", peers));
+    CHECK(!parse_peers(":7000", peers));
+    CHECK(!parse_peers("lb3:x", peers));
+}
+
+int main()
+{
+    test_placements_reach_peers();
+    test_conflicts_converge();
+    test_late_start_catches_up();
+    test_slow_apply_holds_up_only_its_room();
+    test_health_and_leader();
+    test_parse_peers();
+    return test_result("test_gossip");
+}
@@ -0,0 +1,178 @@
+/*
+ * test_hash_ring.cpp
+ * Checks for the consistent-hash room placement, rebalancing and load
+ * weighting in balancer.h
+ */
+#include "balancer.h"
+#include "test.h"
+
+struct TestPool : public ServerPool
+{
+    vector<int> ports, loads;
+    vector<bool> status;
+
+    TestPool(int servers)
+    {
+        for (int i = 0; i < servers; i++)
+            addServer(8000 + i);
+    }
+    void addServer(int p)
+    {
+        ports.push_back(p);
+        loads.push_back(0);
+        status.push_back(true);
+    }
+    int size() const override { return ports.size(); }
+    int port(int idx) const override { return ports[idx]; }
+    bool up(int idx) const override { return status[idx]; }
+    int load(int idx) const override { return loads[idx]; }
+    int weight(int) const override { return 1; }
+};
+
+const int ROOMS = 20000;
+
+void test_even_spread()
+{
+    TestPool pool(5);
+    ConsistentHash hash(pool);
+    vector<int> count(5);
+    for (int r = 0; r < ROOMS; r++)
+        count[hash.pick("room" + to_string(r))]++;
+    for (int c : count)
+        CHECK(abs(c - ROOMS / 5) < ROOMS / 5 / 4); // within 25% of the mean
+}
+
+void test_adding_server_moves_one_nth()
+{
+    TestPool before(4), after(4);
+    after.addServer(8004);
+    ConsistentHash oldRing(before), newRing(after);
+    int moved = 0;
+    for (int r = 0; r < ROOMS; r++)
+    {
+        string room = "room" + to_string(r);
+        int from = oldRing.pick(room), to = newRing.pick(room);
+        if (from != to)
+        {
+            moved++;
+            CHECK(to == 4); // rooms only ever move to the new server
+        }
+    }
+    CHECK(abs(moved - ROOMS / 5) < ROOMS / 5 / 4);
+}
+
+void test_failed_server_only_moves_its_rooms()
+{
+    TestPool pool(4);
+    ConsistentHash hash(pool);
+    vector<int> placement(ROOMS);
+    for (int r = 0; r < ROOMS; r++)
+        placement[r] = hash.pick("room" + to_string(r));
+    pool.status[2] = false;
+    for (int r = 0; r < ROOMS; r++)
+    {
+        int now = hash.pick("room" + to_string(r));
+        CHECK(now != 2);
+        if (placement[r] != 2)
+            CHECK(now == placement[r]);
+    }
+    pool.status = vector<bool>(4, false);
+    CHECK(hash.pick("room") == -1);
+}
+
+void test_bounded_loads_cap_every_server()
+{
+    TestPool pool(4);
+    double epsilon = 0.25;
+    BoundedLoadHash bounded(pool, epsilon);
+    for (int r = 0; r < ROOMS; r++)
+    {
+        // Everyone asks for the same room hash region: the plain ring would
+        // put all of them on one server
+        int idx = bounded.pick("hot-room");
+        pool.loads[idx]++;
+        long long total = accumulate(pool.loads.begin(), pool.loads.end(), 0LL);
+        CHECK(pool.loads[idx] <= ceil((1 + epsilon) * total / 4) + 1);
+    }
+    int first = ConsistentHash(pool).pick("hot-room");
+    CHECK(pool.loads[first] < ROOMS); // the hot spot spilled over
+}
+
+// One hot server sheds the room that evens it out best with the coolest
+// server; a balanced pool, or a room too big to help, stays put
+void test_rebalance_moves_best_room_off_hot_server()
+{
+    TestPool pool(3);
+    vector<vector<pair<string, int>>> rooms(3);
+    pool.loads = {10, 10, 10};
+    rooms[0] = {{"a", 6}, {"b", 4}};
+    CHECK(plan_rebalance(pool, rooms, 0.25).empty());
+
+    pool.loads = {40, 10, 4};
+    rooms[0] = {{"big", 38}, {"mid", 17}, {"small", 2}};
+    vector<Migration> moves = plan_rebalance(pool, rooms, 0.25);
+    CHECK(moves.size() == 1);
+    CHECK(moves[0].room == "mid" && moves[0].from == 0 && moves[0].to == 2 && moves[0].members == 17);
+
+    // Moving the only room would just move the hot spot
+    rooms[0] = {{"big", 40}};
+    CHECK(plan_rebalance(pool, rooms, 0.25).empty());
+
+    // A room carries its share of the weighted load, not just its members:
+    // moving either of these would only swap the hot spot
+    pool.loads = {30, 16, 4};
+    rooms[0] = {{"chatty", 5}, {"busy", 5}};
+    pool.status[2] = false;
+    CHECK(plan_rebalance(pool, rooms, 0.25).empty());
+    pool.status[2] = true;
+
+    // Down servers and unknown loads take no part
+    pool.loads = {40, 10, 4};
+    rooms[0] = {{"mid", 17}, {"rest", 23}};
+    pool.status[2] = false;
+    moves = plan_rebalance(pool, rooms, 0.25);
+    CHECK(moves.size() == 1 && moves[0].room == "mid" && moves[0].to == 1 && moves[0].load == 17);
+    pool.loads[1] = INT_MAX;
+    CHECK(plan_rebalance(pool, rooms, 0.25).empty());
+}
+
+// Fifty busy rooms load a server more than sixty idle clients
+void test_weighted_load_counts_activity()
+{
+    LoadWeights weights;
+    LoadReport busy, idle;
+    busy.users = 50;
+    busy.rooms = 50;
+    busy.messages_per_sec = 500;
+    busy.bytes_per_sec = 500 * 1024;
+    busy.cpu_permille = 300;
+    idle.users = 60;
+    idle.rooms = 3;
+    idle.cpu_permille = 10;
+    CHECK(weights.score(busy) > 2 * weights.score(idle));
+    CHECK(weights.score(idle) == 63);
+
+    // Only client counts, as before
+    LoadWeights count;
+    CHECK(count.parse("rooms=0,msgs=0,kbps=0,queued=0,cpu=0"));
+    CHECK(count.score(busy) == 50 && count.score(idle) == 60);
+    CHECK(!count.parse("users=1,latency=3"));
+    CHECK(!count.parse("users=x"));
+    CHECK(!count.parse("cpu=-1"));
+
+    LoadReport backlog;
+    backlog.queued_bytes = UINT32_MAX; // saturates below the "unknown" INT_MAX
+    weights.queued = 1e9;
+    CHECK(weights.score(backlog) == INT_MAX - 1);
+}
+
+int main()
+{
+    test_even_spread();
+    test_adding_server_moves_one_nth();
+    test_failed_server_only_moves_its_rooms();
+    test_bounded_loads_cap_every_server();
+    test_rebalance_moves_best_room_off_hot_server();
+    test_weighted_load_counts_activity();
+    return test_result("test_hash_ring");
+}
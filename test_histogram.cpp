@@ -0,0 +1,72 @@
+/*
+ * test_histogram.cpp
+ * Checks the percentiles, precision and merging of histogram.h
+ */
+#include "histogram.h"
+#include "test.h"
+
+// Within one bucket of the exact value: 1/128 above it at most
+bool close_to(uint64_t got, uint64_t exact) { return got >= exact && got <= exact + exact / 128 + 1; }
+
+void test_empty()
+{
+    Histogram histogram;
+    CHECK(histogram.count() == 0 && histogram.percentile(50) == 0 && histogram.min() == 0 && histogram.max() == 0);
+}
+
+void test_percentiles_of_uniform_values()
+{
+    Histogram histogram;
+    for (uint64_t value = 1; value <= 1000000; value++)
+        histogram.record(value);
+    CHECK(histogram.count() == 1000000);
+    CHECK(close_to(histogram.percentile(50), 500000));
+    CHECK(close_to(histogram.percentile(99), 990000));
+    CHECK(close_to(histogram.percentile(99.9), 999000));
+    CHECK(histogram.percentile(100) == 1000000);
+    CHECK(histogram.min() == 1 && histogram.max() == 1000000);
+    CHECK(fabs(histogram.mean() - 500000.5) < 1);
+}
+
+// Small values are exact, huge ones keep their relative precision
+void test_precision_across_magnitudes()
+{
+    for (uint64_t value : vector<uint64_t>{0, 1, 255, 256, 1000, 123456789, 1ULL << 40, UINT64_MAX / 3})
+    {
+        Histogram histogram;
+        histogram.record(value);
+        histogram.record(value);
+        CHECK(histogram.percentile(50) == value); // clipped to the largest value seen
+    }
+    for (uint64_t value : vector<uint64_t>{1000, 3000, 9000, 27000})
+    {
+        Histogram single;
+        single.record(value);
+        single.record(value * 100);
+        CHECK(close_to(single.percentile(50), value));
+    }
+}
+
+void test_merge_adds_counts()
+{
+    Histogram fast, slow, all;
+    for (int i = 0; i < 990; i++)
+        fast.record(1000);
+    for (int i = 0; i < 10; i++)
+        slow.record(1000000);
+    all.merge(fast);
+    all.merge(slow);
+    CHECK(all.count() == 1000);
+    CHECK(close_to(all.percentile(99), 1000));
+    CHECK(close_to(all.percentile(99.9), 1000000));
+    CHECK(all.min() == 1000 && all.max() == 1000000);
+}
+
+int main()
+{
+    test_empty();
+    test_percentiles_of_uniform_values();
+    test_precision_across_magnitudes();
+    test_merge_adds_counts();
+    return test_result("test_histogram");
+}
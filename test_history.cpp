@@ -0,0 +1,139 @@
+/*
+ * test_history.cpp
+ * Checks the per-room message rings and the memory-bounded cache of them
+ * in history.h
+ */
+#include "history.h"
+#include "test.h"
+
+// A server-to-client CHAT frame from "bob" saying text
+string chat(const string &text)
+{
+    string frame(named_frame_size("bob", text.size()), 0);
+    put_named_frame(&frame[0], MSG_CHAT, 7, room_id_of("lobby"), "bob", text.data(), text.size());
+    return frame;
+}
+
+// The texts of the frames in a replay, each checked to be a flagged CHAT
+vector<string> texts_of(const Message &replay)
+{
+    FrameDecoder decoder;
+    decoder.feed(replay.data(), replay.size());
+    vector<string> texts;
+    Frame frame;
+    while (decoder.next(frame) == 1)
+    {
+        string name, text;
+        CHECK(frame.header.type == MSG_CHAT && frame.header.flags == FLAG_HISTORY);
+        CHECK(split_named_payload(frame, name, text) && name == "bob");
+        texts.push_back(text);
+    }
+    CHECK(decoder.buffered() == 0);
+    return texts;
+}
+
+void test_ring()
+{
+    RoomHistory history(4);
+    Message replay;
+    CHECK(!history.replay(replay));
+    for (int i = 0; i < 3; i++)
+        CHECK(history.append(chat("m" + to_string(i)).data(), chat("m" + to_string(i)).size()));
+    CHECK(history.replay(replay));
+    CHECK(texts_of(replay) == vector<string>({"m0", "m1", "m2"}));
+
+    // Past the message limit the oldest go
+    for (int i = 3; i < 10; i++)
+    {
+        string frame = chat("m" + to_string(i));
+        history.append(frame.data(), frame.size());
+    }
+    CHECK(history.messages() == 4);
+    CHECK(history.replay(replay));
+    CHECK(texts_of(replay) == vector<string>({"m6", "m7", "m8", "m9"}));
+
+    // The frame that went out is left as it was
+    string frame = chat("live");
+    history.append(frame.data(), frame.size());
+    CHECK(frame == chat("live"));
+
+    // Too big to keep, and not a frame at all
+    string huge = chat(string(HISTORY_ARENA_MAX, 'x'));
+    CHECK(!history.append(huge.data(), huge.size()));
+    CHECK(!history.append("x", 1));
+    CHECK(history.messages() == 4);
+}
+
+void test_arena_growth_and_wrap()
+{
+    // Frames of changing sizes, so the ring wraps at every arena size and
+    // the arena grows while frames straddle its end
+    RoomHistory history(1000);
+    deque<string> expected;
+    size_t kept_bytes = 0;
+    for (int i = 0; i < 3000; i++)
+    {
+        string text = to_string(i) + string((i * 37) % 3000, 'a' + i % 26);
+        string frame = chat(text);
+        CHECK(history.append(frame.data(), frame.size()));
+        expected.push_back(text);
+        kept_bytes += frame.size();
+        while (expected.size() > 1000 || kept_bytes > HISTORY_ARENA_MAX)
+        {
+            kept_bytes -= chat(expected.front()).size();
+            expected.pop_front();
+        }
+        if (i % 97 == 0 || i == 2999)
+        {
+            Message replay;
+            CHECK(history.replay(replay) && replay.size() == kept_bytes);
+            vector<string> texts = texts_of(replay);
+            CHECK(texts == vector<string>(expected.begin(), expected.end()));
+        }
+    }
+    CHECK(history.bytes_used() == kept_bytes);
+    CHECK(history.footprint() >= HISTORY_ARENA_MAX);
+}
+
+void test_cache_budget()
+{
+    HistoryCache cache;
+    cache.max_messages = 8;
+    string frame = chat("hello");
+    CHECK(cache.record("a", frame.data(), frame.size()) == 0);
+    size_t one_room = cache.memory();
+    CHECK(one_room >= HISTORY_ARENA_MIN);
+    cache.budget = one_room * 3;
+    CHECK(cache.record("b", frame.data(), frame.size()) == 0);
+    CHECK(cache.record("c", frame.data(), frame.size()) == 0);
+    CHECK(cache.size() == 3);
+
+    // A join counts as use: "b" is now the idlest, and goes for "d"
+    Message replay;
+    CHECK(cache.replay("a", replay) && texts_of(replay) == vector<string>({"hello"}));
+    CHECK(cache.record("d", frame.data(), frame.size()) == 1);
+    CHECK(!cache.replay("b", replay));
+    CHECK(cache.replay("a", replay) && cache.replay("c", replay) && cache.replay("d", replay));
+    CHECK(cache.memory() <= cache.budget);
+
+    // A room over the budget on its own is kept, at the cost of all others
+    string big = chat(string(60000, 'y'));
+    CHECK(cache.record("big", big.data(), big.size()) == 3);
+    CHECK(cache.size() == 1 && cache.replay("big", replay));
+
+    cache.forget("big");
+    CHECK(cache.size() == 0 && cache.memory() == 0);
+
+    HistoryCache off;
+    off.max_messages = 0;
+    off.record("a", frame.data(), frame.size());
+    CHECK(off.size() == 0 && !off.replay("a", replay));
+}
+
+int main()
+{
+    test_ring();
+    test_arena_growth_and_wrap();
+    test_cache_budget();
+    return test_result("test_history");
+}
@@ -4,6 +4,38 @@ import time
 import threading
 import subprocess
 from typing import List, Tuple
+import struct
+
+
+# Wire format shared with protocol.h: a 16 byte header (version, type, flags,
+# sender id, room id, payload length; network byte order) plus the payload
+MSG_HELLO, MSG_ASSIGN, MSG_CHAT, MSG_NOTICE, MSG_EXIT = 1, 2, 3, 4, 5
+
+
+def frame(msg_type, payload=b""):
+    return struct.pack("!BBHIII", 1, msg_type, 0, 0, 0, len(payload)) + payload
+
+
+def hello_frame(name, room):
+    name = name.encode() if isinstance(name, str) else name
+    room = room.encode() if isinstance(room, str) else room
+    return frame(MSG_HELLO, bytes([len(name)]) + name + room)
+
+
+def chat_frame(text):
+    return frame(MSG_EXIT) if text in ("#exit", b"#exit") else \
+        frame(MSG_CHAT, text.encode() if isinstance(text, str) else text)
+
+
+def read_assigned_port(sock):
+    """Reads the MSG_ASSIGN reply of the load balancer"""
+    data = b""
+    while len(data) < 20:
+        chunk = sock.recv(20 - len(data))
+        if not chunk:
+            break
+        data += chunk
+    return struct.unpack("!I", data[16:20])[0] if len(data) == 20 else -1
 
 class TestChatSystem:
     @pytest.fixture(scope="session")
@@ -39,11 +71,10 @@ class TestChatSystem:
         client.connect(("localhost", 6000))
         
         # Send client name and room
-        client.send(b"TestClient")
-        client.send(b"Room1")
+        client.send(hello_frame(b"TestClient", b"Room1"))
         
         # Receive server port
-        server_port = int.from_bytes(client.recv(4), byteorder='big')
+        server_port = read_assigned_port(client)
         assert 8000 <= server_port <= 8002
         
         client.close()
@@ -53,9 +84,8 @@ class TestChatSystem:
         def connect_client(name: str, room: str) -> int:
             client = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
             client.connect(("localhost", 6000))
-            client.send(name.encode())
-            client.send(room.encode())
-            port = int.from_bytes(client.recv(4), byteorder='big')
+            client.send(hello_frame(name, room))
+            port = read_assigned_port(client)
             client.close()
             return port
             
@@ -70,9 +100,8 @@ class TestChatSystem:
         for i in range(5):
             client = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
             client.connect(("localhost", 6000))
-            client.send(f"Client{i}".encode())
-            client.send(f"Room{i}".encode())
-            port = int.from_bytes(client.recv(4), byteorder='big')
+            client.send(hello_frame(f"Client{i}", f"Room{i}"))
+            port = read_assigned_port(client)
             ports.append(port)
             client.close()
             
@@ -86,9 +115,8 @@ class TestChatSystem:
         # Get initial server assignment
         client = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
         client.connect(("localhost", 6000))
-        client.send(b"Client1")
-        client.send(b"Room1")
-        initial_port = int.from_bytes(client.recv(4), byteorder='big')
+        client.send(hello_frame(b"Client1", b"Room1"))
+        initial_port = read_assigned_port(client)
         client.close()
         
         # Kill server process for that port
@@ -99,9 +127,8 @@ class TestChatSystem:
         # Try connecting again
         client = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
         client.connect(("localhost", 6000))
-        client.send(b"Client2")
-        client.send(b"Room2")
-        new_port = int.from_bytes(client.recv(4), byteorder='big')
+        client.send(hello_frame(b"Client2", b"Room2"))
+        new_port = read_assigned_port(client)
         client.close()
         
         assert new_port != initial_port
@@ -114,11 +141,10 @@ class TestChatSystem:
             # Connect to load balancer
             lb_client = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
             lb_client.connect(("localhost", 6000))
-            lb_client.send(name.encode())
-            lb_client.send(room.encode())
+            lb_client.send(hello_frame(name, room))
             
             # Get server port and connect
-            server_port = int.from_bytes(lb_client.recv(4), byteorder='big')
+            server_port = read_assigned_port(lb_client)
             lb_client.close()
             
             chat_client = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
@@ -126,7 +152,7 @@ class TestChatSystem:
             
             # Send messages
             for msg in messages:
-                chat_client.send(msg.encode())
+                chat_client.send(chat_frame(msg))
                 response = chat_client.recv(1024).decode()
                 received_msgs.append(response)
             
@@ -0,0 +1,123 @@
+/*
+ * test_metrics.cpp
+ * Checks the sharded counters, histograms, text format and HTTP endpoint
+ * in metrics.h
+ */
+#include "metrics.h"
+#include "test.h"
+
+const int THREADS = 24; // more than METRIC_SHARDS, so some share a shard
+const int ADDS = 100000;
+
+bool contains(const string &text, const string &line) { return text.find(line) != string::npos; }
+
+void test_counters_add_up_across_threads()
+{
+    MetricsRegistry registry;
+    Counter &counter = registry.counter("test_adds_total", "Adds from every thread.");
+    LatencyHistogram &latency = registry.histogram("test_latency_seconds", "Made-up latencies.");
+    vector<thread> threads;
+    for (int t = 0; t < THREADS; t++)
+        threads.emplace_back([&] {
+            for (int i = 0; i < ADDS; i++)
+            {
+                counter.add();
+                if (i % 1000 == 0)
+                    latency.record(chrono::microseconds(200));
+            }
+        });
+    for (thread &worker : threads)
+        worker.join();
+    CHECK(counter.value() == (uint64_t)THREADS * ADDS);
+    vector<uint64_t> counts;
+    double sum;
+    latency.collect(counts, sum);
+    CHECK(accumulate(counts.begin(), counts.end(), 0ULL) == (uint64_t)THREADS * ADDS / 1000);
+    CHECK(fabs(sum - THREADS * ADDS / 1000 * 0.0002) < 1e-6);
+}
+
+void test_text_format()
+{
+    MetricsRegistry registry;
+    registry.counter("test_requests_total", "Requests.").add(3);
+    registry.gauge("test_clients", "Clients.", [] { return 12.0; });
+    registry.gauges("test_server_up", "Per server.", [] {
+        return vector<pair<string, double>>{{"port=\"8000\"", 1}, {"port=\"8001\"", 0}};
+    });
+    LatencyHistogram &latency = registry.histogram("test_wait_seconds", "Waits.");
+    latency.record(chrono::microseconds(50)); // on a bound: counted in that bucket
+    latency.record(chrono::milliseconds(3));
+    latency.record(chrono::seconds(10));
+    string text = registry.render();
+    CHECK(contains(text, "# HELP test_requests_total Requests.\n# TYPE test_requests_total counter\n"
+                         "test_requests_total 3\n"));
+    CHECK(contains(text, "# TYPE test_clients gauge\ntest_clients 12\n"));
+    CHECK(contains(text, "test_server_up{port=\"8000\"} 1\ntest_server_up{port=\"8001\"} 0\n"));
+    CHECK(contains(text, "# TYPE test_wait_seconds histogram\n"));
+    CHECK(contains(text, "test_wait_seconds_bucket{le=\"5e-05\"} 1\n"));
+    CHECK(contains(text, "test_wait_seconds_bucket{le=\"0.0025\"} 1\n"));
+    CHECK(contains(text, "test_wait_seconds_bucket{le=\"0.005\"} 2\n"));
+    CHECK(contains(text, "test_wait_seconds_bucket{le=\"5\"} 2\n"));
+    CHECK(contains(text, "test_wait_seconds_bucket{le=\"+Inf\"} 3\n"));
+    CHECK(contains(text, "test_wait_seconds_sum 10.00305\n"));
+    CHECK(contains(text, "test_wait_seconds_count 3\n"));
+}
+
+string http_get(int port, const string &path)
+{
+    int socket_id = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof address);
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(socket_id, (struct sockaddr *)&address, sizeof address) == -1)
+    {
+        close(socket_id);
+        return "";
+    }
+    string request = "GET " + path + " HTTP/1.1\r\nHost: localhost\r\n\r\n", response;
+    send(socket_id, request.data(), request.size(), 0);
+    char buffer[4096];
+    ssize_t n;
+    while ((n = recv(socket_id, buffer, sizeof buffer, 0)) > 0)
+        response.append(buffer, n);
+    close(socket_id);
+    return response;
+}
+
+void test_endpoint_serves_scrapes()
+{
+    MetricsRegistry registry;
+    registry.counter("test_scraped_total", "Scrapes.").add(7);
+    MetricsServer server;
+    CHECK(server.start(0, registry));
+    CHECK(server.port() > 0);
+    string response = http_get(server.port(), "/metrics");
+    CHECK(response.compare(0, 15, "HTTP/1.0 200 OK") == 0);
+    CHECK(contains(response, "Content-Type: text/plain; version=0.0.4\r\n"));
+    CHECK(contains(response, "\r\n\r\n# HELP test_scraped_total Scrapes.\n"));
+    CHECK(contains(response, "test_scraped_total 7\n"));
+    CHECK(http_get(server.port(), "/").compare(0, 22, "HTTP/1.0 404 Not Found") == 0);
+    // A client that never sends its request does not block the next one
+    int idle = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof address);
+    address.sin_family = AF_INET;
+    address.sin_port = htons(server.port());
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    CHECK(connect(idle, (struct sockaddr *)&address, sizeof address) == 0);
+    CHECK(contains(http_get(server.port(), "/metrics"), "test_scraped_total 7\n"));
+    close(idle);
+
+    MetricsServer taken;
+    CHECK(!taken.start(server.port(), registry));
+}
+
+int main()
+{
+    test_counters_add_up_across_threads();
+    test_text_format();
+    test_endpoint_serves_scrapes();
+    return test_result("test_metrics");
+}
@@ -0,0 +1,179 @@
+/*
+ * test_outbox.cpp
+ * Checks the overflow policies of the bounded per-client queue in outbox.h
+ */
+#include "outbox.h"
+#include "test.h"
+
+const size_t FRAME = 1024;
+
+// A connected pair with small kernel buffers, so a peer that never reads
+// fills the socket quickly and the rest piles up in the outbox
+void small_pair(int fds[2])
+{
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    int size = 4096;
+    setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof size);
+    setsockopt(fds[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof size);
+}
+
+Message numbered(int i)
+{
+    string frame(FRAME, ' ');
+    memcpy(&frame[0], &i, sizeof i);
+    return make_message(frame);
+}
+
+// Reads what the peer has sent so far, flushing the outbox as the socket
+// drains the way a reactor would on EPOLLOUT
+vector<int> drain(Outbox &outbox, int socket_id)
+{
+    vector<int> seen;
+    string pending;
+    char buffer[8192];
+    while (true)
+    {
+        CHECK(outbox.flush(true));
+        ssize_t n = recv(socket_id, buffer, sizeof buffer, MSG_DONTWAIT);
+        if (n <= 0)
+            break;
+        pending.append(buffer, n);
+        while (pending.size() >= FRAME)
+        {
+            int i;
+            memcpy(&i, pending.data(), sizeof i);
+            seen.push_back(i);
+            pending.erase(0, FRAME);
+        }
+    }
+    return seen;
+}
+
+void test_flush_stops_at_full_socket()
+{
+    outbox_config = OutboxConfig();
+    int fds[2];
+    small_pair(fds);
+    Outbox outbox(fds[0]);
+    for (int i = 0; i < 100; i++)
+        CHECK(outbox.enqueue(numbered(i)));
+    CHECK(outbox.flush());
+    CHECK(!outbox.empty());
+    vector<int> seen = drain(outbox, fds[1]);
+    CHECK(outbox.empty());
+    CHECK(seen.size() == 100);
+    for (size_t i = 0; i < seen.size(); i++)
+        CHECK(seen[i] == (int)i);
+    close(fds[1]);
+}
+
+void test_drop_oldest_keeps_newest_in_order()
+{
+    outbox_config = OutboxConfig();
+    outbox_config.max_bytes = 16 * FRAME;
+    outbox_config.policy = DROP_OLDEST;
+    uint64_t dropped = outbox_counters.dropped_frames;
+    int fds[2];
+    small_pair(fds);
+    Outbox outbox(fds[0]);
+    for (int i = 0; i < 1000; i++)
+    {
+        CHECK(outbox.enqueue(numbered(i)));
+        CHECK(outbox.flush());
+        CHECK(!outbox.over_limit());
+    }
+    CHECK(outbox_counters.dropped_frames > dropped);
+    vector<int> seen = drain(outbox, fds[1]);
+    CHECK(!seen.empty() && seen.back() == 999);
+    CHECK(is_sorted(seen.begin(), seen.end()));
+    CHECK(adjacent_find(seen.begin(), seen.end()) == seen.end());
+    close(fds[1]);
+}
+
+void test_disconnect_slow_consumer()
+{
+    outbox_config = OutboxConfig();
+    outbox_config.max_bytes = 16 * FRAME;
+    outbox_config.policy = DISCONNECT_SLOW;
+    uint64_t disconnects = outbox_counters.slow_disconnects;
+    int fds[2];
+    small_pair(fds);
+    Outbox outbox(fds[0]);
+    int accepted = 0;
+    while (accepted < 1000 && outbox.enqueue(numbered(accepted)))
+    {
+        outbox.flush();
+        accepted++;
+    }
+    CHECK(accepted < 1000);
+    CHECK(outbox_counters.slow_disconnects == disconnects + 1);
+    close(fds[1]);
+}
+
+// Backpressure queues everything and leaves pausing the senders to the
+// reactor, which watches over_limit()
+void test_backpressure_reports_over_limit()
+{
+    outbox_config = OutboxConfig();
+    outbox_config.max_bytes = 16 * FRAME;
+    outbox_config.policy = BACKPRESSURE;
+    int fds[2];
+    small_pair(fds);
+    Outbox outbox(fds[0]);
+    int i = 0;
+    while (i < 1000 && !outbox.over_limit())
+    {
+        CHECK(outbox.enqueue(numbered(i++)));
+        outbox.flush();
+    }
+    CHECK(outbox.over_limit());
+    vector<int> seen = drain(outbox, fds[1]);
+    CHECK(!outbox.over_limit());
+    CHECK(seen.size() == (size_t)i);
+    for (size_t k = 0; k < seen.size(); k++)
+        CHECK(seen[k] == (int)k);
+    close(fds[1]);
+}
+
+// The io_uring reactors send asynchronously: frames stay queued and out of
+// reach of drop-oldest until end_send(), and a short write marks the socket
+// full just as EAGAIN does
+void test_async_send_keeps_frames_until_done()
+{
+    outbox_config = OutboxConfig();
+    outbox_config.max_bytes = 4 * FRAME;
+    outbox_config.policy = DROP_OLDEST;
+    int fds[2];
+    small_pair(fds);
+    Outbox outbox(fds[0]);
+    for (int i = 0; i < 4; i++)
+        CHECK(outbox.enqueue(numbered(i)));
+    struct iovec iov[FLUSH_BATCH];
+    CHECK(outbox.begin_send(iov, 2) == 2);
+    CHECK(outbox.sending());
+    for (int i = 4; i < 8; i++)
+        CHECK(outbox.enqueue(numbered(i)));
+    CHECK(outbox.flush()); // no write may overtake the one in flight
+    // The socket takes a frame and a half of it
+    CHECK(write(fds[0], iov[0].iov_base, iov[0].iov_len) == (ssize_t)FRAME);
+    CHECK(write(fds[0], iov[1].iov_base, FRAME / 2) == (ssize_t)FRAME / 2);
+    outbox.end_send(FRAME + FRAME / 2);
+    CHECK(!outbox.sending());
+    CHECK(outbox.waiting());
+    vector<int> seen = drain(outbox, fds[1]);
+    CHECK(outbox.empty());
+    CHECK(seen.size() == 8);
+    for (size_t k = 0; k < seen.size(); k++)
+        CHECK(seen[k] == (int)k);
+    close(fds[1]);
+}
+
+int main()
+{
+    test_flush_stops_at_full_socket();
+    test_drop_oldest_keeps_newest_in_order();
+    test_disconnect_slow_consumer();
+    test_backpressure_reports_over_limit();
+    test_async_send_keeps_frames_until_done();
+    return test_result("test_outbox");
+}
@@ -0,0 +1,206 @@
+/*
+ * test_protocol.cpp
+ * Checks for the frame encoder and streaming decoder in protocol.h
+ */
+#include "protocol.h"
+#include "test.h"
+
+// A stream of frames of varied sizes, including empty and multi-KB payloads
+string sample_stream(vector<string> &texts)
+{
+    string stream;
+    for (int i = 0; i < 50; i++)
+    {
+        texts.push_back(string(i * i * 7 % 5000, 'a' + i % 26));
+        encode_named_frame(stream, MSG_CHAT, i, room_id_of("room"), "user" + to_string(i),
+                           texts.back().data(), texts.back().size());
+    }
+    return stream;
+}
+
+// Feeds the stream in chunks of the given size and checks every frame
+void check_chunked(size_t chunk)
+{
+    vector<string> texts;
+    string stream = sample_stream(texts);
+    FrameDecoder decoder;
+    Frame frame;
+    size_t decoded = 0;
+    for (size_t at = 0; at < stream.size(); at += chunk)
+    {
+        decoder.feed(stream.data() + at, min(chunk, stream.size() - at));
+        while (decoder.next(frame) == 1)
+        {
+            string name, text;
+            CHECK(frame.header.type == MSG_CHAT);
+            CHECK(frame.header.sender_id == decoded);
+            CHECK(frame.header.room_id == room_id_of("room"));
+            CHECK(split_named_payload(frame, name, text));
+            CHECK(name == "user" + to_string(decoded));
+            CHECK(text == texts[decoded]);
+            decoded++;
+        }
+    }
+    CHECK(decoded == texts.size());
+    CHECK(decoder.buffered() == 0);
+}
+
+void test_partial_and_coalesced_reads()
+{
+    check_chunked(1);       // every frame split across many reads
+    check_chunked(7);       // headers split mid-field
+    check_chunked(4096);    // several frames per read
+    check_chunked(1 << 20); // the whole stream in one read
+}
+
+void test_rejects_garbage()
+{
+    FrameDecoder decoder;
+    Frame frame;
+    char garbage[256];
+    memset(garbage, 'x', sizeof garbage);
+    decoder.feed(garbage, sizeof garbage);
+    CHECK(decoder.next(frame) == -1);
+
+    FrameDecoder oversized;
+    char header[sizeof(FrameHeader)];
+    put_header(header, MSG_CHAT, 1, 1, MAX_PAYLOAD + 1);
+    oversized.feed(header, sizeof header);
+    CHECK(oversized.next(frame) == -1);
+}
+
+void test_long_messages_are_not_truncated()
+{
+    string text(MAX_PAYLOAD - 64, 'z'), stream, name, out;
+    encode_named_frame(stream, MSG_CHAT, 3, 4, "someone", text.data(), text.size());
+    FrameDecoder decoder;
+    Frame frame;
+    decoder.feed(stream.data(), stream.size());
+    CHECK(decoder.next(frame) == 1);
+    CHECK(split_named_payload(frame, name, out) && out == text);
+}
+
+void test_u32_payload()
+{
+    string stream;
+    encode_u32_frame(stream, MSG_ASSIGN, 0, 9, 8001);
+    CHECK(stream.size() == sizeof(FrameHeader) + 4);
+    FrameDecoder decoder;
+    Frame frame;
+    uint32_t port = 0;
+    decoder.feed(stream.data(), stream.size());
+    CHECK(decoder.next(frame) == 1 && read_u32_payload(frame, port) && port == 8001);
+
+    // An ASSIGN naming the server's host, written in place the way the
+    // balancer does
+    char reply[U32_FRAME_SIZE + 16];
+    put_u32_text_frame(reply, MSG_ASSIGN, 0, 9, 8002, "chat2.internal", 14);
+    decoder.feed(reply, U32_FRAME_SIZE + 14);
+    string host;
+    CHECK(decoder.next(frame) == 1 && split_u32_payload(frame, port, host));
+    CHECK(port == 8002 && host == "chat2.internal");
+    CHECK(!read_u32_payload(frame, port));
+}
+
+void test_u64_payload()
+{
+    string stream;
+    uint64_t seq = 0x0102030405060708ULL, value = 0;
+    encode_u64_frame(stream, MSG_SEQ, 0, 9, seq);
+    CHECK(stream.size() == U64_FRAME_SIZE);
+    CHECK(stream[sizeof(FrameHeader)] == 1 && stream[U64_FRAME_SIZE - 1] == 8); // big endian on the wire
+    FrameDecoder decoder;
+    Frame frame;
+    decoder.feed(stream.data(), stream.size());
+    CHECK(decoder.next(frame) == 1 && frame.header.type == MSG_SEQ && read_u64_payload(frame, value));
+    CHECK(value == seq);
+    uint32_t short_value;
+    CHECK(!read_u32_payload(frame, short_value));
+}
+
+void test_migrate_and_room_loads()
+{
+    string stream;
+    encode_migrate(stream, 3, "lobby", 8002, "chat2.example");
+    vector<pair<string, int>> rooms = {{"lobby", 40}, {"", 1}, {string(200, 'r'), 7}};
+    encode_room_loads(stream, 4, rooms);
+    FrameDecoder decoder;
+    Frame frame;
+    decoder.feed(stream.data(), stream.size());
+    uint32_t port = 0;
+    string room, host;
+    CHECK(decoder.next(frame) == 1 && frame.header.type == MSG_MIGRATE);
+    CHECK(frame.header.room_id == room_id_of("lobby"));
+    CHECK(read_migrate(frame, room, port, host) && port == 8002 && host == "chat2.example" && room == "lobby");
+    Frame short_frame = frame;
+    short_frame.length = sizeof(uint32_t) + 5; // cut into the host
+    CHECK(!read_migrate(short_frame, room, port, host));
+    vector<pair<string, int>> decoded;
+    CHECK(decoder.next(frame) == 1 && frame.header.type == MSG_ROOM_REPLY && frame.header.sender_id == 4);
+    CHECK(read_room_loads(frame, decoded) && decoded == rooms);
+    frame.length--; // cut into the last room
+    CHECK(!read_room_loads(frame, decoded));
+}
+
+void test_load_report()
+{
+    LoadReport sent;
+    sent.users = 60;
+    sent.rooms = 50;
+    sent.messages_per_sec = 1200;
+    sent.bytes_per_sec = 3000000;
+    sent.queued_bytes = 65536;
+    sent.cpu_permille = 875;
+    char wire[LOAD_FRAME_SIZE];
+    put_load_frame(wire, 9, sent);
+    string stream(wire, sizeof wire);
+    encode_u32_frame(stream, MSG_LOAD_REPLY, 10, 0, 17); // an older server
+    encode_frame(stream, MSG_LOAD_REPLY, 11, 0, "abc", 3); // not even a user count
+    FrameDecoder decoder;
+    Frame frame;
+    decoder.feed(stream.data(), stream.size());
+    LoadReport got;
+    CHECK(decoder.next(frame) == 1 && frame.header.sender_id == 9);
+    CHECK(read_load_report(frame, got));
+    CHECK(got.users == 60 && got.rooms == 50 && got.messages_per_sec == 1200 && got.bytes_per_sec == 3000000 &&
+          got.queued_bytes == 65536 && got.cpu_permille == 875);
+    CHECK(decoder.next(frame) == 1 && read_load_report(frame, got));
+    CHECK(got.users == 17 && got.rooms == 0 && got.cpu_permille == 0);
+    CHECK(decoder.next(frame) == 1 && !read_load_report(frame, got));
+}
+
+void test_gossip_frames()
+{
+    string stream;
+    uint64_t version = (3ULL << 32) | 17;
+    encode_gossip_place(stream, 2, "lobby", version, 8001);
+    encode_gossip_health(stream, 2, {{8000, true}, {8001, false}});
+    encode_frame(stream, MSG_GOSSIP_HEALTH, 2, 0, "abc", 3);
+    FrameDecoder decoder;
+    Frame frame;
+    decoder.feed(stream.data(), stream.size());
+    string room;
+    uint64_t got_version = 0;
+    uint32_t port = 0;
+    CHECK(decoder.next(frame) == 1 && frame.header.type == MSG_GOSSIP_PLACE && frame.header.sender_id == 2);
+    CHECK(frame.header.room_id == room_id_of("lobby"));
+    CHECK(read_gossip_place(frame, room, got_version, port) && room == "lobby" && got_version == version &&
+          port == 8001);
+    vector<pair<int, bool>> servers;
+    CHECK(decoder.next(frame) == 1 && read_gossip_health(frame, servers));
+    CHECK(servers == (vector<pair<int, bool>>{{8000, true}, {8001, false}}));
+    CHECK(decoder.next(frame) == 1 && !read_gossip_health(frame, servers));
+}
+
+int main()
+{
+    test_partial_and_coalesced_reads();
+    test_rejects_garbage();
+    test_long_messages_are_not_truncated();
+    test_u32_payload();
+    test_u64_payload();
+    test_migrate_and_room_loads();
+    test_load_report();
+    test_gossip_frames();
+    return test_result("test_protocol");
+}
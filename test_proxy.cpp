@@ -0,0 +1,196 @@
+/*
+ * test_proxy.cpp
+ * Checks splicing between sockets and the pool of server connections in
+ * proxy.h, over loopback TCP
+ */
+#include "proxy.h"
+#include <arpa/inet.h>
+#include <poll.h>
+#include "test.h"
+
+// A loopback listener on a free port
+int listen_loopback(struct sockaddr_in &address)
+{
+    int listen_id = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&address, 0, sizeof address);
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof address;
+    bind(listen_id, (struct sockaddr *)&address, sizeof address);
+    listen(listen_id, 64);
+    getsockname(listen_id, (struct sockaddr *)&address, &length);
+    return listen_id;
+}
+
+// Both ends of a loopback TCP connection, the first non-blocking
+pair<int, int> connected_pair()
+{
+    struct sockaddr_in address;
+    int listen_id = listen_loopback(address);
+    int near = socket(AF_INET, SOCK_STREAM, 0);
+    connect(near, (struct sockaddr *)&address, sizeof address);
+    int far = accept(listen_id, NULL, NULL);
+    close(listen_id);
+    fcntl(near, F_SETFL, O_NONBLOCK);
+    return {near, far};
+}
+
+string read_exactly(int socket_id, size_t bytes)
+{
+    string data(bytes, 0);
+    size_t got = 0;
+    while (got < bytes)
+    {
+        ssize_t n = recv(socket_id, &data[got], bytes - got, 0);
+        if (n <= 0)
+            break;
+        got += n;
+    }
+    data.resize(got);
+    return data;
+}
+
+void wait_readable(int socket_id)
+{
+    struct pollfd ready = {socket_id, POLLIN, 0};
+    poll(&ready, 1, 1000);
+}
+
+void test_pump()
+{
+    // client -> [a, b] -> server: the proxy holds a and b
+    auto [a, client] = connected_pair();
+    auto [b, server] = connected_pair();
+    SplicePipe pipe;
+    CHECK(pipe.open());
+    size_t moved = 0;
+    CHECK(pipe.pump(a, b, moved) && moved == 0); // nothing to read yet
+
+    send(client, "hello", 5, 0);
+    wait_readable(a);
+    CHECK(pipe.pump(a, b, moved) && moved == 5);
+    CHECK(read_exactly(server, 5) == "hello");
+
+    // More than the socket buffers and the pipe hold: the pump stops when b
+    // is full and finishes once the server reads
+    string big(4 << 20, 'x');
+    for (size_t i = 0; i < big.size(); i += 4096)
+        big[i] = 'a' + i / 4096 % 26;
+    thread writer([&] { send(client, big.data(), big.size(), MSG_NOSIGNAL); });
+    string received;
+    while (received.size() < big.size())
+    {
+        wait_readable(a);
+        CHECK(pipe.pump(a, b, moved));
+        char buffer[65536];
+        ssize_t n;
+        while ((n = recv(server, buffer, sizeof buffer, MSG_DONTWAIT)) > 0)
+            received.append(buffer, n);
+    }
+    writer.join();
+    CHECK(received == big);
+    CHECK(moved == 5 + big.size());
+
+    // The client leaves: what it sent last still arrives, then the
+    // direction is over
+    send(client, "bye", 3, 0);
+    close(client);
+    wait_readable(a);
+    moved = 0;
+    bool open = true;
+    for (int i = 0; i < 10 && open; i++)
+        open = pipe.pump(a, b, moved);
+    CHECK(!open && moved == 3 && pipe.pending() == 0);
+    CHECK(read_exactly(server, 3) == "bye");
+
+    close(a);
+    close(b);
+    close(server);
+}
+
+void test_pump_broken_destination()
+{
+    auto [a, client] = connected_pair();
+    auto [b, server] = connected_pair();
+    SplicePipe pipe;
+    CHECK(pipe.open());
+    close(server);
+    // The first write may still land in b's buffer; the reset it draws
+    // fails a later one
+    size_t moved = 0;
+    bool open = true;
+    for (int i = 0; i < 20 && open; i++)
+    {
+        send(client, "x", 1, MSG_NOSIGNAL);
+        wait_readable(a);
+        open = pipe.pump(a, b, moved);
+        this_thread::sleep_for(chrono::milliseconds(5));
+    }
+    CHECK(!open);
+    close(a);
+    close(b);
+    close(client);
+}
+
+void test_pool()
+{
+    struct sockaddr_in address;
+    int listen_id = listen_loopback(address);
+    int port = ntohs(address.sin_port);
+    BackendPool pool;
+    pool.size = 3;
+    pool.refill({{port, address}});
+    CHECK(pool.idle_count(port) == 3);
+
+    // Taken connections are open and left out of the pool
+    bool connecting;
+    int taken = pool.take(port, address, connecting);
+    CHECK(taken != -1 && !connecting && pool.hits == 1);
+    CHECK(pool.idle_count(port) == 2);
+    CHECK(fcntl(taken, F_GETFL) & O_NONBLOCK);
+    int accepted[3];
+    for (int &id : accepted)
+        id = accept(listen_id, NULL, NULL);
+    CHECK(send(taken, "hi", 2, 0) == 2);
+    close(taken);
+
+    // The server closed the idle ones: take skips them and connects afresh
+    for (int id : accepted)
+        close(id);
+    this_thread::sleep_for(chrono::milliseconds(20));
+    taken = pool.take(port, address, connecting);
+    CHECK(taken != -1 && pool.misses == 1 && pool.idle_count(port) == 0);
+    close(taken);
+
+    // A refill replaces dead ones, and one without the server drops its pool
+    pool.refill({{port, address}});
+    CHECK(pool.idle_count(port) == 3);
+    pool.refill({});
+    CHECK(pool.idle_count(port) == 0);
+
+    // A server that is not listening fails the connect
+    close(listen_id);
+    pool.refill({{port, address}});
+    CHECK(pool.idle_count(port) == 0);
+    taken = pool.take(port, address, connecting);
+    if (taken != -1)
+    {
+        // Refused asynchronously: the socket reports the error
+        struct pollfd done = {taken, POLLOUT, 0};
+        poll(&done, 1, 1000);
+        int error = 0;
+        socklen_t length = sizeof error;
+        getsockopt(taken, SOL_SOCKET, SO_ERROR, &error, &length);
+        CHECK(error == ECONNREFUSED);
+        close(taken);
+    }
+}
+
+int main()
+{
+    signal(SIGPIPE, SIG_IGN);
+    test_pump();
+    test_pump_broken_destination();
+    test_pool();
+    return test_result("test_proxy");
+}
@@ -0,0 +1,239 @@
+/*
+ * test_roomlog.cpp
+ * Checks appending to, reopening and resuming from the per-room segment
+ * logs in roomlog.h, in a scratch directory
+ */
+#include "roomlog.h"
+#include "test.h"
+
+string scratch;
+
+// The directory room is logged in
+string dir_of(const string &room)
+{
+    char name[16];
+    snprintf(name, sizeof name, "%08x", room_id_of(room));
+    return scratch + "/" + name;
+}
+
+// The record a server logs for message number seq of room
+string record(const string &room, uint64_t seq, const string &text)
+{
+    string bytes;
+    encode_u64_frame(bytes, MSG_SEQ, 0, room_id_of(room), seq);
+    size_t at = bytes.size();
+    bytes.resize(at + named_frame_size("bob", text.size()));
+    put_named_frame(&bytes[at], MSG_CHAT, 7, room_id_of(room), "bob", text.data(), text.size());
+    return bytes;
+}
+
+bool append(RoomLog &log, const string &room, const string &text)
+{
+    string error;
+    string bytes = record(room, log.next_seq(), text);
+    return log.append(bytes.data(), bytes.size(), error);
+}
+
+// What a client resuming from seq is sent: (seq, text) of each message
+vector<pair<uint64_t, string>> resume(RoomLog &log, uint64_t from)
+{
+    vector<LogRange> ranges;
+    CHECK(log.ranges_from(from, ranges));
+    int ends[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, ends);
+    string received;
+    thread reader([&] {
+        char buffer[65536];
+        ssize_t n;
+        while ((n = read(ends[1], buffer, sizeof buffer)) > 0)
+            received.append(buffer, n);
+    });
+    size_t sent = 0;
+    CHECK(send_log_ranges(ends[0], ranges, sent) && ranges.empty()); // blocking socket: all of it
+    close(ends[0]);
+    reader.join();
+    close(ends[1]);
+    CHECK(sent == received.size());
+
+    vector<pair<uint64_t, string>> messages;
+    FrameDecoder decoder;
+    decoder.feed(received.data(), received.size());
+    Frame frame;
+    uint64_t seq = 0;
+    while (decoder.next(frame) == 1)
+    {
+        string name, text;
+        if (frame.header.type == MSG_SEQ)
+            CHECK(read_u64_payload(frame, seq));
+        else
+        {
+            CHECK(frame.header.type == MSG_CHAT && frame.header.flags == FLAG_HISTORY);
+            CHECK(split_named_payload(frame, name, text));
+            messages.emplace_back(seq, text);
+        }
+    }
+    CHECK(decoder.buffered() == 0);
+    return messages;
+}
+
+void test_append_and_resume()
+{
+    RoomLog log;
+    string error;
+    CHECK(log.open(scratch, "lobby", error));
+    CHECK(log.next_seq() == 1);
+    CHECK(resume(log, 1).empty());
+    for (int i = 1; i <= 100; i++)
+        CHECK(append(log, "lobby", "m" + to_string(i)));
+    CHECK(log.next_seq() == 101);
+
+    auto messages = resume(log, 42);
+    CHECK(messages.size() == 59 && messages.front() == make_pair((uint64_t)42, string("m42")));
+    CHECK(messages.back() == make_pair((uint64_t)100, string("m100")));
+    CHECK(resume(log, 0).size() == 100);
+    CHECK(resume(log, 101).empty());
+
+    // A restart picks up the numbering where it stopped
+    log.close();
+    RoomLog again;
+    CHECK(again.open(scratch, "lobby", error));
+    CHECK(again.next_seq() == 101);
+    CHECK(append(again, "lobby", "after restart"));
+    messages = resume(again, 100);
+    CHECK(messages.size() == 2 && messages[1] == make_pair((uint64_t)101, string("after restart")));
+}
+
+void test_torn_tail()
+{
+    RoomLog log;
+    string error;
+    CHECK(log.open(scratch, "torn", error));
+    for (int i = 1; i <= 10; i++)
+        append(log, "torn", "m" + to_string(i));
+    log.close();
+
+    // The server died while writing record 11, before its number
+    string path = dir_of("torn") + "/0000000000000001.seg";
+    int file_id = open(path.c_str(), O_RDWR);
+    struct stat info;
+    fstat(file_id, &info);
+    string data(info.st_size, 0);
+    CHECK(pread(file_id, &data[0], data.size(), 0) == (ssize_t)data.size());
+    size_t end = data.find(string(64, '\0'));
+    string partial = record("torn", 11, string(200, 'x')).substr(U64_FRAME_SIZE, 100);
+    CHECK(pwrite(file_id, partial.data(), partial.size(), end + U64_FRAME_SIZE) == (ssize_t)partial.size());
+    close(file_id);
+
+    RoomLog reopened;
+    CHECK(reopened.open(scratch, "torn", error));
+    CHECK(reopened.next_seq() == 11);
+    CHECK(append(reopened, "torn", "short"));
+    auto messages = resume(reopened, 10);
+    CHECK(messages.size() == 2 && messages[1] == make_pair((uint64_t)11, string("short")));
+}
+
+void test_segments()
+{
+    // Enough to fill more segments than are kept
+    RoomLog log;
+    string error;
+    CHECK(log.open(scratch, "busy", error));
+    string text(4000, 'z');
+    size_t per_segment = ROOMLOG_SEGMENT_BYTES / record("busy", 1, text).size();
+    uint64_t total = per_segment * (ROOMLOG_SEGMENTS + 2);
+    for (uint64_t i = 1; i <= total; i++)
+        CHECK(append(log, "busy", to_string(i) + text));
+    CHECK(log.segment_count() == ROOMLOG_SEGMENTS);
+
+    // Resumes cross segments, through the sparse index, and start from the
+    // oldest one kept when asked for more than is left
+    uint64_t from = total - per_segment * 3 / 2;
+    auto messages = resume(log, from);
+    CHECK(messages.size() == total - from + 1);
+    bool in_order = true;
+    for (size_t i = 0; i < messages.size(); i++)
+        in_order &= messages[i].first == from + i && messages[i].second == to_string(from + i) + text;
+    CHECK(in_order);
+    messages = resume(log, 1);
+    CHECK(!messages.empty() && messages.front().first > 1 && messages.back().first == total);
+
+    // Sealed segments from before a restart are read from disk. The worker
+    // has cut them to their records, and the spare is gone.
+    log.close();
+    struct stat info;
+    size_t files = 0, cut = 0;
+    if (DIR *listing = opendir(dir_of("busy").c_str()))
+    {
+        while (struct dirent *entry = readdir(listing))
+        {
+            if (entry->d_name[0] == '.')
+                continue;
+            files++;
+            if (stat((dir_of("busy") + "/" + entry->d_name).c_str(), &info) == 0 &&
+                info.st_size < ROOMLOG_SEGMENT_BYTES)
+                cut++;
+        }
+        closedir(listing);
+    }
+    CHECK(files == ROOMLOG_SEGMENTS && cut == ROOMLOG_SEGMENTS - 1);
+    RoomLog again;
+    CHECK(again.open(scratch, "busy", error));
+    CHECK(again.next_seq() == total + 1);
+    messages = resume(again, from);
+    CHECK(messages.size() == total - from + 1 && messages.front().first == from);
+}
+
+void test_unnamed_spare()
+{
+    // The server died after starting a segment in the spare, before the
+    // worker named it
+    RoomLog log;
+    string error;
+    CHECK(log.open(scratch, "crash", error));
+    for (int i = 1; i <= 3; i++)
+        append(log, "crash", "m" + to_string(i));
+    log.close();
+    string spare = dir_of("crash") + "/spare.tmp";
+    int file_id = open(spare.c_str(), O_RDWR | O_CREAT, 0644);
+    RoomLogHeader header = {ROOMLOG_MAGIC, 5, 0, 4};
+    CHECK(pwrite(file_id, &header, sizeof header, 0) == sizeof header);
+    CHECK(pwrite(file_id, "crash", 5, sizeof header) == 5);
+    CHECK(ftruncate(file_id, ROOMLOG_SEGMENT_BYTES) == 0);
+    close(file_id);
+
+    RoomLog reopened;
+    CHECK(reopened.open(scratch, "crash", error));
+    CHECK(reopened.next_seq() == 4 && reopened.segment_count() == 2);
+    CHECK(append(reopened, "crash", "m4"));
+    auto messages = resume(reopened, 1);
+    CHECK(messages.size() == 4 && messages.back().second == "m4");
+}
+
+void test_collision()
+{
+    // The directory of one room's id holding another room's log
+    RoomLog log;
+    string error;
+    CHECK(log.open(scratch, "first", error));
+    append(log, "first", "hello");
+    log.close();
+    char from[16], to[16];
+    snprintf(from, sizeof from, "%08x", room_id_of("first"));
+    snprintf(to, sizeof to, "%08x", room_id_of("second"));
+    CHECK(rename((scratch + "/" + from).c_str(), (scratch + "/" + to).c_str()) == 0);
+    RoomLog other;
+    CHECK(!other.open(scratch, "second", error) && !error.empty());
+}
+
+int main()
+{
+    char dir[] = "/tmp/test_roomlog.XXXXXX";
+    scratch = mkdtemp(dir);
+    test_append_and_resume();
+    test_torn_tail();
+    test_segments();
+    test_unnamed_spare();
+    test_collision();
+    CHECK(system(("rm -rf " + scratch).c_str()) == 0);
+    return test_result("test_roomlog");
+}
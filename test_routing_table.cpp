@@ -0,0 +1,239 @@
+/*
+ * test_routing_table.cpp
+ * Concurrent stress test for routing_table.h, meant to also be run under
+ * ThreadSanitizer (make tsan)
+ */
+#include "routing_table.h"
+#include "test.h"
+
+const int ROOMS = 1000;
+const int READERS = 4;
+#ifdef __SANITIZE_THREAD__
+const int WRITES = 4000; // ThreadSanitizer slows every access down ~10x
+#else
+const int WRITES = 20000;
+#endif
+
+string room_name(int r) { return "room" + to_string(r); }
+
+// Room r is only ever placed on a server in [r * 10, r * 10 + 9], so any
+// other value seen by a reader is a torn or freed node
+void test_readers_see_consistent_snapshots()
+{
+    RoutingTable table;
+    atomic<bool> done{false};
+    atomic<int> badReads{0};
+    atomic<long long> hits{0};
+
+    vector<thread> readers;
+    for (int t = 0; t < READERS; t++)
+    {
+        readers.emplace_back([&, t]() {
+            mt19937 rng(t);
+            while (!done.load())
+            {
+                int r = rng() % ROOMS, server;
+                if (table.lookup(room_name(r), server))
+                {
+                    hits++;
+                    if (server / 10 != r)
+                        badReads++;
+                }
+            }
+        });
+    }
+
+    thread inserter([&]() {
+        // Writes are quick enough to finish before a reader gets the CPU on
+        // a small machine, so keep going until one has found a room
+        for (int i = 0; i < WRITES || hits == 0; i++)
+            table.insert(room_name(i % ROOMS), (i % ROOMS) * 10);
+    });
+    thread mover([&]() {
+        mt19937 rng(100);
+        for (int i = 0; i < WRITES; i++)
+        {
+            int r = rng() % ROOMS;
+            table.assign(room_name(r), r * 10 + rng() % 10);
+        }
+    });
+    thread eraser([&]() {
+        mt19937 rng(200);
+        for (int i = 0; i < WRITES; i++)
+        {
+            int r = rng() % ROOMS;
+            table.erase(room_name(r), r * 10 + rng() % 10);
+        }
+    });
+
+    inserter.join();
+    mover.join();
+    eraser.join();
+    done = true;
+    for (thread &reader : readers)
+        reader.join();
+
+    CHECK(badReads == 0);
+    CHECK(hits > 0);
+
+    size_t visited = 0;
+    table.for_each([&](const string &room, int server) {
+        visited++;
+        CHECK(room_name(server / 10) == room);
+    });
+    CHECK(visited == table.size());
+}
+
+// Reactors racing to place the same new room must all be told the same server
+void test_racing_inserts_agree()
+{
+    RoutingTable table;
+    const int THREADS = 8;
+    for (int r = 0; r < 50; r++)
+    {
+        vector<int> answer(THREADS);
+        vector<thread> racers;
+        for (int t = 0; t < THREADS; t++)
+            racers.emplace_back([&, t]() { answer[t] = table.insert(room_name(r), 1000 + t); });
+        for (thread &racer : racers)
+            racer.join();
+        for (int t = 0; t < THREADS; t++)
+            CHECK(answer[t] == answer[0]);
+        int server;
+        CHECK(table.lookup(room_name(r), server) && server == answer[0]);
+    }
+}
+
+void test_erase_only_matching_server()
+{
+    RoutingTable table;
+    table.insert("a", 1);
+    CHECK(!table.erase("a", 2));
+    int server;
+    CHECK(table.lookup("a", server) && server == 1);
+    CHECK(table.erase("a", 1));
+    CHECK(!table.lookup("a", server));
+    CHECK(table.size() == 0);
+}
+
+// Two rebalancers racing to move a room: only the first move applies
+void test_move_only_from_current_server()
+{
+    RoutingTable table;
+    table.insert("a", 1);
+    CHECK(!table.move("a", 2, 3));
+    CHECK(table.move("a", 1, 2));
+    CHECK(!table.move("a", 1, 3));
+    int server;
+    CHECK(table.lookup("a", server) && server == 2);
+    CHECK(!table.move("missing", 1, 2));
+    CHECK(table.size() == 1);
+}
+
+// Shards double their buckets as they fill; every room stays where it was
+// put, and lookups racing the rebuilds still find the rooms placed before
+void test_growth()
+{
+    RoutingTable table;
+    const int MANY = 20000;
+    for (int r = 0; r < 100; r++)
+        table.insert(room_name(r), r * 10);
+    atomic<bool> done{false};
+    atomic<int> misses{0};
+    thread reader([&]() {
+        while (!done)
+            for (int r = 0; r < 100; r++)
+            {
+                int server;
+                if (!table.lookup(room_name(r), server) || server != r * 10)
+                    misses++;
+            }
+    });
+    for (int r = 100; r < MANY; r++)
+        table.insert(room_name(r), r * 10);
+    done = true;
+    reader.join();
+    CHECK(misses == 0);
+    CHECK(table.size() == MANY);
+    bool all_found = true;
+    for (int r = 0; r < MANY; r++)
+    {
+        int server;
+        all_found &= table.lookup(room_name(r), server) && server == r * 10;
+    }
+    CHECK(all_found);
+    for (int r = 0; r < MANY; r += 2)
+        CHECK(table.erase(room_name(r), r * 10));
+    CHECK(table.size() == MANY / 2);
+    size_t visited = 0;
+    table.for_each([&](const string &room, int server) {
+        visited++;
+        CHECK(room_name(server / 10) == room && server / 10 % 2 == 1);
+    });
+    CHECK(visited == MANY / 2);
+}
+
+// Writers retire what they replace instead of waiting for readers, so a
+// write from inside a read-side critical section goes through, and what it
+// replaced stays readable until the section ends
+struct Tracked
+{
+    static atomic<int> alive;
+    Tracked() { alive++; }
+    ~Tracked() { alive--; }
+};
+atomic<int> Tracked::alive{0};
+
+void test_writes_do_not_wait_for_readers()
+{
+    RoutingTable table;
+    table.insert("a", 1);
+    {
+        RcuReadGuard guard;
+        CHECK(table.insert("b", 2) == 2);
+        CHECK(table.move("a", 1, 3));
+        int server;
+        CHECK(table.lookup("a", server) && server == 3);
+        size_t visited = 0;
+        table.for_each([&](const string &room, int) {
+            visited++;
+            table.assign(room, 4);
+        });
+        CHECK(visited == 2);
+    }
+    int server;
+    CHECK(table.lookup("a", server) && server == 4);
+
+    Rcu &rcu = Rcu::instance();
+    atomic<bool> reading{false}, retired{false}, release{false};
+    thread reader([&]() {
+        RcuReadGuard guard;
+        reading = true;
+        while (!retired)
+            this_thread::yield();
+        CHECK(Tracked::alive == 1);
+        while (!release)
+            this_thread::yield();
+    });
+    while (!reading)
+        this_thread::yield();
+    rcu.retire(new Tracked());
+    retired = true;
+    this_thread::sleep_for(chrono::milliseconds(20));
+    CHECK(Tracked::alive == 1);
+    release = true;
+    reader.join();
+    rcu.barrier();
+    CHECK(Tracked::alive == 0);
+}
+
+int main()
+{
+    test_erase_only_matching_server();
+    test_move_only_from_current_server();
+    test_racing_inserts_agree();
+    test_growth();
+    test_writes_do_not_wait_for_readers();
+    test_readers_see_consistent_snapshots();
+    return test_result("test_routing_table");
+}
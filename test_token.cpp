@@ -0,0 +1,97 @@
+/*
+ * test_token.cpp
+ * Checks SipHash against the reference vectors and the signing and
+ * checking of routing tokens in token.h
+ */
+#include "token.h"
+#include "test.h"
+
+void test_siphash_vectors()
+{
+    // Key 00 01 .. 0f and messages 00 01 .. (n - 1), from the SipHash paper
+    uint64_t k0 = 0x0706050403020100ULL, k1 = 0x0f0e0d0c0b0a0908ULL;
+    unsigned char message[64];
+    for (int i = 0; i < 64; i++)
+        message[i] = i;
+    CHECK(siphash24(k0, k1, message, 0) == 0x726fdb47dd0e0e31ULL);
+    CHECK(siphash24(k0, k1, message, 8) == 0x93f5f5799a932462ULL);
+    CHECK(siphash24(k0, k1, message, 15) == 0xa129ca6149be45e5ULL);
+    CHECK(siphash24(k0, k1, message, 63) == 0x958a324ceb064572ULL);
+}
+
+void test_parse_key()
+{
+    RouteKey key;
+    CHECK(parse_route_key("000102030405060708090a0b0c0d0e0f\n", key));
+    CHECK(key.set && key.k0 == 0x0001020304050607ULL && key.k1 == 0x08090a0b0c0d0e0fULL);
+    CHECK(parse_route_key("  000102030405060708090A0B0C0D0E0F", key));
+    RouteKey bad;
+    CHECK(!parse_route_key("000102030405060708090a0b0c0d0e", bad));
+    CHECK(!parse_route_key("000102030405060708090a0b0c0d0e0f00", bad));
+    CHECK(!parse_route_key("00010203040506070809 a0b0c0d0e0f", bad));
+    CHECK(!parse_route_key("g00102030405060708090a0b0c0d0e0f", bad));
+    CHECK(!bad.set);
+    string error;
+    CHECK(!load_route_key("/nonexistent/route.key", bad, error));
+}
+
+// Decodes the one frame in bytes
+Frame decode_one(const string &bytes)
+{
+    static FrameDecoder decoder;
+    decoder = FrameDecoder();
+    decoder.feed(bytes.data(), bytes.size());
+    Frame frame;
+    CHECK(decoder.next(frame) == 1);
+    return frame;
+}
+
+void test_sign_and_check()
+{
+    RouteKey key, other;
+    parse_route_key("8c1f0e2d3b4a59687766554433221100", key);
+    parse_route_key("8c1f0e2d3b4a59687766554433221101", other);
+    uint64_t now = 1700000000000ULL;
+    string bytes;
+    encode_route_token(bytes, key, "lobby", 8001, now);
+    CHECK(bytes.size() == ROUTE_TOKEN_FRAME_SIZE);
+    Frame token = decode_one(bytes);
+    CHECK(token.header.type == MSG_ROUTE_TOKEN && token.header.room_id == room_id_of("lobby"));
+    uint32_t port;
+    uint64_t issued;
+    CHECK(read_route_token(token.payload, token.length, port, issued) && port == 8001 && issued == now);
+
+    CHECK(check_route_token(key, token.payload, token.length, "lobby", 8001, now) == ROUTE_FRESH);
+    CHECK(check_route_token(key, token.payload, token.length, "lobby", 8001, now + ROUTE_TOKEN_FRESH) == ROUTE_FRESH);
+    CHECK(check_route_token(key, token.payload, token.length, "lobby", 8001, now + ROUTE_TOKEN_FRESH + 1) ==
+          ROUTE_VALID);
+    CHECK(check_route_token(key, token.payload, token.length, "lobby", 8001, now + ROUTE_TOKEN_TTL) == ROUTE_VALID);
+    CHECK(check_route_token(key, token.payload, token.length, "lobby", 8001, now + ROUTE_TOKEN_TTL + 1) == ROUTE_BAD);
+    // A server whose clock runs a little behind still takes it
+    CHECK(check_route_token(key, token.payload, token.length, "lobby", 8001, now - 2000) == ROUTE_FRESH);
+    CHECK(check_route_token(key, token.payload, token.length, "lobby", 8001, now - ROUTE_TOKEN_FRESH - 1) ==
+          ROUTE_BAD);
+
+    // Bound to the room, the server and the key
+    CHECK(check_route_token(key, token.payload, token.length, "lobby2", 8001, now) == ROUTE_BAD);
+    CHECK(check_route_token(key, token.payload, token.length, "lobby", 8002, now) == ROUTE_BAD);
+    CHECK(check_route_token(other, token.payload, token.length, "lobby", 8001, now) == ROUTE_BAD);
+    CHECK(check_route_token(key, token.payload, token.length - 1, "lobby", 8001, now) == ROUTE_BAD);
+
+    // Any changed byte spoils it; moving the issue time is the useful forgery
+    for (size_t i = 0; i < ROUTE_TOKEN_SIZE; i++)
+    {
+        string forged = bytes;
+        forged[sizeof(FrameHeader) + i] ^= 1;
+        Frame changed = decode_one(forged);
+        CHECK(check_route_token(key, changed.payload, changed.length, "lobby", 8001, now) == ROUTE_BAD);
+    }
+}
+
+int main()
+{
+    test_siphash_vectors();
+    test_parse_key();
+    test_sign_and_check();
+    return test_result("test_token");
+}
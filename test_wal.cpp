@@ -0,0 +1,169 @@
+/*
+ * test_wal.cpp
+ * Checks that the write-ahead log in wal.h replays what was appended, from
+ * many threads, across segment rotation and after a torn write
+ */
+#include "wal.h"
+#include "routing_table.h"
+#include "test.h"
+
+const int THREADS = 4;
+const int ROOMS = 2000;
+
+string temp_dir()
+{
+    char path[] = "/tmp/test_walXXXXXX";
+    return mkdtemp(path);
+}
+
+void remove_dir(const string &dir)
+{
+    for (uint64_t segment : wal_segments(dir))
+        unlink(wal_segment_path(dir, segment).c_str());
+    rmdir(dir.c_str());
+}
+
+Wal::Snapshot snapshot_of(RoutingTable &table)
+{
+    return [&table] {
+        vector<pair<string, int>> placements;
+        table.for_each([&](const string &room, int server) { placements.emplace_back(room, server); });
+        return placements;
+    };
+}
+
+// Rebuilds a table the way the balancer does on startup
+map<string, int> replay(const string &dir, size_t &records)
+{
+    map<string, int> rooms;
+    records = wal_replay(dir, [&](const WalRecord &record) {
+        if (record.type == WAL_ASSIGN)
+            rooms[record.room] = record.port;
+        else if (record.type == WAL_ERASE && rooms.count(record.room) && rooms[record.room] == record.port)
+            rooms.erase(record.room);
+    });
+    return rooms;
+}
+
+// Thread t owns the rooms r with r % THREADS == t, places each on a server,
+// moves every third one and drops every seventh
+void test_concurrent_appends_replay()
+{
+    string dir = temp_dir();
+    RoutingTable table;
+    WalConfig config;
+    config.dir = dir;
+    config.sync = WAL_SYNC_BATCH;
+    {
+        Wal wal;
+        CHECK(wal.open(config, snapshot_of(table)));
+        vector<thread> writers;
+        for (int t = 0; t < THREADS; t++)
+            writers.emplace_back([&, t] {
+                for (int r = t; r < ROOMS; r += THREADS)
+                {
+                    string room = "room" + to_string(r);
+                    CHECK(wal.append(WAL_REQUEST, room, 0, "client" + to_string(r)));
+                    CHECK(wal.append(WAL_ASSIGN, room, 8000 + r % 5));
+                    if (r % 3 == 0)
+                    {
+                        CHECK(wal.append(WAL_ERASE, room, 8000 + r % 5));
+                        CHECK(wal.append(WAL_ASSIGN, room, 9000));
+                    }
+                    if (r % 7 == 0)
+                        CHECK(wal.append(WAL_ERASE, room, r % 3 == 0 ? 9000 : 8000 + r % 5));
+                }
+            });
+        for (thread &writer : writers)
+            writer.join();
+        wal.close();
+        CHECK(wal.appended == (uint64_t)ROOMS * 2 + (ROOMS + 2) / 3 * 2 + (ROOMS + 6) / 7);
+        CHECK(wal.batches > 0);
+    }
+    size_t records;
+    map<string, int> rooms = replay(dir, records);
+    CHECK(records == (size_t)ROOMS * 2 + (ROOMS + 2) / 3 * 2 + (ROOMS + 6) / 7);
+    for (int r = 0; r < ROOMS; r++)
+    {
+        string room = "room" + to_string(r);
+        if (r % 7 == 0)
+            CHECK(!rooms.count(room));
+        else
+            CHECK(rooms.count(room) && rooms[room] == (r % 3 == 0 ? 9000 : 8000 + r % 5));
+    }
+    remove_dir(dir);
+}
+
+// Small segments force rotation; each new segment starts from the table, so
+// only the newest segments need to stay
+void test_rotation_keeps_table()
+{
+    string dir = temp_dir();
+    RoutingTable table;
+    WalConfig config;
+    config.dir = dir;
+    config.sync = WAL_SYNC_NONE;
+    config.segment_bytes = 4096;
+    {
+        Wal wal;
+        CHECK(wal.open(config, snapshot_of(table)));
+        for (int r = 0; r < ROOMS; r++)
+        {
+            string room = "room" + to_string(r);
+            table.assign(room, 8000 + r % 5);
+            CHECK(wal.append(WAL_ASSIGN, room, 8000 + r % 5));
+        }
+    }
+    CHECK(wal_segments(dir).size() == 1);
+    size_t records;
+    map<string, int> rooms = replay(dir, records);
+    CHECK(rooms.size() == (size_t)ROOMS);
+    for (int r = 0; r < ROOMS; r++)
+        CHECK(rooms["room" + to_string(r)] == 8000 + r % 5);
+    remove_dir(dir);
+}
+
+// A crash can leave half a record at the end of the last segment
+void test_torn_tail_is_ignored()
+{
+    string dir = temp_dir();
+    RoutingTable table;
+    WalConfig config;
+    config.dir = dir;
+    {
+        Wal wal;
+        CHECK(wal.open(config, snapshot_of(table)));
+        CHECK(wal.append(WAL_ASSIGN, "kept", 8000));
+        CHECK(wal.append(WAL_ASSIGN, "torn", 8001));
+        CHECK(!wal.append(WAL_ASSIGN, string(WAL_RECORD_MAX, 'x'), 8002)); // too large to log
+    }
+    vector<uint64_t> segments = wal_segments(dir);
+    CHECK(segments.size() == 1);
+    string path = wal_segment_path(dir, segments.back());
+    struct stat info;
+    stat(path.c_str(), &info);
+    CHECK(truncate(path.c_str(), info.st_size - 3) == 0);
+    size_t records;
+    map<string, int> rooms = replay(dir, records);
+    CHECK(records == 1);
+    CHECK(rooms.size() == 1 && rooms["kept"] == 8000);
+
+    // Reopening starts a fresh segment from the replayed table
+    table.assign("kept", 8000);
+    {
+        Wal wal;
+        CHECK(wal.open(config, snapshot_of(table)));
+    }
+    CHECK(wal_segments(dir).size() == 1 && wal_segments(dir)[0] > segments.back());
+    rooms = replay(dir, records);
+    CHECK(records == 1 && rooms["kept"] == 8000);
+    remove_dir(dir);
+}
+
+int main()
+{
+    test_concurrent_appends_replay();
+    test_rotation_keeps_table();
+    test_torn_tail_is_ignored();
+    return test_result("test_wal");
+}
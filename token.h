@@ -0,0 +1,208 @@
+/*
+ * token.h
+ * Signed routing tokens: the balancer's word that a client may join a room
+ * on a server
+ *
+ * With a key (-K on the balancer and the servers) the balancer sends a
+ * MSG_ROUTE_TOKEN ahead of each ASSIGN, and a server ahead of each REDIRECT.
+ * The client sends the token ahead of its HELLO to that server, and keeps
+ * it: after losing the connection it goes straight back with it instead of
+ * asking the balancer again, which saves the round trip and a TCP
+ * handshake on every reconnect. A keyed server admits no client without a
+ * valid token, and answers each admitted HELLO with a renewed one.
+ *
+ * A token names the server's port and the time it was issued, and carries
+ * a SipHash-2-4 MAC over those and the room, so it is only good for that
+ * room on that server and for ROUTE_TOKEN_TTL. The host is not signed: a
+ * port names one server across the whole cluster (backends.h refuses a
+ * list that uses one twice), so servers that share a key must not share a
+ * port, even on different hosts. A server only takes an old token for a
+ * room it knows; it has sent rooms that moved on with REDIRECT anyway, and
+ * after a restart it knows none, so clients holding tokens from before go
+ * back through the balancer. Times are wall clock, so balancers and servers
+ * on different hosts need synchronised clocks.
+ */
+#ifndef TOKEN_H
+#define TOKEN_H
+
+#include <bits/stdc++.h>
+#include <endian.h>
+#include "protocol.h"
+
+using namespace std;
+
+#define ROUTE_TOKEN_SIZE 20      // [u32 port][u64 issued, ms since the epoch][u64 mac]
+#define ROUTE_TOKEN_FRAME_SIZE (sizeof(FrameHeader) + ROUTE_TOKEN_SIZE)
+#define ROUTE_TOKEN_TTL 300000   // ms a token can be used for
+#define ROUTE_TOKEN_FRESH 10000  // ms a token admits a room the server does not know yet
+
+struct RouteKey
+{
+    uint64_t k0 = 0, k1 = 0;
+    bool set = false;
+};
+
+// SipHash-2-4 (Aumasson and Bernstein) of data under the 128-bit key k0, k1
+inline uint64_t siphash24(uint64_t k0, uint64_t k1, const void *data, size_t len)
+{
+    uint64_t v0 = k0 ^ 0x736f6d6570736575ULL, v1 = k1 ^ 0x646f72616e646f6dULL;
+    uint64_t v2 = k0 ^ 0x6c7967656e657261ULL, v3 = k1 ^ 0x7465646279746573ULL;
+    auto rotl = [](uint64_t x, int b) { return (x << b) | (x >> (64 - b)); };
+    auto round = [&] {
+        v0 += v1;
+        v1 = rotl(v1, 13) ^ v0;
+        v0 = rotl(v0, 32);
+        v2 += v3;
+        v3 = rotl(v3, 16) ^ v2;
+        v0 += v3;
+        v3 = rotl(v3, 21) ^ v0;
+        v2 += v1;
+        v1 = rotl(v1, 17) ^ v2;
+        v2 = rotl(v2, 32);
+    };
+    const unsigned char *in = (const unsigned char *)data;
+    size_t whole = len - len % 8;
+    for (size_t at = 0; at < whole; at += 8)
+    {
+        uint64_t m = 0;
+        for (int i = 7; i >= 0; i--)
+            m = (m << 8) | in[at + i]; // little endian
+        v3 ^= m;
+        round();
+        round();
+        v0 ^= m;
+    }
+    uint64_t last = (uint64_t)len << 56;
+    for (size_t i = whole; i < len; i++)
+        last |= (uint64_t)in[i] << (8 * (i - whole));
+    v3 ^= last;
+    round();
+    round();
+    v0 ^= last;
+    v2 ^= 0xff;
+    for (int i = 0; i < 4; i++)
+        round();
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+// Parses 32 hex digits, surrounding whitespace allowed. Returns false if
+// that is not what text holds.
+inline bool parse_route_key(const string &text, RouteKey &key)
+{
+    size_t begin = text.find_first_not_of(" \t\r\n"), end = text.find_last_not_of(" \t\r\n");
+    if (begin == string::npos || end - begin + 1 != 32)
+        return false;
+    uint64_t halves[2] = {0, 0};
+    for (size_t i = 0; i < 32; i++)
+    {
+        char c = tolower((unsigned char)text[begin + i]);
+        int digit = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+        if (digit == -1)
+            return false;
+        halves[i / 16] = halves[i / 16] << 4 | digit;
+    }
+    key.k0 = halves[0];
+    key.k1 = halves[1];
+    key.set = true;
+    return true;
+}
+
+// Reads the key from a file, e.g. one made with
+// head -c 16 /dev/urandom | xxd -p > route.key
+inline bool load_route_key(const string &path, RouteKey &key, string &error)
+{
+    ifstream in(path);
+    stringstream text;
+    text << in.rdbuf();
+    if (!in)
+    {
+        error = path + ": " + strerror(errno);
+        return false;
+    }
+    if (!parse_route_key(text.str(), key))
+    {
+        error = path + ": expected 32 hex digits";
+        return false;
+    }
+    return true;
+}
+
+inline uint64_t wall_ms()
+{
+    return chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// The room is hashed first, so a MAC costs two short hashes and no copy
+inline uint64_t route_mac(const RouteKey &key, const char *room, size_t room_len, uint32_t port, uint64_t issued)
+{
+    unsigned char signed_part[20];
+    uint64_t room_hash = siphash24(key.k0, key.k1, room, room_len);
+    uint32_t port_n = htonl(port);
+    uint64_t issued_n = htobe64(issued);
+    memcpy(signed_part, &port_n, 4);
+    memcpy(signed_part + 4, &issued_n, 8);
+    memcpy(signed_part + 12, &room_hash, 8);
+    return siphash24(key.k0, key.k1, signed_part, sizeof signed_part);
+}
+
+// Writes a MSG_ROUTE_TOKEN for room on port into the ROUTE_TOKEN_FRAME_SIZE
+// bytes at out
+inline void put_route_token_frame(char *out, const RouteKey &key, const char *room, size_t room_len, uint32_t port,
+                                  uint64_t issued)
+{
+    put_header(out, MSG_ROUTE_TOKEN, 0, room_id_of(room, room_len), ROUTE_TOKEN_SIZE);
+    uint64_t mac = route_mac(key, room, room_len, port, issued);
+    uint32_t port_n = htonl(port);
+    uint64_t issued_n = htobe64(issued), mac_n = htobe64(mac);
+    memcpy(out + sizeof(FrameHeader), &port_n, 4);
+    memcpy(out + sizeof(FrameHeader) + 4, &issued_n, 8);
+    memcpy(out + sizeof(FrameHeader) + 12, &mac_n, 8);
+}
+
+inline void encode_route_token(string &out, const RouteKey &key, const string &room, uint32_t port, uint64_t issued)
+{
+    size_t at = out.size();
+    out.resize(at + ROUTE_TOKEN_FRAME_SIZE);
+    put_route_token_frame(&out[at], key, room.data(), room.size(), port, issued);
+}
+
+// Port and issue time of a token, without checking it. Returns false if
+// the payload is not a token.
+inline bool read_route_token(const char *payload, size_t length, uint32_t &port, uint64_t &issued)
+{
+    if (length != ROUTE_TOKEN_SIZE)
+        return false;
+    memcpy(&port, payload, 4);
+    memcpy(&issued, payload + 4, 8);
+    port = ntohl(port);
+    issued = be64toh(issued);
+    return true;
+}
+
+enum route_check
+{
+    ROUTE_BAD,   // forged, for another room or server, or expired
+    ROUTE_FRESH, // issued within ROUTE_TOKEN_FRESH
+    ROUTE_VALID,
+};
+
+// Checks a token's payload for a HELLO to room on port at time now
+inline route_check check_route_token(const RouteKey &key, const char *payload, size_t length, const string &room,
+                                     uint32_t port, uint64_t now)
+{
+    uint32_t token_port;
+    uint64_t issued, mac;
+    if (!read_route_token(payload, length, token_port, issued) || token_port != port)
+        return ROUTE_BAD;
+    memcpy(&mac, payload + 12, 8);
+    if (be64toh(mac) != route_mac(key, room.data(), room.size(), port, issued))
+        return ROUTE_BAD;
+    // Negative for a balancer clock a little ahead of this one, which is let
+    // off by as much as the fresh window
+    int64_t age = (int64_t)(now - issued);
+    if (age < -ROUTE_TOKEN_FRESH || age > ROUTE_TOKEN_TTL)
+        return ROUTE_BAD;
+    return age <= ROUTE_TOKEN_FRESH ? ROUTE_FRESH : ROUTE_VALID;
+}
+
+#endif
@@ -0,0 +1,385 @@
+/*
+ * uring.h
+ * Just enough io_uring for the reactors, on raw syscalls (no liburing)
+ *
+ * One IoUring per reactor thread. init() sets up the rings together with a
+ * provided buffer ring for receives and a sparse table of registered files,
+ * and fails on kernels that lack any of the pieces the reactors rely on
+ * (multishot accept, buffer rings, sparse file tables, waits with a timeout;
+ * all there since 5.19), so the caller can stay on epoll. Multishot recv
+ * (6.0) is optional: multishot_recv is cleared the first time the kernel
+ * rejects it and receives are re-armed one at a time instead.
+ */
+#ifndef URING_H
+#define URING_H
+
+#include <bits/stdc++.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#include <unistd.h>
+
+using namespace std;
+
+inline int io_uring_setup(unsigned entries, struct io_uring_params *params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+inline int io_uring_enter(int ring_id, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg,
+                          size_t arg_size)
+{
+    return (int)syscall(__NR_io_uring_enter, ring_id, to_submit, min_complete, flags, arg, arg_size);
+}
+
+inline int io_uring_register(int ring_id, unsigned opcode, const void *arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, ring_id, opcode, arg, nr_args);
+}
+
+class IoUring
+{
+    int ring_id = -1;
+    // Submission and completion rings shared with the kernel
+    void *sq_map = MAP_FAILED, *cq_map = MAP_FAILED;
+    size_t sq_map_len = 0, cq_map_len = 0, sqes_len = 0;
+    unsigned *sq_head, *sq_tail, *sq_array, sq_mask, sq_entries;
+    unsigned *cq_head, *cq_tail, cq_mask;
+    struct io_uring_sqe *sqes = (struct io_uring_sqe *)MAP_FAILED;
+    struct io_uring_cqe *cqes;
+    unsigned sqe_tail = 0, submitted = 0;
+
+    // Provided buffers: the kernel picks one per completed receive
+    struct io_uring_buf_ring *buf_ring = (struct io_uring_buf_ring *)MAP_FAILED;
+    size_t buf_ring_len = 0;
+    vector<char> buffers;
+    unsigned buf_count = 0, buf_size = 0;
+
+    bool supports(const struct io_uring_probe *probe, unsigned op)
+    {
+        return op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+    }
+
+    bool map_rings(const struct io_uring_params &params)
+    {
+        sq_map_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_map_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            sq_map_len = cq_map_len = max(sq_map_len, cq_map_len);
+        sq_map = mmap(NULL, sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_id,
+                      IORING_OFF_SQ_RING);
+        if (sq_map == MAP_FAILED)
+            return false;
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            cq_map = sq_map;
+        else if ((cq_map = mmap(NULL, cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_id,
+                                IORING_OFF_CQ_RING)) == MAP_FAILED)
+            return false;
+        sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+        sqes = (struct io_uring_sqe *)mmap(NULL, sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                           ring_id, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED)
+            return false;
+
+        char *sq = (char *)sq_map, *cq = (char *)cq_map;
+        sq_head = (unsigned *)(sq + params.sq_off.head);
+        sq_tail = (unsigned *)(sq + params.sq_off.tail);
+        sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+        sq_entries = params.sq_entries;
+        sq_array = (unsigned *)(sq + params.sq_off.array);
+        for (unsigned i = 0; i < sq_entries; i++)
+            sq_array[i] = i; // SQE slot i always sits in ring position i
+        cq_head = (unsigned *)(cq + params.cq_off.head);
+        cq_tail = (unsigned *)(cq + params.cq_off.tail);
+        cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+        cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+        sqe_tail = submitted = *sq_tail;
+        return true;
+    }
+
+    bool register_buffers(unsigned count, unsigned size)
+    {
+        buf_count = count;
+        buf_size = size;
+        buffers.resize((size_t)count * size);
+        buf_ring_len = count * sizeof(struct io_uring_buf);
+        buf_ring = (struct io_uring_buf_ring *)mmap(NULL, buf_ring_len, PROT_READ | PROT_WRITE,
+                                                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buf_ring == MAP_FAILED)
+            return false;
+        struct io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof reg);
+        reg.ring_addr = (uint64_t)buf_ring;
+        reg.ring_entries = count;
+        reg.bgid = 0;
+        if (io_uring_register(ring_id, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+            return false;
+        buf_ring->tail = 0;
+        for (unsigned bid = 0; bid < count; bid++)
+            recycle(bid);
+        return true;
+    }
+
+public:
+    bool multishot_recv = true; // cleared if the kernel rejects multishot recv
+
+    IoUring() = default;
+    IoUring(const IoUring &) = delete;
+    IoUring &operator=(const IoUring &) = delete;
+
+    ~IoUring()
+    {
+        if (buf_ring != MAP_FAILED)
+            munmap(buf_ring, buf_ring_len);
+        if (sqes != MAP_FAILED)
+            munmap(sqes, sqes_len);
+        if (cq_map != MAP_FAILED && cq_map != sq_map)
+            munmap(cq_map, cq_map_len);
+        if (sq_map != MAP_FAILED)
+            munmap(sq_map, sq_map_len);
+        if (ring_id != -1)
+            close(ring_id);
+    }
+
+    // Sets the ring up on the calling thread, which must be the only one to
+    // submit to it. `buffers` (a power of two) receive buffers of
+    // `buffer_size` bytes and `files` registered file slots. Returns false if
+    // the kernel lacks something the reactors need.
+    bool init(unsigned entries, unsigned buffers, unsigned buffer_size, unsigned files)
+    {
+        struct io_uring_params params;
+        memset(&params, 0, sizeof params);
+        params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+        params.cq_entries = entries * 4;
+        if ((ring_id = io_uring_setup(entries, &params)) < 0)
+        {
+            // Kernels before 6.1 only lack the task-run optimisations
+            memset(&params, 0, sizeof params);
+            params.flags = IORING_SETUP_CQSIZE;
+            params.cq_entries = entries * 4;
+            if ((ring_id = io_uring_setup(entries, &params)) < 0)
+                return false;
+        }
+        if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP) ||
+            !map_rings(params))
+            return false;
+
+        size_t probe_len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+        vector<char> probe_space(probe_len, 0);
+        struct io_uring_probe *probe = (struct io_uring_probe *)probe_space.data();
+        if (io_uring_register(ring_id, IORING_REGISTER_PROBE, probe, 256) < 0)
+            return false;
+        for (unsigned op : {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_SENDMSG, IORING_OP_READ,
+                            IORING_OP_POLL_ADD, IORING_OP_CLOSE, IORING_OP_ASYNC_CANCEL})
+            if (!supports(probe, op))
+                return false;
+
+        struct io_uring_rsrc_register table;
+        memset(&table, 0, sizeof table);
+        table.nr = files;
+        table.flags = IORING_RSRC_REGISTER_SPARSE;
+        if (io_uring_register(ring_id, IORING_REGISTER_FILES2, &table, sizeof table) < 0)
+            return false;
+        return register_buffers(buffers, buffer_size);
+    }
+
+    // Checks once whether this kernel can run the io_uring backend
+    static bool available()
+    {
+        IoUring probe;
+        return probe.init(8, 8, 64, 8);
+    }
+
+    // Returns a zeroed SQE, submitting queued ones first if the ring is full
+    struct io_uring_sqe *get_sqe()
+    {
+        if (sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries)
+            submit(0, 0);
+        struct io_uring_sqe *sqe = &sqes[sqe_tail & sq_mask];
+        memset(sqe, 0, sizeof *sqe);
+        sqe_tail++;
+        return sqe;
+    }
+
+    // Submits everything queued and waits for at least wait_nr completions
+    // or timeout_ms (-1: no limit). One io_uring_enter() per call.
+    void submit(unsigned wait_nr, int timeout_ms)
+    {
+        __atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+        unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+        struct io_uring_getevents_arg arg;
+        struct __kernel_timespec timeout;
+        memset(&arg, 0, sizeof arg);
+        if (wait_nr && timeout_ms >= 0)
+        {
+            timeout.tv_sec = timeout_ms / 1000;
+            timeout.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+            arg.ts = (uint64_t)&timeout;
+        }
+        flags |= IORING_ENTER_EXT_ARG;
+        while (true)
+        {
+            int done = io_uring_enter(ring_id, sqe_tail - submitted, wait_nr, flags, &arg, sizeof arg);
+            if (done >= 0)
+            {
+                submitted += done;
+                if (submitted == sqe_tail)
+                    return;
+                continue;
+            }
+            if (errno == ETIME || errno == EINTR)
+                return;
+            if (errno == EAGAIN || errno == EBUSY)
+            {
+                // Completions are backed up; the caller reaps them first
+                if (wait_nr == 0)
+                    return;
+                wait_nr = 0;
+                continue;
+            }
+            perror("io_uring_enter");
+            exit(-1);
+        }
+    }
+
+    // Calls handle(cqe) for every completion posted so far
+    template <class Handle>
+    void for_each_cqe(Handle handle)
+    {
+        unsigned head = *cq_head;
+        while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+        {
+            struct io_uring_cqe cqe = cqes[head & cq_mask];
+            head++;
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+            handle(cqe);
+        }
+    }
+
+    char *buffer(unsigned bid) { return buffers.data() + (size_t)bid * buf_size; }
+
+    // Returns a receive buffer to the kernel
+    void recycle(unsigned bid)
+    {
+        // Not buf_ring->bufs: under C++ the header's flexible array member
+        // lands 8 bytes into the ring instead of overlaying the tail
+        struct io_uring_buf *slot = (struct io_uring_buf *)buf_ring + (buf_ring->tail & (buf_count - 1));
+        slot->addr = (uint64_t)buffer(bid);
+        slot->len = buf_size;
+        slot->bid = bid;
+        __atomic_store_n(&buf_ring->tail, (uint16_t)(buf_ring->tail + 1), __ATOMIC_RELEASE);
+    }
+
+    // Points registered file slot at fd, or empties it for fd == -1
+    bool update_file(unsigned slot, int fd)
+    {
+        struct io_uring_files_update update;
+        memset(&update, 0, sizeof update);
+        update.offset = slot;
+        update.fds = (uint64_t)&fd;
+        return io_uring_register(ring_id, IORING_REGISTER_FILES_UPDATE, &update, 1) == 1;
+    }
+
+    // Queues a multishot accept. With direct set, accepted sockets go
+    // straight into a free registered file slot and the completion carries
+    // the slot instead of a descriptor.
+    void accept_multishot(int listen_id, uint64_t user_data, bool direct)
+    {
+        struct io_uring_sqe *sqe = get_sqe();
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = listen_id;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK | (direct ? 0 : SOCK_CLOEXEC); // slots have no close-on-exec
+        if (direct)
+            sqe->file_index = IORING_FILE_INDEX_ALLOC;
+        sqe->user_data = user_data;
+    }
+
+    // Queues a receive into a provided buffer; multishot if the kernel
+    // supports it. fixed says whether target is a registered file slot.
+    void recv(int target, bool fixed, uint64_t user_data)
+    {
+        struct io_uring_sqe *sqe = get_sqe();
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = target;
+        sqe->flags = IOSQE_BUFFER_SELECT | (fixed ? IOSQE_FIXED_FILE : 0);
+        sqe->buf_group = 0;
+        if (multishot_recv)
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->user_data = user_data;
+    }
+
+    // Queues a sendmsg that never waits for the socket: it completes with
+    // what the socket took, and a short write cancels the requests linked
+    // after it. link ties the next SQE to this one: it only runs after this
+    // one wrote everything.
+    void sendmsg(int target, bool fixed, const struct msghdr *msg, bool link, uint64_t user_data)
+    {
+        struct io_uring_sqe *sqe = get_sqe();
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = target;
+        sqe->flags = (fixed ? IOSQE_FIXED_FILE : 0) | (link ? IOSQE_IO_LINK : 0);
+        sqe->addr = (uint64_t)msg;
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL | MSG_DONTWAIT;
+        sqe->user_data = user_data;
+    }
+
+    // Queues a one-shot wait for target to become writable
+    void poll_writable(int target, bool fixed, uint64_t user_data)
+    {
+        struct io_uring_sqe *sqe = get_sqe();
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = target;
+        sqe->flags = fixed ? IOSQE_FIXED_FILE : 0;
+        sqe->poll32_events = POLLOUT;
+        sqe->user_data = user_data;
+    }
+
+    // Queues a send; hard_link runs the next SQE even if this one fails
+    void send(int target, bool fixed, const void *data, size_t length, bool hard_link, uint64_t user_data)
+    {
+        struct io_uring_sqe *sqe = get_sqe();
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = target;
+        sqe->flags = (fixed ? IOSQE_FIXED_FILE : 0) | (hard_link ? IOSQE_IO_HARDLINK : 0);
+        sqe->addr = (uint64_t)data;
+        sqe->len = length;
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        sqe->user_data = user_data;
+    }
+
+    void read(int fd, void *data, size_t length, uint64_t user_data)
+    {
+        struct io_uring_sqe *sqe = get_sqe();
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)data;
+        sqe->len = length;
+        sqe->off = (uint64_t)-1;
+        sqe->user_data = user_data;
+    }
+
+    // Closes a registered file slot
+    void close_file(unsigned slot, uint64_t user_data)
+    {
+        struct io_uring_sqe *sqe = get_sqe();
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->file_index = slot + 1;
+        sqe->user_data = user_data;
+    }
+
+    // Cancels the request queued with target_data
+    void cancel(uint64_t target_data, uint64_t user_data)
+    {
+        struct io_uring_sqe *sqe = get_sqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = target_data;
+        sqe->user_data = user_data;
+    }
+};
+
+#endif
@@ -0,0 +1,426 @@
+/*
+ * wal.h
+ * Write-ahead log of room placements for the Load Balancer
+ *
+ * Reactor threads append small binary records to a bounded lock-free ring
+ * (a multi-producer, single-consumer queue); one writer thread drains
+ * whatever has piled up into a single write() and syncs it according to the
+ * configured policy (group commit). The log is a directory of numbered
+ * segments. Every segment starts with a snapshot of the table, so once a new
+ * segment is safely on disk the older ones are deleted.
+ *
+ * Replaying the segments in order rebuilds the room -> server table, which
+ * lets a restarted balancer keep its rooms where they were. Records use the
+ * host's byte order; the log is not meant to move between machines.
+ */
+#ifndef WAL_H
+#define WAL_H
+
+#include <bits/stdc++.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+#define WAL_RING_SLOTS 4096        // records that can wait for the writer
+#define WAL_RECORD_MAX 512         // bytes per record, header included
+#define WAL_BATCH_MAX (256 * 1024) // bytes handed to one write()
+#define WAL_IDLE_WAIT 100          // ms the idle writer sleeps between checks
+
+enum wal_type
+{
+    WAL_REQUEST = 1, // a client asked for a room (audit only)
+    WAL_ASSIGN,      // a room was placed on a server
+    WAL_ERASE,       // a room was taken off a server
+};
+
+enum wal_sync
+{
+    WAL_SYNC_NONE,     // leave it to the kernel
+    WAL_SYNC_INTERVAL, // at most sync_interval ms of records at risk
+    WAL_SYNC_BATCH,    // every write() is synced before the next one
+};
+
+struct WalConfig
+{
+    string dir = "wal";
+    wal_sync sync = WAL_SYNC_INTERVAL;
+    int sync_interval = 1000; // milliseconds
+    size_t segment_bytes = 16 * 1024 * 1024;
+};
+
+// On-disk record: this header, the name, then the room
+struct __attribute__((packed)) WalHeader
+{
+    uint32_t crc;    // CRC-32 of everything after this field
+    uint16_t length; // bytes after the header
+    uint8_t type;
+    uint8_t name_length;
+    uint32_t port;
+};
+
+struct WalRecord
+{
+    wal_type type;
+    int port;
+    string room;
+    string name;
+};
+
+inline uint32_t wal_crc32(const char *data, size_t len, uint32_t crc = 0)
+{
+    static const vector<uint32_t> table = [] {
+        vector<uint32_t> t(256);
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            t[i] = c;
+        }
+        return t;
+    }();
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++)
+        crc = table[(crc ^ (unsigned char)data[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+// Encodes a record into out (WAL_RECORD_MAX bytes). Returns its size, or 0
+// if it does not fit.
+inline size_t wal_encode(char *out, wal_type type, const string &room, int port, const string &name)
+{
+    size_t size = sizeof(WalHeader) + name.size() + room.size();
+    if (name.size() > 255 || size > WAL_RECORD_MAX)
+        return 0;
+    WalHeader header;
+    header.length = size - sizeof header;
+    header.type = type;
+    header.name_length = name.size();
+    header.port = port;
+    memcpy(out, &header, sizeof header);
+    memcpy(out + sizeof header, name.data(), name.size());
+    memcpy(out + sizeof header + name.size(), room.data(), room.size());
+    header.crc = wal_crc32(out + sizeof header.crc, size - sizeof header.crc);
+    memcpy(out, &header.crc, sizeof header.crc);
+    return size;
+}
+
+// Segment file names sort in log order
+inline string wal_segment_path(const string &dir, uint64_t segment)
+{
+    char name[32];
+    snprintf(name, sizeof name, "%016llx.wal", (unsigned long long)segment);
+    return dir + "/" + name;
+}
+
+// Numbers of the segments in dir, oldest first
+inline vector<uint64_t> wal_segments(const string &dir)
+{
+    vector<uint64_t> segments;
+    DIR *listing = opendir(dir.c_str());
+    if (!listing)
+        return segments;
+    while (struct dirent *entry = readdir(listing))
+    {
+        unsigned long long segment;
+        char suffix[8];
+        if (sscanf(entry->d_name, "%16llx.%4s", &segment, suffix) == 2 && strcmp(suffix, "wal") == 0)
+            segments.push_back(segment);
+    }
+    closedir(listing);
+    sort(segments.begin(), segments.end());
+    return segments;
+}
+
+// Calls visit(record) for every intact record in dir, in log order. A
+// segment is read up to its first torn or corrupt record, which is where a
+// crash left it. Returns the number of records visited.
+template <class Visit>
+size_t wal_replay(const string &dir, Visit visit)
+{
+    size_t replayed = 0;
+    for (uint64_t segment : wal_segments(dir))
+    {
+        string path = wal_segment_path(dir, segment);
+        ifstream file(path, ios::binary);
+        string data((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+        size_t at = 0;
+        while (at < data.size())
+        {
+            WalHeader header;
+            if (data.size() - at < sizeof header)
+                break;
+            memcpy(&header, data.data() + at, sizeof header);
+            size_t size = sizeof header + header.length;
+            if (data.size() - at < size || header.name_length > header.length ||
+                header.crc != wal_crc32(data.data() + at + sizeof header.crc, size - sizeof header.crc))
+                break;
+            WalRecord record;
+            record.type = (wal_type)header.type;
+            record.port = header.port;
+            record.name.assign(data, at + sizeof header, header.name_length);
+            record.room.assign(data, at + sizeof header + header.name_length, header.length - header.name_length);
+            visit(record);
+            replayed++;
+            at += size;
+        }
+        if (at < data.size())
+            cerr << "wal: " << path << ": ignoring " << data.size() - at << " bytes after the last intact record\n";
+    }
+    return replayed;
+}
+
+class Wal
+{
+public:
+    // Lists the current placements for the head of a new segment
+    typedef function<vector<pair<string, int>>()> Snapshot;
+
+    atomic<uint64_t> appended{0};
+    atomic<uint64_t> stalls{0};  // appends that waited for a full ring
+    atomic<uint64_t> batches{0}; // write() calls
+    atomic<uint64_t> syncs{0};
+
+private:
+    struct alignas(64) Slot
+    {
+        atomic<size_t> sequence;
+        uint16_t size;
+        char data[WAL_RECORD_MAX];
+    };
+
+    WalConfig config;
+    Snapshot snapshot;
+    vector<Slot> slots;
+    alignas(64) atomic<size_t> head{0}; // next slot to claim, shared by producers
+    alignas(64) size_t tail = 0;        // next slot to drain, writer only
+
+    int segment_id = -1;
+    uint64_t segment = 0;
+    size_t segment_size = 0;
+    bool unsynced = false;
+    chrono::steady_clock::time_point last_sync;
+
+    thread writer;
+    atomic<bool> stopping{false};
+    atomic<bool> idle{false};
+    mutex wake_mutex;
+    condition_variable wake;
+
+    bool ready() const
+    {
+        return slots[tail & (WAL_RING_SLOTS - 1)].sequence.load(memory_order_acquire) == tail + 1;
+    }
+
+    // Appends the next record to batch. Returns false if there is none.
+    bool pop(string &batch)
+    {
+        if (!ready())
+            return false;
+        Slot &slot = slots[tail & (WAL_RING_SLOTS - 1)];
+        batch.append(slot.data, slot.size);
+        slot.sequence.store(tail + WAL_RING_SLOTS, memory_order_release);
+        tail++;
+        return true;
+    }
+
+    void write_all(const string &data)
+    {
+        size_t written = 0;
+        while (written < data.size())
+        {
+            ssize_t n = ::write(segment_id, data.data() + written, data.size() - written);
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n == -1)
+            {
+                perror("wal: write");
+                return;
+            }
+            written += n;
+        }
+        segment_size += data.size();
+        unsynced = true;
+    }
+
+    void sync()
+    {
+        if (unsynced)
+        {
+            if (fdatasync(segment_id) == -1)
+                perror("wal: fdatasync");
+            syncs++;
+        }
+        unsynced = false;
+        last_sync = chrono::steady_clock::now();
+    }
+
+    // Starts the next segment with a snapshot and drops the ones before it
+    // once the snapshot is on disk
+    bool start_segment()
+    {
+        if (segment_id != -1)
+        {
+            sync();
+            ::close(segment_id);
+        }
+        segment++;
+        string path = wal_segment_path(config.dir, segment);
+        if ((segment_id = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644)) == -1)
+        {
+            perror(("wal: " + path).c_str());
+            return false;
+        }
+        segment_size = 0;
+        string head;
+        char record[WAL_RECORD_MAX];
+        for (auto &placement : snapshot())
+            if (size_t size = wal_encode(record, WAL_ASSIGN, placement.first, placement.second, ""))
+                head.append(record, size);
+        write_all(head);
+        unsynced = true;
+        sync();
+        // The new segment has to survive a crash before the old ones go
+        int dir_id = ::open(config.dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dir_id != -1)
+        {
+            fsync(dir_id);
+            ::close(dir_id);
+        }
+        for (uint64_t old : wal_segments(config.dir))
+            if (old < segment)
+                unlink(wal_segment_path(config.dir, old).c_str());
+        return true;
+    }
+
+    void run()
+    {
+        string batch;
+        batch.reserve(WAL_BATCH_MAX + WAL_RECORD_MAX); // the most pop can leave in it
+        while (true)
+        {
+            bool stop = stopping.load();
+            while (batch.size() < WAL_BATCH_MAX && pop(batch))
+                ;
+            if (!batch.empty())
+            {
+                write_all(batch);
+                batches++;
+                batch.clear();
+                if (config.sync == WAL_SYNC_BATCH)
+                    sync();
+            }
+            auto since_sync = chrono::steady_clock::now() - last_sync;
+            if (unsynced && config.sync == WAL_SYNC_INTERVAL && since_sync >= chrono::milliseconds(config.sync_interval))
+                sync();
+            if (segment_size >= config.segment_bytes)
+                start_segment();
+            if (ready())
+                continue;
+            if (stop)
+                break;
+            auto timeout = chrono::milliseconds(WAL_IDLE_WAIT);
+            if (unsynced && config.sync == WAL_SYNC_INTERVAL)
+                timeout = min(timeout, chrono::duration_cast<chrono::milliseconds>(
+                                           chrono::milliseconds(config.sync_interval) - since_sync));
+            unique_lock<mutex> lock(wake_mutex);
+            idle.store(true);
+            atomic_thread_fence(memory_order_seq_cst);
+            if (!ready() && !stopping.load())
+                wake.wait_for(lock, max(timeout, chrono::milliseconds(1)));
+            idle.store(false);
+        }
+        if (config.sync != WAL_SYNC_NONE)
+            sync();
+    }
+
+public:
+    Wal() : slots(WAL_RING_SLOTS)
+    {
+        for (size_t i = 0; i < WAL_RING_SLOTS; i++)
+            slots[i].sequence.store(i, memory_order_relaxed);
+    }
+    ~Wal() { close(); }
+
+    Wal(const Wal &) = delete;
+    Wal &operator=(const Wal &) = delete;
+
+    // Opens a new segment in config.dir, seeded from snapshot, and starts
+    // the writer. Replay the directory before opening it: older segments
+    // are deleted. Returns false if the directory cannot be written.
+    bool open(const WalConfig &wal_config, Snapshot wal_snapshot)
+    {
+        config = wal_config;
+        snapshot = wal_snapshot;
+        if (mkdir(config.dir.c_str(), 0755) == -1 && errno != EEXIST)
+        {
+            perror(("wal: " + config.dir).c_str());
+            return false;
+        }
+        vector<uint64_t> existing = wal_segments(config.dir);
+        segment = existing.empty() ? 0 : existing.back();
+        if (!start_segment())
+            return false;
+        writer = thread(&Wal::run, this);
+        return true;
+    }
+
+    // Writes out everything appended so far and stops the writer
+    void close()
+    {
+        if (writer.joinable())
+        {
+            stopping.store(true);
+            wake.notify_one();
+            writer.join();
+        }
+        if (segment_id != -1)
+            ::close(segment_id);
+        segment_id = -1;
+    }
+
+    // Queues a record for the writer; safe from any thread. Waits if the
+    // ring is full. Returns false for a record too large to log.
+    bool append(wal_type type, const string &room, int port, const string &name = "")
+    {
+        if (name.size() > 255 || sizeof(WalHeader) + name.size() + room.size() > WAL_RECORD_MAX)
+            return false;
+        size_t pos = head.load(memory_order_relaxed);
+        Slot *slot;
+        while (true)
+        {
+            slot = &slots[pos & (WAL_RING_SLOTS - 1)];
+            size_t sequence = slot->sequence.load(memory_order_acquire);
+            if (sequence == pos)
+            {
+                if (head.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+                    break;
+            }
+            else if (sequence < pos)
+            {
+                // Full: the writer is behind, give it the CPU
+                stalls++;
+                this_thread::yield();
+                pos = head.load(memory_order_relaxed);
+            }
+            else
+                pos = head.load(memory_order_relaxed);
+        }
+        slot->size = wal_encode(slot->data, type, room, port, name);
+        slot->sequence.store(pos + 1, memory_order_release);
+        appended++;
+        // Pairs with the writer publishing idle before it checks the ring
+        atomic_thread_fence(memory_order_seq_cst);
+        if (idle.load(memory_order_relaxed))
+        {
+            lock_guard<mutex> guard(wake_mutex);
+            wake.notify_one();
+        }
+        return true;
+    }
+};
+
+#endif
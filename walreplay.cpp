@@ -0,0 +1,43 @@
+/*
+ * walreplay.cpp
+ * Prints what the Load Balancer's write-ahead log would restore
+ *
+ * Usage: ./walreplay [-v] [wal_dir]
+ * -v also lists every record, client requests included, in log order.
+ */
+#include "wal.h"
+
+int main(int argc, char *argv[])
+{
+    bool verbose = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "v")) != -1)
+    {
+        if (opt != 'v')
+        {
+            cerr << "Usage: " << argv[0] << " [-v] [wal_dir]\n";
+            return 1;
+        }
+        verbose = true;
+    }
+    string dir = optind < argc ? argv[optind] : "wal";
+    map<string, int> rooms;
+    size_t records = wal_replay(dir, [&](const WalRecord &record) {
+        if (record.type == WAL_ASSIGN)
+            rooms[record.room] = record.port;
+        else if (record.type == WAL_ERASE && rooms.count(record.room) && rooms[record.room] == record.port)
+            rooms.erase(record.room);
+        if (!verbose)
+            return;
+        if (record.type == WAL_REQUEST)
+            cout << "request " << record.name << " -> " << record.room << "\n";
+        else if (record.type == WAL_ASSIGN)
+            cout << "assign  " << record.room << " -> " << record.port << "\n";
+        else if (record.type == WAL_ERASE)
+            cout << "erase   " << record.room << " -> " << record.port << "\n";
+    });
+    for (auto &room : rooms)
+        cout << room.first << " " << room.second << "\n";
+    cerr << records << " records, " << rooms.size() << " rooms\n";
+    return 0;
+}